@@ -53,6 +53,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "compat.h"
+
+#ifdef B64_SIMD_X86
+#include <immintrin.h>
+#endif
+
 #define Assert(Cond) if (!(Cond)) abort()
 
 static const char Base64[] =
@@ -121,6 +127,105 @@ static const char Pad64 = '=';
 	   characters followed by one "=" padding character.
    */
 
+#ifdef B64_SIMD_X86
+/* Vector encoding after Mula and Lemire: spread every three input bytes
+   over four 32-bit lanes, cut out the four 6-bit groups with two
+   multiplies and map the groups to characters with one table lookup on
+   the range the group falls in.
+ */
+
+__attribute__((target("ssse3")))
+static inline __m128i
+b64_enc_ssse3(__m128i in) {
+	__m128i t0, t1, t2, t3, indices, result, less;
+
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	indices = _mm_or_si128(t1, t3);
+
+	result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+	result = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), result);
+	return _mm_add_epi8(result, indices);
+}
+
+/* Consumes 12 bytes and produces 16 characters per round, but loads 16
+   bytes, so stops while fewer than 16 bytes of input remain.
+ */
+__attribute__((target("ssse3")))
+static size_t
+b64_ntop_ssse3(uint8_t const **srcp, size_t *srclengthp, char *target,
+	       size_t targsize) {
+	uint8_t const *src = *srcp;
+	size_t srclength = *srclengthp;
+	size_t datalength = 0;
+
+	while (srclength >= 16 && datalength + 16 <= targsize) {
+		_mm_storeu_si128((__m128i *)&target[datalength],
+		    b64_enc_ssse3(_mm_loadu_si128((const __m128i *)src)));
+		src += 12;
+		srclength -= 12;
+		datalength += 16;
+	}
+	*srcp = src;
+	*srclengthp = srclength;
+	return datalength;
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_ntop_avx2(uint8_t const **srcp, size_t *srclengthp, char *target,
+	      size_t targsize) {
+	uint8_t const *src = *srcp;
+	size_t srclength = *srclengthp;
+	size_t datalength = 0;
+	__m256i in, t0, t1, t2, t3, indices, result, less;
+
+	while (srclength >= 28 && datalength + 32 <= targsize) {
+		in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		    _mm_loadu_si128((const __m128i *)src)),
+		    _mm_loadu_si128((const __m128i *)(src + 12)), 1);
+		in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+		t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		indices = _mm256_or_si256(t1, t3);
+
+		result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		result = _mm256_or_si256(result,
+		    _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		result = _mm256_shuffle_epi8(_mm256_setr_epi8(
+		    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		    '/' - 63, 'A', 0, 0,
+		    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		    '/' - 63, 'A', 0, 0), result);
+		_mm256_storeu_si256((__m256i *)&target[datalength],
+		    _mm256_add_epi8(result, indices));
+		src += 24;
+		srclength -= 24;
+		datalength += 32;
+	}
+	*srcp = src;
+	*srclengthp = srclength;
+	datalength += b64_ntop_ssse3(srcp, srclengthp, &target[datalength],
+				     targsize - datalength);
+	return datalength;
+}
+#endif
+
 int
 b64_ntop(uint8_t const *src, size_t srclength, char *target, size_t targsize) {
 	size_t datalength = 0;
@@ -128,6 +233,21 @@ b64_ntop(uint8_t const *src, size_t srclength, char *target, size_t targsize) {
 	uint8_t output[4];
 	size_t i;
 
+#ifdef B64_SIMD_X86
+	/* The vector loops encode whole groups only and leave the tail,
+	   including any padding, to the scalar loop below. */
+	switch (b64_simd(-1)) {
+	case 2:
+		datalength = b64_ntop_avx2(&src, &srclength, target, targsize);
+		break;
+	case 1:
+		datalength = b64_ntop_ssse3(&src, &srclength, target, targsize);
+		break;
+	default:
+		break;
+	}
+#endif
+
 	while (2 < srclength) {
 		input[0] = *src++;
 		input[1] = *src++;
@@ -53,6 +53,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "compat.h"
+
+#ifdef B64_SIMD_X86
+#include <immintrin.h>
+#endif
+
 #define Assert(Cond) if (!(Cond)) abort()
 
 static const char Base64[] =
@@ -168,18 +174,145 @@ b64_initialize_rmap ()
 	b64rmap_initialized = 1;
 }
 
+#ifdef B64_SIMD_X86
+/* Vector decoding after Mula and Lemire: classify every character by its
+   high and low nibble, where any character other than the 64 of the
+   alphabet yields a non-zero intersection of both classes, and add the
+   offset belonging to its range.  A block containing anything else,
+   whitespace and padding included, is left to the scalar loop.  Four
+   6-bit values are then packed into three bytes with two multiply-adds.
+ */
+
+__attribute__((target("ssse3")))
+static size_t
+b64_pton_ssse3(char const **srcp, char const *srcend, uint8_t *target,
+	       size_t targsize)
+{
+	char const *src = *srcp;
+	size_t tarindex = 0;
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+	    0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+	    -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	__m128i in, hi_nibbles, lo_nibbles, lo, hi, roll, out;
+
+	while (srcend - src >= 16 && targsize - tarindex >= 16) {
+		in = _mm_loadu_si128((const __m128i *)src);
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+		lo_nibbles = _mm_and_si128(in, mask_2f);
+		lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+		    _mm_setzero_si128())) != 0xffff)
+			break;
+		roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(
+		    _mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm_add_epi8(in, roll);
+
+		out = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		out = _mm_madd_epi16(out, _mm_set1_epi32(0x00011000));
+		out = _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4,
+		    10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		_mm_storeu_si128((__m128i *)&target[tarindex], out);
+		src += 16;
+		tarindex += 12;
+	}
+	*srcp = src;
+	return tarindex;
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_pton_avx2(char const **srcp, char const *srcend, uint8_t *target,
+	      size_t targsize)
+{
+	char const *src = *srcp;
+	size_t tarindex = 0;
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+	    0x15, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+	    0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	    0x10, 0x10, 0x01, 0x02, 0x04,
+	    0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+	    -71, 0, 0, 0, 0, 0, 0, 0, 0,
+	    0, 16, 19, 4, -65, -65, -71,
+	    -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	__m256i in, hi_nibbles, lo_nibbles, lo, hi, roll, out;
+
+	while (srcend - src >= 32 && targsize - tarindex >= 32) {
+		in = _mm256_loadu_si256((const __m256i *)src);
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4),
+					      mask_2f);
+		lo_nibbles = _mm256_and_si256(in, mask_2f);
+		lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(
+		    _mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		out = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+		out = _mm256_shuffle_epi8(out, _mm256_setr_epi8(2, 1, 0, 6, 5,
+		    4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		out = _mm256_permutevar8x32_epi32(out,
+		    _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((__m256i *)&target[tarindex], out);
+		src += 32;
+		tarindex += 24;
+	}
+	*srcp = src;
+	tarindex += b64_pton_ssse3(srcp, srcend, &target[tarindex],
+				   targsize - tarindex);
+	return tarindex;
+}
+#endif
+
 static int
 b64_pton_do(char const *src, uint8_t *target, size_t targsize)
 {
 	int tarindex, state, ch;
 	uint8_t ofs;
+#ifdef B64_SIMD_X86
+	int level, retry;
+	char const *srcend = NULL;
+
+	/* Whole blocks of base64 characters are decoded by the vector
+	   loops whenever the scalar loop is at a quantum boundary.  After
+	   a block they refuse, they are retried only once the scalar loop
+	   completed another quantum. */
+	level = b64_simd(-1);
+	retry = (level > 0);
+	if (retry)
+		srcend = src + strlen(src);
+#endif
 
 	state = 0;
 	tarindex = 0;
 
 	while (1)
 	{
-		ch = *src++;
+#ifdef B64_SIMD_X86
+		if (retry && state == 0) {
+			if (level == 2)
+				tarindex += b64_pton_avx2(&src, srcend,
+				    &target[tarindex], targsize - tarindex);
+			else
+				tarindex += b64_pton_ssse3(&src, srcend,
+				    &target[tarindex], targsize - tarindex);
+			retry = 0;
+		}
+#endif
+		ch = (uint8_t)*src++;
 		ofs = b64rmap[ch];
 
 		if (ofs >= b64rmap_special) {
@@ -224,6 +357,9 @@ b64_pton_do(char const *src, uint8_t *target, size_t targsize)
 			target[tarindex] |= ofs;
 			tarindex++;
 			state = 0;
+#ifdef B64_SIMD_X86
+			retry = (level > 0);
+#endif
 			break;
 		default:
 			abort();
@@ -236,7 +372,7 @@ b64_pton_do(char const *src, uint8_t *target, size_t targsize)
 	 */
 
 	if (ch == Pad64) {		/* We got a pad char. */
-		ch = *src++;		/* Skip it, get next. */
+		ch = (uint8_t)*src++;		/* Skip it, get next. */
 		switch (state) {
 		case 0:		/* Invalid = in first position */
 		case 1:		/* Invalid = in second position */
@@ -244,13 +380,13 @@ b64_pton_do(char const *src, uint8_t *target, size_t targsize)
 
 		case 2:		/* Valid, means one byte of info */
 			/* Skip any number of spaces. */
-			for ((void)NULL; ch != '\0'; ch = *src++)
+			for ((void)NULL; ch != '\0'; ch = (uint8_t)*src++)
 				if (b64rmap[ch] != b64rmap_space)
 					break;
 			/* Make sure there is another trailing = sign. */
 			if (ch != Pad64)
 				return (-1);
-			ch = *src++;		/* Skip the = */
+			ch = (uint8_t)*src++;		/* Skip the = */
 			/* Fall through to "single trailing =" case. */
 			/* FALLTHROUGH */
 
@@ -259,7 +395,7 @@ b64_pton_do(char const *src, uint8_t *target, size_t targsize)
 			 * We know this char is an =.  Is there anything but
 			 * whitespace after it?
 			 */
-			for ((void)NULL; ch != '\0'; ch = *src++)
+			for ((void)NULL; ch != '\0'; ch = (uint8_t)*src++)
 				if (b64rmap[ch] != b64rmap_space)
 					return (-1);
 
@@ -296,7 +432,7 @@ b64_pton_len(char const *src)
 
 	while (1)
 	{
-		ch = *src++;
+		ch = (uint8_t)*src++;
 		ofs = b64rmap[ch];
 
 		if (ofs >= b64rmap_special) {
@@ -337,7 +473,7 @@ b64_pton_len(char const *src)
 	 */
 
 	if (ch == Pad64) {		/* We got a pad char. */
-		ch = *src++;		/* Skip it, get next. */
+		ch = (uint8_t)*src++;		/* Skip it, get next. */
 		switch (state) {
 		case 0:		/* Invalid = in first position */
 		case 1:		/* Invalid = in second position */
@@ -345,13 +481,13 @@ b64_pton_len(char const *src)
 
 		case 2:		/* Valid, means one byte of info */
 			/* Skip any number of spaces. */
-			for ((void)NULL; ch != '\0'; ch = *src++)
+			for ((void)NULL; ch != '\0'; ch = (uint8_t)*src++)
 				if (b64rmap[ch] != b64rmap_space)
 					break;
 			/* Make sure there is another trailing = sign. */
 			if (ch != Pad64)
 				return (-1);
-			ch = *src++;		/* Skip the = */
+			ch = (uint8_t)*src++;		/* Skip the = */
 			/* Fall through to "single trailing =" case. */
 			/* FALLTHROUGH */
 
@@ -360,7 +496,7 @@ b64_pton_len(char const *src)
 			 * We know this char is an =.  Is there anything but
 			 * whitespace after it?
 			 */
-			for ((void)NULL; ch != '\0'; ch = *src++)
+			for ((void)NULL; ch != '\0'; ch = (uint8_t)*src++)
 				if (b64rmap[ch] != b64rmap_space)
 					return (-1);
 
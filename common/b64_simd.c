@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include "compat.h"
+
+/* Detected once, a concurrent first call detects twice with the same
+ * outcome, which is harmless.
+ */
+static int b64_supported = -1;
+static int b64_level = -1;
+
+static int
+b64_detect(void)
+{
+#ifdef B64_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return 2;
+    if (__builtin_cpu_supports("ssse3"))
+        return 1;
+#endif
+    return 0;
+}
+
+int
+b64_simd(int level)
+{
+    int supported = __atomic_load_n(&b64_supported, __ATOMIC_RELAXED);
+    if (supported < 0) {
+        supported = b64_detect();
+        __atomic_store_n(&b64_supported, supported, __ATOMIC_RELAXED);
+        __atomic_store_n(&b64_level, supported, __ATOMIC_RELAXED);
+    }
+    if (level >= 0) {
+        if (level > supported)
+            level = supported;
+        __atomic_store_n(&b64_level, level, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&b64_level, __ATOMIC_RELAXED);
+}
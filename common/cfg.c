@@ -144,6 +144,19 @@ engine_config(const char* cfgfile,
         ecfg->num_worker_threads_enforcer = parse_conf_worker_threads(cfgfile, 1);
         ecfg->num_worker_threads_signer = parse_conf_worker_threads(cfgfile, 0);
         ecfg->num_signer_threads = parse_conf_signer_threads(cfgfile);
+        ecfg->num_signer_threads_min = parse_conf_signer_threads_bound(cfgfile, "Minimum", ecfg->num_signer_threads);
+        ecfg->num_signer_threads_max = parse_conf_signer_threads_bound(cfgfile, "Maximum", ecfg->num_signer_threads);
+        if (ecfg->num_signer_threads_max < ecfg->num_signer_threads_min) {
+            ecfg->num_signer_threads_max = ecfg->num_signer_threads_min;
+        }
+        if (ecfg->num_signer_threads < ecfg->num_signer_threads_min) {
+            ecfg->num_signer_threads = ecfg->num_signer_threads_min;
+        } else if (ecfg->num_signer_threads > ecfg->num_signer_threads_max) {
+            ecfg->num_signer_threads = ecfg->num_signer_threads_max;
+        }
+        ecfg->resign_budget = parse_conf_resign_budget(cfgfile);
+        ecfg->rollover_spread = parse_conf_rollover_spread(cfgfile);
+        ecfg->zone_sharing_weighted = parse_conf_zone_sharing(cfgfile);
         ecfg->manual_keygen = parse_conf_manual_keygen(cfgfile);
         ecfg->repositories = parse_conf_repositories(cfgfile);
         /* If any verbosity has been specified at cmd line we will use that */
@@ -429,8 +442,25 @@ engine_config_print(FILE* out, engineconfig_type* config)
             config->working_dir_signer);
         fprintf(out, "\t\t<WorkerThreads>%i</WorkerThreads>\n",
             config->num_worker_threads_signer);
-        fprintf(out, "\t\t<SignerThreads>%i</SignerThreads>\n",
-            config->num_signer_threads);
+        if (config->num_signer_threads_min < config->num_signer_threads_max) {
+            fprintf(out, "\t\t<SignerThreads Minimum=\"%i\" Maximum=\"%i\">%i</SignerThreads>\n",
+                config->num_signer_threads_min, config->num_signer_threads_max,
+                config->num_signer_threads);
+        } else {
+            fprintf(out, "\t\t<SignerThreads>%i</SignerThreads>\n",
+                config->num_signer_threads);
+        }
+        if (config->resign_budget >= 0) {
+            fprintf(out, "\t\t<ResignBudget>%i</ResignBudget>\n",
+                config->resign_budget);
+        }
+        if (config->rollover_spread >= 0) {
+            fprintf(out, "\t\t<RolloverSpread>%i</RolloverSpread>\n",
+                config->rollover_spread);
+        }
+        if (config->zone_sharing_weighted) {
+            fprintf(out, "\t\t<ZoneSharing>weighted</ZoneSharing>\n");
+        }
         if (config->notify_command) {
             fprintf(out, "\t\t<NotifyCommand>%s</NotifyCommand>\n",
                 config->notify_command);
@@ -457,6 +487,7 @@ engine_config_freehsms(struct engineconfig_repository* hsm)
         free((void*)hsmtofree->module);
         free((void*)hsmtofree->pin);
         free((void*)hsmtofree->tokenlabel);
+        free((void*)hsmtofree->software_keys);
         free(hsmtofree);
         hsmtofree = hsm;
     }
@@ -48,6 +48,9 @@ struct engineconfig_repository {
     uint8_t use_pubkey;
     uint8_t require_backup;
     unsigned int allow_extract;
+    unsigned int session_pool;
+    unsigned int weight;
+    char* software_keys;
 };
 
 struct engineconfig_listener {
@@ -97,6 +100,11 @@ struct engineconfig_struct {
     int num_worker_threads_enforcer;
     int num_worker_threads_signer;
     int num_signer_threads;
+    int num_signer_threads_min; /* Signer/SignerThreads/@Minimum */
+    int num_signer_threads_max; /* Signer/SignerThreads/@Maximum */
+    int resign_budget;
+    int rollover_spread;
+    int zone_sharing_weighted;
     int manual_keygen;
     int verbosity;
     int db_port; /* Datastore/MySQL/Host/@Port */
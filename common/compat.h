@@ -51,3 +51,13 @@ int b64_ntop(uint8_t const *src, size_t srclength, char *target,
 #ifndef B64_PTON
 int b64_pton(char const *src, uint8_t *target, size_t targsize);
 #endif
+
+/* The base64 routines use SSSE3 or AVX2 when the processor has them.
+ * b64_simd limits the instruction set to at most the given level (0 for
+ * scalar, 1 for SSSE3, 2 for AVX2) and returns the level in effect, a
+ * negative argument only queries it.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define B64_SIMD_X86 1
+#endif
+int b64_simd(int level);
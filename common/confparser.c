@@ -245,6 +245,9 @@ parse_conf_repositories(const char* cfgfile)
             cur->require_backup = 0;
             cur->use_pubkey = 1;
             cur->allow_extract = 0;
+            cur->session_pool = 0;
+            cur->weight = 1;
+            cur->software_keys = NULL;
             cur->next = NULL;
 
             if (prev)
@@ -268,6 +271,18 @@ parse_conf_repositories(const char* cfgfile)
                     cur->use_pubkey = 0;
                 if (xmlStrEqual(curNode->name, (const xmlChar *)"AllowExtraction"))
                     cur->allow_extract = 1;
+                if (xmlStrEqual(curNode->name, (const xmlChar *)"SessionPool")) {
+                    xmlChar* content = xmlNodeGetContent(curNode);
+                    cur->session_pool = atoi((char *) content);
+                    xmlFree(content);
+                }
+                if (xmlStrEqual(curNode->name, (const xmlChar *)"SoftwareKeys"))
+                    cur->software_keys = (char *) xmlNodeGetContent(curNode);
+                if (xmlStrEqual(curNode->name, (const xmlChar *)"Weight")) {
+                    xmlChar* content = xmlNodeGetContent(curNode);
+                    cur->weight = atoi((char *) content);
+                    xmlFree(content);
+                }
 
                 curNode = curNode->next;
             }
@@ -897,3 +912,78 @@ parse_conf_signer_threads(const char* cfgfile)
     /* no SignerThreads value configured, look at WorkerThreads */
     return parse_conf_worker_threads(cfgfile, 0);
 }
+
+/* the number of RRsets to sign per pass over a zone, 0 to derive it from
+ * the size of the zone, -1 if re-signing is not spread */
+int
+parse_conf_resign_budget(const char* cfgfile)
+{
+    int budget = -1;
+    const char* str = parse_conf_string(cfgfile,
+                                        "//Configuration/Signer/ResignBudget",
+                                        0);
+    if (str) {
+        if (strlen(str) > 0) {
+            budget = atoi(str);
+        }
+        free((void*)str);
+    }
+    return budget;
+}
+
+/* the percentage of the signature validity over which a successor key
+ * takes over signing from a retiring key, -1 if not spread */
+int
+parse_conf_rollover_spread(const char* cfgfile)
+{
+    int spread = -1;
+    const char* str = parse_conf_string(cfgfile,
+                                        "//Configuration/Signer/RolloverSpread",
+                                        0);
+    if (str) {
+        if (strlen(str) > 0) {
+            spread = atoi(str);
+            if (spread > 100) {
+                spread = 100;
+            }
+        }
+        free((void*)str);
+    }
+    return spread;
+}
+
+/* whether the drudgers share out their work over the zones weighted to
+ * the work outstanding for each, instead of round-robin */
+int
+parse_conf_zone_sharing(const char* cfgfile)
+{
+    int weighted = 0;
+    const char* str = parse_conf_string(cfgfile,
+                                        "//Configuration/Signer/ZoneSharing",
+                                        0);
+    if (str) {
+        if (strcmp(str, "weighted") == 0) {
+            weighted = 1;
+        }
+        free((void*)str);
+    }
+    return weighted;
+}
+
+/* the Minimum or Maximum number of signer threads to run, numst if not
+ * given */
+int
+parse_conf_signer_threads_bound(const char* cfgfile, const char* bound, int numst)
+{
+    char expr[64];
+    const char* str;
+    snprintf(expr, sizeof(expr), "//Configuration/Signer/SignerThreads/@%s", bound);
+    str = parse_conf_string(cfgfile, expr, 0);
+    if (str) {
+        if (strlen(str) > 0 && atoi(str) > 0) {
+            numst = atoi(str);
+        }
+        free((void*)str);
+    }
+    return numst;
+}
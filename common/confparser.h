@@ -102,6 +102,10 @@ int parse_conf_verbosity(const char* cfgfile);
 /** Enforcer and signer specific */
 int parse_conf_worker_threads(const char* cfgfile, int is_enforcer);
 int parse_conf_signer_threads(const char* cfgfile);
+int parse_conf_signer_threads_bound(const char* cfgfile, const char* bound, int numst);
+int parse_conf_resign_budget(const char* cfgfile);
+int parse_conf_rollover_spread(const char* cfgfile);
+int parse_conf_zone_sharing(const char* cfgfile);
 int parse_conf_manual_keygen(const char* cfgfile);
 int parse_conf_db_port(const char *cfgfile);
 time_t parse_conf_automatic_keygen_period(const char* cfgfile);
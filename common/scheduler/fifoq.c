@@ -47,6 +47,10 @@ fifoq_create()
 {
     fifoq_type* fifoq;
     CHECKALLOC(fifoq = (fifoq_type*) malloc(sizeof(fifoq_type)));
+    fifoq->owners = NULL;
+    fifoq->nowners = 0;
+    fifoq->maxowners = 0;
+    fifoq->weighted = 0;
     fifoq_wipe(fifoq);
     pthread_mutex_init(&fifoq->q_lock, NULL);
     pthread_cond_init(&fifoq->q_threshold, NULL);
@@ -55,6 +59,19 @@ fifoq_create()
 }
 
 
+static void
+fifoq_dropowner(fifoq_type* q, size_t i)
+{
+    q->count -= q->owners[i]->count;
+    free(q->owners[i]->items);
+    free(q->owners[i]);
+    q->owners[i] = q->owners[--q->nowners];
+    if (q->next >= q->nowners) {
+        q->next = 0;
+    }
+}
+
+
 /**
  * Wipe queue.
  *
@@ -62,12 +79,129 @@ fifoq_create()
 void
 fifoq_wipe(fifoq_type* q)
 {
-    size_t i = 0;
-    for (i=0; i < FIFOQ_MAX_COUNT; i++) {
-        q->blob[i] = NULL;
-        q->owner[i] = NULL;
+    while (q->nowners > 0) {
+        fifoq_dropowner(q, 0);
     }
+    q->next = 0;
     q->count = 0;
+    q->sequence = 0;
+}
+
+
+/**
+ * Lookup the queue of an owner, if asked adding it when it has none yet.
+ *
+ */
+static struct fifoq_owner*
+fifoq_owner(fifoq_type* q, void* owner, int add)
+{
+    struct fifoq_owner* entry;
+    size_t i;
+    for (i = 0; i < q->nowners; i++) {
+        if (q->owners[i]->owner == owner) {
+            return q->owners[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (q->nowners == q->maxowners) {
+        q->maxowners = (q->maxowners ? q->maxowners * 2 : 8);
+        CHECKALLOC(q->owners = (struct fifoq_owner**) realloc(q->owners,
+            q->maxowners * sizeof(struct fifoq_owner*)));
+    }
+    CHECKALLOC(entry = (struct fifoq_owner*) malloc(sizeof(struct fifoq_owner)));
+    entry->owner = owner;
+    entry->worker = NULL;
+    entry->items = NULL;
+    entry->count = 0;
+    entry->capacity = 0;
+    entry->urgent = 0;
+    entry->deficit = 0;
+    entry->outstanding = 0;
+    entry->failed = 0;
+    entry->waiting = 0;
+    q->owners[q->nowners++] = entry;
+    return entry;
+}
+
+
+static int
+fifoq_before(struct fifoq_item* a, struct fifoq_item* b)
+{
+    if (a->deadline != b->deadline) {
+        return a->deadline < b->deadline;
+    }
+    return a->sequence < b->sequence;
+}
+
+
+/**
+ * Whether an owner may queue another item.  Each owner can take up to an
+ * equal part of the queue, and an owner without items can always queue
+ * one, so that small zones are not held up behind large ones.
+ *
+ */
+static int
+fifoq_mayqueue(fifoq_type* q, struct fifoq_owner* entry)
+{
+    if (entry->count == 0) {
+        return 1;
+    } else if (q->count >= FIFOQ_MAX_COUNT) {
+        return 0;
+    }
+    return entry->count < FIFOQ_MAX_COUNT / q->nowners;
+}
+
+
+/**
+ * Number of items an owner may take in its turn.
+ *
+ */
+static long
+fifoq_weight(fifoq_type* q, struct fifoq_owner* entry)
+{
+    long weight = 1;
+    long outstanding;
+    if (q->weighted) {
+        /* larger zones get more turns, but only logarithmically so */
+        for (outstanding = entry->outstanding; outstanding > 1; outstanding >>= 1) {
+            weight++;
+        }
+    }
+    return weight;
+}
+
+
+/**
+ * Select the owner to take the next item from.
+ *
+ */
+static struct fifoq_owner*
+fifoq_select(fifoq_type* q)
+{
+    struct fifoq_owner* entry;
+    struct fifoq_owner* urgent = NULL;
+    size_t i;
+    for (i = 0; i < q->nowners; i++) {
+        entry = q->owners[i];
+        if (entry->count > 0 && entry->items[0].deadline < entry->urgent &&
+            (!urgent || fifoq_before(&entry->items[0], &urgent->items[0]))) {
+            urgent = entry;
+        }
+    }
+    if (urgent) {
+        return urgent;
+    }
+    /* deficit round-robin over the owners with items */
+    while (q->owners[q->next]->count == 0 || q->owners[q->next]->deficit <= 0) {
+        q->next = (q->next + 1) % q->nowners;
+        entry = q->owners[q->next];
+        entry->deficit = (entry->count > 0 ? entry->deficit + fifoq_weight(q, entry) : 0);
+    }
+    entry = q->owners[q->next];
+    entry->deficit -= 1;
+    return entry;
 }
 
 
@@ -79,18 +213,38 @@ void*
 fifoq_pop(fifoq_type* q, void** context)
 {
     void* pop = NULL;
+    struct fifoq_owner* entry;
+    struct fifoq_item last;
     size_t i = 0;
+    size_t child;
+    int notify = 0;
     if (!q || q->count <= 0) {
         return NULL;
     }
-    pop = q->blob[0];
-    *context = q->owner[0];
-    for (i = 0; i < q->count-1; i++) {
-        q->blob[i] = q->blob[i+1];
-        q->owner[i] = q->owner[i+1];
-    }
+    entry = fifoq_select(q);
+    pop = entry->items[0].blob;
+    *context = entry->owner;
+    /* restore the heap with the last item taking the place of the first */
+    entry->count -= 1;
     q->count -= 1;
-    if (q->count <= (size_t) FIFOQ_MAX_COUNT * 0.1) {
+    last = entry->items[entry->count];
+    while ((child = 2 * i + 1) < entry->count) {
+        if (child + 1 < entry->count && fifoq_before(&entry->items[child+1], &entry->items[child])) {
+            child += 1;
+        }
+        if (!fifoq_before(&entry->items[child], &last)) {
+            break;
+        }
+        entry->items[i] = entry->items[child];
+        i = child;
+    }
+    entry->items[i] = last;
+    for (i = 0; i < q->nowners; i++) {
+        if (q->owners[i]->waiting && fifoq_mayqueue(q, q->owners[i])) {
+            notify = 1;
+        }
+    }
+    if (notify || q->count <= (size_t) FIFOQ_MAX_COUNT * 0.1) {
         /**
          * Notify waiting workers that they can start queuing again
          * If no workers are waiting, this call has no effect.
@@ -101,17 +255,37 @@ fifoq_pop(fifoq_type* q, void** context)
 }
 
 
+/**
+ * Start queuing items for an owner.
+ *
+ */
+void
+fifoq_open(fifoq_type* q, void* owner, worker_type* worker, time_t urgent)
+{
+    struct fifoq_owner* entry;
+    pthread_mutex_lock(&q->q_lock);
+    entry = fifoq_owner(q, owner, 1);
+    entry->worker = worker;
+    entry->urgent = urgent;
+    pthread_mutex_unlock(&q->q_lock);
+}
+
+
 /**
  * Push item to queue.
  *
  */
 ods_status
-fifoq_push(fifoq_type* q, void* item, void* context, int* tries)
+fifoq_push(fifoq_type* q, void* item, void* context, time_t deadline, int* tries)
 {
+    struct fifoq_owner* entry;
+    struct fifoq_item* parent;
+    size_t i;
     if (!q || !item) {
         return ODS_STATUS_ASSERT_ERR;
     }
-    if (q->count >= FIFOQ_MAX_COUNT) {
+    entry = fifoq_owner(q, context, 1);
+    if (!fifoq_mayqueue(q, entry)) {
         /**
          * #262:
          * If drudgers remain on hold, do additional broadcast.
@@ -123,10 +297,28 @@ fifoq_push(fifoq_type* q, void* item, void* context, int* tries)
             /* reset tries */
             *tries = 0;
         }
+        entry->waiting = 1;
         return ODS_STATUS_UNCHANGED;
     }
-    q->blob[q->count] = item;
-    q->owner[q->count] = context;
+    entry->waiting = 0;
+    if (entry->count == entry->capacity) {
+        entry->capacity = (entry->capacity ? entry->capacity * 2 : 16);
+        CHECKALLOC(entry->items = (struct fifoq_item*) realloc(entry->items,
+            entry->capacity * sizeof(struct fifoq_item)));
+    }
+    /* sift the new item up to its place in the heap */
+    for (i = entry->count; i > 0; i = (i - 1) / 2) {
+        parent = &entry->items[(i - 1) / 2];
+        if (parent->deadline <= deadline) {
+            break;
+        }
+        entry->items[i] = *parent;
+    }
+    entry->items[i].blob = item;
+    entry->items[i].deadline = deadline;
+    entry->items[i].sequence = q->sequence++;
+    entry->count += 1;
+    entry->outstanding += 1;
     q->count += 1;
     if (q->count == 1) {
         ods_log_deeebug("[%s] threshold %lu reached, notify drudgers",
@@ -137,30 +329,51 @@ fifoq_push(fifoq_type* q, void* item, void* context, int* tries)
     return ODS_STATUS_OK;
 }
 
+/**
+ * Report an item of an owner done.  Once all are done, the worker waiting
+ * for them is woken.
+ *
+ */
 void
-fifoq_report(fifoq_type* q, worker_type* superior, ods_status subtaskstatus)
+fifoq_report(fifoq_type* q, void* owner, ods_status subtaskstatus)
 {
+    struct fifoq_owner* entry;
     pthread_mutex_lock(&q->q_lock);
-    if (subtaskstatus != ODS_STATUS_OK) {
-        superior->tasksFailed += 1;
-    }
-    superior->tasksOutstanding -= 1;
-    if (superior->tasksOutstanding == 0) {
-        pthread_cond_signal(&superior->tasksBlocker);
+    entry = fifoq_owner(q, owner, 0);
+    if (entry) {
+        if (subtaskstatus != ODS_STATUS_OK) {
+            entry->failed += 1;
+        }
+        entry->outstanding -= 1;
+        if (entry->outstanding == 0 && entry->worker) {
+            pthread_cond_signal(&entry->worker->tasksBlocker);
+        }
     }
     pthread_mutex_unlock(&q->q_lock);
 }
 
+/**
+ * Wait until all items of an owner are done, after which its queue is
+ * removed.
+ *
+ */
 void
-fifoq_waitfor(fifoq_type* q, worker_type* worker, long nsubtasks, long* nsubtasksfailed)
+fifoq_waitfor(fifoq_type* q, void* owner, long* nsubtasksfailed)
 {
+    struct fifoq_owner* entry;
+    size_t i;
     pthread_mutex_lock(&q->q_lock);
-    worker->tasksOutstanding += nsubtasks;
-    while (worker->tasksOutstanding > 0 && !worker->need_to_exit) {
-        pthread_cond_wait(&worker->tasksBlocker, &q->q_lock);
+    *nsubtasksfailed = 0;
+    entry = fifoq_owner(q, owner, 0);
+    if (entry) {
+        while (entry->worker && entry->outstanding > 0 && !entry->worker->need_to_exit) {
+            pthread_cond_wait(&entry->worker->tasksBlocker, &q->q_lock);
+        }
+        *nsubtasksfailed = entry->failed;
+        for (i = 0; q->owners[i] != entry; i++)
+            ;
+        fifoq_dropowner(q, i);
     }
-    *nsubtasksfailed = worker->tasksFailed;
-    worker->tasksFailed = 0;
     pthread_mutex_unlock(&q->q_lock);
 }
 
@@ -178,14 +391,22 @@ fifoq_cleanup(fifoq_type* q)
     pthread_cond_destroy(&q->q_threshold);
     pthread_cond_destroy(&q->q_nonfull);
     pthread_mutex_destroy(&q->q_lock);
+    fifoq_wipe(q);
+    free(q->owners);
     free(q);
 }
 
 void
 fifoq_notifyall(fifoq_type* q)
 {
+    size_t i;
     pthread_mutex_lock(&q->q_lock);
     pthread_cond_broadcast(&q->q_threshold);
     pthread_cond_broadcast(&q->q_nonfull);
+    for (i = 0; i < q->nowners; i++) {
+        if (q->owners[i]->worker) {
+            pthread_cond_signal(&q->owners[i]->worker->tasksBlocker);
+        }
+    }
     pthread_mutex_unlock(&q->q_lock);
 }
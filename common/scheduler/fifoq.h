@@ -53,13 +53,47 @@ typedef struct fifoq_struct fifoq_type;
 #define FIFOQ_MAX_COUNT 1000
 #define FIFOQ_TRIES_COUNT 10
 
+/**
+ * Queued item, with the deadline by which it is to be taken.
+ */
+struct fifoq_item {
+    void* blob;
+    time_t deadline;
+    unsigned long sequence;
+};
+
+/**
+ * Queue of the items of one owner, the zone being signed by a worker.
+ * Its items are taken earliest deadline first, in order of arrival for
+ * equal deadlines.  The owner is done when no items remain outstanding.
+ */
+struct fifoq_owner {
+    void* owner;
+    worker_type* worker;
+    struct fifoq_item* items;
+    size_t count;
+    size_t capacity;
+    time_t urgent; /* items with earlier deadlines do not wait their turn */
+    long deficit;
+    long outstanding;
+    long failed;
+    int waiting;
+};
+
 /**
  * FIFO Queue.
+ * Owners take turns, round-robin or weighted to the work they have
+ * outstanding, except for urgent items which are taken earliest deadline
+ * first over all owners.  Each owner gets an equal share of the queue.
  */
 struct fifoq_struct {
-    void* blob[FIFOQ_MAX_COUNT];
-    void* owner[FIFOQ_MAX_COUNT];
+    struct fifoq_owner** owners;
+    size_t nowners;
+    size_t maxowners;
+    size_t next;
     size_t count;
+    unsigned long sequence;
+    int weighted;
     pthread_mutex_t q_lock;
     pthread_cond_t q_threshold;
     pthread_cond_t q_nonfull;
@@ -89,16 +123,29 @@ void fifoq_wipe(fifoq_type* q);
  */
 void* fifoq_pop(fifoq_type* q, void** worker);
 
+/**
+ * Start queuing items for an owner.
+ * \param[in] q queue
+ * \param[in] owner owner of the items
+ * \param[in] worker worker to wake once all items are done
+ * \param[in] urgent items with an earlier deadline go before other owners
+ *
+ */
+void fifoq_open(fifoq_type* q, void* owner, worker_type* worker, time_t urgent);
+
 /**
  * Push item to queue.
  * \param[in] q queue
  * \param[in] item item
  * \param[in] worker owner of item
+ * \param[in] deadline time by which the item is to be taken
  * \param[out] tries number of tries
  * \return ods_status status
+ *         ODS_STATUS_UNCHANGED: the queue is full, or the owner has its
+ *         share of the queue
  *
  */
-ods_status fifoq_push(fifoq_type* q, void* item, void* worker, int* tries);
+ods_status fifoq_push(fifoq_type* q, void* item, void* worker, time_t deadline, int* tries);
 
 /**
  * Clean up queue.
@@ -107,8 +154,8 @@ ods_status fifoq_push(fifoq_type* q, void* item, void* worker, int* tries);
  */
 void fifoq_cleanup(fifoq_type* q);
 
-void fifoq_report(fifoq_type* q, worker_type* superior, ods_status subtaskstatus);
-void fifoq_waitfor(fifoq_type* q, worker_type* worker, long nsubtasks, long* nsubtasksfailed);
+void fifoq_report(fifoq_type* q, void* owner, ods_status subtaskstatus);
+void fifoq_waitfor(fifoq_type* q, void* owner, long* nsubtasksfailed);
 void fifoq_notifyall(fifoq_type* q);
 
 #endif /* SCHEDULER_FIFOQ_H */
@@ -59,7 +59,7 @@ const char* TASK_TYPE_SIGNCONF  = "signconf";
 
 const char* TASK_SIGNCONF       = "[configure]";
 const char* TASK_READ           = "[read]";
-const char* TASK_NSECIFY        = "[???]";
+const char* TASK_NSECIFY        = "[nsecify]";
 const char* TASK_SIGN           = "[sign]";
 const char* TASK_WRITE          = "[write]";
 const char* TASK_FORCESIGNCONF  = "[forcesignconf]";
@@ -44,8 +44,8 @@ worker_create(const char* name, schedule_type* taskq)
     worker->need_to_exit = 0;
     worker->context = NULL;
     worker->taskq = taskq;
-    worker->tasksOutstanding = 0;
-    worker->tasksFailed = 0;
+    worker->worked = 0;
+    worker->workedusecs = 0;
     pthread_cond_init(&worker->tasksBlocker, NULL);
     return worker;
 }
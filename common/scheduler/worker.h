@@ -44,9 +44,10 @@ struct worker_struct {
     janitor_thread_t thread_id;
     int need_to_exit;
     void* context;
-    int tasksOutstanding;
-    int tasksFailed;
     pthread_cond_t tasksBlocker;
+    /* records signed by a drudger and the time it took, kept under the signq lock */
+    unsigned long worked;
+    unsigned long long workedusecs;
 };
 
 /**
@@ -48,32 +48,63 @@ char *progname = NULL;
 typedef struct {
     unsigned int id;
     hsm_ctx_t *ctx;
-    libhsm_key_t *key;
+    const libhsm_key_t *key;
     unsigned int iterations;
+    unsigned int depth;
+    int wire;
 } sign_arg_t;
 
+/* Signatures of one thread in progress in the session pool */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int outstanding;
+    unsigned int failed;
+} sign_inflight_t;
+
 static void
 usage ()
 {
     fprintf(stderr,
         "usage: %s "
-        "[-c config] -r repository [-i iterations] [-s keysize] [-t threads]\n",
+        "[-c config] -r repository [-i iterations] [-s keysize] [-t threads]\n"
+        "       [-d depth] [-p sessions] [-w] [-x]\n",
         progname);
 }
 
+static void
+signed_callback (void *arg, ldns_rr *sig, const char *error)
+{
+    sign_inflight_t *inflight = arg;
+
+    if (sig) {
+        ldns_rr_free(sig);
+    } else {
+        fprintf(stderr, "asynchronous signing failed: %s\n",
+                error ? error : "unknown error");
+    }
+    pthread_mutex_lock(&inflight->lock);
+    if (!sig) inflight->failed++;
+    inflight->outstanding--;
+    pthread_cond_signal(&inflight->cond);
+    pthread_mutex_unlock(&inflight->lock);
+}
+
 static void *
 sign (void *arg)
 {
     hsm_ctx_t *ctx = NULL;
-    libhsm_key_t *key = NULL;
+    const libhsm_key_t *key = NULL;
 
     size_t i;
     unsigned int iterations = 0;
 
     ldns_rr_list *rrset;
     ldns_rr *rr, *sig, *dnskey_rr;
+    ldns_buffer *wire = NULL;
     ldns_status status;
     hsm_sign_params_t *sign_params;
+    sign_inflight_t inflight;
 
     sign_arg_t *sign_arg = arg;
 
@@ -94,10 +125,62 @@ sign (void *arg)
     sign_params->owner = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, "opendnssec.se.");
     dnskey_rr = hsm_get_dnskey(ctx, key, sign_params);
     sign_params->keytag = ldns_calc_keytag(dnskey_rr);
+    if (sign_arg->wire) {
+        /* encoded once, as the signer keeps it with the RRset */
+        wire = ldns_buffer_new(LDNS_MIN_BUFLEN);
+        for (i=0; i<ldns_rr_list_rr_count(rrset); i++) {
+            (void) ldns_rr2buffer_wire_canonical(wire,
+                ldns_rr_list_rr(rrset, i), LDNS_SECTION_ANSWER);
+        }
+        rr = ldns_rr_list_rr(rrset, 0);
+    }
 
-    /* Do some signing */
+    /* Do some signing, keeping up to depth signatures in progress */
+    if (sign_arg->depth > 1) {
+        pthread_mutex_init(&inflight.lock, NULL);
+        pthread_cond_init(&inflight.cond, NULL);
+        inflight.outstanding = 0;
+        inflight.failed = 0;
+        for (i=0; i<iterations && !inflight.failed; i++) {
+            pthread_mutex_lock(&inflight.lock);
+            while (inflight.outstanding >= sign_arg->depth) {
+                pthread_cond_wait(&inflight.cond, &inflight.lock);
+            }
+            inflight.outstanding++;
+            pthread_mutex_unlock(&inflight.lock);
+            if ((wire ? hsm_sign_rrset_wire_submit(ctx, rr,
+                            ldns_buffer_begin(wire), ldns_buffer_position(wire),
+                            key, sign_params, signed_callback, &inflight)
+                      : hsm_sign_rrset_submit(ctx, rrset, key, sign_params,
+                            signed_callback, &inflight)) != HSM_OK) {
+                fprintf(stderr,
+                        "hsm_sign_rrset_submit() returned error: %s in %s\n",
+                        ctx->error_message,
+                        ctx->error_action
+                );
+                pthread_mutex_lock(&inflight.lock);
+                inflight.outstanding--;
+                pthread_mutex_unlock(&inflight.lock);
+                break;
+            }
+        }
+        pthread_mutex_lock(&inflight.lock);
+        while (inflight.outstanding > 0) {
+            pthread_cond_wait(&inflight.cond, &inflight.lock);
+        }
+        pthread_mutex_unlock(&inflight.lock);
+        pthread_cond_destroy(&inflight.cond);
+        pthread_mutex_destroy(&inflight.lock);
+        iterations = 0;
+    }
     for (i=0; i<iterations; i++) {
-        sig = hsm_sign_rrset(ctx, rrset, key, sign_params);
+        if (wire) {
+            sig = hsm_sign_rrset_wire(ctx, rr, ldns_buffer_begin(wire),
+                                      ldns_buffer_position(wire), key,
+                                      sign_params);
+        } else {
+            sig = hsm_sign_rrset(ctx, rrset, key, sign_params);
+        }
         if (! sig) {
             fprintf(stderr,
                     "hsm_sign_rrset() returned error: %s in %s\n",
@@ -110,6 +193,7 @@ sign (void *arg)
     }
 
     /* Clean up */
+    if (wire) ldns_buffer_free(wire);
     ldns_rr_list_deep_free(rrset);
     hsm_sign_params_free(sign_params);
     ldns_rr_free(dnskey_rr);
@@ -129,9 +213,16 @@ main (int argc, char *argv[])
 
     hsm_ctx_t *ctx = NULL;
     libhsm_key_t *key = NULL;
+    const libhsm_key_t *sign_key;
     unsigned int keysize = 1024;
     unsigned int iterations = 1;
     unsigned int threads = 1;
+    unsigned int depth = 1;
+    int sessions = -1;
+    int software = 0;
+    int wire = 0;
+    struct engineconfig_repository* repositories;
+    struct engineconfig_repository* repo;
 
     static struct timeval start,end;
 
@@ -150,14 +241,20 @@ main (int argc, char *argv[])
 
     progname = argv[0];
 
-    while ((ch = getopt(argc, argv, "c:i:r:s:t:")) != -1) {
+    while ((ch = getopt(argc, argv, "c:d:i:p:r:s:t:wx")) != -1) {
         switch (ch) {
         case 'c':
             config = strdup(optarg);
             break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
         case 'i':
             iterations = atoi(optarg);
             break;
+        case 'p':
+            sessions = atoi(optarg);
+            break;
         case 'r':
             repository = strdup(optarg);
             break;
@@ -167,6 +264,12 @@ main (int argc, char *argv[])
         case 't':
             threads = atoi(optarg);
             break;
+        case 'w':
+            wire = 1;
+            break;
+        case 'x':
+            software = 1;
+            break;
         default:
             usage();
             exit(1);
@@ -192,7 +295,20 @@ main (int argc, char *argv[])
 
     /* Open HSM library */
     fprintf(stderr, "Opening HSM Library...\n");
-    result = hsm_open2(parse_conf_repositories(config?config:HSM_DEFAULT_CONFIG), hsm_prompt_pin);
+    repositories = parse_conf_repositories(config?config:HSM_DEFAULT_CONFIG);
+    for (repo = repositories; repo; repo = repo->next) {
+        if (sessions >= 0) {
+            repo->session_pool = sessions;
+        }
+        if (software) {
+            /* generate an extractable key, to be signed with in-process */
+            repo->allow_extract = 1;
+            if (!repo->software_keys) {
+                repo->software_keys = strdup("");
+            }
+        }
+    }
+    result = hsm_open2(repositories, hsm_prompt_pin);
     if (result != HSM_OK) {
         char* error =  hsm_get_error(NULL);
         if (error != NULL) {
@@ -215,6 +331,15 @@ main (int argc, char *argv[])
     if (key) {
         char *id = hsm_get_key_id(ctx, key);
         fprintf(stderr, "Temporary key created: %s\n", id);
+        sign_key = key;
+        if (software) {
+            sign_key = keycache_lookup(ctx, id);
+            if (!sign_key || !sign_key->pkey) {
+                fprintf(stderr, "Could not export the key, signing through PKCS#11\n");
+                software = 0;
+                if (!sign_key) sign_key = key;
+            }
+        }
         free(id);
     } else {
         fprintf(stderr, "Could not generate a key pair in repository \"%s\"\n", repository);
@@ -232,12 +357,18 @@ main (int argc, char *argv[])
             fprintf(stderr, "hsm_create_context() returned error\n");
             exit(-1);
         }
-        sign_arg_array[n].key = key;
+        sign_arg_array[n].key = sign_key;
         sign_arg_array[n].iterations = iterations;
+        sign_arg_array[n].depth = depth;
+        sign_arg_array[n].wire = wire;
     }
 
     fprintf(stderr, "Signing %d RRsets with %s using %d %s...\n",
         iterations, algoname, threads, (threads > 1 ? "threads" : "thread"));
+    if (depth > 1) {
+        fprintf(stderr, "Keeping %d signatures in flight per thread over %lu pooled sessions\n",
+            depth, (unsigned long) hsm_sign_pool_size());
+    }
     gettimeofday(&start, NULL);
 
     /* Create threads for signing */
@@ -267,9 +398,10 @@ main (int argc, char *argv[])
     end.tv_usec-= start.tv_usec;
     elapsed =(double)(end.tv_sec)+(double)(end.tv_usec)*.000001;
     speed = iterations / elapsed * threads;
-    printf("%d %s, %d signatures per thread, %.2f sig/s (RSA %d bits)\n",
+    printf("%d %s, %d signatures per thread, %.2f sig/s (RSA %d bits, depth %d, %lu pooled sessions%s%s)\n",
         threads, (threads > 1 ? "threads" : "thread"), iterations,
-        speed, keysize);
+        speed, keysize, depth, (unsigned long) hsm_sign_pool_size(),
+        (software ? ", in-process" : ""), (wire ? ", canonical wire" : ""));
 
     /* Delete temporary key */
     fprintf(stderr, "Deleting temporary key...\n");
@@ -682,6 +682,7 @@ typedef unsigned long ck_mechanism_type_t;
 #define CKM_DSA_PARAMETER_GEN		(0x2000)
 #define CKM_DH_PKCS_PARAMETER_GEN	(0x2001)
 #define CKM_X9_42_DH_PARAMETER_GEN	(0x2002)
+#define CKM_AES_KEY_WRAP_PAD		(0x210a)	/* From PKCS#11 v2.40 */
 #define CKM_VENDOR_DEFINED		((unsigned long) (1 << 31))
 
 
@@ -32,6 +32,8 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <dlfcn.h>
 #include <ldns/ldns.h>
 
@@ -51,6 +53,19 @@
 #include <pkcs11.h>
 #include <pthread.h>
 
+#ifdef HAVE_SSL
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include <openssl/x509.h>
+#endif
+
 /*! Fixed length from PKCS#11 specification */
 #define HSM_TOKEN_LABEL_LENGTH 32
 
@@ -445,6 +460,9 @@ hsm_module_new(const char *repository,
     if (config) {
         CHECKALLOC(module->config = malloc(sizeof(hsm_config_t)));
         memcpy(module->config, config, sizeof(hsm_config_t));
+        if (config->software_keys) {
+            module->config->software_keys = strdup(config->software_keys);
+        }
     } else {
         module->config = NULL;
     }
@@ -455,6 +473,11 @@ hsm_module_new(const char *repository,
     module->path = (path ? strdup(path) : NULL);
     module->handle = NULL;
     module->sym = NULL;
+    module->pool = NULL;
+    module->outstanding = 0;
+    module->failed = 0;
+    module->generation = 0;
+    module->pin = NULL;
     
     return module;
 }
@@ -466,12 +489,215 @@ hsm_module_free(hsm_module_t *module)
         if (module->name) free(module->name);
         if (module->token_label) free(module->token_label);
         if (module->path) free(module->path);
-        if (module->config) free(module->config);
+        if (module->pin) {
+            memset(module->pin, 0, strlen(module->pin));
+            free(module->pin);
+        }
+        if (module->config) {
+            free(module->config->software_keys);
+            free(module->config);
+        }
 
         free(module);
     }
 }
 
+/* Interval in seconds at which repositories out of rotation are probed */
+#define HSM_PROBE_INTERVAL 30
+
+static pthread_mutex_t hsm_prober_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hsm_prober_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t hsm_prober;
+static int hsm_prober_state = 0; /* 0 not started, 1 running, 2 stopping */
+
+/* returns non-zero if the PKCS#11 return value indicates that the token
+ * or its sessions are unusable, rather than a problem with the request */
+static int
+hsm_pkcs11_device_error(CK_RV rv)
+{
+    switch (rv) {
+        case CKR_GENERAL_ERROR:
+        case CKR_FUNCTION_FAILED:
+        case CKR_DEVICE_ERROR:
+        case CKR_DEVICE_MEMORY:
+        case CKR_DEVICE_REMOVED:
+        case CKR_SESSION_CLOSED:
+        case CKR_SESSION_HANDLE_INVALID:
+        case CKR_TOKEN_NOT_PRESENT:
+        case CKR_TOKEN_NOT_RECOGNIZED:
+        case CKR_USER_NOT_LOGGED_IN:
+        case CKR_CRYPTOKI_NOT_INITIALIZED:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* checks that the session is still logged in and that a new session
+ * can be opened with the token */
+static CK_RV
+hsm_session_probe(const hsm_session_t *session)
+{
+    CK_FUNCTION_LIST_PTR sym = session->module->sym;
+    CK_SESSION_INFO info;
+    CK_SESSION_HANDLE session_handle;
+    CK_RV rv;
+
+    rv = sym->C_GetSessionInfo(session->session, &info);
+    if (rv != CKR_OK) return rv;
+    if (info.state != CKS_RW_USER_FUNCTIONS) return CKR_USER_NOT_LOGGED_IN;
+    rv = sym->C_OpenSession(info.slotID, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                            NULL, NULL, &session_handle);
+    if (rv != CKR_OK) return rv;
+    return sym->C_CloseSession(session_handle);
+}
+
+/* replaces the handle of the session, which the token may have
+ * invalidated, by a newly opened one, logging in again if asked to */
+static CK_RV
+hsm_session_reopen(hsm_ctx_t *ctx, hsm_session_t *session, int login)
+{
+    CK_FUNCTION_LIST_PTR sym = session->module->sym;
+    const char *pin = session->module->pin;
+    CK_SLOT_ID slot_id;
+    CK_SESSION_HANDLE session_handle;
+    CK_RV rv;
+
+    if (hsm_get_slot_id(ctx, sym, session->module->token_label,
+                        &slot_id) != HSM_OK) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+    rv = sym->C_OpenSession(slot_id, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                            NULL, NULL, &session_handle);
+    if (rv != CKR_OK) return rv;
+    if (login && pin) {
+        rv = sym->C_Login(session_handle, CKU_USER, (unsigned char *) pin,
+                          strlen(pin));
+        if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+            (void) sym->C_CloseSession(session_handle);
+            return rv;
+        }
+    }
+    (void) sym->C_CloseSession(session->session);
+    session->session = session_handle;
+    return CKR_OK;
+}
+
+/* reopens the session if its repository was reconnected after it was
+ * opened.  Sessions are reopened by the thread using them, the others
+ * are left alone.  Returns non-zero if it could not be reopened. */
+static int
+hsm_session_refresh(hsm_ctx_t *ctx, hsm_session_t *session)
+{
+    unsigned int generation;
+
+    generation = __atomic_load_n(&session->module->generation,
+                                 __ATOMIC_ACQUIRE);
+    if (session->generation == generation) return 0;
+    if (hsm_session_reopen(ctx, session, 0) != CKR_OK) return 1;
+    session->generation = generation;
+    return 0;
+}
+
+/* reconnects the repository of the session of the global context, which
+ * is out of rotation, and puts it back into rotation if the token is
+ * usable again.  The sessions of the other contexts and of the pool are
+ * reopened as they are next used, ahead of signing with them. */
+static CK_RV
+hsm_module_recover(hsm_session_t *session)
+{
+    hsm_module_t *module = session->module;
+    CK_RV rv;
+
+    rv = hsm_session_reopen(NULL, session, 1);
+    if (rv == CKR_OK) {
+        rv = hsm_session_probe(session);
+    }
+    if (rv != CKR_OK) return rv;
+    session->generation = __atomic_add_fetch(&module->generation, 1,
+                                             __ATOMIC_RELEASE);
+    __atomic_store_n(&module->failed, 0, __ATOMIC_RELEASE);
+    return CKR_OK;
+}
+
+/* periodically reconnects the repositories out of rotation, and puts
+ * those that respond again back into rotation */
+static void *
+hsm_prober_run(void *arg)
+{
+    struct timespec deadline;
+    hsm_session_t *session;
+    size_t i;
+
+    (void) arg;
+    pthread_mutex_lock(&hsm_prober_lock);
+    while (hsm_prober_state == 1) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += HSM_PROBE_INTERVAL;
+        pthread_cond_timedwait(&hsm_prober_cond, &hsm_prober_lock, &deadline);
+        if (hsm_prober_state != 1) break;
+        pthread_mutex_unlock(&hsm_prober_lock);
+        pthread_mutex_lock(&_hsm_ctx_mutex);
+        for (i = 0; _hsm_ctx && i < _hsm_ctx->session_count; i++) {
+            session = _hsm_ctx->session[i];
+            if (session &&
+                __atomic_load_n(&session->module->failed, __ATOMIC_RELAXED)) {
+                (void) hsm_module_recover(session);
+            }
+        }
+        pthread_mutex_unlock(&_hsm_ctx_mutex);
+        pthread_mutex_lock(&hsm_prober_lock);
+    }
+    pthread_mutex_unlock(&hsm_prober_lock);
+    return NULL;
+}
+
+/* takes the module out of rotation, until the background probe finds the
+ * token usable again */
+static void
+hsm_module_fail(hsm_module_t *module)
+{
+    time_t expected = 0;
+
+    if (!__atomic_compare_exchange_n(&module->failed, &expected, time(NULL),
+            0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&hsm_prober_lock);
+    if (hsm_prober_state == 0 &&
+        !pthread_create(&hsm_prober, NULL, hsm_prober_run, NULL)) {
+        hsm_prober_state = 1;
+    }
+    pthread_mutex_unlock(&hsm_prober_lock);
+}
+
+/* stops the background probe, must not be called holding _hsm_ctx_mutex */
+static void
+hsm_prober_stop(void)
+{
+    pthread_mutex_lock(&hsm_prober_lock);
+    if (hsm_prober_state != 1) {
+        pthread_mutex_unlock(&hsm_prober_lock);
+        return;
+    }
+    hsm_prober_state = 2;
+    pthread_cond_signal(&hsm_prober_cond);
+    pthread_mutex_unlock(&hsm_prober_lock);
+    pthread_join(hsm_prober, NULL);
+    pthread_mutex_lock(&hsm_prober_lock);
+    hsm_prober_state = 0;
+    pthread_mutex_unlock(&hsm_prober_lock);
+}
+
+static unsigned int
+hsm_module_weight(const hsm_module_t *module)
+{
+    if (module->config && module->config->weight) {
+        return module->config->weight;
+    }
+    return 1;
+}
+
 static hsm_session_t *
 hsm_session_new(hsm_module_t *module, CK_SESSION_HANDLE session_handle)
 {
@@ -479,6 +705,8 @@ hsm_session_new(hsm_module_t *module, CK_SESSION_HANDLE session_handle)
     CHECKALLOC(session = malloc(sizeof(hsm_session_t)));
     session->module = module;
     session->session = session_handle;
+    session->generation = __atomic_load_n(&module->generation,
+                                          __ATOMIC_ACQUIRE);
     return session;
 }
 
@@ -495,6 +723,9 @@ hsm_config_default(hsm_config_t *config)
 {
     config->use_pubkey = 1;
     config->allow_extract = 0;
+    config->session_pool = 0;
+    config->weight = 1;
+    config->software_keys = NULL;
 }
 
 /* creates a session_t structure, and automatically adds and initializes
@@ -559,6 +790,7 @@ hsm_session_init(hsm_ctx_t *ctx, hsm_session_t **session,
                                    strlen((char *)pin));
 
     if (rv_login == CKR_OK || rv_login == CKR_USER_ALREADY_LOGGED_IN) {
+        module->pin = strdup(pin);
         *session = hsm_session_new(module, session_handle);
         return HSM_OK;
     } else {
@@ -632,6 +864,7 @@ hsm_ctx_new()
     memset(ctx->session, 0, HSM_MAX_SESSIONS * sizeof(hsm_ctx_t*));
     ctx->session_count = 0;
     ctx->error = 0;
+    ctx->rotation = 0;
     return ctx;
 }
 
@@ -649,6 +882,9 @@ hsm_ctx_free(hsm_ctx_t *ctx)
     }
 }
 
+static void hsm_pool_stop(hsm_pool_t *pool);
+static void hsm_pool_destroy(hsm_pool_t *pool);
+
 /* close the session, and free the allocated data
  *
  * if unload is non-zero, C_Logout() is called,
@@ -663,7 +899,11 @@ hsm_session_close(hsm_ctx_t *ctx, hsm_session_t *session, int unload)
      * already finalized it before, so we can safely ignore
      * NOT_INITIALIZED */
     CK_RV rv;
+    hsm_pool_t *pool;
     if (unload) {
+        pool = session->module->pool;
+        session->module->pool = NULL;
+        hsm_pool_destroy(pool);
         rv = ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_Logout(session->session);
         if (rv != CKR_CRYPTOKI_NOT_INITIALIZED) {
             (void) hsm_pkcs11_check_error(ctx, rv, "Logout");
@@ -697,6 +937,13 @@ hsm_ctx_close(hsm_ctx_t *ctx, int unload)
     size_t i;
 
     if (!ctx) return;
+    if (unload) {
+        /* the pools pass failed requests on to each other, all of them
+         * are stopped before any of them is destroyed */
+        for (i = 0; i < ctx->session_count; i++) {
+            hsm_pool_stop(ctx->session[i]->module->pool);
+        }
+    }
     for (i = 0; i < ctx->session_count; i++) {
         hsm_session_close(ctx, ctx->session[i], unload);
         ctx->session[i] = NULL;
@@ -735,13 +982,19 @@ hsm_ctx_clone(hsm_ctx_t *ctx)
         for (i = 0; i < ctx->session_count; i++) {
             new_session = hsm_session_clone(ctx, ctx->session[i]);
             if (!new_session) {
-                /* one of the sessions failed to clone. Clear the
-                 * new ctx and return NULL */
-                hsm_ctx_close(new_ctx, 0);
-                return NULL;
+                /* leave the repository out of rotation, signing
+                 * continues with the others */
+                hsm_module_fail(ctx->session[i]->module);
+                continue;
             }
             hsm_ctx_add_session(new_ctx, new_session);
         }
+        if (new_ctx->session_count == 0 && ctx->session_count > 0) {
+            /* none of the sessions could be cloned. Clear the
+             * new ctx and return NULL */
+            hsm_ctx_close(new_ctx, 0);
+            return NULL;
+        }
         new_ctx->keycache = ctx->keycache;
         new_ctx->keycache_lock = ctx->keycache_lock;
     }
@@ -756,6 +1009,8 @@ libhsm_key_new()
     key->modulename = NULL;
     key->private_key = 0;
     key->public_key = 0;
+    key->replica = NULL;
+    key->pkey = NULL;
     return key;
 }
 
@@ -768,12 +1023,92 @@ hsm_find_key_session(hsm_ctx_t *ctx, const libhsm_key_t *key)
     if (!key || !key->modulename) return NULL;
     for (i = 0; i < ctx->session_count; i++) {
         if (ctx->session[i] && !strcmp(ctx->session[i]->module->name, key->modulename)) {
+            if (hsm_session_refresh(ctx, ctx->session[i])) {
+                hsm_module_fail(ctx->session[i]->module);
+            }
             return ctx->session[i];
         }
     }
     return NULL;
 }
 
+/* find the repository of a key, without touching the sessions of the
+ * context, which may be in use by another thread */
+static hsm_module_t *
+hsm_find_key_module(const hsm_ctx_t *ctx, const libhsm_key_t *key)
+{
+    unsigned int i;
+    if (!key || !key->modulename) return NULL;
+    for (i = 0; i < ctx->session_count; i++) {
+        if (ctx->session[i] && !strcmp(ctx->session[i]->module->name, key->modulename)) {
+            return ctx->session[i]->module;
+        }
+    }
+    return NULL;
+}
+
+/* Selects which of the replicas of a key, in the repositories of the
+ * context, makes the next signature.  Repositories out of rotation are
+ * passed over, of the others the one with the fewest sign operations in
+ * progress for its weight is taken, taking turns when equally loaded.
+ * If no repository is in rotation the first one holding the key is tried.
+ */
+static const libhsm_key_t *
+hsm_select_key(hsm_ctx_t *ctx, const libhsm_key_t *key,
+               hsm_session_t **session)
+{
+    const libhsm_key_t *replica;
+    const libhsm_key_t *best = NULL;
+    hsm_session_t *replica_session;
+    hsm_session_t *best_session = NULL;
+    unsigned long load, best_load = 0;
+    unsigned int weight, best_weight = 1;
+    unsigned int count, turn, order, best_order = 0;
+
+    *session = NULL;
+    if (!key) return NULL;
+    if (!key->replica) {
+        *session = hsm_find_key_session(ctx, key);
+        return key;
+    }
+    for (count = 0, replica = key; replica; replica = replica->replica) {
+        count++;
+    }
+    turn = ctx->rotation++ % count;
+    for (order = 0, replica = key; replica; replica = replica->replica) {
+        order = (order + 1) % count;
+        replica_session = hsm_find_key_session(ctx, replica);
+        if (!replica_session) continue;
+        if (!*session) {
+            *session = replica_session;
+        }
+        if (__atomic_load_n(&replica_session->module->failed, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        load = __atomic_load_n(&replica_session->module->outstanding,
+                               __ATOMIC_RELAXED) + 1;
+        weight = hsm_module_weight(replica_session->module);
+        if (!best || load * best_weight < best_load * weight ||
+            (load * best_weight == best_load * weight &&
+             (order + count - turn) % count < (best_order + count - turn) % count)) {
+            best = replica;
+            best_session = replica_session;
+            best_load = load;
+            best_weight = weight;
+            best_order = order;
+        }
+    }
+    if (!best) {
+        /* nothing in rotation, try the first repository with the key */
+        for (replica = key; replica; replica = replica->replica) {
+            if (hsm_find_key_session(ctx, replica) == *session) break;
+        }
+        return replica;
+    }
+    *session = best_session;
+    return best;
+}
+
 /* Returns the key type (algorithm) of the given key */
 static CK_KEY_TYPE
 hsm_get_key_algorithm(hsm_ctx_t *ctx, const hsm_session_t *session,
@@ -1871,54 +2206,70 @@ hsm_get_key_rdata(hsm_ctx_t *ctx, hsm_session_t *session,
     }
 }
 
-/* this function allocates memory for the mechanism ID and enough room
- * to leave the upcoming digest data. It fills in the mechanism id
- * use with care. The returned data must be free'd by the caller.
- * Only used by RSA PKCS. */
-static CK_BYTE *
-hsm_create_prefix(CK_ULONG digest_len,
-                  ldns_algorithm algorithm,
-                  CK_ULONG *data_size)
+static const CK_BYTE RSA_MD5_ID[] = { 0x30, 0x20, 0x30, 0x0C, 0x06, 0x08, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x05, 0x05, 0x00, 0x04, 0x10 };
+static const CK_BYTE RSA_SHA1_ID[] = { 0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2B, 0x0E, 0x03, 0x02, 0x1A, 0x05, 0x00, 0x04, 0x14 };
+static const CK_BYTE RSA_SHA256_ID[] = { 0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+static const CK_BYTE RSA_SHA512_ID[] = { 0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40 };
+
+/* the largest identifier prefix and digest put in front of the signature */
+#define HSM_MAX_PREFIX_LENGTH 19
+#define HSM_MAX_DIGEST_LENGTH 64
+/* the RRSIG rdata in front of the signature, with the longest signer name */
+#define HSM_RRSIG_HEADER_LENGTH (18 + LDNS_MAX_DOMAINLEN)
+
+/* returns the identifier of the digest that goes in front of it for
+ * RSA PKCS, which is empty for the other algorithms, or NULL if the
+ * algorithm is not signed over a digest */
+static const CK_BYTE *
+hsm_digest_prefix(ldns_algorithm algorithm, CK_ULONG *prefix_len)
 {
-    CK_BYTE *data;
-    const CK_BYTE RSA_MD5_ID[] = { 0x30, 0x20, 0x30, 0x0C, 0x06, 0x08, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x05, 0x05, 0x00, 0x04, 0x10 };
-    const CK_BYTE RSA_SHA1_ID[] = { 0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2B, 0x0E, 0x03, 0x02, 0x1A, 0x05, 0x00, 0x04, 0x14 };
-    const CK_BYTE RSA_SHA256_ID[] = { 0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
-    const CK_BYTE RSA_SHA512_ID[] = { 0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40 };
-
     switch((ldns_signing_algorithm)algorithm) {
         case LDNS_SIGN_RSAMD5:
-            *data_size = sizeof(RSA_MD5_ID) + digest_len;
-            CHECKALLOC(data = malloc(*data_size));
-            memcpy(data, RSA_MD5_ID, sizeof(RSA_MD5_ID));
-            break;
+            *prefix_len = sizeof(RSA_MD5_ID);
+            return RSA_MD5_ID;
         case LDNS_SIGN_RSASHA1:
         case LDNS_SIGN_RSASHA1_NSEC3:
-            *data_size = sizeof(RSA_SHA1_ID) + digest_len;
-            CHECKALLOC(data = malloc(*data_size));
-            memcpy(data, RSA_SHA1_ID, sizeof(RSA_SHA1_ID));
-            break;
-	case LDNS_SIGN_RSASHA256:
-            *data_size = sizeof(RSA_SHA256_ID) + digest_len;
-            CHECKALLOC(data = malloc(*data_size));
-            memcpy(data, RSA_SHA256_ID, sizeof(RSA_SHA256_ID));
-            break;
-	case LDNS_SIGN_RSASHA512:
-            *data_size = sizeof(RSA_SHA512_ID) + digest_len;
-            CHECKALLOC(data = malloc(*data_size));
-            memcpy(data, RSA_SHA512_ID, sizeof(RSA_SHA512_ID));
-            break;
+            *prefix_len = sizeof(RSA_SHA1_ID);
+            return RSA_SHA1_ID;
+        case LDNS_SIGN_RSASHA256:
+            *prefix_len = sizeof(RSA_SHA256_ID);
+            return RSA_SHA256_ID;
+        case LDNS_SIGN_RSASHA512:
+            *prefix_len = sizeof(RSA_SHA512_ID);
+            return RSA_SHA512_ID;
         case LDNS_SIGN_DSA:
         case LDNS_SIGN_DSA_NSEC3:
         case LDNS_SIGN_ECC_GOST:
         case LDNS_SIGN_ECDSAP256SHA256:
         case LDNS_SIGN_ECDSAP384SHA384:
-            *data_size = digest_len;
-            CHECKALLOC(data = malloc(*data_size));
-            break;
+            /* nothing goes in front of the digest */
+            *prefix_len = 0;
+            return RSA_SHA1_ID;
         default:
             return NULL;
     }
+}
+
+/* this function allocates memory for the mechanism ID and enough room
+ * to leave the upcoming digest data. It fills in the mechanism id
+ * use with care. The returned data must be free'd by the caller.
+ * Only used by RSA PKCS. */
+static CK_BYTE *
+hsm_create_prefix(CK_ULONG digest_len,
+                  ldns_algorithm algorithm,
+                  CK_ULONG *data_size)
+{
+    CK_BYTE *data;
+    const CK_BYTE *prefix;
+    CK_ULONG prefix_len;
+
+    prefix = hsm_digest_prefix(algorithm, &prefix_len);
+    if (!prefix) {
+        return NULL;
+    }
+    *data_size = prefix_len + digest_len;
+    CHECKALLOC(data = malloc(*data_size));
+    memcpy(data, prefix, prefix_len);
     return data;
 }
 
@@ -1956,30 +2307,59 @@ hsm_digest_through_hsm(hsm_ctx_t *ctx,
     return digest;
 }
 
-static ldns_rdf *
-hsm_sign_buffer(hsm_ctx_t *ctx,
-                ldns_buffer *sign_buf,
-                const libhsm_key_t *key,
-                ldns_algorithm algorithm)
+/* returns the PKCS#11 mechanism that signs for the algorithm */
+static int
+hsm_sign_mechanism(ldns_algorithm algorithm, CK_MECHANISM_TYPE *mechanism)
 {
-    CK_RV rv;
-    CK_ULONG signatureLen = HSM_MAX_SIGNATURE_LENGTH;
-    CK_BYTE signature[HSM_MAX_SIGNATURE_LENGTH];
-    CK_MECHANISM sign_mechanism;
+    switch((ldns_signing_algorithm)algorithm) {
+        case LDNS_SIGN_RSAMD5:
+        case LDNS_SIGN_RSASHA1:
+        case LDNS_SIGN_RSASHA1_NSEC3:
+        case LDNS_SIGN_RSASHA256:
+        case LDNS_SIGN_RSASHA512:
+            *mechanism = CKM_RSA_PKCS;
+            break;
+        case LDNS_SIGN_DSA:
+        case LDNS_SIGN_DSA_NSEC3:
+            *mechanism = CKM_DSA;
+            break;
+        case LDNS_SIGN_ECC_GOST:
+            *mechanism = CKM_GOSTR3410;
+            break;
+        case LDNS_SIGN_ECDSAP256SHA256:
+        case LDNS_SIGN_ECDSAP384SHA384:
+            *mechanism = CKM_ECDSA;
+            break;
+        case LDNS_SIGN_ED25519:
+            *mechanism = CKM_EDDSA;
+            break;
+        case LDNS_SIGN_ED448:
+            *mechanism = CKM_EDDSA;
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
 
+/* Prepares the data to be passed to C_Sign() for the contents of the sign
+ * buffer, and returns the mechanism to use.  Depending on the algorithm
+ * this is the digest, with an identifier prefix for RSA, or the data itself.
+ * The returned data must be free'd by the caller. */
+static CK_BYTE *
+hsm_sign_prepare(hsm_ctx_t *ctx,
+                 hsm_session_t *session,
+                 ldns_buffer *sign_buf,
+                 ldns_algorithm algorithm,
+                 CK_MECHANISM_TYPE *mechanism,
+                 CK_ULONG *data_len)
+{
     int data_direct = 0; // don't pre-create digest, use data directly
 
-    ldns_rdf *sig_rdf;
     CK_BYTE *digest = NULL;
     CK_ULONG digest_len = 0;
 
     CK_BYTE *data = NULL;
-    CK_ULONG data_len = 0;
-
-    hsm_session_t *session;
-
-    session = hsm_find_key_session(ctx, key);
-    if (!session) return NULL;
 
     /* some HSMs don't really handle CKM_SHA1_RSA_PKCS well, so
      * we'll do the hashing manually */
@@ -2046,88 +2426,888 @@ hsm_sign_buffer(hsm_ctx_t *ctx,
         return NULL;
     }
 
+    if (!hsm_sign_mechanism(algorithm, mechanism)) {
+        free(digest);
+        return NULL;
+    }
+
     if (data_direct) {
-        data = ldns_buffer_begin(sign_buf);
-        data_len = ldns_buffer_position(sign_buf);
+        *data_len = ldns_buffer_position(sign_buf);
+        CHECKALLOC(data = malloc(*data_len));
+        memcpy(data, ldns_buffer_begin(sign_buf), *data_len);
     } else {
         /* CKM_RSA_PKCS does the padding, but cannot know the identifier
          * prefix, so we need to add that ourselves.
          * The other algorithms will just get the digest buffer returned. */
-        data = hsm_create_prefix(digest_len, algorithm, &data_len);
-        memcpy(data + data_len - digest_len, digest, digest_len);
+        data = hsm_create_prefix(digest_len, algorithm, data_len);
+        memcpy(data + *data_len - digest_len, digest, digest_len);
+        free(digest);
     }
+    return data;
+}
 
-    sign_mechanism.pParameter = NULL;
-    sign_mechanism.ulParameterLen = 0;
-    switch((ldns_signing_algorithm)algorithm) {
-        case LDNS_SIGN_RSAMD5:
+/* Prepares the data to be passed to C_Sign() like hsm_sign_prepare(), for
+ * a message in two parts which is digested in one pass into the storage
+ * given.  Returns the length of the data, or 0 for algorithms that do not
+ * sign over a digest made in-process. */
+static CK_ULONG
+hsm_sign_prepare_parts(const uint8_t *head, size_t head_len,
+                       const uint8_t *tail, size_t tail_len,
+                       ldns_algorithm algorithm,
+                       CK_MECHANISM_TYPE *mechanism,
+                       CK_BYTE data[HSM_MAX_PREFIX_LENGTH + HSM_MAX_DIGEST_LENGTH])
+{
+    const CK_BYTE *prefix;
+    CK_ULONG prefix_len;
+    CK_ULONG digest_len;
+    CK_BYTE *digest;
+    ldns_sha1_ctx sha1;
+    ldns_sha256_CTX sha256;
+    ldns_sha512_CTX sha512;
+
+    prefix = hsm_digest_prefix(algorithm, &prefix_len);
+    if (!prefix || !hsm_sign_mechanism(algorithm, mechanism)) {
+        return 0;
+    }
+    memcpy(data, prefix, prefix_len);
+    digest = data + prefix_len;
+    switch ((ldns_signing_algorithm)algorithm) {
         case LDNS_SIGN_RSASHA1:
         case LDNS_SIGN_RSASHA1_NSEC3:
-        case LDNS_SIGN_RSASHA256:
-        case LDNS_SIGN_RSASHA512:
-            sign_mechanism.mechanism = CKM_RSA_PKCS;
-            break;
         case LDNS_SIGN_DSA:
         case LDNS_SIGN_DSA_NSEC3:
-            sign_mechanism.mechanism = CKM_DSA;
-            break;
-        case LDNS_SIGN_ECC_GOST:
-            sign_mechanism.mechanism = CKM_GOSTR3410;
+            digest_len = LDNS_SHA1_DIGEST_LENGTH;
+            ldns_sha1_init(&sha1);
+            ldns_sha1_update(&sha1, head, head_len);
+            ldns_sha1_update(&sha1, tail, tail_len);
+            ldns_sha1_final(digest, &sha1);
             break;
+        case LDNS_SIGN_RSASHA256:
         case LDNS_SIGN_ECDSAP256SHA256:
-        case LDNS_SIGN_ECDSAP384SHA384:
-            sign_mechanism.mechanism = CKM_ECDSA;
+            digest_len = LDNS_SHA256_DIGEST_LENGTH;
+            ldns_sha256_init(&sha256);
+            ldns_sha256_update(&sha256, head, head_len);
+            ldns_sha256_update(&sha256, tail, tail_len);
+            ldns_sha256_final(digest, &sha256);
             break;
-        case LDNS_SIGN_ED25519:
-            sign_mechanism.mechanism = CKM_EDDSA;
+        case LDNS_SIGN_ECDSAP384SHA384:
+            digest_len = LDNS_SHA384_DIGEST_LENGTH;
+            ldns_sha384_init(&sha512);
+            ldns_sha384_update(&sha512, head, head_len);
+            ldns_sha384_update(&sha512, tail, tail_len);
+            ldns_sha384_final(digest, &sha512);
             break;
-        case LDNS_SIGN_ED448:
-            sign_mechanism.mechanism = CKM_EDDSA;
+        case LDNS_SIGN_RSASHA512:
+            digest_len = LDNS_SHA512_DIGEST_LENGTH;
+            ldns_sha512_init(&sha512);
+            ldns_sha512_update(&sha512, head, head_len);
+            ldns_sha512_update(&sha512, tail, tail_len);
+            ldns_sha512_final(digest, &sha512);
             break;
         default:
-            /* log error? or should we not even get here for
-             * unsupported algorithms? */
-            free(data);
-            free(digest);
-            return NULL;
-    }
-
-    rv = ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_SignInit(
-                                      session->session,
-                                      &sign_mechanism,
-                                      key->private_key);
-    if (hsm_pkcs11_check_error(ctx, rv, "sign init")) {
-        if (!data_direct) {
-            free(data);
-            free(digest);
-        }
-        return NULL;
+            /* MD5 and GOST are digested by the HSM */
+            return 0;
     }
+    return prefix_len + digest_len;
+}
 
-    rv = ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_Sign(session->session, data, data_len,
-                                      signature,
-                                      &signatureLen);
-    if (hsm_pkcs11_check_error(ctx, rv, "sign final")) {
-        if (!data_direct) {
-            free(data);
-            free(digest);
-        }
-        return NULL;
-    }
+/* Signs the prepared data in the given session.  On failure the action
+ * that failed is returned through action. */
+static CK_RV
+hsm_sign_data(CK_FUNCTION_LIST_PTR sym,
+              CK_SESSION_HANDLE session,
+              CK_MECHANISM_TYPE mechanism,
+              CK_OBJECT_HANDLE private_key,
+              CK_BYTE *data,
+              CK_ULONG data_len,
+              CK_BYTE *signature,
+              CK_ULONG *signature_len,
+              const char **action)
+{
+    CK_RV rv;
+    CK_MECHANISM sign_mechanism;
 
-    sig_rdf = ldns_rdf_new_frm_data(LDNS_RDF_TYPE_B64,
-                                    signatureLen,
-                                    signature);
+    sign_mechanism.mechanism = mechanism;
+    sign_mechanism.pParameter = NULL;
+    sign_mechanism.ulParameterLen = 0;
 
-    if (!data_direct) {
-        free(data);
-        free(digest);
+    *action = "sign init";
+    rv = sym->C_SignInit(session, &sign_mechanism, private_key);
+    if (rv != CKR_OK) {
+        return rv;
     }
+    *action = "sign final";
+    return sym->C_Sign(session, data, data_len, signature, signature_len);
+}
+
+#ifdef HAVE_SSL
+static pthread_key_t hsm_software_ctx_key;
+static pthread_once_t hsm_software_ctx_once = PTHREAD_ONCE_INIT;
+
+static void
+hsm_software_ctx_free(void *mdctx)
+{
+    EVP_MD_CTX_free(mdctx);
+}
+
+static void
+hsm_software_ctx_init(void)
+{
+    (void) pthread_key_create(&hsm_software_ctx_key, hsm_software_ctx_free);
+}
+
+/* returns the digest context of the calling thread, ready for reuse */
+static EVP_MD_CTX *
+hsm_software_ctx(void)
+{
+    EVP_MD_CTX *mdctx;
+
+    pthread_once(&hsm_software_ctx_once, hsm_software_ctx_init);
+    mdctx = pthread_getspecific(hsm_software_ctx_key);
+    if (!mdctx) {
+        CHECKALLOC(mdctx = EVP_MD_CTX_new());
+        (void) pthread_setspecific(hsm_software_ctx_key, mdctx);
+    } else {
+        EVP_MD_CTX_reset(mdctx);
+    }
+    return mdctx;
+}
+
+/* returns non-zero if the algorithm can be signed in-process, and the
+ * digest to sign with, which is NULL for EdDSA */
+static int
+hsm_software_md(ldns_algorithm algorithm, const EVP_MD **md)
+{
+    const EVP_MD *digest;
+
+    switch ((ldns_signing_algorithm)algorithm) {
+        case LDNS_SIGN_RSASHA1:
+        case LDNS_SIGN_RSASHA1_NSEC3:
+            digest = EVP_sha1();
+            break;
+        case LDNS_SIGN_RSASHA256:
+        case LDNS_SIGN_ECDSAP256SHA256:
+            digest = EVP_sha256();
+            break;
+        case LDNS_SIGN_ECDSAP384SHA384:
+            digest = EVP_sha384();
+            break;
+        case LDNS_SIGN_RSASHA512:
+            digest = EVP_sha512();
+            break;
+        case LDNS_SIGN_ED25519:
+        case LDNS_SIGN_ED448:
+            digest = NULL;
+            break;
+        default:
+            return 0;
+    }
+    if (md) *md = digest;
+    return 1;
+}
+
+/* whether the algorithm digests the message in steps, EdDSA does not */
+static int
+hsm_software_streams(ldns_algorithm algorithm)
+{
+    const EVP_MD *md;
+
+    return hsm_software_md(algorithm, &md) && md != NULL;
+}
+
+/* passphrase callback refusing to decrypt, keys in the directory must
+ * be stored unencrypted rather than prompt on the terminal */
+static int
+hsm_software_no_passphrase(char *buf, int size, int rwflag, void *arg)
+{
+    (void) buf;
+    (void) size;
+    (void) rwflag;
+    (void) arg;
+    return -1;
+}
+
+/* reads the private key from the PKCS#8 file <locator>.pem in the
+ * directory, returns NULL if there is none.  The file is refused unless
+ * it is a regular file owned by us or root, which others cannot access. */
+static EVP_PKEY *
+hsm_software_read_key(const char *directory, const char *locator)
+{
+    char *path;
+    int fd;
+    struct stat st;
+    FILE *fp;
+    EVP_PKEY *pkey;
+
+    if (!directory || !*directory) return NULL;
+    CHECKALLOC(path = malloc(strlen(directory) + strlen(locator) + 6));
+    sprintf(path, "%s/%s.pem", directory, locator);
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    free(path);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+        (st.st_uid != geteuid() && st.st_uid != 0) ||
+        (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        close(fd);
+        return NULL;
+    }
+    if (!(fp = fdopen(fd, "r"))) {
+        close(fd);
+        return NULL;
+    }
+    pkey = PEM_read_PrivateKey(fp, NULL, hsm_software_no_passphrase, NULL);
+    fclose(fp);
+    return pkey;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#define EVP_PKEY_get1_encoded_public_key EVP_PKEY_get1_tls_encodedpoint
+#endif
+
+/* returns copies of the modulus and public exponent of the RSA key */
+static int
+hsm_software_rsa_key(EVP_PKEY *pkey, BIGNUM **n, BIGNUM **e)
+{
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+    const RSA *rsa;
+    const BIGNUM *rsa_n, *rsa_e;
+
+    if (!(rsa = EVP_PKEY_get0_RSA(pkey))) return 0;
+    RSA_get0_key(rsa, &rsa_n, &rsa_e, NULL);
+    *n = BN_dup(rsa_n);
+    *e = BN_dup(rsa_e);
+#else
+    *n = NULL;
+    *e = NULL;
+    (void) EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_N, n);
+    (void) EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_E, e);
+#endif
+    if (!*n || !*e) {
+        BN_free(*n);
+        BN_free(*e);
+        return 0;
+    }
+    return 1;
+}
+
+/* encodes the public part of the private key as in the DNSKEY, for the
+ * algorithms that can be signed in-process */
+static ldns_rdf *
+hsm_software_public_rdata(EVP_PKEY *pkey)
+{
+    BIGNUM *n, *e;
+    unsigned char *point;
+    unsigned char *data = NULL;
+    size_t data_size = 0;
+    size_t n_len, e_len, offset;
+
+    switch (EVP_PKEY_base_id(pkey)) {
+        case EVP_PKEY_RSA:
+            if (!hsm_software_rsa_key(pkey, &n, &e)) return NULL;
+            n_len = BN_num_bytes(n);
+            e_len = BN_num_bytes(e);
+            if (e_len > 65535) {
+                BN_free(n);
+                BN_free(e);
+                return NULL;
+            }
+            offset = (e_len <= 255 ? 1 : 3);
+            data_size = offset + e_len + n_len;
+            CHECKALLOC(data = malloc(data_size));
+            if (offset == 1) {
+                data[0] = e_len;
+            } else {
+                data[0] = 0;
+                ldns_write_uint16(&data[1], (uint16_t) e_len);
+            }
+            BN_bn2bin(e, &data[offset]);
+            BN_bn2bin(n, &data[offset + e_len]);
+            BN_free(n);
+            BN_free(e);
+            break;
+        case EVP_PKEY_EC:
+            data_size = EVP_PKEY_get1_encoded_public_key(pkey, &point);
+            if (data_size < 2 || point[0] != POINT_CONVERSION_UNCOMPRESSED) {
+                if (data_size) OPENSSL_free(point);
+                return NULL;
+            }
+            /* the DNSKEY leaves out the form in front of the point */
+            CHECKALLOC(data = malloc(--data_size));
+            memcpy(data, point + 1, data_size);
+            OPENSSL_free(point);
+            break;
+        case EVP_PKEY_ED25519:
+        case EVP_PKEY_ED448:
+            if (EVP_PKEY_get_raw_public_key(pkey, NULL, &data_size) != 1) {
+                return NULL;
+            }
+            CHECKALLOC(data = malloc(data_size));
+            if (EVP_PKEY_get_raw_public_key(pkey, data, &data_size) != 1) {
+                free(data);
+                return NULL;
+            }
+            break;
+        default:
+            return NULL;
+    }
+    return ldns_rdf_new(LDNS_RDF_TYPE_B64, data_size, data);
+}
+
+/* returns non-zero if the private key is the one of the key pair on the
+ * token, by comparing their public parts */
+static int
+hsm_software_matches(hsm_ctx_t *ctx, hsm_session_t *session,
+                     const libhsm_key_t *key, EVP_PKEY *pkey)
+{
+    ldns_rdf *token;
+    ldns_rdf *software;
+    int matches;
+
+    if (!(software = hsm_software_public_rdata(pkey))) return 0;
+    if (!(token = hsm_get_key_rdata(ctx, session, key))) {
+        ldns_rdf_deep_free(software);
+        return 0;
+    }
+    matches = (ldns_rdf_compare(token, software) == 0);
+    ldns_rdf_deep_free(token);
+    ldns_rdf_deep_free(software);
+    return matches;
+}
+
+/* exports the private key from the token, by wrapping it with an AES key
+ * created for the occasion and unwrapping the PKCS#8 structure again in
+ * memory.  The private key must have been generated extractable. */
+static EVP_PKEY *
+hsm_software_export_key(const hsm_session_t *session, const libhsm_key_t *key)
+{
+    CK_FUNCTION_LIST_PTR sym = session->module->sym;
+    CK_RV rv;
+    CK_OBJECT_HANDLE wrapkey;
+    CK_MECHANISM keygen = { CKM_AES_KEY_GEN, NULL_PTR, 0 };
+    CK_MECHANISM wrap = { CKM_AES_KEY_WRAP_PAD, NULL_PTR, 0 };
+    CK_OBJECT_CLASS keyclass = CKO_SECRET_KEY;
+    CK_KEY_TYPE keytype = CKK_AES;
+    CK_ULONG keylen = 32;
+    CK_BBOOL ctrue = CK_TRUE;
+    CK_BBOOL cfalse = CK_FALSE;
+    CK_BYTE kek[32];
+    CK_BYTE *wrapped = NULL;
+    CK_ULONG wrapped_len = 0;
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    int der_len = 0, len;
+    EVP_CIPHER_CTX *cipher;
+    PKCS8_PRIV_KEY_INFO *p8 = NULL;
+    EVP_PKEY *pkey = NULL;
+
+    CK_ATTRIBUTE template[] = {
+        { CKA_CLASS,       &keyclass, sizeof(keyclass) },
+        { CKA_KEY_TYPE,    &keytype,  sizeof(keytype)  },
+        { CKA_VALUE_LEN,   &keylen,   sizeof(keylen)   },
+        { CKA_TOKEN,       &cfalse,   sizeof(cfalse)   },
+        { CKA_WRAP,        &ctrue,    sizeof(ctrue)    },
+        { CKA_SENSITIVE,   &cfalse,   sizeof(cfalse)   },
+        { CKA_EXTRACTABLE, &ctrue,    sizeof(ctrue)    }
+    };
+    CK_ATTRIBUTE value[] = {
+        { CKA_VALUE, kek, sizeof(kek) }
+    };
+
+    rv = sym->C_GenerateKey(session->session, &keygen, template, 7, &wrapkey);
+    if (rv != CKR_OK) return NULL;
+    rv = sym->C_GetAttributeValue(session->session, wrapkey, value, 1);
+    if (rv == CKR_OK) {
+        rv = sym->C_WrapKey(session->session, &wrap, wrapkey,
+                            key->private_key, NULL, &wrapped_len);
+    }
+    if (rv == CKR_OK) {
+        CHECKALLOC(wrapped = malloc(wrapped_len));
+        rv = sym->C_WrapKey(session->session, &wrap, wrapkey,
+                            key->private_key, wrapped, &wrapped_len);
+    }
+    (void) sym->C_DestroyObject(session->session, wrapkey);
+    if (rv == CKR_OK && (cipher = EVP_CIPHER_CTX_new()) != NULL) {
+        CHECKALLOC(der = malloc(wrapped_len));
+        EVP_CIPHER_CTX_set_flags(cipher, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_wrap_pad(), NULL, kek, NULL) == 1 &&
+            EVP_DecryptUpdate(cipher, der, &len, wrapped, wrapped_len) == 1) {
+            der_len = len;
+            if (EVP_DecryptFinal_ex(cipher, der + der_len, &len) == 1) {
+                der_len += len;
+                p = der;
+                p8 = d2i_PKCS8_PRIV_KEY_INFO(NULL, &p, der_len);
+            }
+        }
+        EVP_CIPHER_CTX_free(cipher);
+    }
+    if (p8) {
+        pkey = EVP_PKCS82PKEY(p8);
+        PKCS8_PRIV_KEY_INFO_free(p8);
+    }
+    if (der) {
+        OPENSSL_cleanse(der, wrapped_len);
+        free(der);
+    }
+    OPENSSL_cleanse(kek, sizeof(kek));
+    free(wrapped);
+    return pkey;
+}
+
+/* loads the private keys for the replicas of the key in repositories
+ * configured to sign in-process */
+static void
+hsm_software_load_keys(hsm_ctx_t *ctx, libhsm_key_t *key, const char *locator)
+{
+    hsm_session_t *session;
+    EVP_PKEY *pkey;
+    int error = ctx->error;
+
+    for (; key; key = key->replica) {
+        session = hsm_find_key_session(ctx, key);
+        if (!session || !session->module->config ||
+            !session->module->config->software_keys) {
+            continue;
+        }
+        pkey = hsm_software_read_key(
+                        session->module->config->software_keys, locator);
+        if (pkey && !hsm_software_matches(ctx, session, key, pkey)) {
+            /* a stale or misplaced file, not the key on the token */
+            EVP_PKEY_free(pkey);
+            pkey = NULL;
+        }
+        if (!pkey) {
+            pkey = hsm_software_export_key(session, key);
+        }
+        key->pkey = pkey;
+    }
+    /* signing through the token is not an error */
+    if (!error) ctx->error = 0;
+}
+
+/* Signs the message in two parts in-process with the private key held in
+ * memory.  EdDSA does not digest in steps, for it the message is passed
+ * as a whole in the first part. */
+static ldns_rdf *
+hsm_sign_software(hsm_ctx_t *ctx,
+                  const uint8_t *head, size_t head_len,
+                  const uint8_t *tail, size_t tail_len,
+                  const libhsm_key_t *key,
+                  ldns_algorithm algorithm)
+{
+    const EVP_MD *md;
+    EVP_MD_CTX *mdctx;
+    unsigned char signature[HSM_MAX_SIGNATURE_LENGTH];
+    unsigned char raw[2 * 66];
+    size_t signature_len = sizeof(signature);
+    const unsigned char *p;
+    ECDSA_SIG *ecdsa;
+    const BIGNUM *r, *s;
+    int half;
+
+    if (!hsm_software_md(algorithm, &md)) return NULL;
+    mdctx = hsm_software_ctx();
+    if (EVP_DigestSignInit(mdctx, NULL, md, NULL, key->pkey) != 1 ||
+        (md ? EVP_DigestSignUpdate(mdctx, head, head_len) != 1 ||
+              EVP_DigestSignUpdate(mdctx, tail, tail_len) != 1 ||
+              EVP_DigestSignFinal(mdctx, signature, &signature_len) != 1
+            : EVP_DigestSign(mdctx, signature, &signature_len,
+                             head, head_len) != 1)) {
+        hsm_ctx_set_error(ctx, HSM_ERROR, "hsm_sign_software()",
+            "%s", ERR_reason_error_string(ERR_get_error()));
+        return NULL;
+    }
+    if ((ldns_signing_algorithm)algorithm != LDNS_SIGN_ECDSAP256SHA256 &&
+        (ldns_signing_algorithm)algorithm != LDNS_SIGN_ECDSAP384SHA384) {
+        return ldns_rdf_new_frm_data(LDNS_RDF_TYPE_B64, signature_len,
+                                     signature);
+    }
+    /* DNSSEC wants r and s concatenated instead of the DER encoding */
+    half = ((ldns_signing_algorithm)algorithm == LDNS_SIGN_ECDSAP256SHA256 ? 32 : 48);
+    p = signature;
+    if (!(ecdsa = d2i_ECDSA_SIG(NULL, &p, signature_len))) {
+        hsm_ctx_set_error(ctx, HSM_ERROR, "hsm_sign_software()",
+            "Invalid ECDSA signature");
+        return NULL;
+    }
+    ECDSA_SIG_get0(ecdsa, &r, &s);
+    BN_bn2binpad(r, raw, half);
+    BN_bn2binpad(s, raw + half, half);
+    ECDSA_SIG_free(ecdsa);
+    return ldns_rdf_new_frm_data(LDNS_RDF_TYPE_B64, 2 * half, raw);
+}
+#endif
+
+/* returns the replica of the key that can sign in-process for the
+ * algorithm, or NULL if the key needs to go through PKCS#11 */
+static const libhsm_key_t *
+hsm_software_key(const libhsm_key_t *key, ldns_algorithm algorithm)
+{
+#ifdef HAVE_SSL
+    for (; key; key = key->replica) {
+        if (key->pkey && hsm_software_md(algorithm, NULL)) {
+            return key;
+        }
+    }
+#else
+    (void) key;
+    (void) algorithm;
+#endif
+    return NULL;
+}
+
+/* Signs with the key, in the repository selected for it, either the data
+ * prepared beforehand or when that is NULL the contents of the sign
+ * buffer.  When the device fails the signature is retried with a replica
+ * of the key in another repository. */
+static ldns_rdf *
+hsm_sign_key(hsm_ctx_t *ctx,
+             ldns_buffer *sign_buf,
+             CK_BYTE *prepared,
+             CK_ULONG prepared_len,
+             CK_MECHANISM_TYPE prepared_mechanism,
+             const libhsm_key_t *key,
+             ldns_algorithm algorithm)
+{
+    CK_RV rv;
+    CK_ULONG signatureLen = HSM_MAX_SIGNATURE_LENGTH;
+    CK_BYTE signature[HSM_MAX_SIGNATURE_LENGTH];
+    CK_MECHANISM_TYPE mechanism = prepared_mechanism;
+    const char *action;
+
+    ldns_rdf *sig_rdf;
+
+    CK_BYTE *data = prepared;
+    CK_ULONG data_len = prepared_len;
+
+    hsm_session_t *session;
+    const libhsm_key_t *replica;
+    unsigned int attempts = 0;
+
+    for (;;) {
+        replica = hsm_select_key(ctx, key, &session);
+        if (!session) return NULL;
+
+        if (!prepared) {
+            data = hsm_sign_prepare(ctx, session, sign_buf, algorithm,
+                                    &mechanism, &data_len);
+            if (!data) {
+                return NULL;
+            }
+        }
+
+        __atomic_add_fetch(&session->module->outstanding, 1, __ATOMIC_RELAXED);
+        signatureLen = HSM_MAX_SIGNATURE_LENGTH;
+        rv = hsm_sign_data((CK_FUNCTION_LIST_PTR)session->module->sym,
+                           session->session, mechanism, replica->private_key,
+                           data, data_len, signature, &signatureLen, &action);
+        __atomic_sub_fetch(&session->module->outstanding, 1, __ATOMIC_RELAXED);
+        if (!prepared) {
+            free(data);
+        }
+        if (rv != CKR_OK && hsm_pkcs11_device_error(rv)) {
+            /* take the repository out of rotation and retry the
+             * signature with the key in one of the others */
+            hsm_module_fail(session->module);
+            if (key->replica && ++attempts < HSM_MAX_SESSIONS &&
+                hsm_select_key(ctx, key, &session) && session &&
+                !__atomic_load_n(&session->module->failed, __ATOMIC_RELAXED)) {
+                continue;
+            }
+        }
+        if (hsm_pkcs11_check_error(ctx, rv, action)) {
+            return NULL;
+        }
+        break;
+    }
+
+    sig_rdf = ldns_rdf_new_frm_data(LDNS_RDF_TYPE_B64,
+                                    signatureLen,
+                                    signature);
 
     return sig_rdf;
 
 }
 
+static ldns_rdf *
+hsm_sign_buffer(hsm_ctx_t *ctx,
+                ldns_buffer *sign_buf,
+                const libhsm_key_t *key,
+                ldns_algorithm algorithm)
+{
+#ifdef HAVE_SSL
+    const libhsm_key_t *replica;
+
+    if ((replica = hsm_software_key(key, algorithm)) != NULL) {
+        return hsm_sign_software(ctx, ldns_buffer_begin(sign_buf),
+                                 ldns_buffer_position(sign_buf), NULL, 0,
+                                 replica, algorithm);
+    }
+#endif
+    return hsm_sign_key(ctx, sign_buf, NULL, 0, 0, key, algorithm);
+}
+
+/*! Sign request queued to the session pool of a module */
+struct hsm_sign_request {
+    struct hsm_sign_request *next;
+    CK_MECHANISM_TYPE mechanism;
+    CK_OBJECT_HANDLE private_key;
+    CK_BYTE *data;
+    CK_ULONG data_len;
+    ldns_rr *signature;
+    hsm_sign_callback_t callback;
+    void *arg;
+    /* to pass the request on to another repository holding the key */
+    hsm_ctx_t *ctx;
+    const libhsm_key_t *key;
+    unsigned int attempts;
+    /* holds the data when it is a digest made in-process */
+    CK_BYTE digest[HSM_MAX_PREFIX_LENGTH + HSM_MAX_DIGEST_LENGTH];
+};
+
+/*! Pool of sessions on a token, each served by its own thread, which
+ * perform the sign requests queued to the pool.  A PKCS#11 C_Sign()
+ * blocks for the full round trip to the HSM, the pool allows a caller
+ * to have several requests in progress at the same time.
+ */
+struct hsm_pool_struct {
+    hsm_module_t *module;
+    size_t nsessions;
+    hsm_session_t **sessions;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct hsm_sign_request *head;
+    struct hsm_sign_request **tail;
+    int stopping;
+    int stopped;
+};
+
+struct hsm_pool_thread {
+    hsm_pool_t *pool;
+    hsm_session_t *session;
+};
+
+static int hsm_pool_submit(hsm_pool_t *pool,
+                           struct hsm_sign_request *request);
+
+/* queues the prepared request to the pool of the repository, to be signed
+ * with the replica of the key in it.  Returns non-zero if the pool is
+ * stopping and the request was not queued. */
+static int
+hsm_sign_enqueue(hsm_module_t *module,
+                 const libhsm_key_t *replica,
+                 struct hsm_sign_request *request)
+{
+    request->private_key = replica->private_key;
+    __atomic_add_fetch(&module->outstanding, 1, __ATOMIC_RELAXED);
+    if (hsm_pool_submit(module->pool, request)) {
+        __atomic_sub_fetch(&module->outstanding, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/* passes a request that failed on a repository now out of rotation on to
+ * the pool of the least loaded of the other repositories in rotation that
+ * hold the key.  Returns non-zero if it was queued there. */
+static int
+hsm_sign_reroute(struct hsm_sign_request *request)
+{
+    const libhsm_key_t *replica;
+    const libhsm_key_t *best = NULL;
+    hsm_module_t *module;
+    hsm_module_t *best_module = NULL;
+    unsigned long load, best_load = 0;
+    unsigned int weight, best_weight = 1;
+
+    if (!request->key->replica || ++request->attempts >= HSM_MAX_SESSIONS) {
+        return 0;
+    }
+    for (replica = request->key; replica; replica = replica->replica) {
+        module = hsm_find_key_module(request->ctx, replica);
+        if (!module || !module->pool ||
+            __atomic_load_n(&module->failed, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        load = __atomic_load_n(&module->outstanding, __ATOMIC_RELAXED) + 1;
+        weight = hsm_module_weight(module);
+        if (!best || load * best_weight < best_load * weight) {
+            best = replica;
+            best_module = module;
+            best_load = load;
+            best_weight = weight;
+        }
+    }
+    if (!best) return 0;
+    return !hsm_sign_enqueue(best_module, best, request);
+}
+
+static void *
+hsm_pool_run(void *arg)
+{
+    struct hsm_pool_thread *self = arg;
+    hsm_pool_t *pool = self->pool;
+    hsm_session_t *session = self->session;
+    struct hsm_sign_request *request;
+    CK_ULONG signatureLen;
+    CK_BYTE signature[HSM_MAX_SIGNATURE_LENGTH];
+    const char *action;
+    CK_RV rv;
+
+    free(self);
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        request = pool->head;
+        if (request) {
+            pool->head = request->next;
+            if (!pool->head) {
+                pool->tail = &pool->head;
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!request) {
+            break;
+        }
+        rv = CKR_SESSION_HANDLE_INVALID;
+        if (!hsm_session_refresh(NULL, session)) {
+            signatureLen = HSM_MAX_SIGNATURE_LENGTH;
+            rv = hsm_sign_data((CK_FUNCTION_LIST_PTR)pool->module->sym,
+                               session->session, request->mechanism,
+                               request->private_key, request->data,
+                               request->data_len, signature, &signatureLen,
+                               &action);
+        }
+        __atomic_sub_fetch(&pool->module->outstanding, 1, __ATOMIC_RELAXED);
+        if (rv != CKR_OK && hsm_pkcs11_device_error(rv)) {
+            /* take the repository out of rotation and have the
+             * signature made by another one holding the key, the
+             * RRset is only failed if there is none */
+            hsm_module_fail(pool->module);
+            if (!__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED) &&
+                hsm_sign_reroute(request)) {
+                continue;
+            }
+        }
+        if (rv == CKR_OK) {
+            ldns_rr_rrsig_set_sig(request->signature,
+                ldns_rdf_new_frm_data(LDNS_RDF_TYPE_B64, signatureLen,
+                                      signature));
+            request->callback(request->arg, request->signature, NULL);
+        } else {
+            ldns_rr_free(request->signature);
+            request->callback(request->arg, NULL, ldns_pkcs11_rv_str(rv));
+        }
+        if (request->data != request->digest) {
+            free(request->data);
+        }
+        free(request);
+    }
+    return NULL;
+}
+
+/* opens the sessions of the pool as clones of the given session, and
+ * starts their threads.  Returns NULL if no session could be opened. */
+static hsm_pool_t *
+hsm_pool_create(hsm_ctx_t *ctx, hsm_session_t *session, unsigned int size)
+{
+    hsm_pool_t *pool;
+    hsm_session_t *clone;
+    struct hsm_pool_thread *thread;
+    size_t i;
+
+    CHECKALLOC(pool = malloc(sizeof(hsm_pool_t)));
+    CHECKALLOC(pool->sessions = malloc(sizeof(hsm_session_t *) * size));
+    CHECKALLOC(pool->threads = malloc(sizeof(pthread_t) * size));
+    pool->module = session->module;
+    pool->nsessions = 0;
+    pool->head = NULL;
+    pool->tail = &pool->head;
+    pool->stopping = 0;
+    pool->stopped = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (i = 0; i < size; i++) {
+        if (!(clone = hsm_session_clone(ctx, session))) {
+            break;
+        }
+        CHECKALLOC(thread = malloc(sizeof(struct hsm_pool_thread)));
+        thread->pool = pool;
+        thread->session = clone;
+        if (pthread_create(&pool->threads[pool->nsessions], NULL, hsm_pool_run, thread)) {
+            free(thread);
+            ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_CloseSession(clone->session);
+            hsm_session_free(clone);
+            break;
+        }
+        pool->sessions[pool->nsessions++] = clone;
+    }
+    if (pool->nsessions == 0) {
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        free(pool->sessions);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* completes all queued requests and stops the threads of the pool, from
+ * then on requests submitted to it fail back to their caller */
+static void
+hsm_pool_stop(hsm_pool_t *pool)
+{
+    size_t i;
+
+    if (!pool || pool->stopped) return;
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nsessions; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->stopped = 1;
+}
+
+/* stops the pool and closes its sessions */
+static void
+hsm_pool_destroy(hsm_pool_t *pool)
+{
+    size_t i;
+
+    if (!pool) return;
+    hsm_pool_stop(pool);
+    for (i = 0; i < pool->nsessions; i++) {
+        ((CK_FUNCTION_LIST_PTR)pool->module->sym)->C_CloseSession(pool->sessions[i]->session);
+        hsm_session_free(pool->sessions[i]);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->sessions);
+    free(pool);
+}
+
+static int
+hsm_pool_submit(hsm_pool_t *pool, struct hsm_sign_request *request)
+{
+    request->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return 1;
+    }
+    *pool->tail = request;
+    pool->tail = &request->next;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
 static int
 hsm_dname_is_wildcard(const ldns_rdf* dname)
 {
@@ -2136,8 +3316,10 @@ hsm_dname_is_wildcard(const ldns_rdf* dname)
              ldns_rdf_data(dname)[1] == '*');
 }
 
+/* creates the RRSIG without signature for the RRset of which rr is a
+ * member */
 static ldns_rr *
-hsm_create_empty_rrsig(const ldns_rr_list *rrset,
+hsm_create_empty_rrsig(const ldns_rr *rr,
                        const hsm_sign_params_t *sign_params)
 {
     ldns_rr *rrsig;
@@ -2147,25 +3329,21 @@ hsm_create_empty_rrsig(const ldns_rr_list *rrset,
     uint8_t label_count;
 
     label_count = ldns_dname_label_count(
-                       ldns_rr_owner(ldns_rr_list_rr(rrset, 0)));
+                       ldns_rr_owner(rr));
     /* RFC 4035 section 2.2: dnssec label length and wildcards */
-    if (hsm_dname_is_wildcard(ldns_rr_owner(ldns_rr_list_rr(rrset, 0)))) {
+    if (hsm_dname_is_wildcard(ldns_rr_owner(rr))) {
         label_count--;
     }
 
     rrsig = ldns_rr_new_frm_type(LDNS_RR_TYPE_RRSIG);
 
     /* set the type on the new signature */
-    orig_ttl = ldns_rr_ttl(ldns_rr_list_rr(rrset, 0));
-    orig_class = ldns_rr_get_class(ldns_rr_list_rr(rrset, 0));
+    orig_ttl = ldns_rr_ttl(rr);
+    orig_class = ldns_rr_get_class(rr);
 
     ldns_rr_set_class(rrsig, orig_class);
     ldns_rr_set_ttl(rrsig, orig_ttl);
-    ldns_rr_set_owner(rrsig,
-              ldns_rdf_clone(
-                   ldns_rr_owner(
-                    ldns_rr_list_rr(rrset,
-                            0))));
+    ldns_rr_set_owner(rrsig, ldns_rdf_clone(ldns_rr_owner(rr)));
 
     /* fill in what we know of the signature */
 
@@ -2178,7 +3356,7 @@ hsm_create_empty_rrsig(const ldns_rr_list *rrset,
     (void)ldns_rr_rrsig_set_signame(
                rrsig,
                ldns_rdf_clone(sign_params->owner));
-    /* label count - get it from the first rr in the rr_list */
+    /* label count - get it from the owner of the rr */
     (void)ldns_rr_rrsig_set_labels(
             rrsig,
             ldns_native2rdf_int8(LDNS_RDF_TYPE_INT8,
@@ -2225,8 +3403,7 @@ hsm_create_empty_rrsig(const ldns_rr_list *rrset,
             rrsig,
             ldns_native2rdf_int16(
                 LDNS_RDF_TYPE_TYPE,
-                ldns_rr_get_type(ldns_rr_list_rr(rrset,
-                                                 0))));
+                ldns_rr_get_type(rr)));
 
     return rrsig;
 }
@@ -2268,6 +3445,9 @@ hsm_open2(struct engineconfig_repository* rlist,
         hsm_config_default(&module_config);
         module_config.use_pubkey = repo->use_pubkey;
         module_config.allow_extract = repo->allow_extract;
+        module_config.session_pool = repo->session_pool;
+        module_config.weight = repo->weight;
+        module_config.software_keys = repo->software_keys;
         if (repo->name && repo->tokenlabel) {
             if (repo->pin) {
                 result = hsm_attach(repo->name, repo->tokenlabel,
@@ -2315,6 +3495,7 @@ hsm_open2(struct engineconfig_repository* rlist,
 void
 hsm_close()
 {
+    hsm_prober_stop();
     pthread_mutex_lock(&_hsm_ctx_mutex);
     keycache_destroy(_hsm_ctx);
     hsm_ctx_close(_hsm_ctx, 1);
@@ -2337,10 +3518,9 @@ hsm_check_context()
 {
     unsigned int i;
     hsm_session_t *session;
-    CK_SESSION_INFO info;
     CK_RV rv;
-    CK_SESSION_HANDLE session_handle;
     hsm_ctx_t *ctx;
+    int usable = 0;
 
     pthread_mutex_lock(&_hsm_ctx_mutex);
     ctx = _hsm_ctx;
@@ -2349,40 +3529,29 @@ hsm_check_context()
         session = ctx->session[i];
         if (session == NULL) continue;
 
-        /* Get session info */
-        rv = ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_GetSessionInfo(
-                                        session->session,
-                                        &info);
-        if (hsm_pkcs11_check_error(ctx, rv, "get session info")) {
-            pthread_mutex_unlock(&_hsm_ctx_mutex);
-            return HSM_ERROR;
-        }
-
-        /* Check session info */
-        if (info.state != CKS_RW_USER_FUNCTIONS) {
-            hsm_ctx_set_error(ctx, HSM_ERROR, "hsm_check_context()",
-                              "Session not logged in");
-            pthread_mutex_unlock(&_hsm_ctx_mutex);
-            return HSM_ERROR;
-        }
-
-        /* Try open and close a session with the token */
-        rv = ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_OpenSession(info.slotID,
-                                        CKF_SERIAL_SESSION | CKF_RW_SESSION,
-                                        NULL,
-                                        NULL,
-                                        &session_handle);
-        if (hsm_pkcs11_check_error(ctx, rv, "test open session")) {
-            pthread_mutex_unlock(&_hsm_ctx_mutex);
-            return HSM_ERROR;
+        /* Check the session is logged in, and try open and close a
+         * session with the token, reconnecting the repository if it
+         * was out of rotation */
+        if (__atomic_load_n(&session->module->failed, __ATOMIC_RELAXED)) {
+            rv = hsm_module_recover(session);
+        } else {
+            rv = hsm_session_probe(session);
         }
-        rv = ((CK_FUNCTION_LIST_PTR)session->module->sym)->C_CloseSession(session_handle);
-        if (hsm_pkcs11_check_error(ctx, rv, "test close session")) {
-            pthread_mutex_unlock(&_hsm_ctx_mutex);
-            return HSM_ERROR;
+        if (rv != CKR_OK) {
+            /* take the repository out of rotation, signing continues
+             * as long as one of the others remains usable */
+            hsm_module_fail(session->module);
+            continue;
         }
+        usable++;
     }
 
+    if (!usable && ctx->session_count > 0) {
+        hsm_ctx_set_error(ctx, HSM_ERROR, "hsm_check_context()",
+                          "No repository usable");
+        pthread_mutex_unlock(&_hsm_ctx_mutex);
+        return HSM_ERROR;
+    }
     pthread_mutex_unlock(&_hsm_ctx_mutex);
     return HSM_OK;
 }
@@ -2422,8 +3591,16 @@ hsm_sign_params_free(hsm_sign_params_t *params)
 void
 libhsm_key_free(libhsm_key_t *key)
 {
-    free(key->modulename);
-    free(key);
+    libhsm_key_t *replica;
+    while (key) {
+        replica = key->replica;
+#ifdef HAVE_SSL
+        EVP_PKEY_free(key->pkey);
+#endif
+        free(key->modulename);
+        free(key);
+        key = replica;
+    }
 }
 
 libhsm_key_t **
@@ -3102,33 +4279,29 @@ libhsm_key_info_free(libhsm_key_info_t *key_info)
     }
 }
 
-ldns_rr*
-hsm_sign_rrset(hsm_ctx_t *ctx,
-               const ldns_rr_list* rrset,
-               const libhsm_key_t *key,
-               const hsm_sign_params_t *sign_params)
+/* creates the RRSIG without signature for the RRset, and the buffer with
+ * the data to be signed */
+static ldns_buffer *
+hsm_sign_rrset_buffer(const ldns_rr_list* rrset,
+                      const hsm_sign_params_t *sign_params,
+                      ldns_rr **signature)
 {
-    ldns_rr *signature;
     ldns_buffer *sign_buf;
-    ldns_rdf *b64_rdf;
     size_t i;
 
-    if (!key) return NULL;
-    if (!sign_params) return NULL;
-
-    signature = hsm_create_empty_rrsig((ldns_rr_list *)rrset,
-                                       sign_params);
+    *signature = hsm_create_empty_rrsig(ldns_rr_list_rr(rrset, 0),
+                                        sign_params);
 
     /* right now, we have: a key, a semi-sig and an rrset. For
      * which we can create the sig and base64 encode that and
      * add that to the signature */
     sign_buf = ldns_buffer_new(LDNS_MAX_PACKETLEN);
 
-    if (ldns_rrsig2buffer_wire(sign_buf, signature)
+    if (ldns_rrsig2buffer_wire(sign_buf, *signature)
         != LDNS_STATUS_OK) {
         ldns_buffer_free(sign_buf);
         /* ERROR */
-        ldns_rr_free(signature);
+        ldns_rr_free(*signature);
         return NULL;
     }
 
@@ -3141,7 +4314,27 @@ hsm_sign_rrset(hsm_ctx_t *ctx,
     if (ldns_rr_list2buffer_wire(sign_buf, rrset)
         != LDNS_STATUS_OK) {
         ldns_buffer_free(sign_buf);
-        ldns_rr_free(signature);
+        ldns_rr_free(*signature);
+        return NULL;
+    }
+    return sign_buf;
+}
+
+ldns_rr*
+hsm_sign_rrset(hsm_ctx_t *ctx,
+               const ldns_rr_list* rrset,
+               const libhsm_key_t *key,
+               const hsm_sign_params_t *sign_params)
+{
+    ldns_rr *signature;
+    ldns_buffer *sign_buf;
+    ldns_rdf *b64_rdf;
+
+    if (!key) return NULL;
+    if (!sign_params) return NULL;
+
+    sign_buf = hsm_sign_rrset_buffer(rrset, sign_params, &signature);
+    if (!sign_buf) {
         return NULL;
     }
 
@@ -3159,6 +4352,244 @@ hsm_sign_rrset(hsm_ctx_t *ctx,
     return signature;
 }
 
+int
+hsm_sign_rrset_submit(hsm_ctx_t *ctx,
+                      const ldns_rr_list* rrset,
+                      const libhsm_key_t *key,
+                      const hsm_sign_params_t *sign_params,
+                      hsm_sign_callback_t callback,
+                      void *arg)
+{
+    ldns_rr *signature;
+    ldns_buffer *sign_buf;
+    hsm_session_t *session;
+    const libhsm_key_t *replica;
+    struct hsm_sign_request *request;
+
+    if (!key) return HSM_ERROR;
+    if (!sign_params) return HSM_ERROR;
+
+    replica = hsm_select_key(ctx, key, &session);
+    if (!session) return HSM_ERROR;
+    if (!session->module->pool ||
+        hsm_software_key(key, sign_params->algorithm)) {
+        signature = hsm_sign_rrset(ctx, rrset, key, sign_params);
+        if (!signature) return HSM_ERROR;
+        callback(arg, signature, NULL);
+        return HSM_OK;
+    }
+
+    sign_buf = hsm_sign_rrset_buffer(rrset, sign_params, &signature);
+    if (!sign_buf) {
+        return HSM_ERROR;
+    }
+    CHECKALLOC(request = malloc(sizeof(struct hsm_sign_request)));
+    request->data = hsm_sign_prepare(ctx, session, sign_buf,
+                                     sign_params->algorithm,
+                                     &request->mechanism,
+                                     &request->data_len);
+    ldns_buffer_free(sign_buf);
+    if (!request->data) {
+        ldns_rr_free(signature);
+        free(request);
+        return HSM_ERROR;
+    }
+    request->signature = signature;
+    request->callback = callback;
+    request->arg = arg;
+    request->ctx = ctx;
+    request->key = key;
+    request->attempts = 0;
+    if (hsm_sign_enqueue(session->module, replica, request)) {
+        ldns_rr_free(signature);
+        if (request->data != request->digest) {
+            free(request->data);
+        }
+        free(request);
+        return HSM_ERROR;
+    }
+    return HSM_OK;
+}
+
+/* encodes the RRSIG rdata without the signature, which is signed in front
+ * of the RRset, into the storage given.  Returns its length or 0. */
+static size_t
+hsm_rrsig_header(const ldns_rr *signature, uint8_t *storage, size_t size)
+{
+    ldns_buffer header;
+
+    ldns_buffer_init_frm_data(&header, storage, size);
+    if (ldns_rrsig2buffer_wire(&header, signature) != LDNS_STATUS_OK ||
+        ldns_buffer_status(&header) != LDNS_STATUS_OK) {
+        return 0;
+    }
+    return ldns_buffer_position(&header);
+}
+
+/* assembles the RRSIG rdata and RRset in a sign buffer, for the
+ * algorithms that do not sign over a digest made in steps */
+static ldns_buffer *
+hsm_sign_wire_buffer(const uint8_t *header, size_t header_len,
+                     const uint8_t *wire, size_t wire_len)
+{
+    ldns_buffer *sign_buf;
+
+    sign_buf = ldns_buffer_new(header_len + wire_len);
+    ldns_buffer_write(sign_buf, header, header_len);
+    ldns_buffer_write(sign_buf, wire, wire_len);
+    return sign_buf;
+}
+
+ldns_rr*
+hsm_sign_rrset_wire(hsm_ctx_t *ctx,
+                    const ldns_rr *rr,
+                    const uint8_t *wire,
+                    size_t wire_len,
+                    const libhsm_key_t *key,
+                    const hsm_sign_params_t *sign_params)
+{
+    ldns_rr *signature;
+    uint8_t header[HSM_RRSIG_HEADER_LENGTH];
+    size_t header_len;
+    CK_BYTE data[HSM_MAX_PREFIX_LENGTH + HSM_MAX_DIGEST_LENGTH];
+    CK_ULONG data_len = 0;
+    CK_MECHANISM_TYPE mechanism;
+    const libhsm_key_t *replica;
+    ldns_buffer *sign_buf;
+    ldns_rdf *b64_rdf;
+
+    if (!key) return NULL;
+    if (!sign_params) return NULL;
+
+    signature = hsm_create_empty_rrsig(rr, sign_params);
+    header_len = hsm_rrsig_header(signature, header, sizeof(header));
+    if (!header_len) {
+        ldns_rr_free(signature);
+        return NULL;
+    }
+
+    replica = hsm_software_key(key, sign_params->algorithm);
+    if (!replica) {
+        data_len = hsm_sign_prepare_parts(header, header_len, wire, wire_len,
+                                          sign_params->algorithm,
+                                          &mechanism, data);
+    }
+    if (data_len > 0) {
+        b64_rdf = hsm_sign_key(ctx, NULL, data, data_len, mechanism, key,
+                               sign_params->algorithm);
+#ifdef HAVE_SSL
+    } else if (replica && hsm_software_streams(sign_params->algorithm)) {
+        b64_rdf = hsm_sign_software(ctx, header, header_len, wire, wire_len,
+                                    replica, sign_params->algorithm);
+#endif
+    } else {
+        sign_buf = hsm_sign_wire_buffer(header, header_len, wire, wire_len);
+        b64_rdf = hsm_sign_buffer(ctx, sign_buf, key, sign_params->algorithm);
+        ldns_buffer_free(sign_buf);
+    }
+    if (!b64_rdf) {
+        ldns_rr_free(signature);
+        return NULL;
+    }
+
+    ldns_rr_rrsig_set_sig(signature, b64_rdf);
+
+    return signature;
+}
+
+int
+hsm_sign_rrset_wire_submit(hsm_ctx_t *ctx,
+                           const ldns_rr *rr,
+                           const uint8_t *wire,
+                           size_t wire_len,
+                           const libhsm_key_t *key,
+                           const hsm_sign_params_t *sign_params,
+                           hsm_sign_callback_t callback,
+                           void *arg)
+{
+    ldns_rr *signature;
+    uint8_t header[HSM_RRSIG_HEADER_LENGTH];
+    size_t header_len;
+    ldns_buffer *sign_buf;
+    hsm_session_t *session;
+    const libhsm_key_t *replica;
+    struct hsm_sign_request *request;
+
+    if (!key) return HSM_ERROR;
+    if (!sign_params) return HSM_ERROR;
+
+    replica = hsm_select_key(ctx, key, &session);
+    if (!session) return HSM_ERROR;
+    if (!session->module->pool ||
+        hsm_software_key(key, sign_params->algorithm)) {
+        signature = hsm_sign_rrset_wire(ctx, rr, wire, wire_len, key,
+                                        sign_params);
+        if (!signature) return HSM_ERROR;
+        callback(arg, signature, NULL);
+        return HSM_OK;
+    }
+
+    signature = hsm_create_empty_rrsig(rr, sign_params);
+    header_len = hsm_rrsig_header(signature, header, sizeof(header));
+    if (!header_len) {
+        ldns_rr_free(signature);
+        return HSM_ERROR;
+    }
+    CHECKALLOC(request = malloc(sizeof(struct hsm_sign_request)));
+    request->data = request->digest;
+    request->data_len = hsm_sign_prepare_parts(header, header_len,
+                                               wire, wire_len,
+                                               sign_params->algorithm,
+                                               &request->mechanism,
+                                               request->digest);
+    if (request->data_len == 0) {
+        sign_buf = hsm_sign_wire_buffer(header, header_len, wire, wire_len);
+        request->data = hsm_sign_prepare(ctx, session, sign_buf,
+                                         sign_params->algorithm,
+                                         &request->mechanism,
+                                         &request->data_len);
+        ldns_buffer_free(sign_buf);
+    }
+    if (!request->data) {
+        ldns_rr_free(signature);
+        free(request);
+        return HSM_ERROR;
+    }
+    request->signature = signature;
+    request->callback = callback;
+    request->arg = arg;
+    request->ctx = ctx;
+    request->key = key;
+    request->attempts = 0;
+    if (hsm_sign_enqueue(session->module, replica, request)) {
+        ldns_rr_free(signature);
+        if (request->data != request->digest) {
+            free(request->data);
+        }
+        free(request);
+        return HSM_ERROR;
+    }
+    return HSM_OK;
+}
+
+size_t
+hsm_sign_pool_size(void)
+{
+    size_t i;
+    size_t count = 0;
+
+    pthread_mutex_lock(&_hsm_ctx_mutex);
+    if (_hsm_ctx) {
+        for (i = 0; i < _hsm_ctx->session_count; i++) {
+            if (_hsm_ctx->session[i] && _hsm_ctx->session[i]->module->pool) {
+                count += _hsm_ctx->session[i]->module->pool->nsessions;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_hsm_ctx_mutex);
+    return count;
+}
+
 int
 hsm_keytag(const char* loc, int alg, int ksk, uint16_t* keytag)
 {
@@ -3342,6 +4773,10 @@ int hsm_attach(const char *repository,
     if (result == HSM_OK) {
         result = hsm_ctx_add_session(_hsm_ctx, session);
     }
+    if (result == HSM_OK && config && config->session_pool > 0) {
+        session->module->pool = hsm_pool_create(_hsm_ctx, session,
+                                                config->session_pool);
+    }
     return result;
 }
 
@@ -3511,8 +4946,7 @@ keycache_delfunc(ldns_rbnode_t* node, void* cargo)
 {
     (void)cargo;
     free((void*)node->key);
-    free(((libhsm_key_t*)node->data)->modulename);
-    free((void*)node->data);
+    libhsm_key_free((libhsm_key_t*)node->data);
     free((void*)node);
 }
 
@@ -3534,6 +4968,29 @@ keycache_destroy(hsm_ctx_t* ctx)
     ctx->keycache_lock = NULL;
 }
 
+/* links the key pairs with the same CKA_ID in the other repositories of
+ * the context to the key, so signing can be spread over them */
+static void
+hsm_find_key_replicas(hsm_ctx_t *ctx, libhsm_key_t *key, const char *id)
+{
+    unsigned char *id_bytes;
+    size_t len;
+    unsigned int i;
+    int error = ctx->error;
+    libhsm_key_t **last = &key->replica;
+
+    id_bytes = hsm_hex_parse(id, &len);
+    if (!id_bytes) return;
+    for (i = 0; i < ctx->session_count; i++) {
+        if (!strcmp(ctx->session[i]->module->name, key->modulename)) continue;
+        *last = hsm_find_key_by_id_session(ctx, ctx->session[i], id_bytes, len);
+        if (*last) last = &(*last)->replica;
+    }
+    free(id_bytes);
+    /* a repository without the key is not an error */
+    if (!error) ctx->error = 0;
+}
+
 const libhsm_key_t*
 keycache_lookup(hsm_ctx_t* ctx, const char* locator)
 {
@@ -3547,6 +5004,10 @@ keycache_lookup(hsm_ctx_t* ctx, const char* locator)
         if ((key = hsm_find_key_by_id(ctx, locator)) == NULL) {
             node = NULL;
         } else {
+            hsm_find_key_replicas(ctx, key, locator);
+#ifdef HAVE_SSL
+            hsm_software_load_keys(ctx, key, locator);
+#endif
             CHECKALLOC(node = malloc(sizeof(ldns_rbnode_t)));
             node->key = strdup(locator);
             node->data = key;
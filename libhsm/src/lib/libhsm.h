@@ -29,6 +29,7 @@
 #define HSM_H 1
 
 #include <stdint.h>
+#include <time.h>
 #include <ldns/rbtree.h>
 #include <pthread.h>
 #include "cfg.h"
@@ -81,8 +82,14 @@
 typedef struct {
     unsigned int use_pubkey;     /*!< Maintain public keys in HSM */
     unsigned int allow_extract;  /*!< Generate CKA_EXTRACTABLE private keys */
+    unsigned int session_pool;   /*!< Sessions for asynchronous signing */
+    unsigned int weight;         /*!< Share of the signing load */
+    char *software_keys;         /*!< Sign in-process, PKCS#8 directory */
 } hsm_config_t;
 
+/*! Pool of sessions for asynchronous signing on a token */
+typedef struct hsm_pool_struct hsm_pool_t;
+
 /*! Data type to describe an HSM */
 typedef struct {
     unsigned int id;             /*!< HSM numerical identifier */
@@ -92,19 +99,27 @@ typedef struct {
     void         *handle;        /*!< handle from dlopen()*/
     void         *sym;           /*!< Function list from dlsym */
     hsm_config_t *config;        /*!< optional per HSM configuration */
+    hsm_pool_t   *pool;          /*!< sessions for asynchronous signing */
+    unsigned int outstanding;    /*!< sign operations in progress */
+    time_t       failed;         /*!< out of rotation since, or 0 */
+    unsigned int generation;     /*!< bumped each time it is reconnected */
+    char         *pin;           /*!< to log in again when reconnected */
 } hsm_module_t;
 
 /*! HSM Session */
 typedef struct {
     hsm_module_t  *module;
     unsigned long session;
+    unsigned int  generation;    /*!< of the module when opened */
 } hsm_session_t;
 
 /*! HSM Key Pair */
-typedef struct {
+typedef struct libhsm_key_struct {
     char *modulename;   /*!< name of the module, as in hsm_session_t.module.name */
     unsigned long      private_key;  /*!< private key within module */
     unsigned long      public_key;   /*!< public key within module */
+    struct libhsm_key_struct *replica; /*!< same key in another module */
+    struct evp_pkey_st *pkey;          /*!< private key to sign in-process */
 } libhsm_key_t;
 
 /*! HSM Key Pair Information */
@@ -132,9 +147,21 @@ typedef struct {
     
     ldns_rbtree_t* keycache;
     pthread_mutex_t *keycache_lock;
+
+    /*!< spreads signing over equally loaded repositories */
+    unsigned int rotation;
 } hsm_ctx_t;
 
 
+/*! Completion of an asynchronous sign request
+
+\param arg       argument given when the request was submitted
+\param signature the RRSIG, to be freed by the callee, or NULL on failure
+\param error     static string describing the failure, or NULL
+*/
+typedef void (*hsm_sign_callback_t)(void *arg, ldns_rr *signature,
+                                    const char *error);
+
 /*! Set HSM Context Error
 
 If the ctx is given, and it's error value is still 0, the value will be
@@ -234,10 +261,12 @@ hsm_create_context(void);
 /*! Check HSM context
 
 Check if the associated sessions are still alive.
-If they are not alive, then try re-open libhsm.
+Repositories that are not alive are taken out of rotation, and put back
+once a background probe finds them usable again.  Those that respond are
+put back into rotation.
 
 \param context HSM context
-\return 0 if successful, !0 if failed
+\return 0 if at least one repository is usable, !0 if all failed
 */
 extern int
 hsm_check_context();
@@ -80,6 +80,85 @@ hsm_sign_rrset(hsm_ctx_t *ctx,
                const libhsm_key_t *key,
                const hsm_sign_params_t *sign_params);
 
+/*! Submit an RRset for signing using key
+
+If the repository of the key has a session pool, the signature is made by
+one of the sessions of the pool and the callback is called from the thread
+of that session.  Otherwise the RRset is signed immediately and the callback
+is called before returning.  The sign buffer is constructed before returning,
+so the RRset need not be kept.  Should the repository fail while the request
+is queued, it is passed on to the pool of another repository holding the key,
+hence the context and key must be kept until the callback was called.
+
+\param context HSM context
+\param rrset RRset to sign
+\param key Key pair used to sign
+\param callback called exactly once with the result if HSM_OK is returned
+\param arg argument passed to the callback
+\return HSM_OK if submitted, !0 if failed
+*/
+extern int
+hsm_sign_rrset_submit(hsm_ctx_t *ctx,
+                      const ldns_rr_list* rrset,
+                      const libhsm_key_t *key,
+                      const hsm_sign_params_t *sign_params,
+                      hsm_sign_callback_t callback,
+                      void *arg);
+
+/*! Sign RRset in canonical wire form using key
+
+Like hsm_sign_rrset(), but the RRset is given as the canonical wire
+encoding of its records in canonical order, as signed after the RRSIG
+rdata.  The RRSIG rdata and the RRset are digested in one pass without
+assembling them in a sign buffer.
+
+\param context HSM context
+\param rr a record of the RRset, giving owner, class, type and TTL
+\param wire canonical wire encoding of the RRset
+\param wire_len length of the encoding
+\param key Key pair used to sign
+\return ldns_rr* Signed RRset
+*/
+extern ldns_rr*
+hsm_sign_rrset_wire(hsm_ctx_t *ctx,
+                    const ldns_rr *rr,
+                    const uint8_t *wire,
+                    size_t wire_len,
+                    const libhsm_key_t *key,
+                    const hsm_sign_params_t *sign_params);
+
+/*! Submit an RRset in canonical wire form for signing using key
+
+As hsm_sign_rrset_submit(), with the RRset given as for
+hsm_sign_rrset_wire().  The digest is made before returning, so the
+encoding need not be kept.
+
+\param context HSM context
+\param rr a record of the RRset, giving owner, class, type and TTL
+\param wire canonical wire encoding of the RRset
+\param wire_len length of the encoding
+\param key Key pair used to sign
+\param callback called exactly once with the result if HSM_OK is returned
+\param arg argument passed to the callback
+\return HSM_OK if submitted, !0 if failed
+*/
+extern int
+hsm_sign_rrset_wire_submit(hsm_ctx_t *ctx,
+                           const ldns_rr *rr,
+                           const uint8_t *wire,
+                           size_t wire_len,
+                           const libhsm_key_t *key,
+                           const hsm_sign_params_t *sign_params,
+                           hsm_sign_callback_t callback,
+                           void *arg);
+
+/*! Number of sessions available for asynchronous signing
+
+\return the total size of the session pools of the attached repositories
+*/
+extern size_t
+hsm_sign_pool_size(void);
+
 
 /*! Get DNSKEY RR
 
@@ -341,12 +341,9 @@ adfile_write(zone_type* adzone, names_view_type view, const char* filename)
     if (!tmpname) {
         return ODS_STATUS_MALLOC_ERR;
     }
-    if(writezone(view, tmpname)) {
-        if (adzone->adoutbound->error) {
-            ods_log_error("[%s] unable to write zone %s file %s", adapter_str, adzone->name, filename);
-            adzone->adoutbound->error = 0;
-            status = ODS_STATUS_FWRITE_ERR;
-        }
+    if ((status = writezone(view, tmpname)) != ODS_STATUS_OK) {
+        ods_log_error("[%s] unable to write zone %s file %s", adapter_str, adzone->name, filename);
+        adzone->adoutbound->error = 0;
     }
 
     if (status == ODS_STATUS_OK) {
@@ -56,7 +56,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <time.h>
@@ -64,6 +66,22 @@
 
 static const char* engine_str = "engine";
 
+/* Seconds between samples of the load, when the number of drudgers is adjusted */
+#define DRUDGERS_INTERVAL 10
+/* Samples in a row that have to ask for more or fewer drudgers */
+#define DRUDGERS_GROWVOTES 3
+#define DRUDGERS_SHRINKVOTES 6
+/* Records queued per drudger above which more drudgers are wanted */
+#define DRUDGERS_BACKLOG 16
+/* Percentage of the time busy below which drudgers are mostly idle */
+#define DRUDGERS_IDLE 25
+/* CPU utilisation in percent above which no drudgers are added or above
+ * which drudgers are removed */
+#define DRUDGERS_CPUHIGH 80
+#define DRUDGERS_CPUMAX 95
+/* Signing latency over the unloaded latency at which the HSM is saturated */
+#define DRUDGERS_LATENCYHIGH 2.0
+
 /**
  * Create engine.
  *
@@ -101,6 +119,7 @@ engine_create(void)
     schedule_registertask(engine->taskq, TASK_CLASS_SIGNER, TASK_READ, do_readzone);
     schedule_registertask(engine->taskq, TASK_CLASS_SIGNER, TASK_FORCEREAD, do_forcereadzone);
     schedule_registertask(engine->taskq, TASK_CLASS_SIGNER, TASK_SIGN, do_signzone);
+    schedule_registertask(engine->taskq, TASK_CLASS_SIGNER, TASK_NSECIFY, do_nsec3rebuild);
     schedule_registertask(engine->taskq, TASK_CLASS_SIGNER, TASK_WRITE, do_writezone);
     return engine;
 }
@@ -234,18 +253,155 @@ engine_create_workers(engine_type* engine)
     int threadCount = 0;
     ods_log_assert(engine);
     ods_log_assert(engine->config);
-    numTotalWorkers = engine->config->num_worker_threads_signer + engine->config->num_signer_threads;
+    numTotalWorkers = engine->config->num_worker_threads_signer + engine->config->num_signer_threads_max;
     CHECKALLOC(engine->workers = (worker_type**) malloc(numTotalWorkers * sizeof(worker_type*)));
     for (i=0; i < engine->config->num_worker_threads_signer; i++) {
         asprintf(&name, "worker[%d]", i+1);
         engine->workers[threadCount++] = worker_create(name, engine->taskq);
     }
-    for (i=0; i < engine->config->num_signer_threads; i++) {
+    for (i=0; i < engine->config->num_signer_threads_max; i++) {
         asprintf(&name, "drudger[%d]", i+1);
         engine->workers[threadCount++] = worker_create(name, engine->taskq);
     }
 }
 
+static void
+engine_start_drudger(engine_type* engine, int i)
+{
+    worker_type* drudger = engine->workers[engine->config->num_worker_threads_signer + i];
+    drudger->need_to_exit = 0;
+    janitor_thread_create(&drudger->thread_id, workerthreadclass, (janitor_runfn_t)drudge, drudger);
+}
+
+static void
+engine_stop_drudger(engine_type* engine, int i)
+{
+    worker_type* drudger = engine->workers[engine->config->num_worker_threads_signer + i];
+    fifoq_type* signq = engine->taskq->signq;
+    /* the drudger finishes the records it holds before leaving */
+    pthread_mutex_lock(&signq->q_lock);
+    drudger->need_to_exit = 1;
+    pthread_cond_broadcast(&signq->q_threshold);
+    pthread_mutex_unlock(&signq->q_lock);
+    janitor_thread_join(drudger->thread_id);
+}
+
+/**
+ * Take a sample of the load of the drudgers, return the number of seconds
+ * since the previous sample.
+ *
+ */
+static double
+engine_sample_drudgers(engine_type* engine, size_t* queued, double* busy,
+    double* latency, double* cpu)
+{
+    fifoq_type* signq = engine->taskq->signq;
+    struct timespec now;
+    struct rusage usage;
+    struct timeval cputime;
+    struct timeval cpuused;
+    unsigned long worked = 0;
+    unsigned long long workedusecs = 0;
+    double elapsed;
+    long ncpus;
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+    timeradd(&usage.ru_utime, &usage.ru_stime, &cputime);
+    pthread_mutex_lock(&signq->q_lock);
+    *queued = signq->count;
+    for (i=0; i < engine->config->num_signer_threads_max; i++) {
+        worked += engine->workers[engine->config->num_worker_threads_signer + i]->worked;
+        workedusecs += engine->workers[engine->config->num_worker_threads_signer + i]->workedusecs;
+    }
+    pthread_mutex_unlock(&signq->q_lock);
+    elapsed = (now.tv_sec - engine->drudgers_sampled.tv_sec) +
+        (now.tv_nsec - engine->drudgers_sampled.tv_nsec) / 1000000000.0;
+    if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        ncpus = 1;
+    }
+    timersub(&cputime, &engine->drudgers_cputime, &cpuused);
+    *cpu = (elapsed > 0.0 ? 100.0 * (cpuused.tv_sec + cpuused.tv_usec / 1000000.0) / (elapsed * ncpus) : 0.0);
+    *busy = (elapsed > 0.0 ? 100.0 * (workedusecs - engine->drudgers_workedusecs) / 1000000.0 / (elapsed * engine->num_drudgers) : 0.0);
+    if (worked > engine->drudgers_worked) {
+        *latency = (workedusecs - engine->drudgers_workedusecs) / 1000.0 / (worked - engine->drudgers_worked);
+    } else {
+        *latency = 0.0;
+    }
+    engine->drudgers_sampled = now;
+    engine->drudgers_cputime = cputime;
+    engine->drudgers_worked = worked;
+    engine->drudgers_workedusecs = workedusecs;
+    return elapsed;
+}
+
+/**
+ * Grow or shrink the number of drudgers running between the configured
+ * bounds.  More drudgers are started when records keep queuing up while
+ * neither the CPU nor the HSM is saturated, drudgers are stopped when they
+ * are mostly idle or the CPU is.  Both have to be asked for by a number of
+ * samples in a row, and growing and shrinking have separate thresholds, so
+ * the number does not swing with short bursts of work.
+ *
+ */
+static void
+engine_resize_drudgers(engine_type* engine)
+{
+    size_t queued;
+    double busy, latency, cpu;
+    int ndrudgers = engine->num_drudgers;
+    int hsmsaturated;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (engine->drudgers_sampled.tv_sec + DRUDGERS_INTERVAL > now.tv_sec) {
+        return;
+    }
+    engine_sample_drudgers(engine, &queued, &busy, &latency, &cpu);
+    if (latency > 0.0) {
+        /* follow the lowest latency seen, slowly letting go of it for
+         * when the HSM itself has changed */
+        if (engine->drudgers_baseline == 0.0 || latency < engine->drudgers_baseline) {
+            engine->drudgers_baseline = latency;
+        } else {
+            engine->drudgers_baseline += (latency - engine->drudgers_baseline) / 32;
+        }
+    }
+    hsmsaturated = (latency > engine->drudgers_baseline * DRUDGERS_LATENCYHIGH);
+    if (ndrudgers < engine->config->num_signer_threads_max &&
+        queued > (size_t) ndrudgers * DRUDGERS_BACKLOG &&
+        cpu < DRUDGERS_CPUHIGH && !hsmsaturated) {
+        engine->drudgers_votes = (engine->drudgers_votes > 0 ? engine->drudgers_votes + 1 : 1);
+    } else if (ndrudgers > engine->config->num_signer_threads_min &&
+        ((queued == 0 && busy < DRUDGERS_IDLE) || cpu > DRUDGERS_CPUMAX)) {
+        engine->drudgers_votes = (engine->drudgers_votes < 0 ? engine->drudgers_votes - 1 : -1);
+    } else {
+        engine->drudgers_votes = 0;
+    }
+    if (engine->drudgers_votes >= DRUDGERS_GROWVOTES) {
+        ndrudgers += (ndrudgers / 4 > 1 ? ndrudgers / 4 : 1);
+        if (ndrudgers > engine->config->num_signer_threads_max) {
+            ndrudgers = engine->config->num_signer_threads_max;
+        }
+    } else if (engine->drudgers_votes <= -DRUDGERS_SHRINKVOTES) {
+        ndrudgers -= 1;
+    } else {
+        return;
+    }
+    ods_log_info("[%s] %s drudgers from %d to %d: %lu records queued, "
+        "drudgers %.0f%% busy, signing latency %.1f msec (unloaded %.1f "
+        "msec), cpu %.0f%%", engine_str,
+        (ndrudgers > engine->num_drudgers ? "growing" : "shrinking"),
+        engine->num_drudgers, ndrudgers, (unsigned long) queued, busy,
+        latency, engine->drudgers_baseline, cpu);
+    while (engine->num_drudgers < ndrudgers) {
+        engine_start_drudger(engine, engine->num_drudgers++);
+    }
+    while (engine->num_drudgers > ndrudgers) {
+        engine_stop_drudger(engine, --engine->num_drudgers);
+    }
+    engine->drudgers_votes = 0;
+}
+
 static void
 engine_start_workers(engine_type* engine)
 {
@@ -255,6 +411,7 @@ engine_start_workers(engine_type* engine)
     ods_log_assert(engine);
     ods_log_assert(engine->config);
     ods_log_debug("[%s] start workers", engine_str);
+    engine->taskq->signq->weighted = engine->config->zone_sharing_weighted;
     for (i=0; i < engine->config->num_worker_threads_signer; i++,threadCount++) {
         CHECKALLOC(context = malloc(sizeof(struct worker_context)));
         context->engine = engine;
@@ -264,9 +421,14 @@ engine_start_workers(engine_type* engine)
         engine->workers[threadCount]->context = context;
         janitor_thread_create(&engine->workers[threadCount]->thread_id, workerthreadclass, (janitor_runfn_t)worker_start, engine->workers[threadCount]);
     }
-    for (i=0; i < engine->config->num_signer_threads; i++,threadCount++) {
-        engine->workers[threadCount]->need_to_exit = 0;
-        janitor_thread_create(&engine->workers[threadCount]->thread_id, workerthreadclass, (janitor_runfn_t)drudge, engine->workers[threadCount]);
+    for (engine->num_drudgers=0; engine->num_drudgers < engine->config->num_signer_threads; engine->num_drudgers++) {
+        engine_start_drudger(engine, engine->num_drudgers);
+    }
+    engine->drudgers_votes = 0;
+    engine->drudgers_baseline = 0.0;
+    {   size_t queued;
+        double busy, latency, cpu;
+        engine_sample_drudgers(engine, &queued, &busy, &latency, &cpu);
     }
 }
 
@@ -278,7 +440,7 @@ engine_stop_threads(engine_type* engine)
     ods_log_assert(engine);
     ods_log_assert(engine->config);
     ods_log_debug("[%s] stop workers and drudgers", engine_str);
-    numTotalWorkers = engine->config->num_worker_threads_signer + engine->config->num_signer_threads;
+    numTotalWorkers = engine->config->num_worker_threads_signer + engine->num_drudgers;
     for (i=0; i < numTotalWorkers; i++) {
         engine->workers[i]->need_to_exit = 1;
     }
@@ -496,6 +658,7 @@ engine_setup_finish(engine_type* engine, int fd)
 static void
 engine_run(engine_type* engine)
 {
+    struct timespec timeout;
     if (!engine) {
         return;
     }
@@ -512,9 +675,19 @@ engine_run(engine_type* engine)
              * Also it would be easier to wake up the command hander
              * as signals will reach it if it is the main thread! */
             ods_log_debug("[%s] taking a break", engine_str);
-            pthread_cond_wait(&engine->signal_cond, &engine->signal_lock);
+            if (engine->config->num_signer_threads_min < engine->config->num_signer_threads_max) {
+                clock_gettime(CLOCK_REALTIME, &timeout);
+                timeout.tv_sec += DRUDGERS_INTERVAL;
+                pthread_cond_timedwait(&engine->signal_cond, &engine->signal_lock, &timeout);
+            } else {
+                pthread_cond_wait(&engine->signal_cond, &engine->signal_lock);
+            }
         }
         pthread_mutex_unlock(&engine->signal_lock);
+        if (!engine->need_to_exit && !engine->need_to_reload &&
+            engine->config->num_signer_threads_min < engine->config->num_signer_threads_max) {
+            engine_resize_drudgers(engine);
+        }
     }
     ods_log_debug("[%s] signer halted", engine_str);
     engine_stop_threads(engine);
@@ -831,7 +1004,7 @@ engine_cleanup(engine_type* engine)
         return;
     }
     if (engine->config) {
-        numTotalWorkers = engine->config->num_worker_threads_signer + engine->config->num_signer_threads;
+        numTotalWorkers = engine->config->num_worker_threads_signer + engine->config->num_signer_threads_max;
         if (engine->workers) {
             for (i=0; i < (size_t) numTotalWorkers; i++) {
                 worker_cleanup(engine->workers[i]);
@@ -34,6 +34,8 @@
 
 #include "config.h"
 #include <signal.h>
+#include <time.h>
+#include <sys/time.h>
 
 typedef struct engine_struct engine_type;
 
@@ -52,6 +54,15 @@ struct engine_struct {
     engineconfig_type* config;
     worker_type** workers;
     schedule_type* taskq;
+
+    /* Drudgers running, adjusted between the configured bounds */
+    int num_drudgers;
+    int drudgers_votes; /* samples in a row asking to grow (>0) or shrink (<0) */
+    double drudgers_baseline; /* signing latency in msec when the HSM is not loaded */
+    unsigned long drudgers_worked;
+    unsigned long long drudgers_workedusecs;
+    struct timespec drudgers_sampled;
+    struct timeval drudgers_cputime;
     cmdhandler_type* cmdhandler;
 
     pid_t pid;
@@ -29,23 +29,53 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "utilities.h"
+#include "logging.h"
 #include "views/marshalling.h"
 #include "views/proto.h"
+#include "views/uthash.h"
 #include "signer/zone.h"
 #include "metastorage.h"
 
-struct definition_struct {
-    const char *membercode;
-    size_t membersize;
-    int (*memberfunction)(marshall_handle,void*);
-    const char* (*membername)(void*);
+static logger_cls_type cls = LOGGER_INITIALIZE("metastorage");
+
+/* The meta storage is an append only log of zone entries, where a later
+ * entry for a zone replaces the earlier ones.  The entries are kept in
+ * memory, indexed by zone name, so storing the serials of a zone only
+ * costs appending one entry.  Once the log contains too many replaced
+ * entries it is rewritten with just the current ones.
+ */
+#define METASTORAGE_COMPACTMINIMUM 1024
+
+struct metaentry {
+    char* name;
+    uint32_t* nextserial;
+    uint32_t* inboundserial;
+    uint32_t* outboundserial;
+    UT_hash_handle hh;
+};
+
+struct metastorage_struct {
+    const char* filename;
+    int basefd;
+    dev_t device;
+    ino_t inode;
+    marshall_handle store;
+    struct metaentry* entries;
+    long nentries;
+    long nappended;
 };
 
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metastorage_struct signerdb = { "signer.db", AT_FDCWD, 0, 0, NULL, NULL, 0, 0 };
+static char filemagic[8] = "\0ODS-M2\n";
+static char filemagicv1[8] = "\0ODS-M1\n";
+
 static int
-zonemarshall(marshall_handle h, void* ptr)
+entrymarshall(marshall_handle h, void* ptr)
 {
-    zone_type* d = *(zone_type**) ptr;
+    struct metaentry* d = *(struct metaentry**) ptr;
     int size = 0;
     size += marshalling(h, "name", &(d->name), NULL, 0, marshallstring);
     size += marshalling(h, "nextserial", &(d->nextserial), marshall_OPTIONAL, sizeof(int), marshallinteger);
@@ -54,167 +84,219 @@ zonemarshall(marshall_handle h, void* ptr)
     return size;
 }
 
-static const char*
-zonename(void* ptr)
+static uint32_t*
+serialcopy(uint32_t* serial)
 {
-    zone_type* d = ptr;
-    return d->name;
+    uint32_t* copy = NULL;
+    if(serial) {
+        CHECKALLOC(copy = malloc(sizeof(uint32_t)));
+        *copy = *serial;
+    }
+    return copy;
 }
 
-int
-metastorage(const char* filename, int ndefs, struct definition_struct* defs, const char* name, void* item)
+static void
+entrydispose(struct metaentry* entry)
 {
-    int basefd = AT_FDCWD;
-    int rdfd;
-    int wrfd;
-    off_t offset;
-    off_t size;
-    ssize_t count;
-    struct definition_struct* rddef = &defs[0];
-    struct definition_struct* wrdef = &defs[0];
-    size_t filenamelen;
+    free(entry->name);
+    free(entry->nextserial);
+    free(entry->inboundserial);
+    free(entry->outboundserial);
+    free(entry);
+}
+
+static void
+entryupdate(struct metastorage_struct* storage, struct metaentry* entry)
+{
+    struct metaentry* existing;
+    HASH_FIND_STR(storage->entries, entry->name, existing);
+    if(existing) {
+        HASH_DEL(storage->entries, existing);
+        entrydispose(existing);
+        storage->nentries -= 1;
+    }
+    HASH_ADD_KEYPTR(hh, storage->entries, entry->name, strlen(entry->name), entry);
+    storage->nentries += 1;
+}
+
+static void
+storageclear(struct metastorage_struct* storage)
+{
+    struct metaentry* entry;
+    struct metaentry* tmp;
+    HASH_ITER(hh, storage->entries, entry, tmp) {
+        HASH_DEL(storage->entries, entry);
+        entrydispose(entry);
+    }
+    storage->nentries = 0;
+    storage->nappended = 0;
+    if(storage->store)
+        marshallclose(storage->store);
+    storage->store = NULL;
+}
+
+/* Writes all current entries to a new file which replaces the existing one,
+ * leaving it open for appending.
+ */
+static int
+storagerewrite(struct metastorage_struct* storage)
+{
+    int fd;
     char* tmpfilename;
-    marshall_handle rdhandle = NULL;
-    marshall_handle wrhandle = NULL;
-    marshall_handle freehandle = NULL;
-    void* ptr;
+    struct stat statbuf;
+    struct metaentry* entry;
+    struct metaentry* tmp;
+    marshall_handle handle;
+    asprintf(&tmpfilename, "%s~", storage->filename);
+    if((fd = openat(storage->basefd, tmpfilename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write %s: %s\n", tmpfilename, strerror(errno));
+        free(tmpfilename);
+        return -1;
+    }
+    if(write(fd, filemagic, sizeof(filemagic)) != sizeof(filemagic)) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write %s: %s\n", tmpfilename, strerror(errno));
+        close(fd);
+        unlinkat(storage->basefd, tmpfilename, 0);
+        free(tmpfilename);
+        return -1;
+    }
+    handle = marshallcreate(marshall_OUTPUT, fd);
+    HASH_ITER(hh, storage->entries, entry, tmp) {
+        marshalling(handle, entry->name, &entry, NULL, sizeof(struct metaentry), entrymarshall);
+        marshallsync(handle, 0);
+    }
+    if(marshallsync(handle, 1) || fdatasync(fd) || renameat(storage->basefd, tmpfilename, storage->basefd, storage->filename)) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to replace %s: %s\n", storage->filename, strerror(errno));
+        marshallclose(handle);
+        free(tmpfilename);
+        return -1;
+    }
+    free(tmpfilename);
+    fstat(fd, &statbuf);
+    storage->device = statbuf.st_dev;
+    storage->inode = statbuf.st_ino;
+    if(storage->store)
+        marshallclose(storage->store);
+    storage->store = handle;
+    storage->nappended = storage->nentries;
+    return 0;
+}
+
+/* Loads the entries from file, unless they already are.  The file is
+ * only read again when it has been replaced or removed by someone else.
+ */
+static int
+storageload(struct metastorage_struct* storage)
+{
+    int fd;
+    int legacy;
+    off_t size;
+    struct stat statbuf;
+    struct metaentry* entry;
+    marshall_handle input;
     char buffer[8];
 
-    freehandle = marshallcreate(marshall_FREE);
-    //basefd = open(directory,O_DIRECTORY,0);
-    for(;;) {
-        if(name!=NULL) {
-            rdfd = openat(basefd,filename,O_RDONLY);
-        } else {
-            rdfd = openat(basefd,filename,O_RDWR);
-        }
-        if(rdfd < 0 && errno == ENOENT) {
-            wrfd = openat(basefd,filename,O_WRONLY|O_CREAT|O_EXCL,0666);
-            if(wrfd < 0 || errno == EEXIST) {
-                continue;
-            } else if(wrfd < 0) {
-                abort(); // FIXME
-                return -1;
-            } else {
-                if(lockf(wrfd,F_LOCK,0)) {
-                    abort(); // FIXME
-                }
-                break;
-            }
-        } else if(rdfd < 0) {
-            abort(); // FIXME
+    if(fstatat(storage->basefd, storage->filename, &statbuf, 0) == 0) {
+        if(storage->store && statbuf.st_dev == storage->device && statbuf.st_ino == storage->inode)
+            return 0;
+    } else if(errno != ENOENT) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to access %s: %s\n", storage->filename, strerror(errno));
+        return -1;
+    }
+    storageclear(storage);
+    if((fd = openat(storage->basefd, storage->filename, O_RDWR)) < 0) {
+        if(errno != ENOENT) {
+            logger_message(&cls, logger_noctx, logger_ERROR, "unable to open %s: %s\n", storage->filename, strerror(errno));
             return -1;
-        } else {
-            if(name==NULL) {
-                if(lockf(rdfd,F_LOCK,0)) {
-                    fprintf(stderr,"operation failed %s (%d) %d\n",strerror(errno),errno,rdfd);
-                    //abort(); // FIXME
-                    //return -1;
-                }
-            }
-            wrfd = -1;
-            break;
         }
+        return storagerewrite(storage);
     }
-    if(rdfd >= 0) {
-        size = lseek(rdfd,0,SEEK_END);
-        offset = lseek(rdfd,0,SEEK_SET);
-        count = read(rdfd,&buffer,sizeof(buffer));
-        if(count != sizeof(buffer)) {
-            abort();
-        }
-        if(memcmp(buffer,"\0ODS-M1\n",sizeof(buffer))) {
-            abort(); // FIXME
-        }
+    size = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+    if(read(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+        buffer[0] = '\1';
     }
-    filenamelen = strlen(filename);
-    tmpfilename = malloc(filenamelen+2);
-    memcpy(tmpfilename,filename,filenamelen);
-    tmpfilename[filenamelen+0] = '~';
-    tmpfilename[filenamelen+1] = '\0';
-    if(wrfd < 0 && name == NULL) {
-        wrfd = openat(basefd,tmpfilename,O_WRONLY|O_CREAT|O_TRUNC,0666);
-        if(wrfd < 0) {
-            abort(); // FIXME
-        }
+    legacy = (memcmp(buffer, filemagicv1, sizeof(filemagicv1)) == 0);
+    if(!legacy && memcmp(buffer, filemagic, sizeof(filemagic))) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unrecognized content in %s\n", storage->filename);
+        close(fd);
+        return -1;
     }
-    if(wrfd >= 0) {
-        memset(buffer,'\0',8);
-        memcpy(buffer,wrdef->membercode,8);
-        count = write(wrfd,buffer,8);
-        if(count != 8) {
-            abort(); // FIXME
+    input = marshallcreate((legacy ? marshall_LEGACYINPUT : marshall_INPUT), fd);
+    for(;;) {
+        if(legacy ? lseek(fd, 0, SEEK_CUR) >= size : marshalleof(input))
+            break;
+        CHECKALLOC(entry = malloc(sizeof(struct metaentry)));
+        entry->name = NULL;
+        marshalling(input, "", &entry, NULL, sizeof(struct metaentry), entrymarshall);
+        if(entry->name == NULL) {
+            free(entry);
+            break;
         }
-        wrhandle = marshallcreate(marshall_OUTPUT, wrfd);
+        entryupdate(storage, entry);
+        storage->nappended += 1;
     }
-
-    if(rdfd >= 0) {
-        rdhandle = marshallcreate(marshall_INPUT, rdfd);
-        ptr = malloc(wrdef->membersize);
-        do {
-            offset = lseek(rdfd,0,SEEK_CUR);
-            if(offset < size) {
-                marshalling(rdhandle, "", &ptr, NULL, rddef->membersize, rddef->memberfunction);
-                if(wrfd>=0) {
-                    if(strcmp(wrdef->membername(item), rddef->membername(ptr))) {
-                        marshalling(wrhandle, wrdef->membername(ptr), &ptr, NULL, wrdef->membersize, wrdef->memberfunction);
-                    }
-                }
-                if(name != NULL && !strcmp(name, rddef->membername(ptr))) {
-                    memcpy(item, ptr, wrdef->membersize); 
-                } else {
-                    marshalling(freehandle, "", &ptr, NULL, wrdef->membersize, wrdef->memberfunction);
-                }
-            }
-        } while(offset < size);
-        free(ptr);
-    }
-    if(wrfd>=0 && name==NULL) {
-        marshalling(wrhandle, wrdef->membername(item), &item, NULL, wrdef->membersize, wrdef->memberfunction);
-    }
-
-    marshallclose(freehandle);
-    if(rdfd >= 0)
-        marshallclose(rdhandle);
-    if(wrfd >= 0)
-        marshallclose(wrhandle);
-    if(wrfd >= 0) {
-        close(wrfd);
-        if(rdfd >=0) {
-            renameat(basefd,tmpfilename,basefd,filename);
-        }
+    if(legacy) {
+        marshallclose(input);
+        return storagerewrite(storage);
     }
-    lockf(rdfd,F_UNLCK,0);
-    close(rdfd);
+    fstat(fd, &statbuf);
+    storage->device = statbuf.st_dev;
+    storage->inode = statbuf.st_ino;
+    storage->store = marshallcreate(marshall_APPEND, input);
+    marshallclose(input);
     return 0;
 }
 
-static int ndefs = 0;
-static struct definition_struct* defs = NULL;
-
-static void
-setup(void)
-{
-    if(ndefs!=0)
-        return;
-    ndefs = 1;
-    defs = malloc(sizeof(struct definition_struct)*ndefs);
-    defs[0].membercode = "\0ODS-M1\n";
-    defs[0].membersize = sizeof(struct zone_struct);
-    defs[0].memberfunction = zonemarshall;
-    defs[0].membername = zonename;
-}
-
 int
 metastorageget(const char* name, void* item)
 {
-    setup();
-    return metastorage("signer.db", ndefs, defs, name, (void**)item);
+    zone_type* zone = item;
+    struct metaentry* entry;
+    int rc = 1;
+    CHECK(pthread_mutex_lock(&lock));
+    if(storageload(&signerdb) == 0) {
+        HASH_FIND_STR(signerdb.entries, name, entry);
+        if(entry) {
+            /* the zone is already named, only the stored fields are taken */
+            zone->nextserial = serialcopy(entry->nextserial);
+            zone->inboundserial = serialcopy(entry->inboundserial);
+            zone->outboundserial = serialcopy(entry->outboundserial);
+            rc = 0;
+        }
+    }
+    CHECK(pthread_mutex_unlock(&lock));
+    return rc;
 }
 
 int
 metastorageput(void* item)
 {
-    setup();
-    return metastorage("signer.db", ndefs, defs, NULL, item);
+    zone_type* zone = item;
+    struct metaentry* entry;
+    int rc = -1;
+    CHECKALLOC(entry = malloc(sizeof(struct metaentry)));
+    entry->name = strdup(zone->name);
+    entry->nextserial = serialcopy(zone->nextserial);
+    entry->inboundserial = serialcopy(zone->inboundserial);
+    entry->outboundserial = serialcopy(zone->outboundserial);
+    CHECK(pthread_mutex_lock(&lock));
+    if(storageload(&signerdb) == 0) {
+        entryupdate(&signerdb, entry);
+        if(signerdb.nappended >= METASTORAGE_COMPACTMINIMUM && signerdb.nappended >= 2 * signerdb.nentries) {
+            rc = storagerewrite(&signerdb);
+        } else {
+            marshalling(signerdb.store, entry->name, &entry, NULL, sizeof(struct metaentry), entrymarshall);
+            signerdb.nappended += 1;
+            if(marshallsync(signerdb.store, 1)) {
+                /* the store is left unusable, start over in a new file */
+                rc = storagerewrite(&signerdb);
+            } else
+                rc = 0;
+        }
+    } else {
+        entrydispose(entry);
+    }
+    CHECK(pthread_mutex_unlock(&lock));
+    return rc;
 }
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <ldns/ldns.h>
+#include "utilities.h"
+#include "logging.h"
+#include "duration.h"
+#include "hsm.h"
+#include "signer/zone.h"
+#include "signer/zonelist.h"
+#include "signer/nsec3params.h"
+#include "views/proto.h"
+#include "nsec3rebuild.h"
+
+static logger_cls_type cls = LOGGER_INITIALIZE("nsec3rebuild");
+
+/* When the NSEC3 parameters change, the new chain is built next to the
+ * one being served.  The owner names of the zone are collected, hashed
+ * with the new parameters and their NSEC3 records created and signed in
+ * a number of steps, each limited to NSEC3REBUILD_BUDGET seconds of
+ * work.  Meanwhile the zone keeps being signed using the old parameters.
+ * Once complete, a single sign pass moves the new denial with its
+ * signatures onto the records and publishes the new NSEC3PARAM, after
+ * which the regular neighbour processing fixes up the NSEC3 records of
+ * names that changed during the rebuild.
+ */
+#define NSEC3REBUILD_BUDGET 2
+#define NSEC3REBUILD_CHUNK 4096
+
+enum rebuildstate { REBUILD_COLLECT, REBUILD_HASH, REBUILD_SIGN, REBUILD_READY };
+static const char* rebuildstates[] = { "collecting names", "hashing", "signing", "ready for switchover" };
+
+struct nsec3rebuild {
+    nsec3params_type* params;
+    signconf_type conf;
+    signconf_type* confptr;
+    struct names_view_zone zonedata;
+    enum rebuildstate state;
+    recordset_type* shadow;
+    size_t count;
+    size_t nhashed;
+    size_t nsigned;
+    time_t started;
+    double elapsed;
+};
+
+/* protects the zone->nsec3rebuild pointer against the command handler */
+static pthread_mutex_t rebuildlock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+sameparams(nsec3params_type* a, nsec3params_type* b)
+{
+    return a->algorithm == b->algorithm && a->flags == b->flags && a->iterations == b->iterations &&
+           a->salt_len == b->salt_len && !memcmp(a->salt_data, b->salt_data, a->salt_len);
+}
+
+static void
+rebuilddestroy(struct nsec3rebuild* rebuild)
+{
+    size_t i;
+    for(i=0; i<rebuild->count; i++)
+        names_recorddispose(rebuild->shadow[i]);
+    free(rebuild->shadow);
+    names_nsec3cachedestroy(rebuild->zonedata.nsec3cache);
+    nsec3params_cleanup(rebuild->params);
+    free(rebuild);
+}
+
+void
+nsec3rebuild_cancel(zone_type* zone)
+{
+    struct nsec3rebuild* rebuild;
+    CHECK(pthread_mutex_lock(&rebuildlock));
+    rebuild = zone->nsec3rebuild;
+    zone->nsec3rebuild = NULL;
+    CHECK(pthread_mutex_unlock(&rebuildlock));
+    if(rebuild) {
+        logger_message(&cls, logger_noctx, logger_INFO, "zone %s: NSEC3 chain rebuild abandoned\n", zone->name);
+        rebuilddestroy(rebuild);
+    }
+}
+
+/**
+ * Called with each newly loaded signer configuration before it replaces
+ * the current one.  As long as the chain for the new NSEC3 parameters is
+ * not complete, the new configuration carries the parameters of the chain
+ * being served.
+ */
+void
+nsec3rebuild_start(zone_type* zone, signconf_type* signconf)
+{
+    struct nsec3rebuild* rebuild = zone->nsec3rebuild;
+    nsec3params_type* active = zone->signconf->nsec3params;
+    nsec3params_type* target = signconf->nsec3params;
+    if(!active || !target || !zone->signconf->last_modified || sameparams(active, target)) {
+        /* no chain being served that needs replacing (anymore) */
+        nsec3rebuild_cancel(zone);
+        return;
+    }
+    if(rebuild && !sameparams(rebuild->params, target)) {
+        nsec3rebuild_cancel(zone);
+        rebuild = NULL;
+    }
+    zone->signconf->nsec3params = NULL;
+    signconf->nsec3params = active;
+    active->sc = signconf;
+    if(rebuild) {
+        nsec3params_cleanup(target);
+        return;
+    }
+    CHECKALLOC(rebuild = malloc(sizeof(struct nsec3rebuild)));
+    rebuild->params = target;
+    rebuild->conf = *signconf;
+    rebuild->conf.nsec3params = target;
+    rebuild->confptr = &rebuild->conf;
+    rebuild->zonedata.defaultttl = NULL;
+    rebuild->zonedata.apex = zone->name;
+    rebuild->zonedata.signconf = &rebuild->confptr;
+    rebuild->zonedata.nsec3cache = names_nsec3cachecreate();
+    rebuild->state = REBUILD_COLLECT;
+    rebuild->shadow = NULL;
+    rebuild->count = 0;
+    rebuild->nhashed = 0;
+    rebuild->nsigned = 0;
+    rebuild->started = time_now();
+    rebuild->elapsed = 0.0;
+    CHECK(pthread_mutex_lock(&rebuildlock));
+    zone->nsec3rebuild = rebuild;
+    CHECK(pthread_mutex_unlock(&rebuildlock));
+    logger_message(&cls, logger_noctx, logger_INFO, "zone %s: NSEC3 parameters changed, building new chain in the background\n", zone->name);
+}
+
+int
+nsec3rebuild_ready(zone_type* zone)
+{
+    return zone->nsec3rebuild && zone->nsec3rebuild->state == REBUILD_READY;
+}
+
+static int
+comparedenial(const void* a, const void* b)
+{
+    return strcmp(names_recordgetdenial(*(recordset_type*)a), names_recordgetdenial(*(recordset_type*)b));
+}
+
+static int
+comparename(const void* a, const void* b)
+{
+    return strcmp(names_recordgetname(*(recordset_type*)a), names_recordgetname(*(recordset_type*)b));
+}
+
+static double
+elapsedsince(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static void
+collectnames(struct nsec3rebuild* rebuild, names_view_type view)
+{
+    names_iterator iter;
+    recordset_type record;
+    size_t capacity = 1024;
+    CHECKALLOC(rebuild->shadow = malloc(sizeof(recordset_type) * capacity));
+    for(iter=names_viewiterator(view,NULL); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+        if(names_recordgetdenial(record) == NULL)
+            continue;
+        if(rebuild->count == capacity) {
+            capacity *= 2;
+            CHECKALLOC(rebuild->shadow = realloc(rebuild->shadow, sizeof(recordset_type) * capacity));
+        }
+        rebuild->shadow[rebuild->count++] = names_recordcreatetemp(names_recordgetname(record));
+    }
+}
+
+static void
+hashnames(struct nsec3rebuild* rebuild, size_t count)
+{
+    size_t i;
+    for(i=0; i<count; i++)
+        names_recordannotate(rebuild->shadow[rebuild->nhashed+i], &rebuild->zonedata);
+    names_recordannotatepending(&rebuild->shadow[rebuild->nhashed], count);
+    __atomic_store_n(&rebuild->nhashed, rebuild->nhashed + count, __ATOMIC_RELAXED);
+}
+
+static ods_status
+signshadow(struct nsec3rebuild* rebuild, names_view_type view, hsm_ctx_t* ctx, struct denial_struct* denial)
+{
+    recordset_type shadow = rebuild->shadow[rebuild->nsigned];
+    recordset_type record;
+    const char* next;
+    record = names_take(view, 0, names_recordgetname(shadow));
+    if(record == NULL || names_recordgetdenial(record) == NULL)
+        return ODS_STATUS_OK; /* removed or occluded since, the switchover will leave it out */
+    next = names_recordgetdenial(rebuild->shadow[(rebuild->nsigned + 1) % rebuild->count]);
+    if(denial_nsecifyhashed(&rebuild->conf, view, record, names_recordgetdenial(shadow), next, denial))
+        return ODS_STATUS_OK;
+    names_recordsetdenial(shadow, denial_rr(denial));
+    return rrset_sign(&rebuild->conf, view, shadow, LDNS_RR_TYPE_NSEC3, ctx, time_now());
+}
+
+/**
+ * Perform one budgeted step of the rebuild, returns non-zero if more
+ * steps are needed.
+ */
+int
+nsec3rebuild_step(zone_type* zone)
+{
+    struct nsec3rebuild* rebuild = zone->nsec3rebuild;
+    struct timespec start;
+    struct denial_struct* denial;
+    names_view_type view;
+    hsm_ctx_t* ctx;
+    size_t count;
+    ods_status status = ODS_STATUS_OK;
+    if(!rebuild || rebuild->state == REBUILD_READY)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rebuild->conf = *zone->signconf;
+    rebuild->conf.nsec3params = rebuild->params;
+    view = zonelist_obtainresource(NULL, zone, NULL, offsetof(zone_type, signview));
+    names_viewreset(view);
+    if(rebuild->state == REBUILD_COLLECT) {
+        collectnames(rebuild, view);
+        __atomic_store_n(&rebuild->count, rebuild->count, __ATOMIC_RELAXED);
+        __atomic_store_n(&rebuild->state, REBUILD_HASH, __ATOMIC_RELAXED);
+    }
+    while(rebuild->state == REBUILD_HASH && elapsedsince(&start) < NSEC3REBUILD_BUDGET) {
+        count = rebuild->count - rebuild->nhashed;
+        if(count > NSEC3REBUILD_CHUNK)
+            count = NSEC3REBUILD_CHUNK;
+        hashnames(rebuild, count);
+        if(rebuild->nhashed == rebuild->count) {
+            qsort(rebuild->shadow, rebuild->count, sizeof(recordset_type), comparedenial);
+            __atomic_store_n(&rebuild->state, REBUILD_SIGN, __ATOMIC_RELAXED);
+        }
+    }
+    if(rebuild->state == REBUILD_SIGN && elapsedsince(&start) < NSEC3REBUILD_BUDGET) {
+        if((status = zone_prepare_keys(zone)) == ODS_STATUS_OK && (ctx = hsm_create_context()) != NULL) {
+            CHECKALLOC(denial = malloc(sizeof(struct denial_struct)));
+            while(rebuild->nsigned < rebuild->count && elapsedsince(&start) < NSEC3REBUILD_BUDGET) {
+                if((status = signshadow(rebuild, view, ctx, denial)) != ODS_STATUS_OK)
+                    break;
+                __atomic_store_n(&rebuild->nsigned, rebuild->nsigned + 1, __ATOMIC_RELAXED);
+            }
+            free(denial);
+            hsm_destroy_context(ctx);
+        }
+        if(status != ODS_STATUS_OK)
+            logger_message(&cls, logger_noctx, logger_WARN, "zone %s: NSEC3 chain rebuild postponed: %s\n", zone->name, ods_status2str(status));
+        if(rebuild->nsigned == rebuild->count)
+            __atomic_store_n(&rebuild->state, REBUILD_READY, __ATOMIC_RELAXED);
+    }
+    zonelist_releaseresource(NULL, zone, NULL, offsetof(zone_type, signview), view);
+    rebuild->elapsed += elapsedsince(&start);
+    logger_message(&cls, logger_noctx, logger_INFO, "zone %s: NSEC3 chain rebuild %s, %lu of %lu names hashed, %lu signed\n",
+                   zone->name, rebuildstates[rebuild->state], (unsigned long)rebuild->nhashed,
+                   (unsigned long)rebuild->count, (unsigned long)rebuild->nsigned);
+    return rebuild->state != REBUILD_READY;
+}
+
+/**
+ * Replace the served chain with the rebuilt one, in the view and sign pass
+ * that produces serial newserial.
+ */
+void
+nsec3rebuild_switchover(zone_type* zone, names_view_type view, int newserial)
+{
+    struct nsec3rebuild* rebuild = zone->nsec3rebuild;
+    nsec3params_type* active;
+    names_iterator iter;
+    recordset_type record;
+    recordset_type previous;
+    recordset_type* found;
+    recordset_type* records;
+    recordset_type* pending;
+    ldns_rr* rr;
+    size_t i, count = 0, npending = 0, capacity = 1024;
+    struct timespec start;
+    if(!nsec3rebuild_ready(zone))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    active = zone->signconf->nsec3params;
+    zone->signconf->nsec3params = rebuild->params;
+    rebuild->params->sc = zone->signconf;
+    rebuild->params = active;
+    rebuild->conf = *zone->signconf;
+    qsort(rebuild->shadow, rebuild->count, sizeof(recordset_type), comparename);
+
+    CHECKALLOC(records = malloc(sizeof(recordset_type) * capacity));
+    for(iter=names_viewiterator(view,NULL); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+        if(names_recordvalidupto(record, NULL) || !names_recordvalidfrom(record, NULL) || !names_recordgetdenial(record))
+            continue;
+        if(count == capacity) {
+            capacity *= 2;
+            CHECKALLOC(records = realloc(records, sizeof(recordset_type) * capacity));
+        }
+        records[count++] = record;
+    }
+    CHECKALLOC(pending = malloc(sizeof(recordset_type) * (count ? count : 1)));
+    for(i=0; i<count; i++) {
+        record = previous = records[i];
+        if(names_recordhasexpiry(record)) {
+            names_amend(view, record);
+            names_recordsetvalidupto(record, newserial);
+            names_underwrite(view, &record);
+            names_recordsetvalidfrom(record, newserial);
+        } else {
+            names_update(view, &record);
+        }
+        found = bsearch(&record, rebuild->shadow, rebuild->count, sizeof(recordset_type), comparename);
+        if(found && names_recordgetdenial(*found)) {
+            names_recordrebuilddenial(record, previous, *found);
+        } else {
+            /* added since the names were collected */
+            names_recordrebuilddenial(record, previous, NULL);
+            names_recordannotate(record, &rebuild->zonedata);
+            pending[npending++] = record;
+        }
+        if(!strcmp(names_recordgetname(record), zone->name) && (rr = zone_nsec3param_rr(zone)) != NULL) {
+            /* publish the new NSEC3PARAM in the same serial */
+            names_recorddeldata(record, LDNS_RR_TYPE_NSEC3PARAMS, NULL);
+            names_recordadddata(record, ldns_rr_clone(rr));
+            names_recordsetexpiry(record, 0);
+        }
+    }
+    if(npending > 0)
+        names_recordannotatepending(pending, npending);
+    free(pending);
+    free(records);
+    logger_message(&cls, logger_noctx, logger_INFO, "zone %s: switched to new NSEC3 chain at serial %u, %lu names, %lu hashed late, in %.3f s after %.1f s of background work\n",
+                   zone->name, (unsigned int)newserial, (unsigned long)count, (unsigned long)npending, elapsedsince(&start), rebuild->elapsed);
+    CHECK(pthread_mutex_lock(&rebuildlock));
+    zone->nsec3rebuild = NULL;
+    CHECK(pthread_mutex_unlock(&rebuildlock));
+    rebuilddestroy(rebuild);
+}
+
+int
+nsec3rebuild_progress(zone_type* zone, char* buffer, size_t size)
+{
+    struct nsec3rebuild* rebuild;
+    char ctimebuf[32];
+    char* strtime;
+    int len = 0;
+    CHECK(pthread_mutex_lock(&rebuildlock));
+    if((rebuild = zone->nsec3rebuild) != NULL) {
+        strtime = ctime_r(&rebuild->started, ctimebuf);
+        if(strtime)
+            strtime[strlen(strtime)-1] = '\0';
+        len = snprintf(buffer, size, "NSEC3 chain rebuild of zone %s since %s: %s, %lu of %lu names hashed, %lu signed\n",
+                       zone->name, (strtime ? strtime : "(null)"),
+                       rebuildstates[__atomic_load_n(&rebuild->state, __ATOMIC_RELAXED)],
+                       (unsigned long)__atomic_load_n(&rebuild->nhashed, __ATOMIC_RELAXED),
+                       (unsigned long)__atomic_load_n(&rebuild->count, __ATOMIC_RELAXED),
+                       (unsigned long)__atomic_load_n(&rebuild->nsigned, __ATOMIC_RELAXED));
+    }
+    CHECK(pthread_mutex_unlock(&rebuildlock));
+    return len;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NSEC3REBUILD_H
+#define NSEC3REBUILD_H
+
+#include "config.h"
+#include "signer/zone.h"
+#include "signer/signconf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* seconds between the steps of a background NSEC3 chain rebuild */
+#define NSEC3REBUILD_INTERVAL 10
+
+struct nsec3rebuild;
+
+void nsec3rebuild_start(zone_type* zone, signconf_type* signconf);
+int nsec3rebuild_step(zone_type* zone);
+int nsec3rebuild_ready(zone_type* zone);
+void nsec3rebuild_switchover(zone_type* zone, names_view_type view, int newserial);
+void nsec3rebuild_cancel(zone_type* zone);
+int nsec3rebuild_progress(zone_type* zone, char* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NSEC3REBUILD_H */
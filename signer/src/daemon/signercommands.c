@@ -33,6 +33,7 @@
 #include "status.h"
 #include "util.h"
 #include "daemon/engine.h"
+#include "daemon/nsec3rebuild.h"
 #include "cmdhandler.h"
 #include "signercommands.h"
 #include "clientpipe.h"
@@ -72,7 +73,9 @@ cmdhandler_handle_cmd_help(int sockfd, cmdhandler_ctx_type* context, char *cmd)
 
     (void) snprintf(buf, ODS_SE_MAXLINE,
         "Commands:\n"
-        "zones                       Show the currently known zones.\n"
+        "zones                       Show the currently known zones, with the "
+                                    "time left\n"
+        "                            to their first expiring signature.\n"
         "sign <zone> [--serial <nr>] Read zone and schedule for immediate "
                                     "(re-)sign.\n"
         "                            If a serial is given, that serial is used "
@@ -122,6 +125,7 @@ cmdhandler_handle_cmd_zones(int sockfd, cmdhandler_ctx_type* context, char *cmd)
     size_t i;
     ldns_rbnode_t* node = LDNS_RBTREE_NULL;
     zone_type* zone = NULL;
+    time_t now = time_now();
     engine = getglobalcontext(context);
     if (!engine->zonelist || !engine->zonelist->zones) {
         (void)snprintf(buf, ODS_SE_MAXLINE, "There are no zones configured\n");
@@ -140,7 +144,12 @@ cmdhandler_handle_cmd_zones(int sockfd, cmdhandler_ctx_type* context, char *cmd)
         for (i = 0; i < ODS_SE_MAXLINE; i++) {
             buf[i] = 0;
         }
-        (void)snprintf(buf, ODS_SE_MAXLINE, "- %s\n", zone->name);
+        if (zone->nextexpiry) {
+            (void)snprintf(buf, ODS_SE_MAXLINE, "- %s (signatures expire "
+                "in %lds)\n", zone->name, (long)(zone->nextexpiry - now));
+        } else {
+            (void)snprintf(buf, ODS_SE_MAXLINE, "- %s\n", zone->name);
+        }
         client_printf(sockfd, "%s", buf);
         node = ldns_rbtree_next(node);
     }
@@ -446,6 +455,18 @@ cmdhandler_handle_cmd_queue(int sockfd, cmdhandler_ctx_type* context, char *cmd)
         node = ldns_rbtree_next(node);
     }
     pthread_mutex_unlock(&engine->taskq->schedule_lock);
+    /* background work in progress */
+    if (engine->zonelist && engine->zonelist->zones) {
+        pthread_mutex_lock(&engine->zonelist->zl_lock);
+        node = ldns_rbtree_first(engine->zonelist->zones);
+        while (node && node != LDNS_RBTREE_NULL) {
+            if (nsec3rebuild_progress((zone_type*) node->data, buf, ODS_SE_MAXLINE) > 0) {
+                client_printf(sockfd, "%s", buf);
+            }
+            node = ldns_rbtree_next(node);
+        }
+        pthread_mutex_unlock(&engine->zonelist->zl_lock);
+    }
     return 0;
 }
 
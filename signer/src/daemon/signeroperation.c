@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <ldns/ldns.h>
 #include "utilities.h"
@@ -38,6 +39,9 @@
 #include "util.h"
 #include "compat.h"
 #include "hsm.h"
+#include "locks.h"
+#include "views/uthash.h"
+#include "signer/shard.h"
 
 static logger_cls_type cls = LOGGER_INITIALIZE("signing");
 
@@ -96,8 +100,8 @@ rrset_sigvalid_period(signconf_type* sc, ldns_rr_type rrtype, time_t signtime,
     *expiration = (signtime + validity + random_jitter) - jitter;
 }
 
-ldns_rr_type
-domain_is_delegpt(names_view_type view, recordset_type record)
+static ldns_rr_type
+domain_delegpt(recordset_type record)
 {
     if(names_recordhasdata(record, LDNS_RR_TYPE_SOA, NULL, 0)) {
         return LDNS_RR_TYPE_SOA;
@@ -110,33 +114,208 @@ domain_is_delegpt(names_view_type view, recordset_type record)
     return LDNS_RR_TYPE_SOA;
 }
 
+/* Status a name imposes on the names below it, or zero if it has no
+ * data that cuts the subtree and its own parent decides.
+ */
+static ldns_rr_type
+domain_cut(recordset_type record)
+{
+    if (names_recordhasdata(record, LDNS_RR_TYPE_SOA, NULL, 0))
+        return LDNS_RR_TYPE_SOA;
+    if (names_recordhasdata(record, LDNS_RR_TYPE_NS, NULL, 0))
+        return LDNS_RR_TYPE_A; /* Glue / Empty non-terminal to Glue */
+    if (names_recordhasdata(record, LDNS_RR_TYPE_DNAME, NULL, 0))
+        return LDNS_RR_TYPE_DNAME; /* Occluded data / Empty non-terminal to Occluded data */
+    return 0;
+}
+
+ldns_rr_type
+domain_is_delegpt(names_view_type view, recordset_type record)
+{
+    ldns_rr_type delegpt;
+    if(names_recordgetstatus(record, NULL, &delegpt))
+        return delegpt;
+    return domain_delegpt(record);
+}
+
 ldns_rr_type
 domain_is_occluded(names_view_type view, recordset_type record)
 {
     names_iterator iter;
     recordset_type parent = NULL;
+    ldns_rr_type status;
+    if(names_recordgetstatus(record, &status, NULL))
+        return status;
     if(names_recordhasdata(record, LDNS_RR_TYPE_SOA, NULL, 0))
         return LDNS_RR_TYPE_SOA;
     for(iter=names_viewiterator(view,names_iteratorancestors,names_recordgetname(record)); names_iterate(&iter,&parent); names_advance(&iter,NULL)) {
-        if (names_recordhasdata(parent, LDNS_RR_TYPE_SOA, NULL, 0)) {
-            names_end(&iter);
-            return LDNS_RR_TYPE_SOA;
-        }
-        if (names_recordhasdata(parent, LDNS_RR_TYPE_NS, NULL, 0)) {
-            /* Glue / Empty non-terminal to Glue */
+        if ((status = domain_cut(parent)) != 0) {
             names_end(&iter);
-            return LDNS_RR_TYPE_A;
-        }
-        if (names_recordhasdata(parent, LDNS_RR_TYPE_DNAME, NULL, 0)) {
-            /* Occluded data / Empty non-terminal to Occluded data */
-            names_end(&iter);
-            return LDNS_RR_TYPE_DNAME;
+            return status;
         }
     }
     /* Authoritative or delegation */
     return LDNS_RR_TYPE_SOA;
 }
 
+struct domain_status {
+    UT_hash_handle hh;
+    const char* name;
+    recordset_type record;
+    ldns_rr_type below;
+    ldns_rr_type cut;
+    ldns_rr_type delegpt;
+};
+
+static const char*
+domain_parentname(const char* name)
+{
+    for(; *name; name++) {
+        if(*name == '\\') {
+            if(name[1])
+                name++;
+        } else if(*name == '.') {
+            return (name[1] ? &name[1] : NULL);
+        }
+    }
+    return NULL;
+}
+
+static ldns_rr_type
+domain_below(names_view_type view, struct domain_status** statuses, const char* name)
+{
+    struct domain_status* entry;
+    ldns_rr_type status = 0;
+    const char* parent;
+    if(name == NULL)
+        return LDNS_RR_TYPE_SOA;
+    HASH_FIND_STR(*statuses, name, entry);
+    if(entry && entry->below)
+        return entry->below;
+    if(!entry) {
+        /* remember the name so siblings do not walk again, empty non-terminals included */
+        CHECKALLOC(entry = malloc(sizeof(struct domain_status)));
+        entry->record = names_take(view, 1, name);
+        entry->name = (entry->record ? names_recordgetname(entry->record) : name);
+        entry->cut = (entry->record ? domain_cut(entry->record) : 0);
+        entry->below = 0;
+        HASH_ADD_KEYPTR(hh, *statuses, entry->name, strlen(entry->name), entry);
+    }
+    status = entry->cut;
+    if(status == 0) {
+        parent = domain_parentname(name);
+        status = domain_below(view, statuses, parent);
+    }
+    entry->below = status;
+    return status;
+}
+
+static void
+domain_cutshard(void* arg, long begin, long end)
+{
+    struct domain_status** entries = arg;
+    for (long i=begin; i<end; i++) {
+        entries[i]->cut = domain_cut(entries[i]->record);
+        entries[i]->delegpt = domain_delegpt(entries[i]->record);
+    }
+}
+
+static void
+domain_addstatus(struct domain_status** statuses, struct domain_status*** entries, long* nentries, recordset_type record)
+{
+    struct domain_status* entry;
+    HASH_FIND_STR(*statuses, names_recordgetname(record), entry);
+    if(entry)
+        return;
+    CHECKALLOC(entry = malloc(sizeof(struct domain_status)));
+    entry->name = names_recordgetname(record);
+    entry->record = record;
+    entry->below = 0;
+    HASH_ADD_KEYPTR(hh, *statuses, entry->name, strlen(entry->name), entry);
+    if(*nentries % 1024 == 0)
+        CHECKALLOC(*entries = realloc(*entries, sizeof(struct domain_status*) * (*nentries + 1024)));
+    (*entries)[(*nentries)++] = entry;
+}
+
+/**
+ * Update the occlusion and delegation status of the records other views
+ * committed to the view since the previous pass.  Only when a name gains
+ * or loses an NS, DNAME or SOA record, the status of all names below it
+ * is resolved again.  The status of a name below a zone cut is inherited
+ * from the closest ancestor that has data, so each name is resolved only
+ * once instead of walking all the ancestors of every record.  The status
+ * is stored on a revision updated in this view, records shared with
+ * other views are left alone.  The data of the records is looked at in
+ * shards of names, resolving the status over the names is not.
+ */
+void
+domain_updatestatus(names_view_type view, int nshards, struct stats_shards* timings)
+{
+    struct domain_status* statuses = NULL;
+    struct domain_status** entries = NULL;
+    struct domain_status* entry;
+    struct domain_status* tmp;
+    const char** cuts = NULL;
+    names_iterator iter;
+    struct names_arrival arrival;
+    recordset_type record;
+    ldns_rr_type occluded;
+    ldns_rr_type oldoccluded;
+    ldns_rr_type olddelegpt;
+    long nentries = 0;
+    long nresolved = 0;
+    long ncuts = 0;
+    long i;
+    for(iter=names_viewarrivals(view); names_iterate(&iter,&arrival); names_advance(&iter,NULL)) {
+        record = names_take(view, 1, arrival.name);
+        if(record == NULL) {
+            /* the name is gone, whatever it imposed below it went with it */
+            if(arrival.cut != 0) {
+                if(ncuts % 64 == 0)
+                    CHECKALLOC(cuts = realloc(cuts, sizeof(const char*) * (ncuts + 64)));
+                cuts[ncuts++] = arrival.name;
+            }
+        } else if(!names_recordgetstatus(record, NULL, NULL)) {
+            domain_addstatus(&statuses, &entries, &nentries, record);
+        }
+    }
+    shard_run(nshards, nentries, SHARD_MINITEMS, domain_cutshard, entries, timings);
+    for(i=0; i<nentries; i++) {
+        if(entries[i]->cut != names_recordgetcut(entries[i]->record)) {
+            if(ncuts % 64 == 0)
+                CHECKALLOC(cuts = realloc(cuts, sizeof(const char*) * (ncuts + 64)));
+            cuts[ncuts++] = entries[i]->name;
+        }
+    }
+    nresolved = nentries;
+    for(i=0; i<ncuts; i++) {
+        for(iter=names_viewiterator(view,names_iteratorsubtree,cuts[i]); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+            domain_addstatus(&statuses, &entries, &nentries, record);
+        }
+    }
+    if(nentries > nresolved)
+        shard_run(nshards, nentries - nresolved, SHARD_MINITEMS, domain_cutshard, &entries[nresolved], timings);
+    for(i=0; i<nentries; i++) {
+        entry = entries[i];
+        if(entry->cut == LDNS_RR_TYPE_SOA)
+            occluded = LDNS_RR_TYPE_SOA;
+        else
+            occluded = domain_below(view, &statuses, domain_parentname(entry->name));
+        record = entry->record;
+        if(names_recordgetstatus(record, &oldoccluded, &olddelegpt) && oldoccluded == occluded &&
+           olddelegpt == entry->delegpt && names_recordgetcut(record) == entry->cut)
+            continue;
+        names_update(view, &record);
+        names_recordsetstatus(record, occluded, entry->delegpt, entry->cut);
+    }
+    free(cuts);
+    free(entries);
+    HASH_ITER(hh, statuses, entry, tmp) {
+        HASH_DEL(statuses, entry);
+        free(entry);
+    }
+}
+
 struct rrsigkeymatching {
     struct signature_struct* signature;
     key_type* key;
@@ -183,12 +362,118 @@ rrsigkeymatching(signconf_type* signconf, struct signature_struct** rrsigs, stru
     *nrrsigkeymatchingptr = nmatches;
 }
 
+/**
+ * Whether key takes over signing rrtype from the retiring key old, during
+ * a rollover that is spread.
+ *
+ */
+static int
+rrset_istakeover(key_type* key, key_type* old, ldns_rr_type rrtype)
+{
+    if (!key->rolloverend || !key->publish || !old->publish) {
+        return 0;
+    } else if (rrtype == LDNS_RR_TYPE_DNSKEY) {
+        return key->ksk && !old->ksk;
+    } else {
+        return key->zsk && !old->zsk && !old->ksk;
+    }
+}
+
+/**
+ * Time at which a successor key takes over signing an RRset.  These are
+ * spread evenly over the rollover on the hash of the owner name and type,
+ * so an RRset keeps its moment whichever pass comes to sign it.
+ *
+ */
+static time_t
+rrset_takeovertime(key_type* key, recordset_type record, ldns_rr_type rrtype)
+{
+    const unsigned char* s;
+    uint32_t hash = 2166136261U;
+    for (s = (const unsigned char*) names_recordgetname(record); *s; s++) {
+        hash = (hash ^ tolower(*s)) * 16777619U;
+    }
+    hash = (hash ^ (rrtype >> 8)) * 16777619U;
+    hash = (hash ^ (rrtype & 0xff)) * 16777619U;
+    return key->rollover + (time_t) (((uint64_t) (key->rolloverend - key->rollover) * hash) >> 32);
+}
+
+static int
+rrset_rollover(signconf_type* signconf, recordset_type record, ldns_rr_type rrtype, time_t signtime, long* ntotal, long* nsigned)
+{
+    struct signature_struct** signatures;
+    key_type* key;
+    int due = 0;
+    int i;
+    names_recordlookupall(record, rrtype, NULL, NULL, &signatures);
+    for (size_t k=0; k<signconf->keys->count; k++) {
+        key = &signconf->keys->keys[k];
+        if (!key->rolloverend || !(rrtype == LDNS_RR_TYPE_DNSKEY ? key->ksk : key->zsk))
+            continue;
+        *ntotal += 1;
+        for (i=0; signatures[i]; i++) {
+            if (rrsigkeyismatching(signatures[i], key))
+                break;
+        }
+        if (signatures[i]) {
+            *nsigned += 1;
+        } else if (signtime >= rrset_takeovertime(key, record, rrtype)) {
+            due = 1;
+        }
+    }
+    free(signatures);
+    return due;
+}
+
+/**
+ * Count the RRsets of a record to be signed by the successor keys of a
+ * rollover, and those already signed with them.  Returns whether the
+ * moment has come for any of these RRsets to be taken over.
+ *
+ */
+int
+domain_rollover(signconf_type* signconf, names_view_type view, recordset_type record, time_t signtime, long* ntotal, long* nsigned)
+{
+    names_iterator iter;
+    ldns_rr_type rrtype;
+    ldns_rr_type delegpt;
+    int due = 0;
+    if (!signconf || !signconf->keys || domain_is_occluded(view, record) != LDNS_RR_TYPE_SOA) {
+        return 0;
+    }
+    delegpt = domain_is_delegpt(view, record);
+    for (iter=names_recordalltypes(record); names_iterate(&iter,&rrtype); names_advance(&iter,NULL)) {
+        if (delegpt != LDNS_RR_TYPE_SOA && rrtype != LDNS_RR_TYPE_DS)
+            continue;
+        if (rrset_rollover(signconf, record, rrtype, signtime, ntotal, nsigned))
+            due = 1;
+    }
+    if (names_recordgetdenial(record)) {
+        if (rrset_rollover(signconf, record, LDNS_RR_TYPE_NSEC, signtime, ntotal, nsigned))
+            due = 1;
+    }
+    return due;
+}
+
 /**
  * Sign RRset.
  *
  */
 ods_status
 rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record, ldns_rr_type rrtype, hsm_ctx_t* ctx, time_t signtime)
+{
+    return rrset_signbatch(signconf, view, record, rrtype, ctx, signtime, 0, NULL);
+}
+
+/**
+ * Sign RRset, with the new signatures made in the background if a batch
+ * is given.  These are to be added to the record once the batch completes.
+ * Signatures expiring before refreshtime are replaced, also when they are
+ * not yet within the refresh interval of the policy.
+ *
+ */
+ods_status
+rrset_signbatch(signconf_type* signconf, names_view_type view, recordset_type record, ldns_rr_type rrtype, hsm_ctx_t* ctx, time_t signtime, time_t refreshtime, lhsm_batch_type* batch)
 {
     ods_status status;
     uint32_t newsigs;
@@ -197,7 +482,9 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
     time_t expiration;
     ldns_rr_type dstatus = LDNS_RR_TYPE_FIRST;
     ldns_rr_type delegpt = LDNS_RR_TYPE_FIRST;
-    ldns_rr_list* rrset = NULL;
+    ldns_rr* rr = NULL;
+    const uint8_t* wire;
+    size_t wiresize;
     int nmatchedsignatures;
 
     /* Calculate the Refresh Window = Signing time + Refresh */
@@ -205,23 +492,19 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
     if (signconf && signconf->sig_refresh_interval) {
         refresh = (uint32_t) (signtime + duration2time(signconf->sig_refresh_interval));
     }
+    if (refresh > (uint32_t) signtime && (uint32_t) refreshtime > refresh) {
+        /* refreshed ahead of time to level the signing load */
+        refresh = (uint32_t) refreshtime;
+    }
 
     struct signature_struct** signatures;
     struct rrsigkeymatching* matchedsignatures;
-    names_recordlookupall(record, rrtype, NULL, &rrset, &signatures);
+    ldns_rr** superseded;
+    int nsuperseded = 0;
+    names_recordlookupall(record, rrtype, NULL, NULL, &signatures);
     rrsigkeymatching(signconf, signatures, &matchedsignatures, &nmatchedsignatures);
     free(signatures);
 
-    /* Transmogrify rrset */
-    if (ldns_rr_list_rr_count(rrset) <= 0) {
-        /* Empty RRset, no signatures needed */
-        if(rrset) ldns_rr_list_free(rrset);
-        free(matchedsignatures);
-        return 0;
-    }
-
-    ldns_rr_list_sort(rrset);
-
     /* Recycle signatures */
     if (rrtype == LDNS_RR_TYPE_NSEC ||
         rrtype == LDNS_RR_TYPE_NSEC3) {
@@ -234,12 +517,19 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
 
     /* Skip delegation, glue and occluded RRsets */
     if (dstatus != LDNS_RR_TYPE_SOA) {
-        if(rrset) ldns_rr_list_free(rrset);
         free(matchedsignatures);
         return 0;
     }
     if (delegpt != LDNS_RR_TYPE_SOA && rrtype != LDNS_RR_TYPE_DS) {
-        if(rrset) ldns_rr_list_free(rrset);
+        free(matchedsignatures);
+        return 0;
+    }
+
+    /* The RRset in canonical form, as kept with the record between
+     * changes to it, is what gets signed */
+    wire = names_recordgetwire(record, rrtype, &rr, &wiresize);
+    if (wire == NULL) {
+        /* Empty RRset, no signatures needed */
         free(matchedsignatures);
         return 0;
     }
@@ -293,6 +583,7 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
      * optimization, there needs to be no signature, if there is a signature for another key with the same algorithm
      * that is still valid.
      */
+    CHECKALLOC(superseded = malloc(sizeof(ldns_rr*) * (nmatchedsignatures ? nmatchedsignatures : 1)));
     for (int i=0; i<nmatchedsignatures; i++) {
         if(!matchedsignatures[i].signature && matchedsignatures[i].key) {
             /* We now know this key doesn't sign the set, we will only
@@ -306,12 +597,25 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
                     }
                 }
             }
-            if (j < nmatchedsignatures) {
+            if (j < nmatchedsignatures && rrset_istakeover(matchedsignatures[i].key, matchedsignatures[j].key, rrtype)
+                    && signtime >= rrset_takeovertime(matchedsignatures[i].key, record, rrtype)) {
+                /* The successor key takes over ahead of the refresh of
+                 * the signature by the retiring key, which is removed */
+                superseded[nsuperseded++] = matchedsignatures[j].signature->rr;
+                matchedsignatures[j].key = NULL;
+                matchedsignatures[j].signature = NULL;
+            } else if (j < nmatchedsignatures) {
                 matchedsignatures[i].key = NULL;
                 matchedsignatures[i].signature = NULL;
             }
         }
     }
+    /* taken off the record only now, as the matches point into its
+     * signatures */
+    for (int i=0; i<nsuperseded; i++) {
+        names_recorddelsignature(record, rrtype, superseded[i]);
+    }
+    free(superseded);
     /* Calculate signature validity for new signatures */
     rrset_sigvalid_period(signconf, rrtype, signtime, &inception, &expiration);
     /* for each missing signature (no signature, but with key in the tuplie list) produce a signature */
@@ -319,15 +623,23 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
         if (!matchedsignatures[i].signature && matchedsignatures[i].key) {
             /* Sign the RRset with this key */
             logger_message(&cls,logger_noctx,logger_TRACE, "sign %s with key %s inception=%ld expiration=%ld delegation=%s occluded=%s\n",names_recordgetname(record),matchedsignatures[i].key->locator,(long)inception,(long)expiration,(delegpt!=LDNS_RR_TYPE_SOA?"yes":"no"),(dstatus!=LDNS_RR_TYPE_SOA?"yes":"no"));
-            rrsig = lhsm_sign(ctx, rrset, matchedsignatures[i].key, inception, expiration);
-            if (rrsig == NULL) {
-                ods_log_crit("unable to sign RRset[%i]: lhsm_sign() failed", rrtype);
-                if(rrset) ldns_rr_list_free(rrset);
-                free(matchedsignatures);
-                return ODS_STATUS_HSM_ERR;
+            if (batch) {
+                /* Signature is added once the batch completes */
+                if (lhsm_signsubmit(ctx, batch, rr, wire, wiresize, matchedsignatures[i].key, inception, expiration, record, rrtype) != ODS_STATUS_OK) {
+                    ods_log_crit("unable to sign RRset[%i]: lhsm_signsubmit() failed", rrtype);
+                    free(matchedsignatures);
+                    return ODS_STATUS_HSM_ERR;
+                }
+            } else {
+                rrsig = lhsm_sign(ctx, rr, wire, wiresize, matchedsignatures[i].key, inception, expiration);
+                if (rrsig == NULL) {
+                    ods_log_crit("unable to sign RRset[%i]: lhsm_sign() failed", rrtype);
+                    free(matchedsignatures);
+                    return ODS_STATUS_HSM_ERR;
+                }
+                /* Add signature */
+                names_recordaddsignature(record, rrtype, rrsig, strdup(matchedsignatures[i].key->locator), matchedsignatures[i].key->flags);
             }
-            /* Add signature */
-            names_recordaddsignature(record, rrtype, rrsig, strdup(matchedsignatures[i].key->locator), matchedsignatures[i].key->flags);
             newsigs++;
         }
         /* Add signatures for DNSKEY if have been configured to be added explicitjy */
@@ -340,7 +652,6 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
                     ods_log_error("unable to publish dnskeys for zone %s: error decoding literal dnskey", signconf->name);
                     if(apex)
                         ldns_rdf_free(apex);
-                    if(rrset) ldns_rr_list_free(rrset);
                     free(matchedsignatures);
                     return status;
                 }
@@ -354,163 +665,268 @@ rrset_sign(signconf_type* signconf, names_view_type view, recordset_type record,
     }
 
     /* RRset signing completed */
-    if(rrset) ldns_rr_list_free(rrset);
     free(matchedsignatures);
     return 0;
 }
 
 static void
-denial_create_bitmap(names_view_type view, recordset_type record, ldns_rr_type nsectype, ldns_rr_type** types, size_t* types_count)
+denial_bitmapadd(uint8_t windows[256][32], uint8_t windowlen[256], ldns_rr_type rrtype)
+{
+    uint8_t window = rrtype >> 8;
+    uint8_t octet = (rrtype & 0xff) >> 3;
+    if (windowlen[window] == 0)
+        memset(windows[window], 0, sizeof(windows[window]));
+    windows[window][octet] |= 0x80 >> (rrtype & 0x07);
+    if (octet >= windowlen[window])
+        windowlen[window] = octet + 1;
+}
+
+/**
+ * Write the type bit maps field of the NSEC(3) for a record into bitmap,
+ * which must have room for all 256 windows.  Returns the length written.
+ */
+static size_t
+denial_create_bitmap(names_view_type view, recordset_type record, ldns_rr_type nsectype, uint8_t* bitmap)
 {
     names_iterator iter;
     ldns_rr_type rrtype;
     ldns_rr_type occludedstatus = domain_is_occluded(view, record);
     ldns_rr_type delegptstatus = domain_is_delegpt(view, record);
-    *types = NULL;
+    uint8_t windows[256][32];
+    uint8_t windowlen[256];
+    size_t len = 0;
+    int i;
+    memset(windowlen, 0, sizeof(windowlen));
     /* Type Bit Maps */
     switch(nsectype) {
         case LDNS_RR_TYPE_NSEC3:
             if (occludedstatus == LDNS_RR_TYPE_SOA) {
                 if (delegptstatus != LDNS_RR_TYPE_NS /* FIXME investigate if the next predicate could still happen: && record->nitemsets > 0*/) {
-                    *types = malloc(sizeof(ldns_rr_type) * (*types_count = 1));
-                    (*types)[0] = LDNS_RR_TYPE_RRSIG;
+                    denial_bitmapadd(windows, windowlen, LDNS_RR_TYPE_RRSIG);
                 }
             }
             break;
         case LDNS_RR_TYPE_NSEC:
         default:
-            *types = malloc(sizeof(ldns_rr_type) * (*types_count = 2));
-            (*types)[0] = LDNS_RR_TYPE_RRSIG;
-            (*types)[1] = nsectype;
+            denial_bitmapadd(windows, windowlen, LDNS_RR_TYPE_RRSIG);
+            denial_bitmapadd(windows, windowlen, nsectype);
             break;
     }
     if (occludedstatus == LDNS_RR_TYPE_SOA) {
         for(iter=names_recordalltypes(record); names_iterate(&iter,&rrtype); names_advance(&iter,NULL)) {
             if (delegptstatus == LDNS_RR_TYPE_SOA || rrtype == LDNS_RR_TYPE_NS || rrtype == LDNS_RR_TYPE_DS) {
                 /* Authoritative or delegation */
-                *types_count += 1;
-                *types = realloc(*types, sizeof(ldns_rr_type) * *types_count);
-                (*types)[*types_count - 1] = rrtype;
+                denial_bitmapadd(windows, windowlen, rrtype);
             }
         }
     }
+    for (i=0; i<256; i++) {
+        if (windowlen[i]) {
+            bitmap[len++] = i;
+            bitmap[len++] = windowlen[i];
+            memcpy(&bitmap[len], windows[i], windowlen[i]);
+            len += windowlen[i];
+        }
+    }
+    return len;
 }
 
-static ldns_rdf*
-denial_create_nsec3_nxt(ldns_rdf* nxt)
+/**
+ * Convert a domain name in presentation format to uncompressed wire
+ * format.  Returns non-zero if the name is malformed or too long.
+ */
+static int
+denial_name2wire(const char* name, uint8_t* wire, size_t* wirelen)
 {
-    ldns_status status = LDNS_STATUS_OK;
-    ldns_rdf* next_owner_label = NULL;
-    ldns_rdf* next_owner_rdf = NULL;
-    char* next_owner_string = NULL;
-
-    ods_log_assert(nxt);
-    next_owner_label = ldns_dname_label(nxt, 0);
-    if (!next_owner_label) {
-        ods_log_alert("unable to create NSEC3 Next: ldns_dname_label() failed");
-        return NULL;
-    }
-    next_owner_string = ldns_rdf2str(next_owner_label);
-    if (!next_owner_string) {
-        ods_log_alert("unable to create NSEC3 Next: ldns_rdf2str() failed");
-        ldns_rdf_deep_free(next_owner_label);
-        return NULL;
-    }
-    if (next_owner_string[strlen(next_owner_string)-1] == '.') {
-        next_owner_string[strlen(next_owner_string)-1] = '\0';
+    size_t len = 0;
+    size_t label = 0;
+    int c;
+    wire[len++] = 0;
+    for (; *name; name++) {
+        if (*name == '.') {
+            if (len - label == 1) {
+                if (label == 0 && name[1] == '\0')
+                    break; /* root */
+                return 1;
+            }
+            wire[label] = len - label - 1;
+            if (len >= LDNS_MAX_DOMAINLEN)
+                return 1;
+            label = len;
+            wire[len++] = 0;
+            continue;
+        }
+        c = (unsigned char) *name;
+        if (c == '\\') {
+            if (isdigit((unsigned char)name[1]) && isdigit((unsigned char)name[2]) && isdigit((unsigned char)name[3])) {
+                c = (name[1] - '0') * 100 + (name[2] - '0') * 10 + (name[3] - '0');
+                if (c > 255)
+                    return 1;
+                name += 3;
+            } else if (name[1]) {
+                c = (unsigned char) *++name;
+            } else
+                return 1;
+        }
+        if (len - label > LDNS_MAX_LABELLEN || len >= LDNS_MAX_DOMAINLEN - 1)
+            return 1;
+        wire[len++] = c;
     }
-    status = ldns_str2rdf_b32_ext(&next_owner_rdf, next_owner_string);
-    if (status != LDNS_STATUS_OK) {
-        ods_log_alert("unable to create NSEC3 Next: ldns_str2rdf_b32_ext() failed");
+    if (len - label > 1) {
+        /* relative name, terminate it at the root */
+        wire[label] = len - label - 1;
+        wire[len++] = 0;
     }
-    free((void*)next_owner_string);
-    ldns_rdf_deep_free(next_owner_label);
-    return next_owner_rdf;
+    *wirelen = len;
+    return 0;
 }
 
-static ldns_rr*
-denial_create_nsec(names_view_type view, recordset_type domain, ldns_rdf* nxt, uint32_t ttl,
-    ldns_rr_class klass, nsec3params_type* n3p)
+/**
+ * Decode the leading (hashed) label of an NSEC3 owner name in base32
+ * extended hex into raw hash bytes.  Returns non-zero on bad input.
+ */
+static int
+denial_hash2wire(const char* name, uint8_t* hash, size_t* hashlen)
 {
-    const char* denialname;
-    ldns_rr* nsec_rr;
-    ldns_rr_type rrtype;
-    ldns_rr_type dstatus = LDNS_RR_TYPE_FIRST;
-    ldns_rdf* rdf = NULL;
-    ldns_rr_type* types;
-    size_t types_count = 0;
-    int i = 0;
-    ods_log_assert(nxt);
-    nsec_rr = ldns_rr_new();
-    /* RRtype */
-    if (n3p) {
-        rrtype = LDNS_RR_TYPE_NSEC3;
-    } else {
-        rrtype = LDNS_RR_TYPE_NSEC;
-    }
-    ldns_rr_set_type(nsec_rr, rrtype);
-    /* owner */
-    if(n3p) {
-        denialname = names_recordgetdenial(domain);
-    } else {
-        denialname = names_recordgetname(domain);
-    }
-    rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, denialname); // FIXME denial name for NSEC3, NSEC for uses name
-    if (!rdf) {
-        ods_log_alert("unable to create NSEC(3) RR: ldns_rdf_clone(owner) failed");
-        ldns_rr_free(nsec_rr);
-        return NULL;
-    }
-    ldns_rr_set_owner(nsec_rr, rdf);
-    /* NSEC3 parameters */
-    if (n3p) {
-        /* set all to NULL first, then call nsec3_add_param_rdfs. */
-#ifndef SE_NSEC3_RDATA_NSEC3PARAMS
-#define SE_NSEC3_RDATA_NSEC3PARAMS 4
-#endif
-        for (i=0; i < SE_NSEC3_RDATA_NSEC3PARAMS; i++) {
-            ldns_rr_push_rdf(nsec_rr, NULL);
+    uint32_t bits = 0;
+    int nbits = 0;
+    size_t len = 0;
+    int c;
+    for (; *name && *name != '.'; name++) {
+        c = (unsigned char) *name;
+        if (c >= '0' && c <= '9') {
+            c -= '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'v') {
+            c = (c | 0x20) - 'a' + 10;
+        } else
+            return 1;
+        bits = (bits << 5) | c;
+        nbits += 5;
+        if (nbits >= 8) {
+            nbits -= 8;
+            if (len >= 255)
+                return 1;
+            hash[len++] = bits >> nbits;
         }
-        ldns_nsec3_add_param_rdfs(nsec_rr, n3p->algorithm, n3p->flags, n3p->iterations, n3p->salt_len, n3p->salt_data);
     }
-    /* NXT */
-    if (n3p) {
-        rdf = denial_create_nsec3_nxt(nxt);
-    } else {
-        rdf = ldns_rdf_clone(nxt);
-    }
-    if (!rdf) {
-        ods_log_alert("unable to create NSEC(3) RR: create next field failed");
-        ldns_rr_free(nsec_rr);
-        return NULL;
-    }
-    ldns_rr_push_rdf(nsec_rr, rdf);
-    denial_create_bitmap(view, domain, (n3p?LDNS_RR_TYPE_NSEC3:LDNS_RR_TYPE_NSEC), &types, &types_count);
-    rdf = ldns_dnssec_create_nsec_bitmap(types, types_count, rrtype);
-    free(types);
-    if (!rdf) {
-        ods_log_alert("unable to create NSEC(3) RR: ldns_dnssec_create_nsec_bitmap() failed");
-        ldns_rr_free(nsec_rr);
-        return NULL;
-    }
-    ldns_rr_push_rdf(nsec_rr, rdf);
-    ldns_rr_set_ttl(nsec_rr, ttl);
-    ldns_rr_set_class(nsec_rr, klass);
-    return nsec_rr;
+    *hashlen = len;
+    return 0;
 }
 
-ldns_rr*
-denial_nsecify(signconf_type* signconf, names_view_type view, recordset_type domain, ldns_rdf* nxt)
+static void
+denial_endfield(struct denial_struct* denial)
+{
+    denial->fields[denial->nfields++] = denial->rdatalen;
+}
+
+/**
+ * Build the NSEC or NSEC3 RDATA for a domain in wire format, given the
+ * presentation name of the next domain (or of its hashed owner name for
+ * NSEC3).  Nothing is allocated, so the result can be compared against
+ * the current denial of the domain before deciding to create a record.
+ */
+int
+denial_nsecify(signconf_type* signconf, names_view_type view, recordset_type domain, const char* nxt, struct denial_struct* denial)
+{
+    return denial_nsecifyhashed(signconf, view, domain, NULL, nxt, denial);
+}
+
+/**
+ * As denial_nsecify(), but with the hashed owner name given rather than
+ * taken from the domain, for building an NSEC3 chain with other parameters
+ * than the one the domain is annotated for.
+ */
+int
+denial_nsecifyhashed(signconf_type* signconf, names_view_type view, recordset_type domain, const char* hashedowner, const char* nxt, struct denial_struct* denial)
 {
-    ldns_rr* nsec_rr = NULL;
+    nsec3params_type* n3p = signconf->nsec3params;
+    const char* owner;
+    size_t len;
     int ttl = 0;
     /* SOA MINIMUM */
     names_viewgetdefaultttl(view, &ttl);
     if (signconf->soa_min) {
         ttl = duration2time(signconf->soa_min);
     }
-    /* create new NSEC(3) rr */
-    nsec_rr = denial_create_nsec(view, domain, nxt, ttl, LDNS_RR_CLASS_IN, signconf->nsec3params);
+    denial->ttl = ttl;
+    denial->nfields = 0;
+    denial->rdatalen = 0;
+    if (n3p) {
+        denial->rrtype = LDNS_RR_TYPE_NSEC3;
+        owner = (hashedowner ? hashedowner : names_recordgetdenial(domain));
+        denial->rdata[denial->rdatalen++] = n3p->algorithm;
+        denial_endfield(denial);
+        denial->rdata[denial->rdatalen++] = n3p->flags;
+        denial_endfield(denial);
+        denial->rdata[denial->rdatalen++] = n3p->iterations >> 8;
+        denial->rdata[denial->rdatalen++] = n3p->iterations & 0xff;
+        denial_endfield(denial);
+        denial->rdata[denial->rdatalen++] = n3p->salt_len;
+        memcpy(&denial->rdata[denial->rdatalen], n3p->salt_data, n3p->salt_len);
+        denial->rdatalen += n3p->salt_len;
+        denial_endfield(denial);
+        if (denial_hash2wire(nxt, &denial->rdata[denial->rdatalen+1], &len)) {
+            ods_log_alert("unable to create NSEC3 Next: bad hashed owner name %s", nxt);
+            return 1;
+        }
+        denial->rdata[denial->rdatalen] = len;
+        denial->rdatalen += len + 1;
+        denial_endfield(denial);
+    } else {
+        denial->rrtype = LDNS_RR_TYPE_NSEC;
+        owner = names_recordgetname(domain);
+        if (denial_name2wire(nxt, &denial->rdata[denial->rdatalen], &len)) {
+            ods_log_alert("unable to create NSEC Next: bad domain name %s", nxt);
+            return 1;
+        }
+        denial->rdatalen += len;
+        denial_endfield(denial);
+    }
+    if (denial_name2wire(owner, denial->owner, &denial->ownerlen)) {
+        ods_log_alert("unable to create NSEC(3) RR: bad owner name %s", owner);
+        return 1;
+    }
+    denial->rdatalen += denial_create_bitmap(view, domain, denial->rrtype, &denial->rdata[denial->rdatalen]);
+    denial_endfield(denial);
+    return 0;
+}
+
+static ldns_rdf*
+denial_rdf(ldns_rdf_type rdftype, const uint8_t* data, size_t size)
+{
+    uint8_t* copy;
+    CHECKALLOC(copy = malloc(size ? size : 1));
+    memcpy(copy, data, size);
+    return ldns_rdf_new(rdftype, size, copy);
+}
+
+/**
+ * Create the NSEC(3) resource record from the wire format built by
+ * denial_nsecify().
+ */
+ldns_rr*
+denial_rr(struct denial_struct* denial)
+{
+    static const ldns_rdf_type nsecfields[] = {
+        LDNS_RDF_TYPE_DNAME, LDNS_RDF_TYPE_BITMAP
+    };
+    static const ldns_rdf_type nsec3fields[] = {
+        LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_INT16,
+        LDNS_RDF_TYPE_NSEC3_SALT, LDNS_RDF_TYPE_NSEC3_NEXT_OWNER, LDNS_RDF_TYPE_BITMAP
+    };
+    const ldns_rdf_type* fields;
+    ldns_rr* nsec_rr;
+    size_t start;
+    int i;
+    fields = (denial->rrtype == LDNS_RR_TYPE_NSEC3 ? nsec3fields : nsecfields);
+    nsec_rr = ldns_rr_new();
+    ldns_rr_set_type(nsec_rr, denial->rrtype);
+    ldns_rr_set_owner(nsec_rr, denial_rdf(LDNS_RDF_TYPE_DNAME, denial->owner, denial->ownerlen));
+    for (i=0, start=0; i<denial->nfields; start=denial->fields[i++]) {
+        ldns_rr_push_rdf(nsec_rr, denial_rdf(fields[i], &denial->rdata[start], denial->fields[i] - start));
+    }
+    ldns_rr_set_ttl(nsec_rr, denial->ttl);
+    ldns_rr_set_class(nsec_rr, LDNS_RR_CLASS_IN);
     return nsec_rr;
 }
 
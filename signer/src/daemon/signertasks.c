@@ -42,7 +42,9 @@
 #include "status.h"
 #include "signer/tools.h"
 #include "signer/zone.h"
+#include "signer/shard.h"
 #include "util.h"
+#include "nsec3rebuild.h"
 #include "signertasks.h"
 #include "file.h"
 #include "settings.h"
@@ -50,18 +52,18 @@
 static logger_cls_type names_logsigning = LOGGER_INITIALIZE("signing");
 
 /**
- * Queue RRset for signing.
+ * Queue RRset for signing, to be taken before those with later deadlines.
  *
  */
 static void
-worker_queue_domain(struct worker_context* context, fifoq_type* q, void* item, long* nsubtasks)
+worker_queue_domain(struct worker_context* context, fifoq_type* q, void* item, time_t deadline, long* nsubtasks)
 {
     ods_status status = ODS_STATUS_UNCHANGED;
     int tries = 0;
     ods_log_assert(q);
 
         pthread_mutex_lock(&q->q_lock);
-        status = fifoq_push(q, item, context, &tries);
+        status = fifoq_push(q, item, context, deadline, &tries);
         while (status == ODS_STATUS_UNCHANGED) {
             tries++;
             if (context->worker->need_to_exit) {
@@ -69,13 +71,15 @@ worker_queue_domain(struct worker_context* context, fifoq_type* q, void* item, l
                 return; /* FIXME should indicate some fundamental problem */
             }
             /**
-             * Apparently the queue is full. Lets take a small break to not hog CPU.
+             * Apparently the queue is full, or this zone has its share of
+             * it. Lets take a small break to not hog CPU.
              * The worker will release the signq lock while sleeping and will
              * automatically grab the lock when the queue is nonfull.
-             * Queue is nonfull at 10% of the queue size.
+             * Queue is nonfull at 10% of the queue size, or once the zone
+             * is below its share again.
              */
             ods_thread_wait(&q->q_nonfull, &q->q_lock, 5);
-            status = fifoq_push(q, item, context, &tries);
+            status = fifoq_push(q, item, context, deadline, &tries);
         }
         pthread_mutex_unlock(&q->q_lock);
 
@@ -85,7 +89,164 @@ worker_queue_domain(struct worker_context* context, fifoq_type* q, void* item, l
 
 
 /**
- * Queue zone for signing.
+ * Set the time by which the successor keys of a rollover are to have
+ * taken over all RRsets from the retiring keys.  This is a percentage of
+ * the signature validity, but never beyond the time in which signatures
+ * are replaced anyway, so the rollover is not held up.  Returns the
+ * number of keys taking over.
+ *
+ */
+static int
+worker_rollover_keys(struct worker_context* context)
+{
+    signconf_type* signconf = context->zone->signconf;
+    int spread = context->engine->config->rollover_spread;
+    time_t validity = duration2time(signconf->sig_validity_default);
+    time_t window = validity - duration2time(signconf->sig_refresh_interval);
+    key_type* key;
+    size_t i;
+    int nkeys = 0;
+
+    if (spread >= 0 && validity * spread / 100 < window) {
+        window = validity * spread / 100;
+    }
+    if (window < 0) {
+        window = 0;
+    }
+    for (i=0; signconf->keys && i < signconf->keys->count; i++) {
+        key = &signconf->keys->keys[i];
+        key->rolloverend = 0;
+        if (spread >= 0 && key->rollover) {
+            key->rolloverend = key->rollover + window;
+            nkeys++;
+        }
+    }
+    return nkeys;
+}
+
+/**
+ * Select the records to sign in this pass over the zone.
+ *
+ * Normally these are all records with signatures expiring within the
+ * refresh interval.  As the signatures made in one pass also expire
+ * together, this re-signs a zone in bursts.  With a re-sign budget only
+ * that many records are signed per pass, earliest expiring first.  Records
+ * with new data or with less than half the refresh interval left are
+ * always signed, the rest of the budget goes to records that are due and
+ * then to refreshing records ahead of time, until the expirations are
+ * spread evenly.  The refresh time of the context is moved up to cover
+ * the records refreshed early.
+ *
+ * During a key rollover the records whose moment has come to be signed
+ * with the successor key are selected as well, and the progress of the
+ * rollover is counted.
+ *
+ */
+static names_iterator
+worker_select_zone(struct worker_context* context, names_view_type view)
+{
+    signconf_type* signconf = context->zone->signconf;
+    stats_type* stats = context->zone->stats;
+    names_iterator iter;
+    names_iterator selection;
+    recordset_type record;
+    recordset_type* records = NULL;
+    long nrecords = 0, nsigned = 0, i;
+    long budget, passes, urgent = 0, due = 0, early = 0, deferred = 0;
+    long nrollover, rollovertotal = 0, rolloversigned = 0, takeovers = 0;
+    int takeover;
+    time_t refresh = duration2time(signconf->sig_refresh_interval);
+    time_t cycle = duration2time(signconf->sig_validity_default) - refresh;
+    time_t resign = duration2time(signconf->sig_resign_interval);
+    time_t urgenttime = context->clock_in + refresh / 2;
+    time_t expiry;
+
+    context->refreshtime = context->clock_in + refresh;
+    budget = context->engine->config->resign_budget;
+    nrollover = worker_rollover_keys(context);
+    if (refresh <= 0) {
+        budget = -1;
+    }
+    if (budget < 0 && !nrollover) {
+        return names_viewiterator(view, names_iteratorexpiring, context->refreshtime);
+    }
+    for(iter=names_viewiterator(view,names_iteratorexpiring,(time_t)INT_MAX); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+        if(nrecords % 1024 == 0)
+            CHECKALLOC(records = realloc(records, sizeof(recordset_type) * (nrecords + 1024)));
+        records[nrecords++] = record;
+    }
+    if (budget == 0) {
+        /* every record re-signed once per signature lifetime, evenly
+         * spread over the passes made in that time */
+        passes = (resign > 0 && cycle > resign ? cycle / resign : 1);
+        budget = (nrecords + passes - 1) / passes;
+        if (budget < 1)
+            budget = 1;
+    }
+    selection = names_iterator_createrefs(NULL);
+    for (i=0; i<nrecords; i++) {
+        record = records[i];
+        expiry = (names_recordhasexpiry(record) ? names_recordgetexpiry(record) : 0);
+        takeover = (nrollover && domain_rollover(signconf, view, record, context->clock_in, &rollovertotal, &rolloversigned));
+        if (budget < 0) {
+            if (expiry >= context->refreshtime && !takeover)
+                continue;
+        } else if (expiry < urgenttime) {
+            urgent++;
+        } else if (nsigned < budget && expiry < context->refreshtime) {
+            due++;
+        } else if (nsigned < budget) {
+            early++;
+            context->refreshtime = expiry + 1;
+        } else {
+            if (expiry < context->refreshtime)
+                deferred++;
+            if (!takeover)
+                continue;
+        }
+        if (takeover)
+            takeovers++;
+        nsigned++;
+        names_iterator_addptr(selection, record);
+    }
+    free(records);
+    if (nrollover) {
+        ods_log_verbose("[%s] zone %s rollover of %ld keys: %ld of %ld RRsets "
+            "signed with the successor, %ld records taken over in this pass",
+            context->worker->name, context->zone->name, nrollover,
+            rolloversigned, rollovertotal, takeovers);
+        if (stats) {
+            pthread_mutex_lock(&stats->stats_lock);
+            stats->rollover_total = rollovertotal;
+            stats->rollover_signed = rolloversigned;
+            stats->rollover_takeover = takeovers;
+            pthread_mutex_unlock(&stats->stats_lock);
+        }
+    }
+    if (budget < 0) {
+        return selection;
+    }
+    ods_log_verbose("[%s] zone %s re-signing %ld RRsets of budget %ld: %ld "
+        "urgent, %ld due, %ld early, %ld due deferred", context->worker->name,
+        context->zone->name, nsigned, budget, urgent, due, early, deferred);
+    if (stats) {
+        pthread_mutex_lock(&stats->stats_lock);
+        stats->resign_budget = budget;
+        stats->resign_urgent = urgent;
+        stats->resign_due = due;
+        stats->resign_early = early;
+        stats->resign_deferred = deferred;
+        pthread_mutex_unlock(&stats->stats_lock);
+    }
+    return selection;
+}
+
+/**
+ * Queue zone for signing.  The zone gets its own queue, from which the
+ * drudgers take in turn with those of other zones.  Records are taken by
+ * the expiration of their signatures, records with new data as soon as
+ * possible.  Records that can no longer wait, less than half the refresh
+ * interval from expiring, go before those of other zones.
  *
  */
 static void
@@ -93,10 +254,13 @@ worker_queue_zone(struct worker_context* context, fifoq_type* q, names_view_type
 {
     names_iterator iter;
     recordset_type record;
-    time_t refreshtime = context->clock_in + duration2time(context->zone->signconf->sig_refresh_interval);
-    for(iter=names_viewiterator(view,names_iteratorexpiring,refreshtime); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+    time_t deadline;
+    time_t urgent = context->clock_in + duration2time(context->zone->signconf->sig_refresh_interval) / 2;
+    fifoq_open(q, context, context->worker, urgent);
+    for(iter=worker_select_zone(context, view); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+        deadline = (names_recordhasexpiry(record) ? names_recordgetexpiry(record) : context->clock_in);
         names_amend(view, record);
-        worker_queue_domain(context, q, record, nsubtasks);
+        worker_queue_domain(context, q, record, deadline, nsubtasks);
     }
 }
 
@@ -122,27 +286,15 @@ worker_check_jobs(worker_type* worker, task_type* task, int ntasks, long ntasksf
     return ODS_STATUS_OK;
 }
 
-static ods_status
-signdomain(struct worker_context* superior, hsm_ctx_t* ctx, recordset_type record)
+static void
+signdomainexpiry(recordset_type record)
 {
-    ods_status status;
-    names_iterator iter;
-    ldns_rr_type rrtype;
     time_t expiration = INT_MAX;
     time_t rrsigexpirationtime;
     ldns_rr* rrsig;
     struct signature_struct** rrsigs;
     ldns_rdf* rrsigexpiration;
 
-    for (iter=names_recordalltypes(record); names_iterate(&iter,&rrtype); names_advance(&iter,NULL)) {
-        if ((status = rrset_sign(superior->zone->signconf, superior->view, record, rrtype, ctx, superior->clock_in)) != ODS_STATUS_OK)
-            return status;
-    }
-    if(names_recordgetdenial(record)) {
-        if((status = rrset_sign(superior->zone->signconf, superior->view, record, LDNS_RR_TYPE_NSEC, ctx, superior->clock_in)) != ODS_STATUS_OK)
-            return status;
-    }
-
     names_recordlookupall(record, LDNS_RR_TYPE_RRSIG, NULL, NULL, &rrsigs);
     for(int i=0; rrsigs[i]; i++) {
         rrsig = rrsigs[i]->rr;
@@ -154,9 +306,78 @@ signdomain(struct worker_context* superior, hsm_ctx_t* ctx, recordset_type recor
     free(rrsigs);
     names_recordsetexpiry(record, expiration);
     logger_message(&names_logsigning,logger_noctx,logger_DEBUG,"signed %s expiration %ld\n",names_recordgetname(record),expiration);
+}
+
+static ods_status
+signdomainsubmit(struct worker_context* superior, hsm_ctx_t* ctx, recordset_type record, lhsm_batch_type* batch)
+{
+    ods_status status;
+    names_iterator iter;
+    ldns_rr_type rrtype;
+
+    for (iter=names_recordalltypes(record); names_iterate(&iter,&rrtype); names_advance(&iter,NULL)) {
+        if ((status = rrset_signbatch(superior->zone->signconf, superior->view, record, rrtype, ctx, superior->clock_in, superior->refreshtime, batch)) != ODS_STATUS_OK)
+            return status;
+    }
+    if(names_recordgetdenial(record)) {
+        if((status = rrset_signbatch(superior->zone->signconf, superior->view, record, LDNS_RR_TYPE_NSEC, ctx, superior->clock_in, superior->refreshtime, batch)) != ODS_STATUS_OK)
+            return status;
+    }
+    return ODS_STATUS_OK;
+}
+
+static ods_status
+signdomain(struct worker_context* superior, hsm_ctx_t* ctx, recordset_type record)
+{
+    ods_status status;
+    if ((status = signdomainsubmit(superior, ctx, record, NULL)) != ODS_STATUS_OK)
+        return status;
+    signdomainexpiry(record);
     return ODS_STATUS_OK;
 }
 
+/* records taken from the signq by a drudger, being signed together */
+struct drudgeitem {
+    recordset_type record;
+    struct worker_context* superior;
+    ods_status status;
+};
+
+/**
+ * Sign a number of records with their signatures made in the background,
+ * keeping as many operations in progress on the HSM.  The signatures are
+ * added to the records once all have completed.
+ *
+ */
+static void
+signdomains(hsm_ctx_t* ctx, lhsm_batch_type* batch, struct drudgeitem* items, int nitems)
+{
+    int i;
+    struct lhsm_signature* signature;
+    struct lhsm_signature* next;
+    struct drudgeitem* item;
+    for (i=0; i<nitems; i++) {
+        items[i].status = signdomainsubmit(items[i].superior, ctx, items[i].record, batch);
+    }
+    for (signature = lhsm_batch_wait(batch); signature; signature = next) {
+        next = signature->next;
+        for (item=items; item->record != signature->owner; item++)
+            ;
+        if (signature->rrsig) {
+            names_recordaddsignature(item->record, signature->rrtype, signature->rrsig, signature->locator, signature->flags);
+        } else {
+            free(signature->locator);
+            item->status = ODS_STATUS_HSM_ERR;
+        }
+        free(signature);
+    }
+    for (i=0; i<nitems; i++) {
+        if (items[i].status == ODS_STATUS_OK) {
+            signdomainexpiry(items[i].record);
+        }
+    }
+}
+
 void
 drudge(worker_type* worker)
 {
@@ -166,10 +387,20 @@ drudge(worker_type* worker)
     hsm_ctx_t* ctx = NULL;
     engine_type* engine;
     fifoq_type* signq = worker->taskq->signq;
+    lhsm_batch_type* batch = NULL;
+    struct drudgeitem* items = NULL;
+    int nitems, depth = 1;
+    struct timespec start, end;
+    unsigned long worked = 0;
+    unsigned long long workedusecs = 0;
 
     while (worker->need_to_exit == 0) {
         ods_log_deeebug("[%s] report for duty", worker->name);
         pthread_mutex_lock(&signq->q_lock);
+        worker->worked += worked;
+        worker->workedusecs += workedusecs;
+        worked = 0;
+        workedusecs = 0;
         if (worker->need_to_exit != 0) {
             pthread_mutex_unlock(&signq->q_lock);
             break;
@@ -188,13 +419,41 @@ drudge(worker_type* worker)
             if(worker->need_to_exit == 0)
                 record = (recordset_type) fifoq_pop(signq, (void**)&superior);
         }
+        nitems = 0;
+        if (record && depth > 1) {
+            /* take more work to keep the session pools busy */
+            items[nitems].record = record;
+            items[nitems++].superior = superior;
+            while (nitems < depth && (record = (recordset_type) fifoq_pop(signq, (void**)&superior)) != NULL) {
+                items[nitems].record = record;
+                items[nitems++].superior = superior;
+            }
+            record = NULL;
+        }
         pthread_mutex_unlock(&signq->q_lock);
         /* do some work */
-        if (record) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (nitems > 0) {
+            signdomains(ctx, batch, items, nitems);
+            worked += nitems;
+            for (int i=0; i<nitems; i++) {
+                fifoq_report(signq, items[i].superior, items[i].status);
+            }
+        } else if (record) {
             ods_log_assert(superior);
             if (!ctx) {
                 ods_log_debug("[%s] create hsm context", worker->name);
                 ctx = hsm_create_context();
+                if (ctx && hsm_sign_pool_size() > 0) {
+                    /* keep as many signatures in progress as there are pooled
+                     * sessions, spread over as many drudgers as may run */
+                    depth = (hsm_sign_pool_size() + superior->engine->config->num_signer_threads_max - 1) / superior->engine->config->num_signer_threads_max;
+                    if (depth > 1) {
+                        batch = lhsm_batch_create();
+                        CHECKALLOC(items = malloc(sizeof(struct drudgeitem) * depth));
+                        ods_log_debug("[%s] keeping up to %d records in progress", worker->name, depth);
+                    }
+                }
             }
             if (!ctx) {
                 engine = superior->engine;
@@ -207,12 +466,19 @@ drudge(worker_type* worker)
                 status = ODS_STATUS_HSM_ERR;
             } else {
                 status = signdomain(superior, ctx, record);
+                worked += 1;
             }
-            fifoq_report(signq, superior->worker, status);
+            fifoq_report(signq, superior, status);
         }
         /* done work */
+        if (worked) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            workedusecs += (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+        }
     }
     /* cleanup open HSM sessions */
+    lhsm_batch_cleanup(batch);
+    free(items);
     if (ctx) {
         hsm_destroy_context(ctx);
     }
@@ -235,6 +501,10 @@ do_readsignconf(task_type* task, const char* zonename, void* zonearg, void *cont
         /* status unchanged not really possible */
         schedule_unscheduletask(engine->taskq, TASK_READ, zone->name);
         schedule_scheduletask(engine->taskq, TASK_READ, zone->name, zone, &zone->zone_lock, schedule_PROMPTLY);
+        if (zone->nsec3rebuild) {
+            schedule_unscheduletask(engine->taskq, TASK_NSECIFY, zone->name);
+            schedule_scheduletask(engine->taskq, TASK_NSECIFY, zone->name, zone, &zone->zone_lock, schedule_PROMPTLY);
+        }
         zone->zoneconfigvalid = 1;
         return schedule_SUCCESS;
     } else {
@@ -271,43 +541,118 @@ do_forcereadsignconf(task_type* task, const char* zonename, void* zonearg, void
         schedule_unscheduletask(engine->taskq, TASK_SIGN, zone->name);
         schedule_unscheduletask(engine->taskq, TASK_WRITE, zone->name);
         schedule_scheduletask(engine->taskq, TASK_READ, zone->name, zone, &zone->zone_lock, schedule_PROMPTLY);
+        if (zone->nsec3rebuild) {
+            schedule_unscheduletask(engine->taskq, TASK_NSECIFY, zone->name);
+            schedule_scheduletask(engine->taskq, TASK_NSECIFY, zone->name, zone, &zone->zone_lock, schedule_PROMPTLY);
+        }
         return schedule_SUCCESS;
     } else {
         return schedule_SUCCESS;
     }
 }
 
+/**
+ * Perform a step of building the NSEC3 chain for changed NSEC3 parameters.
+ * Once complete, the next sign pass switches over to the new chain.
+ *
+ */
+time_t
+do_nsec3rebuild(task_type* task, const char* zonename, void* zonearg, void *contextarg)
+{
+    struct worker_context* context = contextarg;
+    engine_type* engine = context->engine;
+    zone_type* zone = zonearg;
+    if (!zone->nsec3rebuild) {
+        return schedule_SUCCESS;
+    }
+    if (nsec3rebuild_step(zone)) {
+        return time_now() + NSEC3REBUILD_INTERVAL;
+    }
+    ods_log_info("[%s] NSEC3 chain for zone %s complete, switching over on next sign", context->worker->name, task->owner);
+    schedule_unscheduletask(engine->taskq, TASK_SIGN, zone->name);
+    schedule_scheduletask(engine->taskq, TASK_SIGN, zone->name, zone, &zone->zone_lock, schedule_PROMPTLY);
+    return schedule_SUCCESS;
+}
+
 void
-processoccluded(names_view_type view)
+processoccluded(names_view_type view, int nshards, struct stats_shards* timings)
 {
     struct dual change;
     names_iterator iter;
+    domain_updatestatus(view, nshards, timings);
     /* for any occluded domain names, clear the annotation, since we should not be genereating NSECs for them */
     for (iter=names_viewiterator(view,names_iteratordenialchainupdates); names_iterate(&iter,&change); names_advance(&iter,NULL)) {
-        if(domain_is_occluded(view, change.src) != LDNS_RR_TYPE_SOA) {
-            recordset_type record = change.src;
+        recordset_type record = change.src;
+        /* the status may just have been stored on a revision of this view */
+        names_updated(view, &record);
+        if(domain_is_occluded(view, record) != LDNS_RR_TYPE_SOA) {
             names_update(view, &record);
             names_recordannotate(record, NULL);
         }
     }
 }
 
+struct neighbour {
+    recordset_type record;
+    const char* next;
+    ldns_rr* nsec;
+};
+
+struct neighbours {
+    names_view_type view;
+    signconf_type* signconf;
+    struct neighbour* items;
+};
+
 static void
-processneighbours(names_view_type view, signconf_type* signconf, int newserial)
+neighbourshard(void* arg, long begin, long end)
+{
+    struct neighbours* neighbours = arg;
+    struct neighbour* item;
+    struct denial_struct* denial;
+    CHECKALLOC(denial = malloc(sizeof(struct denial_struct)));
+    for (long i=begin; i<end; i++) {
+        item = &neighbours->items[i];
+        item->nsec = NULL;
+        if (denial_nsecify(neighbours->signconf, neighbours->view, item->record, item->next, denial))
+            continue;
+        if (names_recordcmpdenial(item->record, denial->rrtype, denial->rdata, denial->rdatalen))
+            item->nsec = denial_rr(denial);
+    }
+    free(denial);
+}
+
+/**
+ * Each change in the denial chain carries the name following it, so the
+ * last name of a shard links to the first name of the next shard without
+ * the shards having to look at each other.  The NSEC(3) records are built
+ * in the shards, amending the view is done afterwards in chain order.
+ */
+static void
+processneighbours(names_view_type view, signconf_type* signconf, int newserial, int nshards, struct stats_shards* timings)
 {
     struct dual change;
     names_iterator iter;
-    const char* nextnamestr;
-    ldns_rdf* nextnamerdf;
+    struct neighbours neighbours;
+    long nitems = 0;
+    long i;
+    neighbours.view = view;
+    neighbours.signconf = signconf;
+    neighbours.items = NULL;
     for (iter=names_viewiterator(view,names_iteratordenialchainupdates); names_iterate(&iter,&change); names_advance(&iter,NULL)) {
+        if(nitems % 1024 == 0)
+            CHECKALLOC(neighbours.items = realloc(neighbours.items, sizeof(struct neighbour) * (nitems + 1024)));
+        neighbours.items[nitems].record = change.src;
         if(signconf->nsec3params)
-            nextnamestr = names_recordgetdenial(change.dst);
+            neighbours.items[nitems].next = names_recordgetdenial(change.dst);
         else
-            nextnamestr = names_recordgetname(change.dst);
-        nextnamerdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, nextnamestr);
-        ldns_rr* nsec = denial_nsecify(signconf, view, change.src, nextnamerdf);
-        if (names_recordcmpdenial(change.src, nsec)) {
-            recordset_type record = change.src;
+            neighbours.items[nitems].next = names_recordgetname(change.dst);
+        ++nitems;
+    }
+    shard_run(nshards, nitems, SHARD_MINITEMS, neighbourshard, &neighbours, timings);
+    for (i=0; i<nitems; i++) {
+        if (neighbours.items[i].nsec) {
+            recordset_type record = neighbours.items[i].record;
             if(names_recordhasexpiry(record)) {
                 names_amend(view, record);
                 names_recordsetvalidupto(record, newserial);
@@ -316,47 +661,88 @@ processneighbours(names_view_type view, signconf_type* signconf, int newserial)
             } else {
                 names_amend(view, record);
             }
-            names_recordsetdenial(record, nsec);
+            names_recordsetdenial(record, neighbours.items[i].nsec);
         }
-        ldns_rdf_deep_free(nextnamerdf);
     }
+    free(neighbours.items);
 }
 
+#define PREPARE_AMENDDST 0x1
+#define PREPARE_AMENDSRC 0x2
+#define PREPARE_REMOVESRC 0x4
+
+struct prepare {
+    struct dual change;
+    int actions;
+};
+
+struct prepares {
+    int newserial;
+    struct prepare* items;
+};
+
+/* The purpose of this pass is to go over all new or modified records and fix the SOA serial number from
+ * which these records are valid.  If the records is a modified record, the records that it superceeds, will be
+ * marked with the same serial indicating that it is no longer valid from this moment on.
+ */
 static void
-preparesign(names_view_type prepareview, int newserial)
+prepareshard(void* arg, long begin, long end)
 {
-    int conflict;
-    struct dual change;
-    names_iterator iter;
-    /* The purpose of the next iteration is to go over all new or modified records and fix the SOA serial number from
-     * which these records are valid.  If the records is a modified record, the records that it superceeds, will be
-     * marked with the same serial indicating that it is no longer valid from this moment on.
-     */
-    for (iter=names_viewiterator(prepareview,names_iteratorincoming); names_iterate(&iter,&change); names_advance(&iter,NULL)) {
-        assert(change.dst != change.src);
-        if(names_recordhasexpiry(change.src)) {
-            if(change.dst) {
-                names_amend(prepareview, change.dst);
-                names_recordsetvalidupto(change.dst, newserial);
+    struct prepares* prepares = arg;
+    struct prepare* item;
+    for (long i=begin; i<end; i++) {
+        item = &prepares->items[i];
+        item->actions = 0;
+        if(names_recordhasexpiry(item->change.src)) {
+            if(item->change.dst) {
+                names_recordsetvalidupto(item->change.dst, prepares->newserial);
+                item->actions |= PREPARE_AMENDDST;
             }
-            names_amend(prepareview, change.src);
-            names_recordsetvalidfrom(change.src, newserial);
+            names_recordsetvalidfrom(item->change.src, prepares->newserial);
+            item->actions |= PREPARE_AMENDSRC;
         }
-    }
-    for (iter=names_viewiterator(prepareview,names_iteratorincoming); names_iterate(&iter,&change); names_advance(&iter,NULL)) {
-        if(change.dst && !names_recordvalidupto(change.dst,NULL)) {
-            names_amend(prepareview, change.dst);
-            names_recordsetvalidupto(change.dst, newserial);
+        if(item->change.dst && !names_recordvalidupto(item->change.dst,NULL)) {
+            names_recordsetvalidupto(item->change.dst, prepares->newserial);
+            item->actions |= PREPARE_AMENDDST;
         }
-        if(!names_recordvalidfrom(change.src,NULL)) {
-            if(names_recordhasdata(change.src, 0, NULL, 0)) {
-                names_amend(prepareview, change.src);
-                names_recordsetvalidfrom(change.src, newserial);
+        if(!names_recordvalidfrom(item->change.src,NULL)) {
+            if(names_recordhasdata(item->change.src, 0, NULL, 0)) {
+                names_recordsetvalidfrom(item->change.src, prepares->newserial);
+                item->actions |= PREPARE_AMENDSRC;
             } else {
-                names_remove(prepareview, change.src); // FIXME what if multiple are overwritten?
+                item->actions |= PREPARE_REMOVESRC;
             }
         }
     }
+}
+
+static void
+preparesign(names_view_type prepareview, int newserial, int nshards, struct stats_shards* timings)
+{
+    int conflict;
+    struct dual change;
+    names_iterator iter;
+    struct prepares prepares;
+    long nitems = 0;
+    long i;
+    prepares.newserial = newserial;
+    prepares.items = NULL;
+    for (iter=names_viewiterator(prepareview,names_iteratorincoming); names_iterate(&iter,&change); names_advance(&iter,NULL)) {
+        assert(change.dst != change.src);
+        if(nitems % 1024 == 0)
+            CHECKALLOC(prepares.items = realloc(prepares.items, sizeof(struct prepare) * (nitems + 1024)));
+        prepares.items[nitems++].change = change;
+    }
+    shard_run(nshards, nitems, SHARD_MINITEMS, prepareshard, &prepares, timings);
+    for (i=0; i<nitems; i++) {
+        if(prepares.items[i].actions & PREPARE_AMENDDST)
+            names_amend(prepareview, prepares.items[i].change.dst);
+        if(prepares.items[i].actions & PREPARE_AMENDSRC)
+            names_amend(prepareview, prepares.items[i].change.src);
+        else if(prepares.items[i].actions & PREPARE_REMOVESRC)
+            names_remove(prepareview, prepares.items[i].change.src); // FIXME what if multiple are overwritten?
+    }
+    free(prepares.items);
     conflict = names_viewcommit(prepareview);
     assert(!conflict);
 }
@@ -379,6 +765,9 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
     struct dual change;
     names_iterator iter;
     time_t returnscheduletime = schedule_SUCCESS;
+    struct stats_shards prepareshards = { 0 };
+    struct stats_shards occlusionshards = { 0 };
+    struct stats_shards neighbourshards = { 0 };
 
     context->clock_in = time_now();
     context->zone = zone;
@@ -390,7 +779,7 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
     { names_view_type prepareview;
     prepareview = zonelist_obtainresource(NULL, zone, NULL, offsetof(zone_type, prepareview));
     names_viewreset(prepareview);
-    preparesign(prepareview, newserial);
+    preparesign(prepareview, newserial, engine->config->num_signer_threads_max, &prepareshards);
      
 
     status = zone_update_serial(zone, prepareview);
@@ -409,7 +798,10 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
     { names_view_type neighview;
     neighview = zonelist_obtainresource(NULL, zone, NULL, offsetof(zone_type, neighview));
     names_viewreset(neighview);
-    processoccluded(neighview);
+    processoccluded(neighview, engine->config->num_signer_threads_max, &occlusionshards);
+    if (nsec3rebuild_ready(zone)) {
+        nsec3rebuild_switchover(zone, neighview, newserial);
+    }
     conflict = names_viewcommit(neighview);
     assert(!conflict);
     zonelist_releaseresource(NULL, zone, NULL, offsetof(zone_type, neighview), neighview);
@@ -419,7 +811,7 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
     signview = zonelist_obtainresource(NULL, zone, NULL, offsetof(zone_type, signview));
     context->view = signview;
     names_viewreset(signview);
-    processneighbours(signview, zone->signconf, newserial);
+    processneighbours(signview, zone->signconf, newserial, engine->config->num_signer_threads_max, &neighbourshards);
     conflict = names_viewcommit(signview);
     assert(!conflict);
 
@@ -434,9 +826,13 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
         zone->stats->sig_soa_count = 0;
         zone->stats->sig_reuse = 0;
         zone->stats->sig_time = 0;
+        zone->stats->prepare_shards = prepareshards;
+        zone->stats->occlusion_shards = occlusionshards;
+        zone->stats->neighbour_shards = neighbourshards;
         pthread_mutex_unlock(&zone->stats->stats_lock);
     }
-    /* check the HSM connection before queuing sign operations */
+    /* check the HSM connection before queuing sign operations, failing
+     * repositories are taken out of rotation, only reload when none remain */
     if (hsm_check_context()) {
         ods_log_error("signer instructed to reload due to hsm reset in sign task");
         engine->need_to_reload = 1;
@@ -457,14 +853,13 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
             ods_log_deeebug("[%s] wait until drudgers are finished "
                     "signing zone %s", worker->name, task->owner);
             /* sleep until work is done */
-            fifoq_waitfor(context->signq, worker, nsubtasks, &nsubtasksfailed);
+            fifoq_waitfor(context->signq, context, &nsubtasksfailed);
         } else {
             names_iterator iter;
             hsm_ctx_t* ctx;
             recordset_type record;
-            time_t refreshtime = context->clock_in + duration2time(zone->signconf->sig_refresh_interval);
             ctx = hsm_create_context();
-            for(iter=names_viewiterator(signview,names_iteratorexpiring,refreshtime); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+            for(iter=worker_select_zone(context, signview); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
                 names_amend(signview, record);
                 signdomain(context, ctx, record);
             }
@@ -502,6 +897,14 @@ do_signzone(task_type* task, const char* zonename, void* zonearg, void *contexta
     if(status) {
         logger_message(&logger_cls,logger_noctx,logger_ERROR,"Failed to commit sign");
     }
+    /* keep track of the signature in the zone that expires first */
+    iter = names_viewiterator(signview, names_iteratorfirstexpiring);
+    if (names_iterate(&iter, &record)) {
+        zone->nextexpiry = names_recordgetexpiry(record);
+        names_end(&iter);
+    } else {
+        zone->nextexpiry = 0;
+    }
     zonelist_releaseresource(NULL, zone, NULL, offsetof(zone_type, signview), signview);
 
     if(returnscheduletime == schedule_SUCCESS) {
@@ -602,23 +1005,18 @@ void
 do_outputzonefile(zone_type* zone)
 {
     names_view_type outputview;
-    char* filename;
     char* tmpname;
 
     /* Write the zone as it currently stands */
     outputview = zonelist_obtainresource(NULL, zone, NULL, offsetof(zone_type,outputview));
     names_viewreset(outputview);
     tmpname = ods_build_path(zone->adoutbound->configstr, ".tmp", 0, 0);
-    if(writezone(outputview, tmpname)) {
-        if (zone->adoutbound->error) {
-            ods_log_error("unable to write zone %s file %s", zone->name, filename);
-            zone->adoutbound->error = 0;
-            // status = ODS_STATUS_FWRITE_ERR;
-        }
+    if(writezone(outputview, tmpname) != ODS_STATUS_OK) {
+        ods_log_error("unable to write zone %s file %s", zone->name, tmpname);
+        zone->adoutbound->error = 0;
     } else {
         if (rename((const char*) tmpname, zone->adoutbound->configstr) != 0) {
-            ods_log_error("unable to write file: failed to rename %s to %s (%s)", tmpname, filename, strerror(errno));
-            // status = ODS_STATUS_RENAME_ERR;
+            ods_log_error("unable to write file: failed to rename %s to %s (%s)", tmpname, zone->adoutbound->configstr, strerror(errno));
         }
     }
     free(tmpname);
@@ -652,20 +1050,15 @@ do_purgezone(zone_type* zone)
 void
 do_outputstatefile(zone_type* zone)
 {
-    /* Refresh the current state journal file */
-    struct stat statbuf;
+    /* Checkpoint the current state journal file */
     names_view_type baseview;
     char* filename;
 
     baseview = zone->baseview;
     names_viewreset(baseview);
     filename = ods_build_path(zone->name, ".state", 0, 1);
-    if(fstatat(AT_FDCWD, filename, &statbuf, 0)) {
-        if(errno == ENOENT) {
-            names_viewpersist(baseview, AT_FDCWD, filename);
-        } else {
-            ods_log_error("unable to create state file for zone %s", zone->name);
-        }
+    if(names_viewcheckpoint(baseview, AT_FDCWD, filename)) {
+        ods_log_error("unable to checkpoint state file for zone %s", zone->name);
     }
     free(filename);
 }
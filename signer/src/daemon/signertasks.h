@@ -40,6 +40,7 @@ struct worker_context {
     worker_type* worker;
     fifoq_type* signq;
     time_t clock_in;
+    time_t refreshtime;
     zone_type* zone;
     names_view_type view;
 };
@@ -48,6 +49,7 @@ extern void drudge(worker_type* worker);
 
 extern time_t do_readsignconf(task_type* task, const char* zonename, void* zonearg, void *contextarg);
 extern time_t do_forcereadsignconf(task_type* task, const char* zonename, void* zonearg, void *contextarg);
+extern time_t do_nsec3rebuild(task_type* task, const char* zonename, void* zonearg, void *contextarg);
 extern time_t do_signzone(task_type* task, const char* zonename, void* zonearg, void *contextarg);
 extern time_t do_readzone(task_type* task, const char* zonename, void* zonearg, void *contextarg);
 extern time_t do_forcereadzone(task_type* task, const char* zonename, void* zonearg, void *contextarg);
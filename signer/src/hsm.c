@@ -29,6 +29,8 @@
  *
  */
 
+#include <pthread.h>
+
 #include "daemon/engine.h"
 #include "hsm.h"
 #include "log.h"
@@ -131,18 +133,19 @@ llibhsm_key_start:
 
 
 /**
- * Get RRSIG from one of the HSMs, given a RRset and a key.
+ * Get RRSIG from one of the HSMs, given a RRset in canonical wire form
+ * and a key.
  *
  */
 ldns_rr*
-lhsm_sign(hsm_ctx_t* ctx, ldns_rr_list* rrset, key_type* key_id,
-    time_t inception, time_t expiration)
+lhsm_sign(hsm_ctx_t* ctx, ldns_rr* rr, const uint8_t* wire, size_t wiresize,
+    key_type* key_id, time_t inception, time_t expiration)
 {
     char* error = NULL;
     ldns_rr* result = NULL;
     hsm_sign_params_t* params = NULL;
 
-    if (!key_id || !rrset || !inception || !expiration) {
+    if (!key_id || !rr || !wire || !inception || !expiration) {
         ods_log_error("[%s] unable to sign: missing required elements",
             hsm_str);
         return NULL;
@@ -157,7 +160,8 @@ lhsm_sign(hsm_ctx_t* ctx, ldns_rr_list* rrset, key_type* key_id,
     params->inception = inception;
     params->expiration = expiration;
     params->keytag = key_id->params->keytag;
-    result = hsm_sign_rrset(ctx, rrset, keylookup(ctx, key_id->locator), params);
+    result = hsm_sign_rrset_wire(ctx, rr, wire, wiresize,
+        keylookup(ctx, key_id->locator), params);
     hsm_sign_params_free(params);
     if (!result) {
         error = hsm_get_error(ctx);
@@ -169,3 +173,140 @@ lhsm_sign(hsm_ctx_t* ctx, ldns_rr_list* rrset, key_type* key_id,
     }
     return result;
 }
+
+
+struct lhsm_batch_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    long outstanding;
+    struct lhsm_signature* completed;
+};
+
+/**
+ * Create a batch of signatures made in the background.
+ *
+ */
+lhsm_batch_type*
+lhsm_batch_create(void)
+{
+    lhsm_batch_type* batch;
+    CHECKALLOC(batch = malloc(sizeof(lhsm_batch_type)));
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->done, NULL);
+    batch->outstanding = 0;
+    batch->completed = NULL;
+    return batch;
+}
+
+/**
+ * Clean up a batch, which should have no outstanding signatures.
+ *
+ */
+void
+lhsm_batch_cleanup(lhsm_batch_type* batch)
+{
+    if (!batch) {
+        return;
+    }
+    pthread_cond_destroy(&batch->done);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+}
+
+static void
+lhsm_signcomplete(void* arg, ldns_rr* rrsig, const char* error)
+{
+    struct lhsm_signature* signature = arg;
+    lhsm_batch_type* batch = signature->batch;
+    if (!rrsig) {
+        ods_log_error("[%s] %s", hsm_str, (error ? error : "unknown error"));
+        ods_log_crit("[%s] error signing rrset with libhsm", hsm_str);
+    }
+    signature->rrsig = rrsig;
+    pthread_mutex_lock(&batch->lock);
+    signature->next = batch->completed;
+    batch->completed = signature;
+    batch->outstanding -= 1;
+    if (batch->outstanding == 0) {
+        pthread_cond_signal(&batch->done);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Submit an RRset for signing in the background.  The RRSIG is made
+ * available through lhsm_batch_wait(), tagged with owner and rrtype.
+ *
+ */
+ods_status
+lhsm_signsubmit(hsm_ctx_t* ctx, lhsm_batch_type* batch, ldns_rr* rr,
+    const uint8_t* wire, size_t wiresize, key_type* key_id,
+    time_t inception, time_t expiration, void* owner, ldns_rr_type rrtype)
+{
+    char* error = NULL;
+    hsm_sign_params_t* params = NULL;
+    struct lhsm_signature* signature;
+    int result;
+
+    if (!key_id || !rr || !wire || !inception || !expiration) {
+        ods_log_error("[%s] unable to sign: missing required elements",
+            hsm_str);
+        return ODS_STATUS_ASSERT_ERR;
+    }
+    ods_log_assert(key_id->dnskey);
+    ods_log_assert(key_id->params);
+    CHECKALLOC(signature = malloc(sizeof(struct lhsm_signature)));
+    signature->batch = batch;
+    signature->owner = owner;
+    signature->rrtype = rrtype;
+    signature->locator = strdup(key_id->locator);
+    signature->flags = key_id->flags;
+    signature->rrsig = NULL;
+    /* adjust parameters */
+    params = hsm_sign_params_new();
+    params->owner = ldns_rdf_clone(key_id->params->owner);
+    params->algorithm = key_id->algorithm;
+    params->flags = key_id->flags;
+    params->inception = inception;
+    params->expiration = expiration;
+    params->keytag = key_id->params->keytag;
+    pthread_mutex_lock(&batch->lock);
+    batch->outstanding += 1;
+    pthread_mutex_unlock(&batch->lock);
+    result = hsm_sign_rrset_wire_submit(ctx, rr, wire, wiresize,
+        keylookup(ctx, key_id->locator), params, lhsm_signcomplete, signature);
+    hsm_sign_params_free(params);
+    if (result != HSM_OK) {
+        pthread_mutex_lock(&batch->lock);
+        batch->outstanding -= 1;
+        pthread_mutex_unlock(&batch->lock);
+        free(signature->locator);
+        free(signature);
+        error = hsm_get_error(ctx);
+        if (error) {
+            ods_log_error("[%s] %s", hsm_str, error);
+            free((void*)error);
+        }
+        ods_log_crit("[%s] error signing rrset with libhsm", hsm_str);
+        return ODS_STATUS_HSM_ERR;
+    }
+    return ODS_STATUS_OK;
+}
+
+/**
+ * Wait for all signatures submitted to the batch, and take them.
+ *
+ */
+struct lhsm_signature*
+lhsm_batch_wait(lhsm_batch_type* batch)
+{
+    struct lhsm_signature* completed;
+    pthread_mutex_lock(&batch->lock);
+    while (batch->outstanding > 0) {
+        pthread_cond_wait(&batch->done, &batch->lock);
+    }
+    completed = batch->completed;
+    batch->completed = NULL;
+    pthread_mutex_unlock(&batch->lock);
+    return completed;
+}
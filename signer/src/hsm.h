@@ -56,7 +56,9 @@ extern ods_status lhsm_get_key(hsm_ctx_t* ctx, ldns_rdf* owner, key_type* key_id
 /**
  * Get RRSIG from one of the HSMs, given a RRset and a key.
  * \param[in] ctx HSM context
- * \param[in] rrset RRset to be signed
+ * \param[in] rr record of the RRset to be signed
+ * \param[in] wire canonical wire encoding of the RRset to be signed
+ * \param[in] wiresize size of the encoding
  * \param[in] key_id key credentials
  * \param[in] owner owner of the keys
  * \param[in] inception signature inception
@@ -64,7 +66,68 @@ extern ods_status lhsm_get_key(hsm_ctx_t* ctx, ldns_rdf* owner, key_type* key_id
  * \return ldns_rr* RRSIG record
  *
  */
-extern ldns_rr* lhsm_sign(hsm_ctx_t* ctx, ldns_rr_list* rrset, key_type* key_id,
-    time_t inception, time_t expiration);
+extern ldns_rr* lhsm_sign(hsm_ctx_t* ctx, ldns_rr* rr, const uint8_t* wire,
+    size_t wiresize, key_type* key_id, time_t inception, time_t expiration);
+
+typedef struct lhsm_batch_struct lhsm_batch_type;
+
+/**
+ * Signature made in the background, as returned by lhsm_batch_wait().
+ * The rrsig is NULL if signing failed.
+ *
+ */
+struct lhsm_signature {
+    struct lhsm_signature* next;
+    lhsm_batch_type* batch;
+    void* owner;
+    ldns_rr_type rrtype;
+    char* locator;
+    uint32_t flags;
+    ldns_rr* rrsig;
+};
+
+/**
+ * Create a batch of signatures made in the background.
+ * \return lhsm_batch_type* batch
+ *
+ */
+extern lhsm_batch_type* lhsm_batch_create(void);
+
+/**
+ * Clean up a batch without outstanding signatures.
+ * \param[in] batch batch
+ *
+ */
+extern void lhsm_batch_cleanup(lhsm_batch_type* batch);
+
+/**
+ * Submit an RRset for signing in the background, using the session pool
+ * of the repository of the key if it has one.
+ * \param[in] ctx HSM context
+ * \param[in] batch batch to collect the signature in
+ * \param[in] rr record of the RRset to be signed
+ * \param[in] wire canonical wire encoding of the RRset, not needed after
+ *            return
+ * \param[in] wiresize size of the encoding
+ * \param[in] key_id key credentials
+ * \param[in] inception signature inception
+ * \param[in] expiration signature expiration
+ * \param[in] owner tag for the signature, not interpreted
+ * \param[in] rrtype type covered, not interpreted
+ * \return ods_status status
+ *
+ */
+extern ods_status lhsm_signsubmit(hsm_ctx_t* ctx, lhsm_batch_type* batch,
+    ldns_rr* rr, const uint8_t* wire, size_t wiresize, key_type* key_id,
+    time_t inception, time_t expiration, void* owner, ldns_rr_type rrtype);
+
+/**
+ * Wait for all signatures submitted to a batch.
+ * \param[in] batch batch
+ * \return struct lhsm_signature* list of the completed signatures, to be
+ *         freed by the caller
+ *
+ */
+extern struct lhsm_signature* lhsm_batch_wait(lhsm_batch_type* batch);
 
 #endif /* SHARED_HSM_H */
@@ -109,10 +109,52 @@ keylist_push(keylist_type* kl, const char* locator, const char* resourcerecord,
     kl->keys[kl->count -1].zsk = zsk;
     kl->keys[kl->count -1].dnskey = NULL;
     kl->keys[kl->count -1].params = NULL;
+    kl->keys[kl->count -1].rollover = 0;
+    kl->keys[kl->count -1].rolloverend = 0;
     return &kl->keys[kl->count -1];
 }
 
 
+/**
+ * Mark the keys that take over signing from a retiring key.
+ *
+ */
+void
+keylist_rollover(keylist_type* kl, keylist_type* prev, time_t now)
+{
+    uint16_t i = 0;
+    uint16_t j = 0;
+    key_type* key;
+    key_type* old;
+    if (!kl) {
+        return;
+    }
+    for (i=0; i < kl->count; i++) {
+        key = &kl->keys[i];
+        key->rollover = 0;
+        key->rolloverend = 0;
+        if (!key->publish || (!key->ksk && !key->zsk)) {
+            continue;
+        }
+        for (j=0; j < kl->count; j++) {
+            if (j != i && kl->keys[j].publish &&
+                kl->keys[j].algorithm == key->algorithm &&
+                ((key->ksk && !kl->keys[j].ksk && kl->keys[j].flags == key->flags) ||
+                 (key->zsk && !kl->keys[j].zsk && !kl->keys[j].ksk))) {
+                break;
+            }
+        }
+        if (j == kl->count) {
+            continue;
+        }
+        old = keylist_lookup_by_locator(prev, key->locator);
+        key->rollover = (old && old->rollover ? old->rollover : now);
+        ods_log_verbose("[%s] key %s takes over from a retiring key since "
+            "%ld", key_str, key->locator, (long)key->rollover);
+    }
+}
+
+
 /**
  * Log key.
  *
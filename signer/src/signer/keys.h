@@ -57,6 +57,8 @@ struct key_struct {
     int publish;
     int ksk;
     int zsk;
+    time_t rollover; /* since when taking over from a retiring key, or 0 */
+    time_t rolloverend; /* when all RRsets are to be taken over, or 0 */
 };
 
 /**
@@ -101,6 +103,18 @@ extern key_type* keylist_lookup_by_locator(keylist_type* kl, const char* locator
 extern key_type* keylist_push(keylist_type* kl, const char* locator, const char* resourcerecord,
     uint8_t algorithm, uint32_t flags, int publish, int ksk, int zsk);
 
+/**
+ * Mark the keys that take over signing from a retiring key.  A key does
+ * so when it is active and published while a key in the same role and
+ * of the same algorithm is published but no longer active.  The start
+ * of a rollover is carried over from the previous key list.
+ * \param[in] kl new key list
+ * \param[in] prev previous key list, may be NULL
+ * \param[in] now current time
+ *
+ */
+extern void keylist_rollover(keylist_type* kl, keylist_type* prev, time_t now);
+
 /**
  * Log key list.
  * \param[in] kl key list to print
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2009-2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Passes over a zone split in shards.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "status.h"
+#include "locks.h"
+#include "signer/shard.h"
+
+/* A range of items applied on its own thread, with the time it took */
+struct shard {
+    void (*func)(void* arg, long begin, long end);
+    void* arg;
+    long begin;
+    long end;
+    uint32_t msecs;
+    janitor_thread_t thread;
+    int threaded;
+};
+
+static void
+shard_work(void* arg)
+{
+    struct shard* shard = arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    shard->func(shard->arg, shard->begin, shard->end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    shard->msecs = (uint32_t) ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+/**
+ * Apply func to nitems split in up to nshards contiguous ranges of at
+ * least minitems, each but the first on its own worker thread and the
+ * calling thread taking over when no thread can be started.  The items
+ * must be independent of each other, the time taken by each shard is
+ * added to the timings if given.
+ *
+ */
+int
+shard_run(int nshards, long nitems, long minitems, void (*func)(void* arg, long begin, long end), void* arg, struct stats_shards* timings)
+{
+    struct shard* shards;
+    int i;
+    if (nshards > STATS_MAX_SHARDS)
+        nshards = STATS_MAX_SHARDS;
+    if (minitems > 0 && nshards > nitems / minitems)
+        nshards = nitems / minitems;
+    if (nshards < 1)
+        nshards = 1;
+    CHECKALLOC(shards = malloc(sizeof(struct shard) * nshards));
+    for (i=0; i<nshards; i++) {
+        shards[i].func = func;
+        shards[i].arg = arg;
+        shards[i].begin = nitems * i / nshards;
+        shards[i].end = nitems * (i + 1) / nshards;
+        shards[i].threaded = 0;
+    }
+    for (i=1; i<nshards; i++) {
+        if (janitor_thread_create(&shards[i].thread, workerthreadclass, shard_work, &shards[i])) {
+            shard_work(&shards[i]);
+        } else {
+            janitor_thread_start(shards[i].thread);
+            shards[i].threaded = 1;
+        }
+    }
+    shard_work(&shards[0]);
+    for (i=1; i<nshards; i++) {
+        if (shards[i].threaded)
+            janitor_thread_join(shards[i].thread);
+    }
+    if (timings) {
+        /* a pass may take several calls, which need not use as many
+         * shards, the times are added up per shard */
+        if (timings->count < (uint32_t) nshards)
+            timings->count = nshards;
+        if (timings->items < (uint32_t) nitems)
+            timings->items = nitems;
+        for (i=0; i<nshards; i++)
+            timings->msecs[i] += shards[i].msecs;
+    }
+    free(shards);
+    return nshards;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2009-2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Passes over a zone split in shards.
+ *
+ */
+
+#ifndef SIGNER_SHARD_H
+#define SIGNER_SHARD_H
+
+#include "config.h"
+#include "signer/stats.h"
+
+/* Ranges below this many items are not worth a thread of their own */
+#define SHARD_MINITEMS 1024
+
+/**
+ * Apply func to nitems split in up to nshards contiguous ranges.
+ * \param[in] nshards maximum number of shards
+ * \param[in] nitems number of items
+ * \param[in] minitems minimum number of items in a shard
+ * \param[in] func function applied to the items begin up to end
+ * \param[in] arg argument passed to func
+ * \param[in] timings timings of the pass, added to if given
+ * \return int number of shards used
+ *
+ */
+extern int shard_run(int nshards, long nitems, long minitems,
+    void (*func)(void* arg, long begin, long end), void* arg,
+    struct stats_shards* timings);
+
+#endif /* SIGNER_SHARD_H */
@@ -63,11 +63,47 @@ stats_clear(stats_type* stats)
     stats->sig_soa_count = 0;
     stats->sig_reuse = 0;
     stats->sig_time = 0;
+    stats->resign_budget = 0;
+    stats->resign_urgent = 0;
+    stats->resign_due = 0;
+    stats->resign_early = 0;
+    stats->resign_deferred = 0;
+    stats->rollover_total = 0;
+    stats->rollover_signed = 0;
+    stats->rollover_takeover = 0;
+    stats->prepare_shards.count = 0;
+    stats->occlusion_shards.count = 0;
+    stats->neighbour_shards.count = 0;
     stats->start_time = 0;
     stats->end_time = 0;
 }
 
 
+/**
+ * Log the timings of a pass split in shards.
+ *
+ */
+static void
+stats_log_shards(struct stats_shards* shards, const char* pass,
+    const char* name, uint32_t serial)
+{
+    char buf[STATS_MAX_SHARDS * 12];
+    size_t len = 0;
+    uint32_t i;
+    if (shards->count <= 1) {
+        return;
+    }
+    buf[0] = '\0';
+    for (i=0; i < shards->count && i < STATS_MAX_SHARDS; i++) {
+        len += snprintf(&buf[len], sizeof(buf) - len, "%s%u",
+            (i ? "," : ""), shards->msecs[i]);
+    }
+    ods_log_info("[STATS] %s %u %s[shards=%u items=%u time=%s(msec)]",
+        name?name:"(null)", (unsigned) serial, pass, shards->count,
+        shards->items, buf);
+}
+
+
 /**
  * Log statistics.
  *
@@ -95,6 +131,22 @@ stats_log(stats_type* stats, const char* name, uint32_t serial,
         (unsigned long)stats->nsec_time, stats->sig_count, stats->sig_reuse,
         (unsigned long)stats->sig_time, avsign,
         (uint32_t) (stats->end_time - stats->start_time));
+    if (stats->resign_budget) {
+        ods_log_info("[STATS] %s %u RESIGN[budget=%u urgent=%u due=%u "
+            "early=%u deferred=%u]", name?name:"(null)", (unsigned) serial,
+            stats->resign_budget, stats->resign_urgent, stats->resign_due,
+            stats->resign_early, stats->resign_deferred);
+    }
+    if (stats->rollover_total) {
+        ods_log_info("[STATS] %s %u ROLLOVER[signed=%u/%u (%u%%) "
+            "takeover=%u]", name?name:"(null)", (unsigned) serial,
+            stats->rollover_signed, stats->rollover_total,
+            (unsigned) (100.0 * stats->rollover_signed / stats->rollover_total),
+            stats->rollover_takeover);
+    }
+    stats_log_shards(&stats->prepare_shards, "PREPARE", name, serial);
+    stats_log_shards(&stats->occlusion_shards, "OCCLUSION", name, serial);
+    stats_log_shards(&stats->neighbour_shards, "NEIGHBOURS", name, serial);
 }
 
 
@@ -44,6 +44,17 @@ typedef struct stats_struct stats_type;
 
 #include "locks.h"
 
+#define STATS_MAX_SHARDS 16
+
+/**
+ * Timings of a pass over a zone split in shards.
+ */
+struct stats_shards {
+    uint32_t    count;
+    uint32_t    items;
+    uint32_t    msecs[STATS_MAX_SHARDS];
+};
+
 /**
  * Statistics structure.
  */
@@ -57,6 +68,17 @@ struct stats_struct {
     uint32_t    sig_soa_count;
     uint32_t    sig_reuse;
     time_t      sig_time;
+    uint32_t    resign_budget;
+    uint32_t    resign_urgent;
+    uint32_t    resign_due;
+    uint32_t    resign_early;
+    uint32_t    resign_deferred;
+    uint32_t    rollover_total;
+    uint32_t    rollover_signed;
+    uint32_t    rollover_takeover;
+    struct stats_shards prepare_shards;
+    struct stats_shards occlusion_shards;
+    struct stats_shards neighbour_shards;
     time_t      start_time;
     time_t      end_time;
     pthread_mutex_t stats_lock;
@@ -39,6 +39,7 @@
 #include "signer/tools.h"
 #include "signer/zone.h"
 #include "daemon/metastorage.h"
+#include "daemon/nsec3rebuild.h"
 
 static const char* tools_str = "tools";
 
@@ -67,6 +68,12 @@ tools_signconf(zone_type* zone)
              */
             /* FIXME namedb_wipe_denial(zone, NULL); */
         }
+        /* Changed NSEC3 parameters keep the current chain until the new one
+         * has been built in the background.
+         */
+        nsec3rebuild_start(zone, new_signconf);
+        /* Key Rollover? Successor keys take over gradually. */
+        keylist_rollover(new_signconf->keys, zone->signconf->keys, time_now());
         /* all ok, switch signer configuration */
         signconf_cleanup(zone->signconf);
         ods_log_debug("[%s] zone %s switch to new signconf", tools_str,
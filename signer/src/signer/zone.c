@@ -41,6 +41,7 @@
 #include "compat.h"
 #include "daemon/signertasks.h"
 #include "daemon/metastorage.h"
+#include "daemon/nsec3rebuild.h"
 
 #include <ldns/ldns.h>
 
@@ -98,6 +99,7 @@ zone_create(char* name, ldns_rr_class klass)
     zone->zl_status = ZONE_ZL_OK;
     zone->xfrd = NULL;
     zone->notify = NULL;
+    zone->nsec3rebuild = NULL;
     zone->zoneconfigvalid = 0;
     zone->signconf = signconf_create();
     zone->operatingconf = NULL;
@@ -108,6 +110,7 @@ zone_create(char* name, ldns_rr_class klass)
         return NULL;
     }
     zone->stats = stats_create();
+    zone->nextexpiry = 0;
     return zone;
 }
 
@@ -254,33 +257,20 @@ zone_publish_dnskeys(zone_type* zone, names_view_type view, int skip_hsm_access)
 
 
 /**
- * Publish the NSEC3 parameters as indicated by the signer configuration.
+ * Get the NSEC3PARAM RR for the NSEC3 parameters of the signer configuration.
  *
  */
-ods_status
-zone_publish_nsec3param(zone_type* zone, names_view_type view)
+ldns_rr*
+zone_nsec3param_rr(zone_type* zone)
 {
     ldns_rr* rr = NULL;
-    ods_status status = ODS_STATUS_OK;
-
-    if (!zone || !zone->name || !zone->signconf) {
-        return ODS_STATUS_ASSERT_ERR;
-    }
-    if (!zone->signconf->nsec3params) {
-        /* NSEC */
-        ods_log_assert(zone->signconf->nsec_type == LDNS_RR_TYPE_NSEC);
-        return ODS_STATUS_OK;
-    }
 
     if (!zone->signconf->nsec3params->rr) {
         uint32_t paramttl =
             (uint32_t) duration2time(zone->signconf->nsec3param_ttl);
         rr = ldns_rr_new_frm_type(LDNS_RR_TYPE_NSEC3PARAMS);
         if (!rr) {
-            ods_log_error("[%s] unable to publish nsec3params for zone %s: "
-                "error creating rr (%s)", zone_str, zone->name,
-                ods_status2str(status));
-            return ODS_STATUS_MALLOC_ERR;
+            return NULL;
         }
         ldns_rr_set_class(rr, zone->klass);
         ldns_rr_set_ttl(rr, paramttl);
@@ -297,6 +287,34 @@ zone_publish_nsec3param(zone_type* zone, names_view_type view)
         ldns_set_bit(ldns_rdf_data(ldns_rr_rdf(rr, 1)), 7, 0);
         zone->signconf->nsec3params->rr = rr;
     }
+    return zone->signconf->nsec3params->rr;
+}
+
+
+/**
+ * Publish the NSEC3 parameters as indicated by the signer configuration.
+ *
+ */
+ods_status
+zone_publish_nsec3param(zone_type* zone, names_view_type view)
+{
+    ods_status status = ODS_STATUS_OK;
+
+    if (!zone || !zone->name || !zone->signconf) {
+        return ODS_STATUS_ASSERT_ERR;
+    }
+    if (!zone->signconf->nsec3params) {
+        /* NSEC */
+        ods_log_assert(zone->signconf->nsec_type == LDNS_RR_TYPE_NSEC);
+        return ODS_STATUS_OK;
+    }
+
+    if (!zone_nsec3param_rr(zone)) {
+        ods_log_error("[%s] unable to publish nsec3params for zone %s: "
+            "error creating rr (%s)", zone_str, zone->name,
+            ods_status2str(status));
+        return ODS_STATUS_MALLOC_ERR;
+    }
 
     /* Delete all nsec3param rrs. */
     zone_del_nsec3params(zone, view);
@@ -472,6 +490,7 @@ zone_cleanup(zone_type* zone)
         return;
     }
     pthread_mutex_lock(&zone->zone_lock);
+    nsec3rebuild_cancel(zone);
     ldns_rdf_deep_free(zone->apex);
     adapter_cleanup(zone->adinbound);
     adapter_cleanup(zone->adoutbound);
@@ -105,6 +105,9 @@ struct zone_struct {
     notify_type* notify;
     /* statistics */
     stats_type* stats;
+    time_t nextexpiry; /* earliest expiration of a signature, 0 if none */
+    /* NSEC3 chain being built for changed parameters, if any */
+    struct nsec3rebuild* nsec3rebuild;
     pthread_mutex_t zone_lock;
     pthread_mutex_t xfr_lock;
     /* backing store for rrsigs (both domain as denial) */
@@ -160,6 +163,15 @@ extern ods_status zone_publish_dnskeys(zone_type* zone, names_view_type view, in
  */
 extern ods_status zone_publish_nsec3param(zone_type* zone, names_view_type view);
 
+/**
+ * Get the NSEC3PARAM RR for the NSEC3 parameters of the signer configuration,
+ * creating it if needed.
+ * \param[in] zone zone
+ * \return ldns_rr* NSEC3PARAM RR, owned by the NSEC3 parameters
+ *
+ */
+extern ldns_rr* zone_nsec3param_rr(zone_type* zone);
+
 /**
  * Prepare keys for signing.
  * \param[in] zone zone
@@ -56,6 +56,7 @@
 #include "adapter/adutil.h"
 #include "settings.h"
 #include "cfg.h"
+#include "compat.h"
 
 #include "comparezone.h"
 
@@ -559,6 +560,9 @@ testMarshalling(void)
     h = marshallcreate(marshall_INPUT, fd);
     names_recordmarshall(&record,h);
     // names_dumprecord(stderr,record); In case this test fails enable this to investigate
+    CU_ASSERT_PTR_NOT_NULL(record);
+    CU_ASSERT(names_recordhasdata(record, LDNS_RR_TYPE_A, rr1, 1));
+    CU_ASSERT(names_recordhasdata(record, LDNS_RR_TYPE_NS, rr3, 1));
     marshallclose(h);
     close(fd);
     
@@ -590,6 +594,7 @@ testStatefile(void)
     zone1.nextserial = NULL;
     metastorageput(&zone1);
 
+    zone2.name = "example.com";
     metastorageget("example.com",&zone2);
     CU_ASSERT_PTR_NOT_NULL(zone2.name);
     CU_ASSERT_PTR_NOT_NULL(zone2.inboundserial);
@@ -612,6 +617,7 @@ testStatefile(void)
     zone4.outboundserial = NULL;
     metastorageput(&zone4);
 
+    zone5.name = "example.org";
     metastorageget("example.org",&zone5);
     CU_ASSERT_PTR_NOT_NULL(zone5.name);
     CU_ASSERT_PTR_NULL(zone5.inboundserial);
@@ -620,6 +626,7 @@ testStatefile(void)
     CU_ASSERT_STRING_EQUAL(zone5.name, "example.org");
     CU_ASSERT_EQUAL(*zone5.outboundserial, 222);
 
+    zone6.name = "example.com";
     metastorageget("example.com",&zone6);
     CU_ASSERT_PTR_NOT_NULL(zone6.name);
     CU_ASSERT_PTR_NULL(zone6.inboundserial);
@@ -630,6 +637,52 @@ testStatefile(void)
 }
 
 
+void
+testMetastorage(void)
+{
+    int i, j;
+    int nzones = 50000;
+    char* name;
+    zone_type zone;
+    uint32_t serial;
+    struct timespec start, stop;
+    double elapsed;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    unlink("signer.db");
+    memset(&zone, 0, sizeof(zone_type));
+    zone.inboundserial = &serial;
+    for(j=0; j<2; j++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(i=0; i<nzones; i++) {
+            asprintf(&zone.name, "zone%d.example.com", i);
+            serial = i + j;
+            CU_ASSERT_EQUAL(metastorageput(&zone), 0);
+            free(zone.name);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+        fprintf(stderr, "stored %d zones in %.3f s\n", nzones, elapsed);
+    }
+    zone.inboundserial = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i=0; i<nzones; i++) {
+        asprintf(&name, "zone%d.example.com", i);
+        zone.name = name;
+        CU_ASSERT_EQUAL(metastorageget(name, &zone), 0);
+        free(name);
+        CU_ASSERT_PTR_NOT_NULL(zone.inboundserial);
+        if(zone.inboundserial)
+            CU_ASSERT_EQUAL(*zone.inboundserial, (uint32_t)i + 1);
+        free(zone.inboundserial);
+        free(zone.nextserial);
+        free(zone.outboundserial);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "retrieved %d zones in %.3f s\n", nzones, elapsed);
+    unlink("signer.db");
+}
+
 void
 testTransferfile(void)
 {
@@ -729,6 +782,78 @@ testSignNSEC3(void)
 }
 
 
+/* Counts the NSEC3 records in a zone file that lack a signature that is
+ * still valid at the given time.
+ */
+static int
+unsigneddenials(const char* filename, time_t validafter, int* ndenials)
+{
+    FILE* fp;
+    ldns_zone* zone;
+    ldns_rr_list* rrs;
+    ldns_rr* rr;
+    ldns_rr* rrsig;
+    size_t i, j;
+    int nunsigned = 0;
+    *ndenials = 0;
+    if((fp = fopen(filename, "r")) == NULL)
+        return -1;
+    if(ldns_zone_new_frm_fp(&zone, fp, NULL, 0, LDNS_RR_CLASS_IN) != LDNS_STATUS_OK) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    rrs = ldns_zone_rrs(zone);
+    for(i=0; i<ldns_rr_list_rr_count(rrs); i++) {
+        rr = ldns_rr_list_rr(rrs, i);
+        if(ldns_rr_get_type(rr) != LDNS_RR_TYPE_NSEC3)
+            continue;
+        *ndenials += 1;
+        for(j=0; j<ldns_rr_list_rr_count(rrs); j++) {
+            rrsig = ldns_rr_list_rr(rrs, j);
+            if(ldns_rr_get_type(rrsig) == LDNS_RR_TYPE_RRSIG &&
+               ldns_rdf2rr_type(ldns_rr_rrsig_typecovered(rrsig)) == LDNS_RR_TYPE_NSEC3 &&
+               ldns_dname_compare(ldns_rr_owner(rrsig), ldns_rr_owner(rr)) == 0 &&
+               ldns_rdf2native_time_t(ldns_rr_rrsig_expiration(rrsig)) > validafter)
+                break;
+        }
+        if(j == ldns_rr_list_rr_count(rrs))
+            ++nunsigned;
+    }
+    ldns_zone_deep_free(zone);
+    return nunsigned;
+}
+
+/* The NSEC3 records are signed with the other RRsets of their name, also
+ * when their signatures are refreshed.
+ */
+void
+testSignNSEC3Resign(void)
+{
+    zone_type* zone;
+    int ndenials;
+    time_t start = 1537918509;
+    usefile("signer.db", NULL);
+    usefile("example.com.state", NULL);
+    usefile("zones.xml", "zones.xml.example");
+    usefile("unsigned.zone", "unsigned.zone.example");
+    usefile("signconf.xml", "signconf.xml.nsec3");
+    set_time_now(start);
+    zonelist_update(engine->zonelist, engine->config->zonelist_filename_signer);
+    zone = zonelist_lookup_zone_by_name(engine->zonelist, "example.com", LDNS_RR_CLASS_IN);
+    signzone(zone);
+    CU_ASSERT_EQUAL(unsigneddenials("signed.zone", start, &ndenials), 0);
+    CU_ASSERT(ndenials > 0);
+    /* ten minutes before expiry, within the refresh period of the signconf */
+    set_time_now(start + 86400 - 600);
+    resignzone(zone);
+    CU_ASSERT_EQUAL(unsigneddenials("signed.zone", start + 86400, &ndenials), 0);
+    CU_ASSERT(ndenials > 0);
+    disposezone(zone);
+    set_time_now(start);
+}
+
+
 void
 testSignResign(void)
 {
@@ -749,7 +874,7 @@ testSignResign(void)
     resignzone(zone);
 
     char* filename = ods_build_path(zone->name, ".state", 0, 1);
-    names_viewpersist(zone->baseview, basefd, filename);
+    CU_ASSERT_EQUAL(names_viewpersist(zone->baseview, basefd, filename), 0);
     free(filename);
 
     disposezone(zone);
@@ -996,6 +1121,767 @@ testBackup(void)
     zone_cleanup(zone);
  }
 
+#define STRESSREADERS  8
+#define STRESSCOMMITS  2000
+
+struct stressreader {
+    janitor_thread_t thread;
+    names_view_type view;
+    int* finished;
+};
+
+static void
+stressreader(void* arg)
+{
+    struct stressreader* reader = arg;
+    while(!__atomic_load_n(reader->finished, __ATOMIC_ACQUIRE)) {
+        names_viewreset(reader->view);
+    }
+    names_viewreset(reader->view);
+}
+
+void
+testCommitlogStress(void)
+{
+    int i, count;
+    int finished = 0;
+    char* name = NULL;
+    names_iterator iter;
+    names_view_type baseview;
+    names_view_type inputview;
+    struct stressreader readers[STRESSREADERS];
+
+    baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    names_viewrestore(baseview, "example.com", -1, NULL);
+    inputview = names_viewcreate(baseview, names_view_INPUT[0], &names_view_INPUT[1]);
+    for(i=0; i<STRESSREADERS; i++) {
+        readers[i].view = (i == 0 ? baseview : names_viewcreate(baseview, names_view_BACKUP[0], &names_view_BACKUP[1]));
+        readers[i].finished = &finished;
+        janitor_thread_create(&readers[i].thread, workerthreadclass, stressreader, &readers[i]);
+    }
+    for(i=0; i<STRESSCOMMITS; i++) {
+        asprintf(&name, "name%d.example.com", i);
+        names_place(inputview, name);
+        CU_ASSERT_EQUAL(names_viewcommit(inputview), 0);
+        free(name);
+    }
+    __atomic_store_n(&finished, 1, __ATOMIC_RELEASE);
+    for(i=0; i<STRESSREADERS; i++) {
+        janitor_thread_join(readers[i].thread);
+        count = 0;
+        for(iter=names_viewiterator(readers[i].view, NULL); names_iterate(&iter, NULL); names_advance(&iter, NULL))
+            ++count;
+        CU_ASSERT_EQUAL(count, STRESSCOMMITS);
+    }
+    for(i=1; i<STRESSREADERS; i++)
+        names_viewdestroy(readers[i].view);
+    names_viewdestroy(inputview);
+    names_viewdestroy(baseview);
+}
+
+static const char** parallelviews[] = { names_view_PREPARE, names_view_NEIGHB, names_view_BACKUP };
+
+static void
+parallelcommit(names_view_type inputview, names_view_type* views)
+{
+    int i;
+    CU_ASSERT_EQUAL(names_viewcommit(inputview), 0);
+    for(i=0; i<3; i++)
+        names_viewreset(views[i]);
+}
+
+/* Inserts 5000 names and removes every third one again, committing after
+ * each batch of changes.  The secondary indices of the views are dumped
+ * into contents, with the number of records in them in counts.
+ */
+static void
+parallelupdate(int batch, char* contents[3][4], int counts[3][4])
+{
+    int i, n, pending = 0;
+    char* name = NULL;
+    char* s;
+    size_t size;
+    FILE* fp;
+    recordset_type record;
+    names_view_type baseview;
+    names_view_type inputview;
+    names_view_type views[3];
+    baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    names_viewrestore(baseview, "example.com", -1, NULL);
+    inputview = names_viewcreate(baseview, names_view_INPUT[0], &names_view_INPUT[1]);
+    for(i=0; i<3; i++)
+        views[i] = names_viewcreate(baseview, parallelviews[i][0], &parallelviews[i][1]);
+    for(i=0; i<5000; i++) {
+        asprintf(&name, "name%d.example.com", i);
+        names_place(inputview, name);
+        free(name);
+        if(++pending == batch) {
+            parallelcommit(inputview, views);
+            pending = 0;
+        }
+    }
+    for(i=0; i<5000; i+=3) {
+        asprintf(&name, "name%d.example.com", i);
+        record = names_take(inputview, 0, name);
+        CU_ASSERT_PTR_NOT_NULL(record);
+        if(record)
+            names_remove(inputview, record);
+        free(name);
+        if(++pending == batch) {
+            parallelcommit(inputview, views);
+            pending = 0;
+        }
+    }
+    parallelcommit(inputview, views);
+    for(i=0; i<3; i++) {
+        names_viewvalidate(views[i]);
+        for(n=1; n<4 && parallelviews[i][n+1]; n++) {
+            fp = open_memstream(&contents[i][n], &size);
+            names_dumpindex(fp, views[i], n);
+            fclose(fp);
+            counts[i][n] = 0;
+            for(s=contents[i][n]; *s; s++)
+                if(*s == '\n')
+                    counts[i][n] += 1;
+        }
+        names_viewdestroy(views[i]);
+    }
+    names_viewdestroy(inputview);
+    names_viewdestroy(baseview);
+}
+
+void
+testParallelUpdate(void)
+{
+    int i, n;
+    char* sequential[3][4];
+    char* parallel[3][4];
+    int sequentialcounts[3][4];
+    int parallelcounts[3][4];
+    /* batches below and above the number of changes to update the
+     * secondary indices in parallel for */
+    parallelupdate(500, sequential, sequentialcounts);
+    parallelupdate(5000, parallel, parallelcounts);
+    for(i=0; i<3; i++) {
+        for(n=1; n<4 && parallelviews[i][n+1]; n++) {
+            CU_ASSERT_EQUAL(sequentialcounts[i][n], parallelcounts[i][n]);
+            CU_ASSERT_STRING_EQUAL(sequential[i][n], parallel[i][n]);
+            free(sequential[i][n]);
+            free(parallel[i][n]);
+        }
+    }
+}
+
+void
+testIndexSharing(void)
+{
+    int i, n, zonesize;
+    char* name = NULL;
+    char* message = NULL;
+    struct timespec start, stop;
+    double latency;
+    names_view_type baseview;
+    names_view_type inputview;
+    names_view_type views[3];
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    for(zonesize=1000; zonesize<=100000; zonesize*=10) {
+        baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+        names_viewrestore(baseview, "example.com", -1, NULL);
+        inputview = names_viewcreate(baseview, names_view_INPUT[0], &names_view_INPUT[1]);
+        for(i=0; i<zonesize; i++) {
+            asprintf(&name, "name%d.example.com", i);
+            names_place(inputview, name);
+            free(name);
+        }
+        names_viewcommit(inputview);
+        names_viewreset(baseview);
+        asprintf(&message, "done loading zone of %d names", zonesize);
+        logger_mark_performance(message);
+        free(message);
+        views[0] = names_viewcreate(baseview, names_view_PREPARE[0], &names_view_PREPARE[1]);
+        views[1] = names_viewcreate(baseview, names_view_NEIGHB[0], &names_view_NEIGHB[1]);
+        views[2] = names_viewcreate(baseview, names_view_BACKUP[0], &names_view_BACKUP[1]);
+        asprintf(&message, "done creating views for %d names", zonesize);
+        logger_mark_performance(message);
+        free(message);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(n=0; n<100; n++) {
+            asprintf(&name, "extra%d.example.com", n);
+            names_place(inputview, name);
+            free(name);
+            names_viewcommit(inputview);
+            for(i=0; i<3; i++)
+                names_viewreset(views[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        latency = ((stop.tv_sec - start.tv_sec) * 1000000.0 + (stop.tv_nsec - start.tv_nsec) / 1000.0) / n;
+        fprintf(stderr, "zone of %d names single name commit latency %.1f us\n", zonesize, latency);
+        for(i=0; i<3; i++) {
+            names_viewvalidate(views[i]);
+            names_viewdestroy(views[i]);
+        }
+        names_viewdestroy(inputview);
+        names_viewdestroy(baseview);
+    }
+}
+
+void
+testDenialChain(void)
+{
+    int i, n, nchanged, ttl = 3600;
+    int nrecords = 100000;
+    char* name = NULL;
+    char* ownername;
+    ldns_rr* rr;
+    recordset_type* records;
+    signconf_type* signconf;
+    struct names_view_zone zone;
+    struct denial_struct denial;
+    struct timespec start, stop;
+    double elapsed;
+    names_view_type baseview;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    names_viewrestore(baseview, "example.com", -1, NULL);
+    signconf = signconf_create();
+    signconf->nsec3params = nsec3params_create(signconf, LDNS_SHA1, 0, 10, "aabbccdd");
+    zone.defaultttl = &ttl;
+    zone.apex = "example.com.";
+    zone.signconf = &signconf;
+    zone.nsec3cache = NULL;
+    records = malloc(sizeof(recordset_type) * nrecords);
+    ldns_rr_new_frm_str(&rr, "example.com. 3600 IN A 192.0.2.1", 0, NULL, NULL);
+    for(i=0; i<nrecords; i++) {
+        asprintf(&name, "name%d.example.com.", i);
+        ownername = name;
+        records[i] = names_recordcreate(&ownername);
+        free(name);
+        names_recordadddata(records[i], rr);
+        names_recordannotate(records[i], &zone);
+        names_recordsetstatus(records[i], LDNS_RR_TYPE_SOA, LDNS_RR_TYPE_SOA, 0);
+    }
+    ldns_rr_free(rr);
+    names_recordannotatepending(records, nrecords);
+    logger_mark_performance("done hashing names");
+    for(n=0; n<2; n++) {
+        nchanged = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(i=0; i<nrecords; i++) {
+            CU_ASSERT_EQUAL(denial_nsecify(signconf, baseview, records[i], names_recordgetdenial(records[(i+1)%nrecords]), &denial), 0);
+            if(names_recordcmpdenial(records[i], denial.rrtype, denial.rdata, denial.rdatalen)) {
+                names_recordsetdenial(records[i], denial_rr(&denial));
+                ++nchanged;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+        fprintf(stderr, "NSEC3 chain of %d names %s in %.3f s, %.0f names/s\n", nrecords,
+                (n == 0 ? "built" : "verified unchanged"), elapsed, nrecords / elapsed);
+        CU_ASSERT_EQUAL(nchanged, (n == 0 ? nrecords : 0));
+    }
+    for(i=0; i<nrecords; i++)
+        names_recorddispose(records[i]);
+    free(records);
+    signconf_cleanup(signconf);
+    names_viewdestroy(baseview);
+}
+
+void
+testStatefilePersist(void)
+{
+    int i, count;
+    int zonesize = 100000;
+    char* name = NULL;
+    ldns_rr* rr;
+    ldns_rr* rrsig;
+    recordset_type record;
+    struct stat statbuf;
+    struct timespec start, stop;
+    double elapsed;
+    names_iterator iter;
+    names_view_type baseview;
+    names_view_type inputview;
+    names_view_type restoreview;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    unlink("persist.state");
+    baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    names_viewrestore(baseview, "example.com", -1, NULL);
+    inputview = names_viewcreate(baseview, names_view_INPUT[0], &names_view_INPUT[1]);
+    ldns_rr_new_frm_str(&rr, "example.com. 3600 IN A 192.0.2.1", 0, NULL, NULL);
+    ldns_rr_new_frm_str(&rrsig, "example.com. 3600 IN RRSIG A 7 3 86400 20180525135557 20180525125459 55490 example.com. FV0gZ8FAaqlFnJ6jFuBj4DSImeftLaRdOXhjGxUZuZe29PkkuZP9u2cb9n4SSXRSn88rEHoSff8nPKwYKCOzOxlgHx7q4FZwmGrLrmV7Sfjp41O7DI4P8F/APVwfuc4d63uQq3C2opXgFv76L0CQ/+9mIOxthjL7hVy00UDPzWM=", 0, NULL, NULL);
+    for(i=0; i<zonesize; i++) {
+        asprintf(&name, "name%d.example.com.", i);
+        record = names_place(inputview, name);
+        names_recordadddata(record, rr);
+        names_recordaddsignature(record, LDNS_RR_TYPE_A, ldns_rr_clone(rrsig), strdup("locator"), 256);
+        free(name);
+    }
+    ldns_rr_free(rr);
+    ldns_rr_free(rrsig);
+    names_viewcommit(inputview);
+    names_viewreset(baseview);
+    logger_mark_performance("done loading zone");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CU_ASSERT_EQUAL(names_viewpersist(baseview, AT_FDCWD, "persist.state"), 0);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    CU_ASSERT_EQUAL(stat("persist.state", &statbuf), 0);
+    fprintf(stderr, "persisted %d names in %.3f s, %ld bytes\n", zonesize, elapsed, (long)statbuf.st_size);
+
+    restoreview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CU_ASSERT_EQUAL(names_viewrestore(restoreview, "example.com", -1, "persist.state"), 0);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "restored %d names in %.3f s\n", zonesize, elapsed);
+    count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(iter=names_viewiterator(restoreview, NULL); names_iterate(&iter, &record); names_advance(&iter, NULL)) {
+        if(names_recordhasdata(record, LDNS_RR_TYPE_A, NULL, 0))
+            ++count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "faulted in %d names in %.3f s\n", count, elapsed);
+    CU_ASSERT_EQUAL(count, zonesize);
+
+    names_viewdestroy(restoreview);
+    names_viewdestroy(inputview);
+    names_viewdestroy(baseview);
+    unlink("persist.state");
+}
+
+static void
+checkpointload(names_view_type inputview, names_view_type baseview, int first, int count)
+{
+    int i;
+    char* name = NULL;
+    ldns_rr* rr;
+    recordset_type record;
+    ldns_rr_new_frm_str(&rr, "example.com. 3600 IN A 192.0.2.1", 0, NULL, NULL);
+    for(i=first; i<first+count; i++) {
+        asprintf(&name, "name%d.example.com.", i);
+        record = names_place(inputview, name);
+        names_recordadddata(record, rr);
+        free(name);
+        if(i % 1000 == 999) {
+            names_viewcommit(inputview);
+        }
+    }
+    names_viewcommit(inputview);
+    names_viewreset(baseview);
+    ldns_rr_free(rr);
+}
+
+void
+testStatefileCheckpoint(void)
+{
+    int count;
+    recordset_type record;
+    struct stat statbuf;
+    struct timespec start, stop;
+    double elapsed;
+    names_iterator iter;
+    names_view_type baseview;
+    names_view_type inputview;
+    names_view_type restoreview;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    unlink("checkpoint.state");
+    unlink("checkpoint.state.log");
+    baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    names_viewrestore(baseview, "example.com", -1, NULL);
+    inputview = names_viewcreate(baseview, names_view_INPUT[0], &names_view_INPUT[1]);
+
+    /* the first checkpoint writes the state in full */
+    checkpointload(inputview, baseview, 0, 50000);
+    CU_ASSERT_EQUAL(names_viewcheckpoint(baseview, AT_FDCWD, "checkpoint.state"), 0);
+    CU_ASSERT_EQUAL(stat("checkpoint.state.log", &statbuf), -1);
+
+    /* a journal larger than the state triggers a compaction, changes made
+     * during it end up in the segment and are carried over
+     */
+    checkpointload(inputview, baseview, 50000, 100000);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CU_ASSERT_EQUAL(names_viewcheckpoint(baseview, AT_FDCWD, "checkpoint.state"), 0);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "checkpoint started in %.3f s\n", elapsed);
+    checkpointload(inputview, baseview, 150000, 10000);
+    names_viewdestroy(inputview);
+    names_viewdestroy(baseview);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "checkpoint completed in %.3f s\n", elapsed);
+    CU_ASSERT_EQUAL(stat("checkpoint.state.log", &statbuf), -1);
+
+    restoreview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    CU_ASSERT_EQUAL(names_viewrestore(restoreview, "example.com", -1, "checkpoint.state"), 0);
+    count = 0;
+    for(iter=names_viewiterator(restoreview, NULL); names_iterate(&iter, &record); names_advance(&iter, NULL)) {
+        if(names_recordhasdata(record, LDNS_RR_TYPE_A, NULL, 0))
+            ++count;
+    }
+    CU_ASSERT_EQUAL(count, 160000);
+    names_viewdestroy(restoreview);
+    unlink("checkpoint.state");
+}
+
+static void
+referencezonecontent(names_view_type view, FILE* fp)
+{
+    int first;
+    char* s;
+    ldns_rr_type recordtype;
+    names_iterator domainiter;
+    names_iterator rrsetiter;
+    names_iterator rriter;
+    recordset_type domainitem;
+    for (domainiter = names_viewiterator(view, NULL); names_iterate(&domainiter, &domainitem); names_advance(&domainiter, NULL)) {
+        for (rrsetiter = names_recordalltypes(domainitem); names_iterate(&rrsetiter, &recordtype); names_advance(&rrsetiter, NULL)) {
+            first = 1;
+            for (rriter = names_recordallvaluestrings(domainitem, recordtype); names_iterate(&rriter, &s); names_advance(&rriter, NULL)) {
+                if (recordtype == LDNS_RR_TYPE_SOA && first) {
+                    first = 0;
+                    continue;
+                }
+                fprintf(fp, "%s", s);
+            }
+        }
+        for (rriter = names_recordallvaluestrings(domainitem, LDNS_RR_TYPE_NSEC); names_iterate(&rriter, &s); names_advance(&rriter, NULL)) {
+            fprintf(fp, "%s", s);
+        }
+    }
+}
+
+static int
+comparefiles(const char* filename1, const char* filename2)
+{
+    FILE* fp1;
+    FILE* fp2;
+    int c1, c2;
+    fp1 = fopen(filename1, "r");
+    fp2 = fopen(filename2, "r");
+    if(fp1 == NULL || fp2 == NULL)
+        return -1;
+    do {
+        c1 = fgetc(fp1);
+        c2 = fgetc(fp2);
+    } while(c1 == c2 && c1 != EOF);
+    fclose(fp1);
+    fclose(fp2);
+    return c1 != c2;
+}
+
+void
+testZoneOutput(void)
+{
+    int i, pass;
+    int zonesize = 100000;
+    char* name = NULL;
+    ldns_rr* rr;
+    ldns_rr* rrsig;
+    recordset_type record;
+    struct timespec start, stop;
+    double elapsed;
+    FILE* fp;
+    names_view_type baseview;
+    names_view_type inputview;
+    names_view_type outputview;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    baseview = names_viewcreate(NULL, names_view_BASE[0], &names_view_BASE[1]);
+    names_viewrestore(baseview, "example.com", -1, NULL);
+    inputview = names_viewcreate(baseview, names_view_INPUT[0], &names_view_INPUT[1]);
+    ldns_rr_new_frm_str(&rr, "example.com. 3600 IN A 192.0.2.1", 0, NULL, NULL);
+    ldns_rr_new_frm_str(&rrsig, "example.com. 3600 IN RRSIG A 7 3 86400 20180525135557 20180525125459 55490 example.com. FV0gZ8FAaqlFnJ6jFuBj4DSImeftLaRdOXhjGxUZuZe29PkkuZP9u2cb9n4SSXRSn88rEHoSff8nPKwYKCOzOxlgHx7q4FZwmGrLrmV7Sfjp41O7DI4P8F/APVwfuc4d63uQq3C2opXgFv76L0CQ/+9mIOxthjL7hVy00UDPzWM=", 0, NULL, NULL);
+    for(i=0; i<zonesize; i++) {
+        asprintf(&name, "name%d.example.com.", i);
+        record = names_place(inputview, name);
+        names_recordadddata(record, rr);
+        names_recordaddsignature(record, LDNS_RR_TYPE_A, ldns_rr_clone(rrsig), strdup("locator"), 256);
+        free(name);
+    }
+    ldns_rr_free(rr);
+    ldns_rr_free(rrsig);
+    names_viewcommit(inputview);
+    names_viewreset(baseview);
+    outputview = names_viewcreate(baseview, names_view_BASE[0], &names_view_BASE[1]);
+    logger_mark_performance("done loading zone");
+
+    fp = fopen("zoneoutput.reference", "w");
+    referencezonecontent(outputview, fp);
+    fclose(fp);
+    for(pass=0; pass<2; pass++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fp = fopen("zoneoutput.zone", "w");
+        writezonecontent(outputview, fp);
+        fclose(fp);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+        fprintf(stderr, "%s output of %d names in %.3f s\n", (pass ? "cached" : "initial"), zonesize, elapsed);
+        CU_ASSERT_EQUAL(comparefiles("zoneoutput.reference", "zoneoutput.zone"), 0);
+    }
+
+    names_viewdestroy(outputview);
+    names_viewdestroy(inputview);
+    names_viewdestroy(baseview);
+    unlink("zoneoutput.reference");
+    unlink("zoneoutput.zone");
+}
+
+void
+testBase64(void)
+{
+    int i, level, pass;
+    int count = 1000000;
+    uint8_t data[256];
+    uint8_t decoded[256 + 32];
+    char reference[512];
+    char encoded[512];
+    struct timespec start, stop;
+    double elapsed;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    for(i=0; i<(int)sizeof(data); i++)
+        data[i] = (i * 131 + 7) & 0xff;
+    b64_simd(0);
+    CU_ASSERT_EQUAL(b64_ntop(data, sizeof(data), reference, sizeof(reference)), 344);
+    for(level=b64_simd(2); level>=0; level--) {
+        b64_simd(level);
+        for(pass=0; pass<2; pass++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(i=0; i<count; i++) {
+                if(pass == 0)
+                    b64_ntop(data, sizeof(data), encoded, sizeof(encoded));
+                else
+                    b64_pton(reference, decoded, sizeof(decoded));
+            }
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+            elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+            fprintf(stderr, "level %d %s of %d signatures in %.3f s\n", level, (pass ? "decoding" : "encoding"), count, elapsed);
+        }
+        CU_ASSERT_EQUAL(strcmp(encoded, reference), 0);
+        CU_ASSERT_EQUAL(memcmp(decoded, data, sizeof(data)), 0);
+        /* whitespace and padding are left to the scalar path */
+        CU_ASSERT_EQUAL(b64_pton("AQID BAUG\tBwgJ\nCgsM DQ4P EBES ExQV FhcY GRob HB0e Hw==", decoded, sizeof(decoded)), 31);
+        CU_ASSERT_EQUAL(b64_pton("AQIDBAUGBwgJCgsMDQ4PEBESExQVFhcYGRobHB0eH!==", decoded, sizeof(decoded)), -1);
+    }
+    b64_simd(2);
+}
+
+void
+testRRFormat(void)
+{
+    static const char* samples[] = {
+        "example.com. 3600 IN A 192.0.2.1",
+        "www.example.com. 86400 IN AAAA 2001:db8:0:1::53",
+        "example.com. 3600 IN NS ns1.example.net.",
+        "sub.example.com. 3600 IN DS 12345 8 2 49FD46E6C4B45C55D4AC69CBD3CD34AC1AFE51DE3B4A2F5F7C3C4B8E2E7B7E31",
+        "example.com. 3600 IN RRSIG A 7 3 86400 20180525135557 20180525125459 55490 example.com. FV0gZ8FAaqlFnJ6jFuBj4DSImeftLaRdOXhjGxUZuZe29PkkuZP9u2cb9n4SSXRSn88rEHoSff8nPKwYKCOzOxlgHx7q4FZwmGrLrmV7Sfjp41O7DI4P8F/APVwfuc4d63uQq3C2opXgFv76L0CQ/+9mIOxthjL7hVy00UDPzWM=",
+        "ee19kl3631qol646kjjrh6lh96pduqii.example.com. 3600 IN NSEC3 1 0 5 6467b16f6f36ba4d 13k9b8dv58kcn28us3fc0lqa60jeadp0 A NS SOA RRSIG DNSKEY NSEC3PARAM TYPE65534",
+        "ee19kl3631qol646kjjrh6lh96pduqii.example.com. 3600 IN NSEC3 1 1 0 - 13k9b8dv58kcn28us3fc0lqa60jeadp0 A",
+        "example.com. 3600 IN DNSKEY 256 3 8 AwEAAcFcGsaxxdgiuuGmCkVImy4h99CqT7jwY3pexPGcnUFtR2Fh36BponcwtkZ4cAgtvd4Qs8PkxUdp6p/DlUmObdk=",
+        "example.com. 3600 IN DNSKEY 257 3 13 oJMRESz5E4gYzS/q6XDrvU1qMPYIjCWzJaOau8XNEZeqCYKD5ar0IRd8KqXXFJkqmVfRvMGPmM1x8fGAa2XhSA==",
+        "example.com. 3600 IN TXT \"v=spf1 -all\" \"\"",
+        "_sip._tcp.example.com. 3600 IN TXT \"quote\\\"d\"",
+        "a\\.b.example.com. 3600 IN A 192.0.2.2",
+        "*.example.com. 3600 IN MX 10 mail.example.com."
+    };
+    int i, n, len, handled = 0;
+    char text[2048];
+    char prefix[24];
+    char* reference;
+    ldns_rr* rr;
+    ldns_rr* rrsig;
+    for(n=0; n<(int)(sizeof(samples)/sizeof(samples[0])); n++) {
+        CU_ASSERT_EQUAL(ldns_rr_new_frm_str(&rr, samples[n], 0, NULL, NULL), LDNS_STATUS_OK);
+        reference = ldns_rr2str(rr);
+        if((len = names_rrformat(rr, text, sizeof(text))) >= 0) {
+            ++handled;
+            CU_ASSERT_EQUAL(len, (int)strlen(reference));
+            CU_ASSERT_EQUAL(strcmp(text, reference), 0);
+            CU_ASSERT_EQUAL(names_rrformat(rr, NULL, 0), len);
+            CU_ASSERT_EQUAL(names_rrformat(rr, prefix, sizeof(prefix)), len);
+            CU_ASSERT_EQUAL(strncmp(prefix, reference, sizeof(prefix)-1), 0);
+        }
+        free(reference);
+        ldns_rr_free(rr);
+    }
+    CU_ASSERT(handled > 0);
+
+    /* signatures are the bulk of a signed zone, check them over a range of TTLs */
+    ldns_rr_new_frm_str(&rrsig, samples[4], 0, NULL, NULL);
+    for(i=0; i<100000; i+=997) {
+        ldns_rr_set_ttl(rrsig, i);
+        reference = ldns_rr2str(rrsig);
+        CU_ASSERT_EQUAL(names_rrformat(rrsig, text, sizeof(text)), (int)strlen(reference));
+        CU_ASSERT_EQUAL(strcmp(text, reference), 0);
+        free(reference);
+    }
+    ldns_rr_free(rrsig);
+}
+
+/* Reads the zone file named by ODS_TESTZONEFILE, for instance a TLD zone,
+ * or a generated zone with multi-line records and comments otherwise.
+ */
+void
+testZoneReader(void)
+{
+    int i, len;
+    long records = 0;
+    unsigned int lineno = 0;
+    off_t filesize;
+    const char* filename;
+    char* line;
+    FILE* fp;
+    struct stat st;
+    struct timespec start, stop;
+    double elapsed;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    if((filename = getenv("ODS_TESTZONEFILE")) == NULL) {
+        filename = "zonereader.zone";
+        fp = fopen(filename, "w");
+        fprintf(fp, "$ORIGIN example.com.\n$TTL 3600\n@ IN SOA ns1 postmaster ( 1 ; serial\n 3600 ; refresh\n 600 1209600 3600 )\n");
+        for(i=0; i<200000; i++) {
+            fprintf(fp, "name%d\tIN\tA\t192.0.2.%d ; address\n", i, i % 250);
+            fprintf(fp, "name%d\tIN\tRRSIG\tA 8 3 3600 ( 20300101000000 20200101000000 12345 example.com.\n"
+                        "\t\tFV0gZ8FAaqlFnJ6jFuBj4DSImeftLaRdOXhjGxUZuZe29PkkuZP9u2cb9n4SSXRSn88rEHoSff8nPKwYKCOzOx\n"
+                        "\t\tlgHx7q4FZwmGrLrmV7Sfjp41O7DI4P8F/APVwfuc4d63uQq3C2opXgFv76L0CQ/+9mIOxthjL7hVy00UDPzWM= )\n", i);
+            fprintf(fp, "name%d\tIN\tTXT\t\"quoted (text) ; not a comment\"\n", i);
+        }
+        fclose(fp);
+    }
+    CU_ASSERT_EQUAL(stat(filename, &st), 0);
+    filesize = st.st_size;
+    CU_ASSERT_PTR_NOT_NULL(line = malloc(SE_ADFILE_MAXLINE));
+    CU_ASSERT_PTR_NOT_NULL(fp = fopen(filename, "r"));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while((len = adutil_readline_frm_file(fp, line, &lineno, 0)) >= 0) {
+        ++records;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    fclose(fp);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "read %ld lines of %ld bytes in %.3f s, %.1f MB/s\n", records, (long)filesize, elapsed, filesize / elapsed / 1000000.0);
+    if(getenv("ODS_TESTZONEFILE") == NULL) {
+        CU_ASSERT_EQUAL(records, 600003);
+        CU_ASSERT_EQUAL(lineno, 1000005);
+        fp = fopen(filename, "r");
+        for(i=0; i<5; i++)
+            adutil_readline_frm_file(fp, line, &lineno, 0);
+        CU_ASSERT_EQUAL(strcmp(line, "name0\tIN\tRRSIG\tA 8 3 3600   20300101000000 20200101000000 12345 example.com. \t\tFV0gZ8FAaqlFnJ6jFuBj4DSImeftLaRdOXhjGxUZuZe29PkkuZP9u2cb9n4SSXRSn88rEHoSff8nPKwYKCOzOx \t\tlgHx7q4FZwmGrLrmV7Sfjp41O7DI4P8F/APVwfuc4d63uQq3C2opXgFv76L0CQ/+9mIOxthjL7hVy00UDPzWM=  "), 0);
+        adutil_readline_frm_file(fp, line, &lineno, 0);
+        CU_ASSERT_EQUAL(strcmp(line, "name0\tIN\tTXT\t\"quoted (text) ; not a comment\""), 0);
+        fclose(fp);
+        unlink(filename);
+    }
+    free(line);
+}
+
+/* A comment longer than the line buffer is read in several chunks, none
+ * of which may end up in the line.
+ */
+void
+testZoneReaderComment(void)
+{
+    int i;
+    unsigned int lineno = 0;
+    const char* filename = "zonereadercomment.zone";
+    char* line;
+    FILE* fp;
+    CU_ASSERT_PTR_NOT_NULL(fp = fopen(filename, "w"));
+    fprintf(fp, "a\tIN\tA\t192.0.2.1 ;");
+    for(i=0; i<SE_ADFILE_MAXLINE * 2 / 16; i++)
+        fprintf(fp, " ( \"comment\" )");
+    fprintf(fp, "\nb\tIN\tA\t192.0.2.2\n");
+    fclose(fp);
+    CU_ASSERT_PTR_NOT_NULL(line = malloc(SE_ADFILE_MAXLINE));
+    CU_ASSERT_PTR_NOT_NULL(fp = fopen(filename, "r"));
+    CU_ASSERT(adutil_readline_frm_file(fp, line, &lineno, 0) >= 0);
+    CU_ASSERT_EQUAL(strcmp(line, "a\tIN\tA\t192.0.2.1 "), 0);
+    CU_ASSERT(adutil_readline_frm_file(fp, line, &lineno, 0) >= 0);
+    CU_ASSERT_EQUAL(strcmp(line, "b\tIN\tA\t192.0.2.2"), 0);
+    CU_ASSERT_EQUAL(adutil_readline_frm_file(fp, line, &lineno, 0), -1);
+    CU_ASSERT_EQUAL(lineno, 2);
+    fclose(fp);
+    unlink(filename);
+    free(line);
+}
+
+void
+testNSEC3Hash(void)
+{
+    int i, n, nnames = 100000;
+    const char** names;
+    char** hashed;
+    char* reference;
+    ldns_rdf* dname;
+    ldns_rdf* apex;
+    ldns_rdf* label;
+    ldns_rdf* owner;
+    signconf_type* signconf;
+    struct names_nsec3cache* cache;
+    struct timespec start, stop;
+    double elapsed;
+    logger_configurecls("performance", logger_INFO, logger_log_stdout);
+    signconf = signconf_create();
+    signconf->nsec3params = nsec3params_create(signconf, LDNS_SHA1, 0, 10, "aabbccdd");
+    CU_ASSERT_PTR_NOT_NULL(names = malloc(sizeof(char*) * nnames));
+    CU_ASSERT_PTR_NOT_NULL(hashed = malloc(sizeof(char*) * nnames));
+    for(i=0; i<nnames; i++) {
+        switch(i % 4) {
+            case 0:  asprintf((char**)&names[i], "name%d.example.com.", i); break;
+            case 1:  asprintf((char**)&names[i], "Sub.NAME%d.Example.COM", i); break;
+            case 2:  asprintf((char**)&names[i], "*.w%d.example.com.", i); break;
+            default: asprintf((char**)&names[i], "a\\.b%d.example.com.", i); break;
+        }
+    }
+    apex = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, "example.com");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i=0; i<nnames; i++) {
+        dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, names[i]);
+        label = ldns_nsec3_hash_name(dname, LDNS_SHA1, 10, signconf->nsec3params->salt_len, signconf->nsec3params->salt_data);
+        owner = ldns_dname_cat_clone(label, apex);
+        reference = ldns_rdf2str(owner);
+        free(reference);
+        ldns_rdf_deep_free(owner);
+        ldns_rdf_deep_free(label);
+        ldns_rdf_deep_free(dname);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+    fprintf(stderr, "ldns hashing of %d names in %.3f s, %.0f names/s\n", nnames, elapsed, nnames / elapsed);
+    cache = names_nsec3cachecreate();
+    for(n=0; n<2; n++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        names_nsec3hashnames(cache, signconf->nsec3params, "example.com", names, hashed, nnames);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+        fprintf(stderr, "batch hashing of %d names %s in %.3f s, %.0f names/s\n", nnames,
+                (n == 0 ? "uncached" : "cached"), elapsed, nnames / elapsed);
+        for(i=0; i<nnames; i++) {
+            if(i % 997 == 0) {
+                dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, names[i]);
+                label = ldns_nsec3_hash_name(dname, LDNS_SHA1, 10, signconf->nsec3params->salt_len, signconf->nsec3params->salt_data);
+                owner = ldns_dname_cat_clone(label, apex);
+                reference = ldns_rdf2str(owner);
+                CU_ASSERT_STRING_EQUAL(hashed[i], reference);
+                free(reference);
+                ldns_rdf_deep_free(owner);
+                ldns_rdf_deep_free(label);
+                ldns_rdf_deep_free(dname);
+            }
+            free(hashed[i]);
+        }
+    }
+    names_nsec3cachedestroy(cache);
+    ldns_rdf_deep_free(apex);
+    for(i=0; i<nnames; i++)
+        free((char*)names[i]);
+    free(names);
+    free(hashed);
+    signconf_cleanup(signconf);
+}
+
 extern void testNothing(void);
 extern void testIterator(void);
 extern void testConfig(void);
@@ -1010,6 +1896,19 @@ extern void testSignFastRemove(void);
 extern void testSignFastInsert(void);
 extern void testSignFastChange(void);
 extern void testDisposing(void);
+extern void testCommitlogStress(void);
+extern void testIndexSharing(void);
+extern void testParallelUpdate(void);
+extern void testDenialChain(void);
+extern void testStatefilePersist(void);
+extern void testStatefileCheckpoint(void);
+extern void testMetastorage(void);
+extern void testZoneOutput(void);
+extern void testBase64(void);
+extern void testRRFormat(void);
+extern void testZoneReader(void);
+extern void testZoneReaderComment(void);
+extern void testNSEC3Hash(void);
 
 struct test_struct {
     const char* suite;
@@ -1029,13 +1928,27 @@ struct test_struct {
     { "signer", "testBasic",           "test of start stop" },
     { "signer", "testSignNSEC",        "test NSEC signing" },
     { "signer", "testSignNSEC3",       "test NSEC3 signing" },
+    { "signer", "testSignNSEC3Resign", "test NSEC3 signature refresh" },
     { "signer", "testSignResign",      "test resigning restart" },
     { "signer", "testSignFastRemove",  "test fast updates deletes" },
     { "signer", "testSignFastInsert",  "test fast updates inserts" },
     { "signer", "testSignFastChange",  "test fast updates changes" },
     { "signer", "testDisposing",       "test dispose" },
     { "signer", "testBackup",          "test migration backup files" },
+    { "signer", "testCommitlogStress", "test concurrent commit log readers" },
+    { "signer", "testParallelUpdate",  "test parallel secondary index updates" },
+    { "signer", "testZoneReaderComment", "test comments longer than the line buffer" },
     { "signer", "-testSignNL",          "test NL signing" },
+    { "signer", "-testIndexSharing",    "test index sharing memory and commit latency" },
+    { "signer", "-testDenialChain",     "test NSEC3 chain construction speed" },
+    { "signer", "-testStatefilePersist", "test state file persist and restore speed" },
+    { "signer", "-testStatefileCheckpoint", "test state file checkpoint and compaction" },
+    { "signer", "-testMetastorage",     "test zone meta data storage speed" },
+    { "signer", "-testZoneOutput",      "test zone output speed and content" },
+    { "signer", "-testBase64",          "test base64 encoding and decoding speed" },
+    { "signer", "testRRFormat",         "test presentation format output and speed" },
+    { "signer", "-testZoneReader",      "test zone file line reading speed" },
+    { "signer", "testNSEC3Hash",        "test batched NSEC3 hashing speed" },
     { NULL, NULL, NULL }
 };
 
@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -47,21 +48,49 @@
 struct names_table_struct {
     ldns_rbtree_t* tree;
     names_table_type next;
+    int (*cmp)(const void *, const void *);
+    long epoch;
 };
 
+/* Committed changelogs form a singly linked chain which is only ever
+ * appended to at the tail, under the lock, and trimmed at the head.  Each
+ * changelog gets a strictly increasing epoch when it is published.  Readers
+ * follow the chain without taking the lock; they only publish, per view,
+ * the epoch of the changelog they are currently holding.  A changelog can
+ * be reclaimed once every subscribed view pins a later epoch, as no view
+ * can reach it anymore.
+ */
 struct names_commitlog_struct {
     pthread_mutex_t lock;
     int nviews;
+    int maxviews;
     struct names_changelogchainentry {
         names_view_type view;
-        names_table_type* nextchangelogptr;
-    } *views;
+        names_table_type lastchangelog;
+        long pinned;
+    } **views;
+    struct names_retiredviews {
+        struct names_changelogchainentry** views;
+        struct names_retiredviews* next;
+    } *retired;
+    long epoch;
     names_table_type firstchangelog;
     names_table_type lastchangelog;
     marshall_handle store;
     void (*storefn)(names_table_type, marshall_handle);
+    long long persistbytes;
+    long persistsyncs;
+    int unsynced;
+    time_t lastsync;
 };
 
+/* Changelogs are appended to the store as they are published, but only
+ * forced to disk once for a group of them, or when they have been
+ * lingering for a while.
+ */
+#define NAMES_COMMITLOGSYNCCOUNT 64
+#define NAMES_COMMITLOGSYNCDELAY 1
+
 static void
 destroynode(void* arg, void* key, void* val)
 {
@@ -94,7 +123,9 @@ names_commitlogdestroyfull(names_table_type table)
 void
 names_commitlogdestroyall(names_commitlog_type commitlog, marshall_handle* store)
 {
+    int i;
     names_table_type next;
+    struct names_retiredviews* retired;
     pthread_mutex_destroy(&commitlog->lock);
     if(store)
         *store = commitlog->store;
@@ -103,10 +134,41 @@ names_commitlogdestroyall(names_commitlog_type commitlog, marshall_handle* store
         names_commitlogdestroy(commitlog->firstchangelog);
         commitlog->firstchangelog = next;
     }
+    while(commitlog->retired) {
+        retired = commitlog->retired;
+        commitlog->retired = retired->next;
+        free(retired->views);
+        free(retired);
+    }
+    for(i=0; i<commitlog->nviews; i++)
+        free(commitlog->views[i]);
     free(commitlog->views);
     free(commitlog);
 }
 
+/* Must be called with the lock held. */
+static void
+reclaim(names_commitlog_type logs)
+{
+    int i;
+    long pinned, minpinned;
+    names_table_type changelog;
+    minpinned = -1;
+    for(i=0; i<logs->nviews; i++) {
+        if(logs->views[i]->view) {
+            pinned = __atomic_load_n(&logs->views[i]->pinned, __ATOMIC_ACQUIRE);
+            if(minpinned < 0 || pinned < minpinned)
+                minpinned = pinned;
+        }
+    }
+    while(logs->firstchangelog && logs->firstchangelog->epoch < minpinned) {
+        changelog = logs->firstchangelog;
+        assert(changelog->next);
+        __atomic_store_n(&logs->firstchangelog, changelog->next, __ATOMIC_RELEASE);
+        names_commitlogdestroy(changelog);
+    }
+}
+
 int
 names_commitlogpoppush(names_commitlog_type logs, int viewid, names_table_type* commitlog, names_table_type* submitlog)
 {
@@ -119,85 +181,109 @@ names_commitlogpoppush(names_commitlog_type logs, int viewid, names_table_type*
      * function iteratively).  When there are no changelogs present anymore
      * it hasn't processed, it may optionally add its changelog to the last
      * in this chain.
-     */ 
-    int backlog;
-    int i;
+     * Retrieving changelogs does not need the lock, only publishing a
+     * changelog and reclaiming ones no longer in use do.  The changelog last
+     * returned to a view is pinned and remains valid until the next call.
+     */
+    struct names_changelogchainentry* entry;
     names_table_type poppedlog;
-    names_table_type previouslog = NULL;
-    CHECK(pthread_mutex_lock(&logs->lock));
-    
-    poppedlog = *(logs->views[viewid].nextchangelogptr);
-    if(poppedlog) {
-        logs->views[viewid].nextchangelogptr = &(poppedlog->next);
-        backlog = 1;
-    } else
-        backlog = 0;
-    if(*commitlog) {
-        if(*commitlog == logs->firstchangelog) {
-            previouslog = *commitlog;
-            for(i=0; i<logs->nviews; i++) {
-                if(&(logs->firstchangelog) == logs->views[i].nextchangelogptr)
-                    break;
-            }
-            if(i == logs->nviews) {
-                for(i=0; i<logs->nviews; i++) {
-                    if(logs->views[i].view)
-                        if(logs->views[i].nextchangelogptr == &(previouslog->next))
-                            logs->views[i].nextchangelogptr = &(logs->firstchangelog);
-                }
-                if(logs->lastchangelog == logs->firstchangelog)
-                    logs->lastchangelog = logs->firstchangelog->next;
-                logs->firstchangelog = logs->firstchangelog->next;
-                *commitlog = NULL;
+    int dosync;
+    entry = __atomic_load_n(&logs->views, __ATOMIC_ACQUIRE)[viewid];
+    if(entry->lastchangelog)
+        poppedlog = __atomic_load_n(&entry->lastchangelog->next, __ATOMIC_ACQUIRE);
+    else
+        poppedlog = __atomic_load_n(&logs->firstchangelog, __ATOMIC_ACQUIRE);
+    if(poppedlog == NULL && submitlog) {
+        CHECK(pthread_mutex_lock(&logs->lock));
+        if(entry->lastchangelog)
+            poppedlog = entry->lastchangelog->next;
+        else
+            poppedlog = logs->firstchangelog;
+        if(poppedlog == NULL) {
+            names_commitlogpersistincr(logs, *submitlog);
+            dosync = (logs->store != NULL && (logs->unsynced >= NAMES_COMMITLOGSYNCCOUNT || time(NULL) - logs->lastsync >= NAMES_COMMITLOGSYNCDELAY));
+            (*submitlog)->epoch = ++(logs->epoch);
+            if(logs->lastchangelog == NULL) {
+                __atomic_store_n(&logs->firstchangelog, *submitlog, __ATOMIC_RELEASE);
             } else {
-                previouslog = NULL;
+                assert(logs->lastchangelog == entry->lastchangelog);
+                __atomic_store_n(&logs->lastchangelog->next, *submitlog, __ATOMIC_RELEASE);
             }
+            logs->lastchangelog = *submitlog;
+            entry->lastchangelog = *submitlog;
+            __atomic_store_n(&entry->pinned, (*submitlog)->epoch, __ATOMIC_RELEASE);
+            reclaim(logs);
+            CHECK(pthread_mutex_unlock(&logs->lock));
+            if(dosync)
+                names_commitlogpersistsync(logs);
+            *commitlog = *submitlog;
+            *submitlog = names_tablecreate2(*submitlog);
+            return 0;
         }
+        CHECK(pthread_mutex_unlock(&logs->lock));
     }
-    if(poppedlog == NULL && submitlog) {
-        names_commitlogpersistincr(logs, *submitlog);
-        if(logs->firstchangelog == NULL) {
-            assert(logs->lastchangelog == NULL);
-            logs->lastchangelog = logs->firstchangelog = *submitlog;
-        } else {
-            logs->lastchangelog->next = *submitlog;
-            logs->lastchangelog = *submitlog;
+    *commitlog = poppedlog;
+    if(poppedlog) {
+        entry->lastchangelog = poppedlog;
+        __atomic_store_n(&entry->pinned, poppedlog->epoch, __ATOMIC_RELEASE);
+        if(pthread_mutex_trylock(&logs->lock) == 0) {
+            reclaim(logs);
+            CHECK(pthread_mutex_unlock(&logs->lock));
         }
-        assert(*(logs->views[viewid].nextchangelogptr) == *submitlog);
-        logs->views[viewid].nextchangelogptr = &((*logs->views[viewid].nextchangelogptr)->next);
-        *commitlog = *submitlog;
-        *submitlog = names_tablecreate2(*submitlog);
+        return 1;
     } else {
-        *commitlog = poppedlog;
+        return 0;
     }
-    CHECK(pthread_mutex_unlock(&logs->lock));
-    if(previouslog)
-        names_commitlogdestroy(previouslog);
-    return backlog;
 }
 
 int
 names_commitlogsubscribe(names_view_type view, names_commitlog_type* commitlogptr)
 {
     int viewid;
+    names_commitlog_type logs;
+    struct names_changelogchainentry** views;
+    struct names_retiredviews* retired;
     if(*commitlogptr == NULL) {
-        *commitlogptr = malloc(sizeof(struct names_commitlog_struct));
-        CHECK(pthread_mutex_init(&(*commitlogptr)->lock, NULL));
-        CHECK(pthread_mutex_lock(&(*commitlogptr)->lock));
-        (*commitlogptr)->nviews = 1;
-        (*commitlogptr)->views = malloc(sizeof(struct names_changelogchainentry) * (*commitlogptr)->nviews);
-        (*commitlogptr)->firstchangelog = NULL;
-        (*commitlogptr)->lastchangelog = NULL;
-        (*commitlogptr)->store = NULL;
+        logs = malloc(sizeof(struct names_commitlog_struct));
+        CHECK(pthread_mutex_init(&logs->lock, NULL));
+        CHECK(pthread_mutex_lock(&logs->lock));
+        logs->nviews = 0;
+        logs->maxviews = 4;
+        logs->views = malloc(sizeof(struct names_changelogchainentry*) * logs->maxviews);
+        logs->retired = NULL;
+        logs->epoch = 0;
+        logs->firstchangelog = NULL;
+        logs->lastchangelog = NULL;
+        logs->store = NULL;
+        logs->persistbytes = 0;
+        logs->persistsyncs = 0;
+        logs->unsynced = 0;
+        logs->lastsync = time(NULL);
+        *commitlogptr = logs;
     } else {
-        CHECK(pthread_mutex_lock(&(*commitlogptr)->lock));
-        (*commitlogptr)->nviews += 1;
-        (*commitlogptr)->views = realloc((*commitlogptr)->views, sizeof(struct names_changelogchainentry) * (*commitlogptr)->nviews);
+        logs = *commitlogptr;
+        CHECK(pthread_mutex_lock(&logs->lock));
+        if(logs->nviews == logs->maxviews) {
+            /* Other views may still be reading the old array without the
+             * lock, so it is only released when the commitlog is destroyed.
+             */
+            views = malloc(sizeof(struct names_changelogchainentry*) * logs->maxviews * 2);
+            memcpy(views, logs->views, sizeof(struct names_changelogchainentry*) * logs->nviews);
+            logs->maxviews *= 2;
+            retired = malloc(sizeof(struct names_retiredviews));
+            retired->views = logs->views;
+            retired->next = logs->retired;
+            logs->retired = retired;
+            __atomic_store_n(&logs->views, views, __ATOMIC_RELEASE);
+        }
     }
-    viewid = (*commitlogptr)->nviews - 1;
-    (*commitlogptr)->views[viewid].nextchangelogptr = &((*commitlogptr)->firstchangelog);
-    (*commitlogptr)->views[viewid].view = view;
-    CHECK(pthread_mutex_unlock(&(*commitlogptr)->lock));
+    viewid = logs->nviews;
+    logs->views[viewid] = malloc(sizeof(struct names_changelogchainentry));
+    logs->views[viewid]->view = view;
+    logs->views[viewid]->lastchangelog = NULL;
+    logs->views[viewid]->pinned = 0;
+    logs->nviews += 1;
+    CHECK(pthread_mutex_unlock(&logs->lock));
     return viewid;
 }
 
@@ -205,17 +291,70 @@ void
 names_commitlogunsubscribe(int viewid, names_commitlog_type commitlogptr)
 {
     CHECK(pthread_mutex_lock(&commitlogptr->lock));
-    commitlogptr->views[viewid].nextchangelogptr = NULL;
-    commitlogptr->views[viewid].view = NULL;
+    commitlogptr->views[viewid]->lastchangelog = NULL;
+    commitlogptr->views[viewid]->view = NULL;
     CHECK(pthread_mutex_unlock(&commitlogptr->lock));
 }
 
 void
 names_commitlogpersistincr(names_commitlog_type views, names_table_type changelog)
 {
+    off_t offset;
     if(views->store == NULL)
         return;
+    offset = marshalloffset(views->store);
     views->storefn(changelog, views->store);
+    views->persistbytes += marshalloffset(views->store) - offset;
+    views->unsynced += 1;
+}
+
+/* Forces the changelogs written so far to disk.  The store is only locked
+ * while obtaining the file, other views may continue to commit while
+ * the data is synced.
+ */
+void
+names_commitlogpersistsync(names_commitlog_type commitlog)
+{
+    int fd = -1;
+    CHECK(pthread_mutex_lock(&commitlog->lock));
+    if(commitlog->store && commitlog->unsynced > 0 && marshallfileno(commitlog->store) >= 0) {
+        if(marshallsync(commitlog->store, 1) == 0) {
+            fd = dup(marshallfileno(commitlog->store));
+            commitlog->unsynced = 0;
+            commitlog->persistsyncs += 1;
+        }
+    }
+    commitlog->lastsync = time(NULL);
+    CHECK(pthread_mutex_unlock(&commitlog->lock));
+    if(fd >= 0) {
+        if(fdatasync(fd))
+            logger_message(&names_logcommitlog, logger_noctx, logger_ERROR, "unable to sync state: %s\n", strerror(errno));
+        close(fd);
+    }
+}
+
+/* Replaces the store while no changelogs are being published, such that
+ * no change is lost when switching between files.
+ */
+void
+names_commitlogpersistswitch(names_commitlog_type commitlog, marshall_handle (*switchfn)(void* arg, marshall_handle store), void* arg)
+{
+    CHECK(pthread_mutex_lock(&commitlog->lock));
+    commitlog->store = switchfn(arg, commitlog->store);
+    commitlog->unsynced = 0;
+    commitlog->lastsync = time(NULL);
+    CHECK(pthread_mutex_unlock(&commitlog->lock));
+}
+
+void
+names_commitlogpersiststats(names_commitlog_type commitlog, long long* bytes, long* syncs)
+{
+    CHECK(pthread_mutex_lock(&commitlog->lock));
+    if(bytes)
+        *bytes = commitlog->persistbytes;
+    if(syncs)
+        *syncs = commitlog->persistsyncs;
+    CHECK(pthread_mutex_unlock(&commitlog->lock));
 }
 
 void
@@ -227,14 +366,27 @@ names_commitlogpersistappend(names_commitlog_type commitlog, void (*persistfn)(n
     CHECK(pthread_mutex_unlock(&commitlog->lock));
 }
 
+/* Writes the changelogs not yet in the view to the new store and switches
+ * over to it.  The optional commitfn is called before switching, if it
+ * fails the old store remains in use and *oldstore is left NULL.
+ */
 int
-names_commitlogpersistfull(names_commitlog_type commitlog, void (*persistfn)(names_table_type, marshall_handle), int viewid, marshall_handle store, marshall_handle* oldstore)
+names_commitlogpersistfull(names_commitlog_type commitlog, void (*persistfn)(names_table_type, marshall_handle), int viewid, marshall_handle store, int (*commitfn)(void* arg, marshall_handle store), void* arg, marshall_handle* oldstore)
 {
     names_table_type changelog;
     CHECK(pthread_mutex_lock(&commitlog->lock));
-    for(changelog = *(commitlog->views[viewid].nextchangelogptr); changelog; changelog=changelog->next) {
+    if(commitlog->views[viewid]->lastchangelog)
+        changelog = commitlog->views[viewid]->lastchangelog->next;
+    else
+        changelog = commitlog->firstchangelog;
+    for(; changelog; changelog=changelog->next) {
         persistfn(changelog, store);
     }
+    *oldstore = NULL;
+    if(commitfn && commitfn(arg, store)) {
+        CHECK(pthread_mutex_unlock(&commitlog->lock));
+        return 1;
+    }
     *oldstore = commitlog->store;
     commitlog->store = store;
     commitlog->storefn = persistfn;
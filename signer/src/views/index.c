@@ -32,24 +32,355 @@
 #include <time.h>
 #include <ldns/ldns.h>
 #include "uthash.h"
+#include "utilities.h"
 #include "proto.h"
 
 typedef int (*comparefunction)(const void *, const void *);
 typedef int (*acceptfunction)(recordset_type newitem, recordset_type currentitem, int* cmp);
 
+/* Indices are persistent AVL trees.  Nodes are reference counted and may be
+ * shared between indices, or between an index and an iterator over it.  A
+ * node is only modified in place when it is not shared, otherwise the path
+ * from the root to the modification is copied.  Cloning an index is
+ * therefore only a matter of taking a reference on the root, and unchanged
+ * subtrees remain shared between views.
+ */
+struct names_indexnode {
+    struct names_indexnode* left;
+    struct names_indexnode* right;
+    recordset_type record;
+    int height;
+    int refcount;
+};
+
 struct names_index_struct {
     const char* keyname;
-    ldns_rbtree_t* tree;
+    struct names_indexnode* root;
     acceptfunction acceptfunc;
+    comparefunction comparfunc;
+};
+
+#define NAMES_INDEXMAXDEPTH 64
+
+struct names_indexcursor {
+    int depth;
+    struct names_indexnode* path[NAMES_INDEXMAXDEPTH];
 };
 
 struct names_iterator_struct {
     int (*iterate)(names_iterator*iter, void**);
     int (*advance)(names_iterator*iter, void**);
     int (*end)(names_iterator*iter);
-    ldns_rbnode_t* current;
+    struct names_indexnode* root;
+    struct names_indexcursor cursor;
 };
 
+static struct names_indexnode*
+nodecreate(recordset_type record)
+{
+    struct names_indexnode* node;
+    CHECKALLOC(node = malloc(sizeof(struct names_indexnode)));
+    node->left = NULL;
+    node->right = NULL;
+    node->record = record;
+    node->height = 1;
+    node->refcount = 1;
+    return node;
+}
+
+static void
+noderef(struct names_indexnode* node)
+{
+    if(node)
+        __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+nodeunref(struct names_indexnode* node)
+{
+    struct names_indexnode* right;
+    while(node && __atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        nodeunref(node->left);
+        right = node->right;
+        free(node);
+        node = right;
+    }
+}
+
+static void
+nodeown(struct names_indexnode** nodeptr)
+{
+    struct names_indexnode* node = *nodeptr;
+    struct names_indexnode* copy;
+    if(__atomic_load_n(&node->refcount, __ATOMIC_ACQUIRE) > 1) {
+        CHECKALLOC(copy = malloc(sizeof(struct names_indexnode)));
+        copy->left = node->left;
+        copy->right = node->right;
+        copy->record = node->record;
+        copy->height = node->height;
+        copy->refcount = 1;
+        noderef(copy->left);
+        noderef(copy->right);
+        nodeunref(node);
+        *nodeptr = copy;
+    }
+}
+
+static inline int
+nodeheight(struct names_indexnode* node)
+{
+    return (node ? node->height : 0);
+}
+
+static inline void
+nodeupdate(struct names_indexnode* node)
+{
+    int left = nodeheight(node->left);
+    int right = nodeheight(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
+
+/* The node to rotate must be owned, the child rotated up becomes owned. */
+static struct names_indexnode*
+noderotateright(struct names_indexnode* node)
+{
+    struct names_indexnode* child;
+    nodeown(&node->left);
+    child = node->left;
+    node->left = child->right;
+    child->right = node;
+    nodeupdate(node);
+    nodeupdate(child);
+    return child;
+}
+
+static struct names_indexnode*
+noderotateleft(struct names_indexnode* node)
+{
+    struct names_indexnode* child;
+    nodeown(&node->right);
+    child = node->right;
+    node->right = child->left;
+    child->left = node;
+    nodeupdate(node);
+    nodeupdate(child);
+    return child;
+}
+
+static struct names_indexnode*
+noderebalance(struct names_indexnode* node)
+{
+    int balance;
+    nodeupdate(node);
+    balance = nodeheight(node->left) - nodeheight(node->right);
+    if(balance > 1) {
+        if(nodeheight(node->left->left) < nodeheight(node->left->right)) {
+            nodeown(&node->left);
+            node->left = noderotateleft(node->left);
+        }
+        node = noderotateright(node);
+    } else if(balance < -1) {
+        if(nodeheight(node->right->right) < nodeheight(node->right->left)) {
+            nodeown(&node->right);
+            node->right = noderotateright(node->right);
+        }
+        node = noderotateleft(node);
+    }
+    return node;
+}
+
+static struct names_indexnode*
+nodesearch(names_index_type index, const void* key)
+{
+    int cmp;
+    struct names_indexnode* node = index->root;
+    while(node) {
+        cmp = index->comparfunc(key, node->record);
+        if(cmp == 0)
+            return node;
+        node = (cmp < 0 ? node->left : node->right);
+    }
+    return NULL;
+}
+
+/* Only called when the key is known not to be present. */
+static void
+nodeinsert(names_index_type index, struct names_indexnode** nodeptr, recordset_type record)
+{
+    if(*nodeptr == NULL) {
+        *nodeptr = nodecreate(record);
+    } else {
+        nodeown(nodeptr);
+        if(index->comparfunc(record, (*nodeptr)->record) < 0)
+            nodeinsert(index, &(*nodeptr)->left, record);
+        else
+            nodeinsert(index, &(*nodeptr)->right, record);
+        *nodeptr = noderebalance(*nodeptr);
+    }
+}
+
+static recordset_type
+nodedeletemin(struct names_indexnode** nodeptr)
+{
+    recordset_type record;
+    struct names_indexnode* node;
+    nodeown(nodeptr);
+    node = *nodeptr;
+    if(node->left) {
+        record = nodedeletemin(&node->left);
+        *nodeptr = noderebalance(node);
+    } else {
+        record = node->record;
+        *nodeptr = node->right;
+        free(node);
+    }
+    return record;
+}
+
+/* Only called when the key is known to be present. */
+static void
+nodedelete(names_index_type index, struct names_indexnode** nodeptr, const void* key)
+{
+    int cmp;
+    struct names_indexnode* node;
+    nodeown(nodeptr);
+    node = *nodeptr;
+    cmp = index->comparfunc(key, node->record);
+    if(cmp < 0) {
+        nodedelete(index, &node->left, key);
+    } else if(cmp > 0) {
+        nodedelete(index, &node->right, key);
+    } else if(node->left == NULL || node->right == NULL) {
+        /* the reference on the remaining child is handed over */
+        *nodeptr = (node->left ? node->left : node->right);
+        free(node);
+        return;
+    } else {
+        node->record = nodedeletemin(&node->right);
+    }
+    *nodeptr = noderebalance(node);
+}
+
+/* Only called when the key is known to be present. */
+static void
+nodereplace(names_index_type index, struct names_indexnode** nodeptr, const void* key, recordset_type record)
+{
+    int cmp;
+    nodeown(nodeptr);
+    cmp = index->comparfunc(key, (*nodeptr)->record);
+    if(cmp < 0) {
+        nodereplace(index, &(*nodeptr)->left, key, record);
+    } else if(cmp > 0) {
+        nodereplace(index, &(*nodeptr)->right, key, record);
+    } else {
+        (*nodeptr)->record = record;
+    }
+}
+
+static int
+nodetraverse(struct names_indexnode* node, void (*userfunc)(void* arg, void* key, void* val), void* userarg)
+{
+    int count = 0;
+    while(node) {
+        count += nodetraverse(node->left, userfunc, userarg) + 1;
+        if(userfunc)
+            userfunc(userarg, node->record, node->record);
+        node = node->right;
+    }
+    return count;
+}
+
+static int
+nodeshared(struct names_indexnode* node, int shared)
+{
+    int count = 0;
+    while(node) {
+        if(!shared && __atomic_load_n(&node->refcount, __ATOMIC_RELAXED) > 1)
+            shared = 1;
+        count += nodeshared(node->left, shared) + shared;
+        node = node->right;
+    }
+    return count;
+}
+
+static struct names_indexnode*
+cursorcurrent(struct names_indexcursor* cursor)
+{
+    return (cursor->depth > 0 ? cursor->path[cursor->depth-1] : NULL);
+}
+
+static struct names_indexnode*
+cursordescend(struct names_indexcursor* cursor, struct names_indexnode* node, int leftwards)
+{
+    while(node) {
+        assert(cursor->depth < NAMES_INDEXMAXDEPTH);
+        cursor->path[cursor->depth++] = node;
+        node = (leftwards ? node->left : node->right);
+    }
+    return cursorcurrent(cursor);
+}
+
+static struct names_indexnode*
+cursorfirst(struct names_indexcursor* cursor, struct names_indexnode* root)
+{
+    cursor->depth = 0;
+    return cursordescend(cursor, root, 1);
+}
+
+static struct names_indexnode*
+cursorstep(struct names_indexcursor* cursor, int forwards)
+{
+    struct names_indexnode* node;
+    struct names_indexnode* child;
+    node = cursorcurrent(cursor);
+    if(node == NULL)
+        return NULL;
+    child = (forwards ? node->right : node->left);
+    if(child) {
+        cursor->path[cursor->depth++] = child;
+        return cursordescend(cursor, (forwards ? child->left : child->right), forwards);
+    }
+    do {
+        child = cursor->path[--cursor->depth];
+    } while(cursor->depth > 0 && (forwards ? cursor->path[cursor->depth-1]->right : cursor->path[cursor->depth-1]->left) == child);
+    return cursorcurrent(cursor);
+}
+
+static struct names_indexnode*
+cursornext(struct names_indexcursor* cursor)
+{
+    return cursorstep(cursor, 1);
+}
+
+static struct names_indexnode*
+cursorprevious(struct names_indexcursor* cursor)
+{
+    return cursorstep(cursor, 0);
+}
+
+/* Position the cursor on the greatest element less or equal than the key,
+ * returns whether an exact match was found.  The cursor is left empty when
+ * all elements are greater.
+ */
+static int
+cursorlessequal(names_index_type index, struct names_indexcursor* cursor, const void* key)
+{
+    int cmp = 0;
+    struct names_indexnode* node = index->root;
+    cursor->depth = 0;
+    while(node) {
+        assert(cursor->depth < NAMES_INDEXMAXDEPTH);
+        cursor->path[cursor->depth++] = node;
+        cmp = index->comparfunc(key, node->record);
+        if(cmp == 0)
+            return 1;
+        node = (cmp < 0 ? node->left : node->right);
+    }
+    if(cmp < 0)
+        cursorprevious(cursor);
+    return 0;
+}
+
 int
 names_indexcreate(names_index_type* index, const char* keyname)
 {
@@ -61,59 +392,103 @@ names_indexcreate(names_index_type* index, const char* keyname)
     assert(comparfunc);
     (*index)->keyname = strdup(keyname);
     (*index)->acceptfunc = acceptfunc;
-    (*index)->tree = ldns_rbtree_create(comparfunc);
+    (*index)->comparfunc = comparfunc;
+    (*index)->root = NULL;
     return 0;
 }
 
-struct destroyinfo {
-    void (*free)(void* arg, void* key, void* val);
-    void* arg;
-};
-
-static void
-disposenode(ldns_rbnode_t* node, void* cargo)
+int
+names_indexclone(names_index_type* index, names_index_type source)
 {
-    struct destroyinfo* user = cargo;
-    if(user && user->free) {
-        user->free(user->arg, (void*)node->key, (void*)node->data);
-    }
-    free(node);
+    names_indexcreate(index, source->keyname);
+    noderef(source->root);
+    (*index)->root = source->root;
+    return 0;
 }
 
 void
 names_indexdestroy(names_index_type index, void (*userfunc)(void* arg, void* key, void* val), void* userarg)
 {
-    struct destroyinfo cargo;
-    cargo.free = userfunc;
-    cargo.arg = userarg;
-    ldns_traverse_postorder(index->tree, disposenode, (userfunc?&cargo:NULL));
-    ldns_rbtree_free(index->tree);
+    if(userfunc)
+        nodetraverse(index->root, userfunc, userarg);
+    nodeunref(index->root);
     free((void*)index->keyname);
     free(index);
 }
 
+static struct names_indexnode*
+nodebuild(recordset_type* records, size_t count)
+{
+    struct names_indexnode* node;
+    size_t middle;
+    if(count == 0)
+        return NULL;
+    middle = count / 2;
+    node = nodecreate(records[middle]);
+    node->left = nodebuild(records, middle);
+    node->right = nodebuild(&records[middle+1], count - middle - 1);
+    nodeupdate(node);
+    return node;
+}
+
+/* Bulk load an empty index from records in index order, as read from a
+ * snapshot, in linear time.  Records the index does not accept are
+ * skipped, out of order input falls back to regular insertion.
+ */
+int
+names_indexbuild(names_index_type index, recordset_type* records, size_t count)
+{
+    size_t i, naccepted = 0;
+    int sorted = (index->root == NULL);
+    recordset_type* accepted;
+    CHECKALLOC(accepted = malloc(sizeof(recordset_type) * (count ? count : 1)));
+    for(i=0; i<count; i++) {
+        if(index->acceptfunc(records[i], NULL, NULL)) {
+            if(naccepted > 0 && index->comparfunc(accepted[naccepted-1], records[i]) >= 0)
+                sorted = 0;
+            accepted[naccepted++] = records[i];
+        }
+    }
+    if(sorted) {
+        index->root = nodebuild(accepted, naccepted);
+    } else {
+        for(i=0; i<count; i++)
+            names_indexinsert(index, records[i], NULL);
+    }
+    free(accepted);
+    return naccepted;
+}
+
+int
+names_indexcount(names_index_type index, int* shared)
+{
+    if(shared)
+        *shared = nodeshared(index->root, 0);
+    return nodetraverse(index->root, NULL, NULL);
+}
+
+size_t
+names_indexnodesize(void)
+{
+    return sizeof(struct names_indexnode);
+}
+
 int
 names_indexinsert(names_index_type index, recordset_type record, recordset_type* existing) {
     int cmp;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
     if (existing && *existing) {
-        node = ldns_rbtree_delete(index->tree, *existing);
-        free(node);
+        if(nodesearch(index, *existing))
+            nodedelete(index, &index->root, *existing);
     }
     if (record) {
         if (index->acceptfunc(record, NULL, NULL)) {
-            node = malloc(sizeof (ldns_rbnode_t));
-            assert(record);
-            node->key = record;
-            node->data = record;
-            if (!ldns_rbtree_insert(index->tree, node)) {
-                free(node);
-                node = ldns_rbtree_search(index->tree, record);
-                assert(node);
+            node = nodesearch(index, record);
+            if (node) {
                 if (existing && *existing == NULL) {
-                    *existing = (recordset_type) node->data;
+                    *existing = node->record;
                 }
-                switch (index->acceptfunc(record, (recordset_type) node->data, &cmp)) {
+                switch (index->acceptfunc(record, node->record, &cmp)) {
                     case 0:
                         logger_message(&names_logcommitlog, logger_noctx, logger_DIAG, "      record ignored from %s no match after found\n", index->keyname);
                         if(existing) {
@@ -122,29 +497,27 @@ names_indexinsert(names_index_type index, recordset_type record, recordset_type*
                         return 0;
                     case 1:
                         logger_message(&names_logcommitlog, logger_noctx, logger_DIAG, "      record rewritten in %s matched after found\n", index->keyname);
-                        node->key = record;
-                        node->data = record;
+                        nodereplace(index, &index->root, record, record);
                         return 1;
                     case 2:
                         logger_message(&names_logcommitlog, logger_noctx, logger_DIAG, "      record deleted in %s dropped after found\n", index->keyname);
-                        node = ldns_rbtree_delete(index->tree, node->key);
-                        free(node);
+                        nodedelete(index, &index->root, node->record);
                         return 0;
                     default:
                         abort(); // FIXME
                 }
             } else {
                 logger_message(&names_logcommitlog, logger_noctx, logger_DIAG, "      record inserted in %s after not found\n", index->keyname);
+                nodeinsert(index, &index->root, record);
                 return 1;
             }
         } else {
-            node = ldns_rbtree_search(index->tree, record);
+            node = nodesearch(index, record);
             if (node != NULL) {
-                if (index->acceptfunc(record, (recordset_type) node->data, &cmp) == 0) {
-                    if (cmp == 0 && node->key == record) {
+                if (index->acceptfunc(record, node->record, &cmp) == 0) {
+                    if (cmp == 0 && node->record == record) {
                         logger_message(&names_logcommitlog, logger_noctx, logger_DIAG, "      record not accepted and deleted from in %s\n", index->keyname);
-                        node = ldns_rbtree_delete(index->tree, node->key);
-                        free(node);
+                        nodedelete(index, &index->root, record);
                     } else {
                         logger_message(&names_logcommitlog, logger_noctx, logger_DIAG, "      record not accepted and withheld from deletion from in %s\n", index->keyname);
                     }
@@ -179,32 +552,37 @@ names_indexlookupkey(names_index_type index, const char* keyvalue)
 recordset_type
 names_indexlookup(names_index_type index, recordset_type find)
 {
-    ldns_rbnode_t* node;
-    node = ldns_rbtree_search(index->tree, find);
-    return (node != NULL && node != LDNS_RBTREE_NULL) ? (recordset_type) node->data : NULL;
+    struct names_indexnode* node;
+    node = nodesearch(index, find);
+    return (node != NULL ? node->record : NULL);
+}
+
+int
+names_indexcompare(names_index_type index, recordset_type a, recordset_type b)
+{
+    return index->comparfunc(a, b);
 }
 
 recordset_type
 names_indexlookupnext(names_index_type index, recordset_type find)
 {
-    ldns_rbnode_t* node;
-    node = ldns_rbtree_search(index->tree, find);
-    if(node != NULL && node != LDNS_RBTREE_NULL) {
-        node = ldns_rbtree_next(node);
-        if(node == NULL || node == LDNS_RBTREE_NULL) {
-            node = ldns_rbtree_first(index->tree);
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
+    if(cursorlessequal(index, &cursor, find)) {
+        node = cursornext(&cursor);
+        if(node == NULL) {
+            node = cursorfirst(&cursor, index->root);
         }
+        return node->record;
     }
-    return (node != NULL && node != LDNS_RBTREE_NULL) ? (recordset_type) node->data : NULL;
+    return NULL;
 }
 
 int
 names_indexremove(names_index_type index, recordset_type d)
 {
-    ldns_rbnode_t* node;
-    node = ldns_rbtree_delete(index->tree, d);
-    if(node) {
-        free(node);
+    if(nodesearch(index, d)) {
+        nodedelete(index, &index->root, d);
         return 1;
     } else
         return 0;
@@ -214,14 +592,17 @@ static int
 iterateimpl(names_iterator* i, void** item)
 {
     struct names_iterator_struct** iter = i;
+    struct names_indexnode* node;
     if (item)
         *item = NULL;
     if (*iter) {
-        if ((*iter)->current != NULL && (*iter)->current != LDNS_RBTREE_NULL) {
+        node = cursorcurrent(&(*iter)->cursor);
+        if (node != NULL) {
             if (item)
-                *item = (void*) (*iter)->current->data;
+                *item = node->record;
             return 1;
         } else {
+            nodeunref((*iter)->root);
             free(*iter);
             *iter = NULL;
         }
@@ -233,17 +614,19 @@ static int
 advanceimpl(names_iterator*i, void** item)
 {
     struct names_iterator_struct** iter = i;
+    struct names_indexnode* node;
     if (item)
         *item = NULL;
     if (*iter) {
-        if((*iter)->current != NULL && (*iter)->current != LDNS_RBTREE_NULL) {
-            (*iter)->current = ldns_rbtree_next((*iter)->current);
-            if((*iter)->current != NULL && (*iter)->current != LDNS_RBTREE_NULL) {
+        if(cursorcurrent(&(*iter)->cursor) != NULL) {
+            node = cursornext(&(*iter)->cursor);
+            if(node != NULL) {
                 if(item)
-                    *item = (void*)  (*iter)->current->data;
+                    *item = node->record;
                 return 1;
             }
         }
+        nodeunref((*iter)->root);
         free(*iter);
         *iter = NULL;
     }
@@ -251,23 +634,33 @@ advanceimpl(names_iterator*i, void** item)
 }
 
 static int
-endimpl(names_iterator*iter)
+endimpl(names_iterator*i)
 {
-    if(*iter) free(*iter);
-        *iter = NULL;
+    struct names_iterator_struct** iter = i;
+    if(*iter) {
+        nodeunref((*iter)->root);
+        free(*iter);
+    }
+    *iter = NULL;
     return 0;
 }
 
 names_iterator
 names_indexiterator(names_index_type index)
 {
-    names_iterator iter;
+    struct names_iterator_struct* iter;
     iter = malloc(sizeof(struct names_iterator_struct));
     iter->iterate = iterateimpl;
     iter->advance = advanceimpl;
     iter->end = endimpl;
-    iter->current = (index->tree != NULL ? ldns_rbtree_first(index->tree) : NULL);
-    return iter;
+    /* The iterator holds on to the tree as it was when the iteration
+     * started, modifications during the iteration will copy paths rather
+     * than rebalance the nodes we traverse.
+     */
+    iter->root = index->root;
+    noderef(iter->root);
+    cursorfirst(&iter->cursor, iter->root);
+    return (names_iterator) iter;
 }
 
 names_iterator
@@ -277,23 +670,57 @@ names_iteratordescendants(names_index_type index, va_list ap)
     const char* found;
     int findlen;
     recordset_type record;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
     names_iterator iter;
     iter = names_iterator_createrefs(NULL);
     find = va_arg(ap, char*);
     findlen = strlen(find);
     record = names_recordcreatetemp(find);
-    (void) ldns_rbtree_find_less_equal(index->tree, record, &node);
+    (void) cursorlessequal(index, &cursor, record);
+    node = cursorcurrent(&cursor);
     names_recorddispose(record);
-    while (node && node != LDNS_RBTREE_NULL) {
-        record = (recordset_type) node->key;
+    while (node) {
+        record = node->record;
         found = names_recordgetname(record);
         if (!strncmp(find, found, findlen) && (found[findlen - 1] == '\0' || found[findlen - 1] == '.')) {
             names_iterator_addptr(iter, record);
         } else {
             break;
         }
-        node = ldns_rbtree_previous(node);
+        node = cursorprevious(&cursor);
+    }
+    return iter;
+}
+
+/* The records of the names below the given name, for an index ordered by
+ * namesubtree in which these follow the name itself.
+ */
+names_iterator
+names_iteratorsubtree(names_index_type index, va_list ap)
+{
+    const char* find;
+    int below;
+    recordset_type record;
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
+    names_iterator iter;
+    iter = names_iterator_createrefs(NULL);
+    find = va_arg(ap, char*);
+    record = names_recordcreatetemp(find);
+    /* the comparison is reversed, names below come before it in the tree */
+    if (cursorlessequal(index, &cursor, record)) {
+        node = cursorprevious(&cursor);
+    } else {
+        node = cursorcurrent(&cursor);
+    }
+    names_recorddispose(record);
+    while (node) {
+        (void) names_namesubtreecmp(names_recordgetname(node->record), find, &below);
+        if (!below)
+            break;
+        names_iterator_addptr(iter, node->record);
+        node = cursorprevious(&cursor);
     }
     return iter;
 }
@@ -323,7 +750,7 @@ names_iterator
 names_iteratorancestors(names_index_type index, va_list ap)
 {
     recordset_type record;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
     names_iterator iter;
     char* name;
     char* parent = NULL;
@@ -339,10 +766,10 @@ names_iteratorancestors(names_index_type index, va_list ap)
             parent = names_parent(name);
         if (parent) {
             record = names_recordcreatetemp(parent);
-            node = ldns_rbtree_search(index->tree, record);
+            node = nodesearch(index, record);
             names_recorddispose(record);
-            if (node && node != LDNS_RBTREE_NULL) {
-                names_iterator_addptr(iter, node->data);
+            if (node) {
+                names_iterator_addptr(iter, node->record);
             }
         }
     } while(parent);
@@ -357,7 +784,8 @@ names_iteratorchangedeletes(names_index_type index, va_list ap)
     recordset_type find;
     recordset_type found;
     int serial, since;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
     names_iterator iter;
 
     serial = va_arg(ap, int);
@@ -365,15 +793,15 @@ names_iteratorchangedeletes(names_index_type index, va_list ap)
     names_recordsetvalidupto(find, serial);
     iter = names_iterator_createrefs(NULL);
 
-    if(!ldns_rbtree_find_less_equal(index->tree, find, &node)) {
-        if(node == NULL || node == LDNS_RBTREE_NULL) {
-            node = ldns_rbtree_first(index->tree);
-        } else {
-            node = ldns_rbtree_next(node);
-        }
+    if(cursorlessequal(index, &cursor, find)) {
+        node = cursorcurrent(&cursor);
+    } else if(cursorcurrent(&cursor) == NULL) {
+        node = cursorfirst(&cursor, index->root);
+    } else {
+        node = cursornext(&cursor);
     }
-    while (node && node != LDNS_RBTREE_NULL) {
-        found = (recordset_type) node->key;
+    while (node) {
+        found = node->record;
         if(names_recordvalidfrom(found,&since)) {
             if(since <= serial) {
                 names_iterator_addptr(iter, found);
@@ -381,7 +809,7 @@ names_iteratorchangedeletes(names_index_type index, va_list ap)
         } else {
             abort(); // FIXME cannot happen
         }
-        node = ldns_rbtree_next(node);
+        node = cursornext(&cursor);
     }
 
     names_recorddispose(find);
@@ -394,7 +822,8 @@ names_iteratorchangeinserts(names_index_type index, va_list ap)
     recordset_type find;
     recordset_type found;
     int serial, since;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
     names_iterator iter;
 
     serial = va_arg(ap, int);
@@ -402,19 +831,19 @@ names_iteratorchangeinserts(names_index_type index, va_list ap)
     names_recordsetvalidfrom(find, serial);
     iter = names_iterator_createrefs(NULL);
 
-    if(!ldns_rbtree_find_less_equal(index->tree, find, &node)) {
-        if(node == NULL || node == LDNS_RBTREE_NULL) {
-            node = ldns_rbtree_first(index->tree);
-        } else {
-            node = ldns_rbtree_next(node);
-        }
+    if(cursorlessequal(index, &cursor, find)) {
+        node = cursorcurrent(&cursor);
+    } else if(cursorcurrent(&cursor) == NULL) {
+        node = cursorfirst(&cursor, index->root);
+    } else {
+        node = cursornext(&cursor);
     }
-    while (node && node != LDNS_RBTREE_NULL) {
-        found = (recordset_type) node->key;
+    while (node) {
+        found = node->record;
         if(!names_recordvalidupto(found,NULL)) {
             names_iterator_addptr(iter, found);
         }
-        node = ldns_rbtree_next(node);
+        node = cursornext(&cursor);
     }
 
     names_recorddispose(find);
@@ -428,7 +857,8 @@ names_iteratorchanges(names_index_type index, va_list ap)
     recordset_type found;
     const char* name;
     int serial;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
     names_iterator iter;
 
     name = va_arg(ap, const char*);
@@ -438,20 +868,20 @@ names_iteratorchanges(names_index_type index, va_list ap)
     iter = names_iterator_createrefs(NULL);
             char*t= NULL;
 
-    if(!ldns_rbtree_find_less_equal(index->tree, find, &node)) {
-        if(node == NULL || node == LDNS_RBTREE_NULL) {
-            node = ldns_rbtree_first(index->tree);
-        } else {
-            node = ldns_rbtree_next(node);
-        }
+    if(cursorlessequal(index, &cursor, find)) {
+        node = cursorcurrent(&cursor);
+    } else if(cursorcurrent(&cursor) == NULL) {
+        node = cursorfirst(&cursor, index->root);
+    } else {
+        node = cursornext(&cursor);
     }
-    while (node && node != LDNS_RBTREE_NULL) {
-        found = (recordset_type) node->key;
+    while (node) {
+        found = node->record;
         if(strcmp(names_recordgetname(found), name)) {
             break;
         }
         names_iterator_addptr(iter, found);
-        node = ldns_rbtree_next(node);
+        node = cursornext(&cursor);
     }
 
     names_recorddispose(find);
@@ -465,7 +895,8 @@ names_iteratoroutdated(names_index_type index, va_list ap)
     recordset_type find;
     recordset_type found;
     int serial;
-    ldns_rbnode_t* node;
+    struct names_indexnode* node;
+    struct names_indexcursor cursor;
     names_iterator iter;
 
     serial = va_arg(ap, int);
@@ -474,17 +905,17 @@ names_iteratoroutdated(names_index_type index, va_list ap)
     iter = names_iterator_createrefs(NULL);
             char*t= NULL;
 
-    if(!ldns_rbtree_find_less_equal(index->tree, find, &node)) {
-        if(node == NULL || node == LDNS_RBTREE_NULL) {
-            node = ldns_rbtree_first(index->tree);
-        } else {
-            node = ldns_rbtree_next(node);
-        }
+    if(cursorlessequal(index, &cursor, find)) {
+        node = cursorcurrent(&cursor);
+    } else if(cursorcurrent(&cursor) == NULL) {
+        node = cursorfirst(&cursor, index->root);
+    } else {
+        node = cursornext(&cursor);
     }
-    while (node && node != LDNS_RBTREE_NULL) {
-        found = (recordset_type) node->key;
+    while (node) {
+        found = node->record;
         names_iterator_addptr(iter, found);
-        node = ldns_rbtree_next(node);
+        node = cursornext(&cursor);
     }
 
     names_recorddispose(find);
@@ -498,8 +929,12 @@ names_indexsearchfunction(names_index_type index, names_view_type view, const ch
         names_viewaddsearchfunction(view, index, names_iteratordescendants);
     } else if(!strcmp(keyname,"nameready")) {
         names_viewaddsearchfunction(view, index, names_iteratorancestors);
+    } else if(!strcmp(keyname,"namesubtree")) {
+        names_viewaddsearchfunction(view, index, names_iteratorancestors);
+        names_viewaddsearchfunction(view, index, names_iteratorsubtree);
     } else if(!strcmp(keyname,"expiry")) {
         names_viewaddsearchfunction(view, index, names_iteratorexpiring);
+        names_viewaddsearchfunction(view, index, names_iteratorfirstexpiring);
     } else if(!strcmp(keyname,"validchanges")) {
         names_viewaddsearchfunction(view, index, names_iteratorchanges);
     } else if(!strcmp(keyname,"validdeletes")) {
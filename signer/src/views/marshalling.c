@@ -30,17 +30,31 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
 #include <unistd.h>
 #include <assert.h>
 #include <ldns/ldns.h>
+#include "logging.h"
+#include "utilities.h"
 #include "proto.h"
 
+static logger_cls_type cls = LOGGER_INITIALIZE("marshalling");
+
 enum marshall_mode { COPY, FREE, READ, WRITE, PRINT, COUNT };
 enum marshall_func { BASIC, OBJECT, SELF };
 
 int optionaldummy;
 int* marshall_OPTIONAL = &optionaldummy;
 
+/* Blocks are ended on the first object boundary past this size, data is
+ * written out once this much has been buffered or on a forced sync.
+ */
+#define MARSHALL_BLOCKSIZE (64*1024)
+#define MARSHALL_BUFFERSIZE (1024*1024)
+#define MARSHALL_MAXBLOCKSIZE (256*1024*1024)
+
 struct marshall_struct {
     enum marshall_mode mode;
     int fd;
@@ -48,8 +62,252 @@ struct marshall_struct {
     int indentincr;
     int indentlvl;
     int indentcount;
+    int legacy;        /* unbuffered format with RRs in presentation format */
+    int borrowed;      /* buffer is not owned, but memory read from */
+    int eof;
+    unsigned char* buffer;
+    size_t bufsize;
+    size_t buflen;     /* valid data in buffer */
+    size_t bufpos;     /* read position in the current block */
+    size_t blockstart; /* start of header of current block */
+    size_t blockend;   /* end of payload of current block when reading */
+    off_t bufoffset;   /* file offset of the start of the buffer */
+    off_t validend;    /* file offset after last verified block */
+    int error;         /* errno of the first failed write, sticky */
 };
 
+/*
+ * In the buffered format the stream is cut in blocks, each consisting of
+ * the payload length, the payload and an Adler-32 checksum over the
+ * payload, lengths and checksums in native byte order like all other
+ * integers.  Objects never span blocks, so a torn block at the end of a
+ * file loses only the objects that were not completely written.
+ */
+uint32_t
+marshallchecksum(const void* buffer, size_t len)
+{
+    const unsigned char* data = buffer;
+    uint32_t a = 1, b = 0;
+    size_t n;
+    while(len > 0) {
+        n = (len < 5552 ? len : 5552);
+        len -= n;
+        while(n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static void
+marshallreserve(marshall_handle h, size_t len)
+{
+    if(h->buflen + len > h->bufsize) {
+        while(h->buflen + len > h->bufsize)
+            h->bufsize *= 2;
+        CHECKALLOC(h->buffer = realloc(h->buffer, h->bufsize));
+    }
+}
+
+/* A failed write leaves the file cut back to the last completely written
+ * block and the handle in error, nothing is written through it afterwards.
+ */
+static int
+marshallwriteout(marshall_handle h)
+{
+    ssize_t count;
+    size_t pos = 0;
+    if(h->error)
+        return -1;
+    while(pos < h->blockstart) {
+        count = write(h->fd, &h->buffer[pos], h->blockstart - pos);
+        if(count <= 0) {
+            h->error = (count < 0 ? errno : ENOSPC);
+            logger_message(&cls, logger_noctx, logger_ERROR, "unable to write state: %s\n", strerror(h->error));
+            if(lseek(h->fd, h->validend, SEEK_SET) < 0 || ftruncate(h->fd, h->validend))
+                logger_message(&cls, logger_noctx, logger_WARN, "unable to truncate state: %s\n", strerror(errno));
+            return -1;
+        }
+        pos += count;
+    }
+    h->bufoffset += h->blockstart;
+    h->validend = h->bufoffset;
+    memmove(h->buffer, &h->buffer[h->blockstart], h->buflen - h->blockstart);
+    h->buflen -= h->blockstart;
+    h->blockstart = 0;
+    return 0;
+}
+
+static void
+marshallendblock(marshall_handle h)
+{
+    uint32_t len, checksum;
+    len = h->buflen - h->blockstart - sizeof(uint32_t);
+    if(len == 0)
+        return;
+    checksum = marshallchecksum(&h->buffer[h->blockstart + sizeof(uint32_t)], len);
+    memcpy(&h->buffer[h->blockstart], &len, sizeof(uint32_t));
+    marshallreserve(h, 2 * sizeof(uint32_t));
+    memcpy(&h->buffer[h->buflen], &checksum, sizeof(uint32_t));
+    h->buflen += sizeof(uint32_t);
+    h->blockstart = h->buflen;
+    h->buflen += sizeof(uint32_t);
+}
+
+static size_t
+marshallfill(marshall_handle h, size_t need)
+{
+    ssize_t count;
+    if(h->bufpos > 0 && h->buflen - h->bufpos < need) {
+        memmove(h->buffer, &h->buffer[h->bufpos], h->buflen - h->bufpos);
+        h->bufoffset += h->bufpos;
+        h->buflen -= h->bufpos;
+        h->bufpos = 0;
+    }
+    if(need > h->bufsize) {
+        while(need > h->bufsize)
+            h->bufsize *= 2;
+        CHECKALLOC(h->buffer = realloc(h->buffer, h->bufsize));
+    }
+    while(h->buflen - h->bufpos < need) {
+        count = read(h->fd, &h->buffer[h->buflen], h->bufsize - h->buflen);
+        if(count <= 0)
+            break;
+        h->buflen += count;
+    }
+    return h->buflen - h->bufpos;
+}
+
+static int
+marshallnextblock(marshall_handle h)
+{
+    uint32_t len, checksum;
+    if(h->eof)
+        return 1;
+    if(h->fd < 0) {
+        h->eof = 1;
+        return 1;
+    }
+    if(h->blockend > 0)
+        h->bufpos = h->blockend + sizeof(uint32_t);
+    h->blockend = 0;
+    if(marshallfill(h, sizeof(uint32_t)) < sizeof(uint32_t)) {
+        h->eof = 1;
+        return 1;
+    }
+    memcpy(&len, &h->buffer[h->bufpos], sizeof(uint32_t));
+    if(len > MARSHALL_MAXBLOCKSIZE) {
+        logger_message(&cls, logger_noctx, logger_WARN, "state damaged after offset %ld\n", (long)h->validend);
+        h->eof = 1;
+        return 1;
+    }
+    if(marshallfill(h, len + 2 * sizeof(uint32_t)) < len + 2 * sizeof(uint32_t)) {
+        logger_message(&cls, logger_noctx, logger_WARN, "state truncated after offset %ld\n", (long)h->validend);
+        h->eof = 1;
+        return 1;
+    }
+    memcpy(&checksum, &h->buffer[h->bufpos + sizeof(uint32_t) + len], sizeof(uint32_t));
+    if(checksum != marshallchecksum(&h->buffer[h->bufpos + sizeof(uint32_t)], len)) {
+        logger_message(&cls, logger_noctx, logger_WARN, "state damaged after offset %ld\n", (long)h->validend);
+        h->eof = 1;
+        return 1;
+    }
+    h->bufpos += sizeof(uint32_t);
+    h->blockend = h->bufpos + len;
+    h->validend = h->bufoffset + h->blockend + sizeof(uint32_t);
+    return 0;
+}
+
+static int
+marshallread(marshall_handle h, void* data, size_t len)
+{
+    size_t count, size = 0;
+    if(h->legacy)
+        return read(h->fd, data, len);
+    while(size < len) {
+        if(h->bufpos >= h->blockend && marshallnextblock(h)) {
+            memset(&((char*)data)[size], 0, len - size);
+            break;
+        }
+        count = h->blockend - h->bufpos;
+        if(count > len - size)
+            count = len - size;
+        memcpy(&((char*)data)[size], &h->buffer[h->bufpos], count);
+        h->bufpos += count;
+        size += count;
+    }
+    return size;
+}
+
+static int
+marshallwrite(marshall_handle h, const void* data, size_t len)
+{
+    if(h->error)
+        return len;
+    marshallreserve(h, len);
+    memcpy(&h->buffer[h->buflen], data, len);
+    h->buflen += len;
+    return len;
+}
+
+int
+marshallsync(marshall_handle h, int force)
+{
+    if(h->mode != WRITE || h->buffer == NULL || h->fd < 0)
+        return 0;
+    if(h->error)
+        return -1;
+    if(force || h->buflen - h->blockstart >= MARSHALL_BLOCKSIZE) {
+        marshallendblock(h);
+        if(force || h->blockstart >= MARSHALL_BUFFERSIZE)
+            return marshallwriteout(h);
+    }
+    return 0;
+}
+
+/* The offset in the file up to which data has been passed, whether or not
+ * it has been written out yet.
+ */
+off_t
+marshalloffset(marshall_handle h)
+{
+    if(h->mode == READ)
+        return h->bufoffset + h->bufpos;
+    return h->bufoffset + h->buflen;
+}
+
+int
+marshallfileno(marshall_handle h)
+{
+    return h->fd;
+}
+
+size_t
+marshallbuffer(marshall_handle h, const void** data)
+{
+    *data = h->buffer;
+    return h->buflen;
+}
+
+void
+marshallreset(marshall_handle h)
+{
+    h->buflen = 0;
+}
+
+int
+marshalleof(marshall_handle h)
+{
+    if(h->mode != READ || h->legacy)
+        return 0;
+    if(h->bufpos >= h->blockend)
+        return marshallnextblock(h);
+    return 0;
+}
+
 marshall_handle
 marshallcreate(enum marshall_method method, ...)
 {
@@ -58,15 +316,50 @@ marshallcreate(enum marshall_method method, ...)
     h = malloc(sizeof(struct marshall_struct));
     h->fd = -1;
     h->fp = NULL;
+    h->legacy = 0;
+    h->borrowed = 0;
+    h->eof = 0;
+    h->buffer = NULL;
+    h->bufsize = 0;
+    h->buflen = 0;
+    h->bufpos = 0;
+    h->blockstart = 0;
+    h->blockend = 0;
+    h->bufoffset = 0;
+    h->validend = 0;
+    h->error = 0;
     va_start(ap, method);
     switch(method) {
         case marshall_INPUT:
             h->mode = READ;
             h->fd = va_arg(ap, int);
+            h->bufoffset = h->validend = lseek(h->fd, 0, SEEK_CUR);
+            h->bufsize = MARSHALL_BUFFERSIZE;
+            CHECKALLOC(h->buffer = malloc(h->bufsize));
+            break;
+        case marshall_MEMORY:
+            h->mode = READ;
+            h->buffer = (unsigned char*) va_arg(ap, const void*);
+            h->bufsize = h->buflen = h->blockend = va_arg(ap, size_t);
+            h->borrowed = 1;
+            break;
+        case marshall_BUFFER:
+            h->mode = WRITE;
+            h->bufsize = 4096;
+            CHECKALLOC(h->buffer = malloc(h->bufsize));
+            break;
+        case marshall_LEGACYINPUT:
+            h->mode = READ;
+            h->fd = va_arg(ap, int);
+            h->legacy = 1;
             break;
         case marshall_OUTPUT:
             h->mode = WRITE;
             h->fd = va_arg(ap, int);
+            h->bufoffset = h->validend = lseek(h->fd, 0, SEEK_CUR);
+            h->bufsize = MARSHALL_BUFFERSIZE + MARSHALL_BLOCKSIZE;
+            CHECKALLOC(h->buffer = malloc(h->bufsize));
+            h->buflen = sizeof(uint32_t);
             break;
         case marshall_PRINT:
             h->mode = PRINT;
@@ -77,6 +370,16 @@ marshallcreate(enum marshall_method method, ...)
             old = va_arg(ap, marshall_handle);
             h->fd = old->fd;
             h->fp = old->fp;
+            if(old->mode == READ && !old->legacy) {
+                /* continue after the last intact block, dropping anything beyond */
+                lseek(h->fd, old->validend, SEEK_SET);
+                if(ftruncate(h->fd, old->validend))
+                    logger_message(&cls, logger_noctx, logger_WARN, "unable to truncate state: %s\n", strerror(errno));
+            }
+            h->bufoffset = h->validend = old->validend;
+            h->bufsize = MARSHALL_BUFFERSIZE + MARSHALL_BLOCKSIZE;
+            CHECKALLOC(h->buffer = malloc(h->bufsize));
+            h->buflen = sizeof(uint32_t);
             old->fd = -1;
             old->fp = NULL;
             break;
@@ -91,11 +394,18 @@ marshallcreate(enum marshall_method method, ...)
     return h;
 }
 
-void
+/* Returns non-zero when not all data passed could be written out. */
+int
 marshallclose(marshall_handle h)
 {
+    int rc = 0;
     if(!h)
-        return;
+        return 0;
+    if (h->fd >= 0) {
+        rc = marshallsync(h, 1);
+    }
+    if (!h->borrowed)
+        free(h->buffer);
     if (h->fp && h->fp != stdout && h->fp != stderr) {
         fclose(h->fp);
     }
@@ -103,6 +413,7 @@ marshallclose(marshall_handle h)
         close(h->fd);
     }
     free(h);
+    return rc;
 }
 
 int
@@ -123,12 +434,11 @@ marshallinteger(marshall_handle h, void* member)
         case FREE:
             break;
         case READ:
-            size = read(h->fd, member, sizeof(int));
+            size = marshallread(h, member, sizeof(int));
             assert(size==sizeof(int));
             break;
         case WRITE:
-            size = write(h->fd, member, sizeof(int));
-            assert(size==sizeof(int));
+            size = marshallwrite(h, member, sizeof(int));
             break;
         case COUNT:
             abort(); // FIXME
@@ -152,18 +462,17 @@ marshallint64(marshall_handle h, void* member)
         case FREE:
             break;
         case READ:
-            size = read(h->fd, member, sizeof(int64_t));
+            size = marshallread(h, member, sizeof(int64_t));
             assert(size==sizeof(int64_t));
             break;
         case WRITE:
-            size = write(h->fd, member, sizeof(int64_t));
-            assert(size==sizeof(int64_t));
+            size = marshallwrite(h, member, sizeof(int64_t));
             break;
         case COUNT:
             abort(); // FIXME
             break;
         case PRINT:
-            size = fprintf(h->fp, "%ld", *(int64_t*)member);
+            size = fprintf(h->fp, "%" PRId64, *(int64_t*)member);
             break;
         default:
             abort(); // FIXME
@@ -181,10 +490,10 @@ marshallbyte(marshall_handle h, void* member)
         case FREE:
             break;
         case READ:
-            size = read(h->fd, member, 1);
+            size = marshallread(h, member, 1);
             break;
         case WRITE:
-            size = write(h->fd, member, 1);
+            size = marshallwrite(h, member, 1);
             break;
         case COUNT:
             break;
@@ -213,7 +522,7 @@ marshallstring(marshall_handle h, void* member)
             size = marshallinteger(h, &len);
             if(len >= 0) {
                 *str = malloc(len + 1);
-                read(h->fd, *str, sizeof(char)*len);
+                marshallread(h, *str, sizeof(char)*len);
                 (*str)[len] = '\0';
                 size += len;
             } else {
@@ -224,7 +533,7 @@ marshallstring(marshall_handle h, void* member)
             if(*str) {
                 len = strlen(*str);
                 size = marshallinteger(h, &len);
-                write(h->fd, *str, sizeof(char)*len);
+                marshallwrite(h, *str, sizeof(char)*len);
                 size += len;
             } else {
                 len = -1;
@@ -266,6 +575,9 @@ marshallldnsrr(marshall_handle h, void* member)
     int size;
     int len;
     char* str;
+    char text[64];
+    uint8_t wire[10];
+    size_t i, pos;
     switch(h->mode) {
         case COPY:
             *rr = ldns_rr_clone(*rr);
@@ -275,24 +587,46 @@ marshallldnsrr(marshall_handle h, void* member)
             break;
         case READ:
             size = marshallinteger(h, &len);
-            if(len >= 0) {
+            if(len >= 0 && h->legacy) {
                 str = malloc(len + 1);
-                read(h->fd, str, sizeof(char)*len);
+                marshallread(h, str, sizeof(char)*len);
                 str[len] = '\0';
                 size += len;
                 ldns_rr_new_frm_str(rr, str, 0, NULL, NULL);
+                free(str);
+            } else if(len >= 0) {
+                *rr = NULL;
+                pos = 0;
+                if(h->bufpos + len <= h->blockend) {
+                    ldns_wire2rr(rr, &h->buffer[h->bufpos], len, &pos, LDNS_SECTION_ANY);
+                    h->bufpos += len;
+                } else {
+                    str = malloc(len);
+                    marshallread(h, str, len);
+                    ldns_wire2rr(rr, (uint8_t*)str, len, &pos, LDNS_SECTION_ANY);
+                    free(str);
+                }
+                size += len;
             } else {
                 *rr = NULL;
             }
             break;
         case WRITE:
             if(*rr) {
-                str = ldns_rr2str(*rr);
-                len = strlen(str);
+                /* uncompressed wire format, owner and rdata names keep their case */
+                len = ldns_rdf_size(ldns_rr_owner(*rr)) + 10;
+                for(i=0; i<ldns_rr_rd_count(*rr); i++)
+                    len += ldns_rdf_size(ldns_rr_rdf(*rr, i));
                 size = marshallinteger(h, &len);
-                write(h->fd, str, sizeof(char)*len);
+                marshallwrite(h, ldns_rdf_data(ldns_rr_owner(*rr)), ldns_rdf_size(ldns_rr_owner(*rr)));
+                ldns_write_uint16(&wire[0], ldns_rr_get_type(*rr));
+                ldns_write_uint16(&wire[2], ldns_rr_get_class(*rr));
+                ldns_write_uint32(&wire[4], ldns_rr_ttl(*rr));
+                ldns_write_uint16(&wire[8], len - ldns_rdf_size(ldns_rr_owner(*rr)) - 10);
+                marshallwrite(h, wire, sizeof(wire));
+                for(i=0; i<ldns_rr_rd_count(*rr); i++)
+                    marshallwrite(h, ldns_rdf_data(ldns_rr_rdf(*rr, i)), ldns_rdf_size(ldns_rr_rdf(*rr, i)));
                 size += len;
-                free(str);
             } else {
                 len = -1;
                 size = marshallinteger(h, &len);
@@ -300,9 +634,11 @@ marshallldnsrr(marshall_handle h, void* member)
             break;
         case COUNT:
             if(*rr) {
-                str = ldns_rr2str(*rr);
-                len = strlen(str);
-                free(str);
+                if((len = names_rrformat(*rr, NULL, 0)) < 0) {
+                    str = ldns_rr2str(*rr);
+                    len = strlen(str);
+                    free(str);
+                }
             } else {
                 len = -1;
             }
@@ -311,12 +647,18 @@ marshallldnsrr(marshall_handle h, void* member)
             break;
         case PRINT:
             if(*rr) {
-                str = ldns_rr2str(*rr);
-                len = (int)strlen(str)-1;
+                if((len = names_rrformat(*rr, text, sizeof(text))) >= 0) {
+                    str = text;
+                } else {
+                    str = ldns_rr2str(*rr);
+                    len = (int)strlen(str);
+                }
+                len = len - 1;
                 if(len > 40)
                     len = 40;
                 size = fprintf(h->fp, "\"%*.*s\"", len, len, str);
-                free(str);
+                if(str != text)
+                    free(str);
             } else {
                 size = fprintf(h->fp, "NULL");
             }
@@ -404,7 +746,7 @@ marshalling(marshall_handle h, const char* name, void* members, int *membercount
                 if(membercount) {
                     size = marshallinteger(h, membercount);
                     if(*membercount >= 0) {
-                        array = malloc(*membercount * membersize);
+                        array = calloc(*membercount, membersize);
                         *(char**)members = array;
                         dest = (char*) array;
                         if(memberfunction != NULL && memberfunction != marshallself) {
@@ -32,12 +32,20 @@ extern "C" {
 #endif
     
 #include <unistd.h>
+#include <stdint.h>
 
-enum marshall_method { marshall_INPUT, marshall_OUTPUT, marshall_APPEND, marshall_PRINT, marshall_FREE };
+enum marshall_method { marshall_INPUT, marshall_LEGACYINPUT, marshall_MEMORY, marshall_OUTPUT, marshall_BUFFER, marshall_APPEND, marshall_PRINT, marshall_FREE };
 typedef struct marshall_struct* marshall_handle;
 
 marshall_handle marshallcreate(enum marshall_method method, ...);
-void marshallclose(marshall_handle h);
+int marshallclose(marshall_handle h);
+int marshallsync(marshall_handle h, int force);
+int marshalleof(marshall_handle h);
+off_t marshalloffset(marshall_handle h);
+int marshallfileno(marshall_handle h);
+size_t marshallbuffer(marshall_handle h, const void** data);
+void marshallreset(marshall_handle h);
+uint32_t marshallchecksum(const void* data, size_t len);
 int marshallself(marshall_handle h, void* member);
 int marshallbyte(marshall_handle h, void* member);
 int marshallinteger(marshall_handle h, void* member);
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ldns/ldns.h>
+#ifdef HAVE_SSL
+#include <openssl/evp.h>
+#endif
+#include "uthash.h"
+#include "utilities.h"
+#include "logging.h"
+#include "proto.h"
+#include "signer/shard.h"
+
+/* NSEC3 owner names are hashed in batches when a view is committed rather
+ * than one at a time as names are placed.  The wire format of each name is
+ * produced directly from its text, the iterated SHA-1 uses the (SHA
+ * extension capable) OpenSSL implementation when available, and batches
+ * are spread over a number of threads.  Hashes are remembered per zone,
+ * keyed by the canonical name for the current salt and iterations, so a
+ * name that disappears and comes back in a later reload is not hashed
+ * again.
+ */
+
+#define NSEC3_DIGESTSIZE 20
+#define NSEC3_LABELSIZE 32
+#define NSEC3_SHARDNAMES 512
+#define NSEC3_MAXTHREADS 8
+#define NSEC3_CHUNK 256
+#define NSEC3_MAXCACHED (1<<20)
+
+static logger_cls_type cls = LOGGER_INITIALIZE("nsec3hash");
+
+struct nsec3entry {
+    UT_hash_handle hh;
+    uint8_t digest[NSEC3_DIGESTSIZE];
+    uint8_t wirelen;
+    uint8_t wire[];
+};
+
+struct names_nsec3cache {
+    pthread_rwlock_t lock;
+    struct nsec3entry* entries;
+    long count;
+    int algorithm;
+    int iterations;
+    int saltlen;
+    uint8_t salt[255];
+    unsigned long generation; /* changes with the parameters */
+    char* apex;
+};
+
+struct nsec3name {
+    const char* name;
+    char** result;
+    int found;
+    int wirelen;
+    uint8_t wire[LDNS_MAX_DOMAINLEN];
+    uint8_t digest[NSEC3_DIGESTSIZE];
+};
+
+/* State for hashing on one thread */
+struct nsec3hasher {
+#ifdef HAVE_SSL
+    EVP_MD_CTX* ctx;
+#endif
+    uint8_t buffer[LDNS_MAX_DOMAINLEN + 255];
+};
+
+struct nsec3range {
+    struct names_nsec3cache* cache;
+    unsigned long generation;
+    const nsec3params_type* n3p;
+    const char* apex;
+    const char** names;
+    char** hashed;
+    size_t hits;
+};
+
+struct names_nsec3cache*
+names_nsec3cachecreate(void)
+{
+    struct names_nsec3cache* cache;
+    CHECKALLOC(cache = malloc(sizeof(struct names_nsec3cache)));
+    CHECK(pthread_rwlock_init(&cache->lock, NULL));
+    cache->entries = NULL;
+    cache->count = 0;
+    cache->algorithm = -1;
+    cache->iterations = -1;
+    cache->saltlen = 0;
+    cache->generation = 0;
+    cache->apex = NULL;
+    return cache;
+}
+
+static void
+cacheflush(struct names_nsec3cache* cache)
+{
+    struct nsec3entry* entry;
+    struct nsec3entry* tmp;
+    HASH_ITER(hh, cache->entries, entry, tmp) {
+        HASH_DEL(cache->entries, entry);
+        free(entry);
+    }
+    cache->count = 0;
+}
+
+void
+names_nsec3cachedestroy(struct names_nsec3cache* cache)
+{
+    if(cache) {
+        cacheflush(cache);
+        free(cache->apex);
+        pthread_rwlock_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+/* Produces the lower case wire format of a plain presentation format name.
+ * Names with escapes are left to ldns by returning -1.
+ */
+static int
+nametowire(const char* name, uint8_t* wire)
+{
+    int pos = 0;
+    int labelpos = 0;
+    int labellen = 0;
+    char ch;
+    if(name[0] == '.' && name[1] == '\0') {
+        wire[0] = 0;
+        return 1;
+    }
+    for(; (ch = *name) != '\0'; name++) {
+        if(ch == '.') {
+            if(labellen == 0)
+                return -1;
+            wire[labelpos] = labellen;
+            labelpos = pos += labellen + 1;
+            labellen = 0;
+        } else if(ch == '\\') {
+            return -1;
+        } else {
+            if(++labellen > LDNS_MAX_LABELLEN || pos + labellen + 2 > LDNS_MAX_DOMAINLEN)
+                return -1;
+            wire[pos + labellen] = (ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch);
+        }
+    }
+    if(labellen > 0) {
+        wire[labelpos] = labellen;
+        pos += labellen + 1;
+    }
+    wire[pos++] = 0;
+    return pos;
+}
+
+static int
+nametowireldns(const char* name, uint8_t* wire)
+{
+    int len = -1;
+    ldns_rdf* dname;
+    if((dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, name)) != NULL) {
+        ldns_dname2canonical(dname);
+        if(ldns_rdf_size(dname) <= LDNS_MAX_DOMAINLEN) {
+            len = ldns_rdf_size(dname);
+            memcpy(wire, ldns_rdf_data(dname), len);
+        }
+        ldns_rdf_deep_free(dname);
+    }
+    return len;
+}
+
+static void
+sha1(struct nsec3hasher* hasher, const uint8_t* data, size_t len, uint8_t* digest)
+{
+#ifdef HAVE_SSL
+    /* the context is reused for all hashes of the thread */
+    EVP_DigestInit_ex(hasher->ctx, EVP_sha1(), NULL);
+    EVP_DigestUpdate(hasher->ctx, data, len);
+    EVP_DigestFinal_ex(hasher->ctx, digest, NULL);
+#else
+    (void)hasher;
+    ldns_sha1((unsigned char*)data, len, digest);
+#endif
+}
+
+/* H(x) = SHA1(x || salt), IH(0) = H(name), IH(k) = H(IH(k-1)) */
+static void
+nsec3digest(struct nsec3hasher* hasher, const uint8_t* wire, int wirelen, const nsec3params_type* n3p, uint8_t* digest)
+{
+    uint8_t* buffer = hasher->buffer;
+    int i;
+    memcpy(buffer, wire, wirelen);
+    memcpy(&buffer[wirelen], n3p->salt_data, n3p->salt_len);
+    sha1(hasher, buffer, wirelen + n3p->salt_len, digest);
+    memcpy(&buffer[NSEC3_DIGESTSIZE], n3p->salt_data, n3p->salt_len);
+    for(i=0; i<n3p->iterations; i++) {
+        memcpy(buffer, digest, NSEC3_DIGESTSIZE);
+        sha1(hasher, buffer, NSEC3_DIGESTSIZE + n3p->salt_len, digest);
+    }
+}
+
+static char*
+formathashed(const uint8_t* digest, const char* apex)
+{
+    static const char b32[] = "0123456789abcdefghijklmnopqrstuv";
+    char* result;
+    char* s;
+    int i;
+    size_t apexlen = strlen(apex);
+    CHECKALLOC(result = malloc(NSEC3_LABELSIZE + 1 + apexlen + 1));
+    s = result;
+    for(i=0; i<NSEC3_DIGESTSIZE; i+=5) {
+        *s++ = b32[digest[i] >> 3];
+        *s++ = b32[((digest[i] & 0x07) << 2) | (digest[i+1] >> 6)];
+        *s++ = b32[(digest[i+1] >> 1) & 0x1f];
+        *s++ = b32[((digest[i+1] & 0x01) << 4) | (digest[i+2] >> 4)];
+        *s++ = b32[((digest[i+2] & 0x0f) << 1) | (digest[i+3] >> 7)];
+        *s++ = b32[(digest[i+3] >> 2) & 0x1f];
+        *s++ = b32[((digest[i+3] & 0x03) << 3) | (digest[i+4] >> 5)];
+        *s++ = b32[digest[i+4] & 0x1f];
+    }
+    *s++ = '.';
+    if(strcmp(apex, "."))
+        memcpy(s, apex, apexlen + 1);
+    else
+        *s = '\0';
+    return result;
+}
+
+/* The cache is only used while it still holds hashes for the parameters
+ * of this range, another caller may have switched it over in between.
+ */
+static void
+hashchunk(struct nsec3hasher* hasher, struct nsec3range* range, struct nsec3name* names, size_t count)
+{
+    size_t i, hits = 0, misses = 0;
+    struct nsec3entry* entry;
+    struct names_nsec3cache* cache = range->cache;
+    if(cache) {
+        CHECK(pthread_rwlock_rdlock(&cache->lock));
+        for(i=0; i<count && cache->generation == range->generation; i++) {
+            if(names[i].wirelen > 0) {
+                HASH_FIND(hh, cache->entries, names[i].wire, names[i].wirelen, entry);
+                if(entry) {
+                    memcpy(names[i].digest, entry->digest, NSEC3_DIGESTSIZE);
+                    names[i].found = 1;
+                    ++hits;
+                }
+            }
+        }
+        CHECK(pthread_rwlock_unlock(&cache->lock));
+        __atomic_add_fetch(&range->hits, hits, __ATOMIC_RELAXED);
+    }
+    for(i=0; i<count; i++) {
+        if(!names[i].found && names[i].wirelen > 0) {
+            nsec3digest(hasher, names[i].wire, names[i].wirelen, range->n3p, names[i].digest);
+            ++misses;
+        }
+    }
+    if(cache && misses > 0) {
+        CHECK(pthread_rwlock_wrlock(&cache->lock));
+        for(i=0; i<count && cache->generation == range->generation; i++) {
+            if(!names[i].found && names[i].wirelen > 0) {
+                HASH_FIND(hh, cache->entries, names[i].wire, names[i].wirelen, entry);
+                if(entry)
+                    continue;
+                if(cache->count >= NSEC3_MAXCACHED)
+                    cacheflush(cache);
+                CHECKALLOC(entry = malloc(sizeof(struct nsec3entry) + names[i].wirelen));
+                memcpy(entry->digest, names[i].digest, NSEC3_DIGESTSIZE);
+                entry->wirelen = names[i].wirelen;
+                memcpy(entry->wire, names[i].wire, names[i].wirelen);
+                HASH_ADD_KEYPTR(hh, cache->entries, entry->wire, entry->wirelen, entry);
+                cache->count += 1;
+            }
+        }
+        CHECK(pthread_rwlock_unlock(&cache->lock));
+    }
+    for(i=0; i<count; i++) {
+        if(names[i].wirelen > 0)
+            *names[i].result = formathashed(names[i].digest, range->apex);
+        else
+            *names[i].result = NULL;
+    }
+}
+
+static void
+hashrange(void* arg, long begin, long end)
+{
+    struct nsec3range* range = arg;
+    struct nsec3name* names;
+    struct nsec3hasher hasher;
+    size_t j, count;
+    long i;
+#ifdef HAVE_SSL
+    CHECKALLOC(hasher.ctx = EVP_MD_CTX_new());
+#endif
+    CHECKALLOC(names = malloc(sizeof(struct nsec3name) * NSEC3_CHUNK));
+    for(i=begin; i<end; i+=count) {
+        count = end - i;
+        if(count > NSEC3_CHUNK)
+            count = NSEC3_CHUNK;
+        for(j=0; j<count; j++) {
+            names[j].name = range->names[i+j];
+            names[j].result = &range->hashed[i+j];
+            names[j].found = 0;
+            names[j].wirelen = nametowire(names[j].name, names[j].wire);
+            if(names[j].wirelen < 0)
+                names[j].wirelen = nametowireldns(names[j].name, names[j].wire);
+        }
+        hashchunk(&hasher, range, names, count);
+    }
+    free(names);
+#ifdef HAVE_SSL
+    EVP_MD_CTX_free(hasher.ctx);
+#endif
+}
+
+static const char*
+cacheprepare(struct names_nsec3cache* cache, const nsec3params_type* n3p, const char* apex, unsigned long* generation)
+{
+    ldns_rdf* dname;
+    CHECK(pthread_rwlock_wrlock(&cache->lock));
+    if(cache->algorithm != n3p->algorithm || cache->iterations != n3p->iterations ||
+       cache->saltlen != n3p->salt_len || memcmp(cache->salt, n3p->salt_data, n3p->salt_len)) {
+        if(cache->count > 0)
+            logger_message(&cls, logger_noctx, logger_DEBUG, "nsec3 parameters changed, dropping %ld cached hashes\n", cache->count);
+        cacheflush(cache);
+        cache->algorithm = n3p->algorithm;
+        cache->iterations = n3p->iterations;
+        cache->saltlen = n3p->salt_len;
+        memcpy(cache->salt, n3p->salt_data, n3p->salt_len);
+        cache->generation += 1;
+    }
+    *generation = cache->generation;
+    if(cache->apex == NULL) {
+        dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, apex);
+        cache->apex = ldns_rdf2str(dname);
+        ldns_rdf_deep_free(dname);
+    }
+    CHECK(pthread_rwlock_unlock(&cache->lock));
+    return cache->apex;
+}
+
+/* Hashes count owner names into hashed, each a newly allocated string in
+ * the form of the owner name of the NSEC3 record, which is NULL for an
+ * invalid name.  The cache is optional.
+ */
+void
+names_nsec3hashnames(struct names_nsec3cache* cache, const nsec3params_type* n3p, const char* apex, const char** names, char** hashed, size_t count)
+{
+    long i, nthreads;
+    struct nsec3range range;
+    ldns_rdf* dname = NULL;
+    char* apexstr = NULL;
+    if(count == 0)
+        return;
+    if(n3p->algorithm != LDNS_SHA1) {
+        for(i=0; i<(long)count; i++)
+            hashed[i] = names_nsec3hashname(n3p, apex, names[i]);
+        return;
+    }
+    range.generation = 0;
+    if(cache) {
+        apex = cacheprepare(cache, n3p, apex, &range.generation);
+    } else {
+        dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, apex);
+        apex = apexstr = ldns_rdf2str(dname);
+        ldns_rdf_deep_free(dname);
+    }
+    range.cache = cache;
+    range.n3p = n3p;
+    range.apex = apex;
+    range.names = names;
+    range.hashed = hashed;
+    range.hits = 0;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > NSEC3_MAXTHREADS)
+        nthreads = NSEC3_MAXTHREADS;
+    nthreads = shard_run(nthreads, count, NSEC3_SHARDNAMES, hashrange, &range, NULL);
+    logger_message(&cls, logger_noctx, logger_DIAG, "hashed %lu names using %ld threads, %lu from cache\n", (unsigned long)count, nthreads, (unsigned long)range.hits);
+    free(apexstr);
+}
+
+char*
+names_nsec3hashname(const nsec3params_type* n3p, const char* apex, const char* name)
+{
+    char* result;
+    ldns_rdf* dname;
+    ldns_rdf* apexname;
+    ldns_rdf* hashed_label;
+    ldns_rdf* hashed_ownername;
+    if(n3p->algorithm == LDNS_SHA1) {
+        names_nsec3hashnames(NULL, n3p, apex, &name, &result, 1);
+        return result;
+    }
+    dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, name);
+    apexname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, apex);
+    hashed_label = ldns_nsec3_hash_name(dname, n3p->algorithm, n3p->iterations, n3p->salt_len, n3p->salt_data);
+    hashed_ownername = ldns_dname_cat_clone(hashed_label, apexname);
+    result = ldns_rdf2str(hashed_ownername);
+    ldns_rdf_deep_free(hashed_ownername);
+    ldns_rdf_deep_free(hashed_label);
+    ldns_rdf_deep_free(apexname);
+    ldns_rdf_deep_free(dname);
+    return result;
+}
@@ -32,10 +32,13 @@ typedef struct recordset_struct* recordset_type;
 typedef struct names_index_struct* names_index_type;
 typedef struct names_table_struct* names_table_type;
 typedef struct names_view_struct* names_view_type;
+typedef struct names_mapping_struct* names_mapping_type;
+typedef struct names_rendered_struct* names_rendered_type;
 
 #include "signer/signconf.h"
 #include "signer/zone.h"
 #include "views/marshalling.h"
+#include "hsm.h"
 #include "logging.h"
 
 extern const char* names_view_BASE[];
@@ -133,15 +136,25 @@ void names_iterator_adddata(names_iterator iter, const void* ptr);
  * the domain structure, containing the denial, rrset, etcetera structures.
  */
 
+struct names_nsec3cache;
+
 struct names_view_zone {
     int* defaultttl;
     const char* apex;
     signconf_type** signconf;
+    struct names_nsec3cache* nsec3cache;
 };
 
 recordset_type names_recordcreate(char**name);
 recordset_type names_recordcreatetemp(const char*name);
 void names_recordannotate(recordset_type d, struct names_view_zone* zone);
+int names_recordhaspendingdenial(recordset_type d);
+void names_recordannotatepending(recordset_type* records, size_t count);
+
+struct names_nsec3cache* names_nsec3cachecreate(void);
+void names_nsec3cachedestroy(struct names_nsec3cache* cache);
+void names_nsec3hashnames(struct names_nsec3cache* cache, const nsec3params_type* n3p, const char* apex, const char** names, char** hashed, size_t count);
+char* names_nsec3hashname(const nsec3params_type* n3p, const char* apex, const char* name);
 recordset_type names_recordcopy(recordset_type, int clear);
 void names_recorddispose(recordset_type);
 void names_recorddisposal(recordset_type record, int doit);
@@ -160,15 +173,28 @@ names_iterator names_recordallvaluestrings(recordset_type d, ldns_rr_type rrtype
 int names_recordvalidupto(recordset_type, int*);
 int names_recordgetvalidupto(recordset_type);
 int names_recordvalidfrom(recordset_type, int*);
-int names_recordcmpdenial(recordset_type record, ldns_rr* denial);
+int names_recordcmpdenial(recordset_type record, ldns_rr_type rrtype, const uint8_t* rdata, size_t rdatalen);
 void names_recordsetdenial(recordset_type record, ldns_rr* denial);
+void names_recordrebuilddenial(recordset_type record, recordset_type previous, recordset_type shadow);
 void names_recordsetvalidupto(recordset_type record, int value);
 void names_recordsetvalidfrom(recordset_type, int value);
 int names_recordhasexpiry(recordset_type);
 int64_t names_recordgetexpiry(recordset_type);
 void names_recordsetexpiry(recordset_type, int64_t value);
+names_rendered_type names_recordgetrendered(recordset_type);
+names_rendered_type names_recordsetrendered(recordset_type, char* text, size_t size);
+const char* names_renderedtext(names_rendered_type, size_t* size);
+void names_renderedrelease(names_rendered_type);
+const uint8_t* names_recordgetwire(recordset_type, ldns_rr_type rrtype, ldns_rr** rr, size_t* size);
+int names_recordgetstatus(recordset_type, ldns_rr_type* occluded, ldns_rr_type* delegpt);
+ldns_rr_type names_recordgetcut(recordset_type);
+void names_recordsetstatus(recordset_type, ldns_rr_type occluded, ldns_rr_type delegpt, ldns_rr_type cut);
+int names_namesubtreecmp(const char* name, const char* other, int* below);
 void names_recordaddsignature(recordset_type record, ldns_rr_type rrtype, ldns_rr* rrsig, const char* keylocator, int keyflags);
+void names_recorddelsignature(recordset_type record, ldns_rr_type rrtype, ldns_rr* rrsig);
 int names_recordmarshall(recordset_type*, marshall_handle);
+recordset_type names_recordcreatemapped(names_mapping_type mapping, const void* header, size_t headersize, const void* body, size_t bodysize, uint32_t checksum);
+void names_recordsnapshot(recordset_type record, marshall_handle header, marshall_handle body);
 size_t names_recordextend(recordset_type);
 
 void names_recordlookupone(recordset_type record, ldns_rr_type type, ldns_rr* template, ldns_rr** rr);
@@ -180,12 +206,17 @@ struct dual {
 };
 
 int names_indexcreate(names_index_type*, const char* keyname);
+int names_indexclone(names_index_type*, names_index_type source);
+int names_indexcount(names_index_type, int* shared);
+size_t names_indexnodesize(void);
 recordset_type names_indexlookup(names_index_type, recordset_type);
+int names_indexcompare(names_index_type index, recordset_type a, recordset_type b);
 recordset_type names_indexlookupnext(names_index_type index, recordset_type find);
 recordset_type names_indexlookupkey(names_index_type, const char* keyvalue);
 int names_indexremove(names_index_type, recordset_type);
 int names_indexremovekey(names_index_type,const char* keyvalue);
 int names_indexinsert(names_index_type index, recordset_type d, recordset_type* existing);
+int names_indexbuild(names_index_type index, recordset_type* records, size_t count);
 void names_indexdestroy(names_index_type, void (*userfunc)(void* arg, void* key, void* val), void* userarg);
 names_iterator names_indexiterator(names_index_type);
 
@@ -204,6 +235,21 @@ void** names_tableput(names_table_type table, void* name);
 void names_tableconcat(names_table_type* list, names_table_type item);
 names_iterator names_tableitems(names_table_type table);
 
+/* A snapshot is a state file that is mapped in memory on restore, where
+ * the records keep referring to the mapped file until first used.
+ */
+
+names_mapping_type names_mappingcreate(int fd, size_t size);
+names_mapping_type names_mappingacquire(names_mapping_type mapping);
+void names_mappingrelease(names_mapping_type mapping);
+int names_snapshotwrite(int fd, names_iterator iter);
+typedef struct names_snapshotpin_struct* names_snapshotpin_type;
+names_snapshotpin_type names_snapshotpin(names_index_type index);
+void names_snapshotpreserve(names_snapshotpin_type pin, recordset_type record);
+int names_snapshotpinwrite(int fd, names_snapshotpin_type pin);
+void names_snapshotunpin(names_snapshotpin_type pin);
+int names_snapshotread(int fd, recordset_type** records, size_t* count);
+
 /* The changelog_ functions are also not to be used directly, they
  * extend the table functionality in combination with the views.
  */
@@ -217,13 +263,17 @@ int names_commitlogpoppush(names_commitlog_type, int viewid, names_table_type* p
 int names_commitlogsubscribe(names_view_type view, names_commitlog_type*);
 void names_commitlogunsubscribe(int viewid, names_commitlog_type commitlogptr);
 void names_commitlogpersistincr(names_commitlog_type, names_table_type changelog);
+void names_commitlogpersistsync(names_commitlog_type);
+void names_commitlogpersistswitch(names_commitlog_type, marshall_handle (*switchfn)(void* arg, marshall_handle store), void* arg);
+void names_commitlogpersiststats(names_commitlog_type, long long* bytes, long* syncs);
 void names_commitlogpersistappend(names_commitlog_type, void (*persistfn)(names_table_type, marshall_handle), marshall_handle store);
-int names_commitlogpersistfull(names_commitlog_type, void (*persistfn)(names_table_type, marshall_handle), int viewid, marshall_handle store, marshall_handle* oldstore);
+int names_commitlogpersistfull(names_commitlog_type, void (*persistfn)(names_table_type, marshall_handle), int viewid, marshall_handle store, int (*commitfn)(void* arg, marshall_handle store), void* arg, marshall_handle* oldstore);
 
 void names_own(names_view_type view, recordset_type* record);
 void names_underwrite(names_view_type view, recordset_type* record);
 void names_overwrite(names_view_type view, recordset_type* record);
 void names_update(names_view_type view, recordset_type* record);
+void names_updated(names_view_type view, recordset_type* record);
 void names_amend(names_view_type view, recordset_type record);
 void* names_place(names_view_type store, const char* name);
 void* names_take(names_view_type view, int index, const char* name);
@@ -240,9 +290,11 @@ void names_viewaddsearchfunction(names_view_type, names_index_type, names_indexr
 void names_viewaddsearchfunction2(names_view_type, names_index_type, names_index_type, names_indexrange_func);
 names_iterator names_iteratorancestors(names_index_type index, va_list ap);
 names_iterator names_iteratordescendants(names_index_type index, va_list ap);
+names_iterator names_iteratorsubtree(names_index_type index, va_list ap);
 names_iterator names_iteratordenialchainupdates(names_index_type primary, names_index_type secondary, va_list ap);
 names_iterator names_iteratorincoming(names_index_type primary, names_index_type secondary, va_list ap);
 names_iterator names_iteratorexpiring(names_index_type index, va_list ap);
+names_iterator names_iteratorfirstexpiring(names_index_type index, va_list ap);
 names_iterator names_iteratorchangedeletes(names_index_type index, va_list ap);
 names_iterator names_iteratorchangeinserts(names_index_type index, va_list ap);
 names_iterator names_iteratorchanges(names_index_type index, va_list ap);
@@ -250,7 +302,17 @@ names_iterator names_iteratoroutdated(names_index_type index, va_list ap);
 
 int names_viewcommit(names_view_type view);
 void names_viewreset(names_view_type view);
-int names_viewpersist(names_view_type view, int basefd, char* filename);
+
+/* A name other views committed a record for, with the zone cut the record
+ * was last resolved with.
+ */
+struct names_arrival {
+    const char* name;
+    ldns_rr_type cut;
+};
+names_iterator names_viewarrivals(names_view_type view);
+int names_viewpersist(names_view_type view, int basefd, const char* filename);
+int names_viewcheckpoint(names_view_type view, int basefd, const char* filename);
 int names_viewconfig(names_view_type view, signconf_type** signconf);
 int names_viewrestore(names_view_type view, const char* apex, int basefd, const char* filename);
 
@@ -266,19 +328,37 @@ void names_dumpviewfull(FILE*, names_view_type view);
 void names_dumpindex(FILE* fp, names_view_type view, int index);
 void names__dumpindex(FILE* fp, names_index_type index);
 
+int names_rrformat(const ldns_rr* rr, char* text, size_t size);
 void writerecordcontent(recordset_type domainitem, FILE* fp);
-void writezonecontent(names_view_type view, FILE* fp);
+ods_status writezonecontent(names_view_type view, FILE* fp);
 void writezoneapex(names_view_type view, FILE* fp);
-int writezone(names_view_type view, const char* filename);
+ods_status writezone(names_view_type view, const char* filename);
 enum operation_enum { PLAIN, DELTAMINUS, DELTAPLUS };
 int readzone(names_view_type view, enum operation_enum operation, const char* filename, char** apexptr, int* defaultttlptr);
 void purgezone(zone_type* zone);
 
 ldns_rr_type domain_is_occluded(names_view_type view, recordset_type record);
 ldns_rr_type domain_is_delegpt(names_view_type view, recordset_type record);
-ldns_rr* denial_nsecify(signconf_type* signconf, names_view_type view, recordset_type domain, ldns_rdf* nxt); // FIXME rename
+void domain_updatestatus(names_view_type view, int nshards, struct stats_shards* timings);
+int domain_rollover(signconf_type* signconf, names_view_type view, recordset_type record, time_t signtime, long* ntotal, long* nsigned);
+/* NSEC3 fixed fields, salt and hash, and the type bit maps of all 256 windows */
+#define DENIAL_MAXRDATA (5 + 256 + 256 + 256 * 34)
+struct denial_struct {
+    ldns_rr_type rrtype;
+    uint32_t ttl;
+    size_t ownerlen;
+    uint8_t owner[LDNS_MAX_DOMAINLEN];
+    int nfields;
+    size_t fields[6];
+    size_t rdatalen;
+    uint8_t rdata[DENIAL_MAXRDATA];
+};
+int denial_nsecify(signconf_type* signconf, names_view_type view, recordset_type domain, const char* nxt, struct denial_struct* denial);
+int denial_nsecifyhashed(signconf_type* signconf, names_view_type view, recordset_type domain, const char* hashedowner, const char* nxt, struct denial_struct* denial);
+ldns_rr* denial_rr(struct denial_struct* denial);
 ods_status namedb_update_serial(zone_type* globalzone);
 ods_status rrset_sign(signconf_type* signconf, names_view_type view, recordset_type domain, ldns_rr_type rrtype, hsm_ctx_t* ctx, time_t signtime);
+ods_status rrset_signbatch(signconf_type* signconf, names_view_type view, recordset_type domain, ldns_rr_type rrtype, hsm_ctx_t* ctx, time_t signtime, time_t refreshtime, lhsm_batch_type* batch);
 ods_status rrset_getliteralrr(ldns_rr** dnskey, const char *resourcerecord, uint32_t ttl, ldns_rdf* apex);
 ods_status namedb_domain_entize(names_view_type view, recordset_type domain, ldns_rdf* dname, ldns_rdf* apex);
 
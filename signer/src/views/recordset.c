@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <ldns/ldns.h>
 #include "uthash.h"
 #include "utilities.h"
@@ -47,20 +48,75 @@ struct itemset {
     struct signatures_struct* signatures;
 };
 
+/* The canonical wire encoding of an RRset, its records in canonical order
+ * as they are signed, kept with the record until the RRset changes.
+ */
+struct wireset {
+    ldns_rr_type rrtype;
+    size_t size;
+    uint8_t* data;
+};
+
 struct recordset_struct {
     char* name;
     int revision;
     int marker;
     ldns_rr* spanhashrr;
     char* spanhash;
+    struct names_view_zone* pendingdenial;
     struct signatures_struct* spansignatures;
     int* validupto;
     int* validfrom;
     int64_t* expiry;
+    ldns_rr_type occluded;
+    ldns_rr_type delegpt;
+    ldns_rr_type cut;
+    names_mapping_type mapping;
+    const void* mappedbody;
+    size_t mappedsize;
+    uint32_t mappedchecksum;
+    unsigned int generation;
+    names_rendered_type rendered;
+    int nwiresets;
+    struct wireset* wiresets;
     int nitemsets;
     struct itemset* itemsets;
 };
 
+static logger_cls_type cls = LOGGER_INITIALIZE("recordset");
+static pthread_mutex_t faultlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t renderlock = PTHREAD_MUTEX_INITIALIZER;
+static int marshallbody(marshall_handle h, recordset_type d);
+
+/* Records restored from a snapshot only carry the fields needed by the
+ * indices.  The resource records and signatures stay in the mapped file
+ * until the record is first used, as most records of a large zone are
+ * not touched between a restart and their next re-signing.
+ */
+static void
+recordfault(recordset_type d)
+{
+    marshall_handle h;
+    names_mapping_type mapping;
+    if(__atomic_load_n(&d->mapping, __ATOMIC_ACQUIRE) == NULL)
+        return;
+    CHECK(pthread_mutex_lock(&faultlock));
+    mapping = d->mapping;
+    if(mapping) {
+        if(marshallchecksum(d->mappedbody, d->mappedsize) == d->mappedchecksum) {
+            h = marshallcreate(marshall_MEMORY, d->mappedbody, d->mappedsize);
+            marshallbody(h, d);
+            marshallclose(h);
+        } else {
+            logger_message(&cls, logger_noctx, logger_ERROR, "snapshot data of %s damaged, discarding\n", d->name);
+        }
+        d->mappedbody = NULL;
+        __atomic_store_n(&d->mapping, NULL, __ATOMIC_RELEASE);
+        names_mappingrelease(mapping);
+    }
+    CHECK(pthread_mutex_unlock(&faultlock));
+}
+
 static void
 disposesignature(struct signatures_struct** signatures)
 {
@@ -76,6 +132,28 @@ disposesignature(struct signatures_struct** signatures)
     }
 }
 
+/* drops the wire encoding of the RRset of the given type, or of all RRsets
+ * if rrtype is 0 */
+static void
+disposewire(recordset_type d, ldns_rr_type rrtype)
+{
+    int i;
+    for(i=0; i<d->nwiresets; i++) {
+        if(rrtype == 0 || d->wiresets[i].rrtype == rrtype) {
+            free(d->wiresets[i].data);
+            if(rrtype != 0) {
+                d->wiresets[i] = d->wiresets[--d->nwiresets];
+                return;
+            }
+        }
+    }
+    if(rrtype == 0) {
+        free(d->wiresets);
+        d->wiresets = NULL;
+        d->nwiresets = 0;
+    }
+}
+
 void
 disposeitemset(struct itemset* itemset)
 {
@@ -91,6 +169,8 @@ void
 names_recordaddsignature(recordset_type d, ldns_rr_type rrtype, ldns_rr* rrsig, const char* keylocator, int keyflags)
 {
     int i, j;
+    recordfault(d);
+    d->generation += 1;
     for(i=0; i<d->nitemsets; i++)
         if(rrtype == d->itemsets[i].rrtype)
             break;
@@ -119,6 +199,35 @@ names_recordaddsignature(recordset_type d, ldns_rr_type rrtype, ldns_rr* rrsig,
     }
 }
 
+/* removes the signature rrsig over the RRset of the given type */
+void
+names_recorddelsignature(recordset_type d, ldns_rr_type rrtype, ldns_rr* rrsig)
+{
+    struct signatures_struct* signatures = NULL;
+    int i;
+    recordfault(d);
+    for(i=0; i<d->nitemsets; i++)
+        if(rrtype == d->itemsets[i].rrtype)
+            break;
+    if (i<d->nitemsets) {
+        signatures = d->itemsets[i].signatures;
+    } else if(rrtype == LDNS_RR_TYPE_NSEC || rrtype == LDNS_RR_TYPE_NSEC3) {
+        signatures = d->spansignatures;
+    }
+    if(!signatures)
+        return;
+    for(i=0; i<signatures->nsigs; i++) {
+        if(signatures->sigs[i].rr == rrsig) {
+            d->generation += 1;
+            free((void*)signatures->sigs[i].keylocator);
+            ldns_rr_free(signatures->sigs[i].rr);
+            signatures->nsigs -= 1;
+            memmove(&signatures->sigs[i], &signatures->sigs[i+1], sizeof(struct signature_struct) * (signatures->nsigs - i));
+            return;
+        }
+    }
+}
+
 int
 names_recordcompare_namerevision(recordset_type a, recordset_type b)
 {
@@ -141,10 +250,21 @@ recordcreate()
     dict->itemsets = NULL;
     dict->spanhash = NULL;
     dict->spanhashrr = NULL;
+    dict->pendingdenial = NULL;
     dict->spansignatures = NULL;
     dict->validupto = NULL;
     dict->validfrom = NULL;
     dict->expiry = NULL;
+    dict->occluded = 0;
+    dict->delegpt = 0;
+    dict->cut = 0;
+    dict->mapping = NULL;
+    dict->mappedbody = NULL;
+    dict->mappedsize = 0;
+    dict->generation = 0;
+    dict->rendered = NULL;
+    dict->nwiresets = 0;
+    dict->wiresets = NULL;
     dict->marker = 0;
     return dict;
 }
@@ -176,26 +296,14 @@ names_recordcreatetemp(const char* name)
 void
 names_recordannotate(recordset_type d, struct names_view_zone* zone)
 {
+    recordfault(d);
+    d->generation += 1;
     if(zone) {
         if(zone->signconf && *(zone->signconf) && (*(zone->signconf))->nsec3params) {
-            nsec3params_type* n3p = (*zone->signconf)->nsec3params;
-            ldns_rdf* dname;
-            ldns_rdf* apex;
-            ldns_rdf* hashed_label;
-            ldns_rdf* hashed_ownername;
-            dname = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, d->name);
-            apex = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, zone->apex);
-            /*
-             * The owner name of the NSEC3 RR is the hash of the original owner
-             * name, prepended as a single label to the zone name.
+            /* hashed together with the other new names of the view when
+             * it is committed, see names_recordannotatepending
              */
-            hashed_label = ldns_nsec3_hash_name(dname, n3p->algorithm, n3p->iterations, n3p->salt_len, n3p->salt_data);
-            hashed_ownername = ldns_dname_cat_clone(hashed_label, apex);
-            d->spanhash = ldns_rdf2str(hashed_ownername);
-            ldns_rdf_deep_free(hashed_ownername);
-            ldns_rdf_deep_free(hashed_label);
-            ldns_rdf_deep_free(apex);
-            ldns_rdf_deep_free(dname);
+            d->pendingdenial = zone;
         } else {
             /* ldns_rdf* rdf;
              * ldns_rdf* revrdf;
@@ -231,17 +339,63 @@ names_recordannotate(recordset_type d, struct names_view_zone* zone)
             free(d->spanhash);
         if(d->spanhashrr)
             ldns_rr_free(d->spanhashrr);
+        disposewire(d, LDNS_RR_TYPE_NSEC);
+        disposewire(d, LDNS_RR_TYPE_NSEC3);
         d->spanhash = NULL;
         d->spanhashrr = NULL;
+        d->pendingdenial = NULL;
     }
 }
 
+int
+names_recordhaspendingdenial(recordset_type d)
+{
+    return d->pendingdenial != NULL;
+}
+
+void
+names_recordannotatepending(recordset_type* records, size_t count)
+{
+    size_t i, j, n;
+    const char** names;
+    char** hashed;
+    struct names_view_zone* zone;
+    nsec3params_type* n3p;
+    CHECKALLOC(names = malloc(sizeof(const char*) * count));
+    CHECKALLOC(hashed = malloc(sizeof(char*) * count));
+    for(i=0; i<count; i=j) {
+        if((zone = records[i]->pendingdenial) == NULL) {
+            j = i + 1;
+            continue;
+        }
+        for(j=i, n=0; j<count && records[j]->pendingdenial == zone; j++)
+            names[n++] = records[j]->name;
+        if(zone->signconf && *(zone->signconf) && (*(zone->signconf))->nsec3params) {
+            n3p = (*zone->signconf)->nsec3params;
+            names_nsec3hashnames(zone->nsec3cache, n3p, zone->apex, names, hashed, n);
+            for(n=0; i+n<j; n++) {
+                free(records[i+n]->spanhash);
+                records[i+n]->spanhash = hashed[n];
+                records[i+n]->pendingdenial = NULL;
+            }
+        } else {
+            for(n=i; n<j; n++) {
+                records[n]->pendingdenial = NULL;
+                names_recordannotate(records[n], zone);
+            }
+        }
+    }
+    free(hashed);
+    free(names);
+}
+
 recordset_type
 names_recordcopy(recordset_type dict, int clear)
 {
     int i, j;
     struct recordset_struct* target;
     char* name = dict->name;
+    recordfault(dict);
     target = (struct recordset_struct*) names_recordcreate(&name);
     target->revision = dict->revision + 1;
     target->nitemsets = dict->nitemsets;
@@ -257,6 +411,10 @@ names_recordcopy(recordset_type dict, int clear)
     }
     target->spanhash = (dict->spanhash ? strdup(dict->spanhash) : NULL);
     target->spanhashrr = (dict->spanhashrr ? ldns_rr_clone(dict->spanhashrr) : NULL);
+    target->pendingdenial = dict->pendingdenial;
+    target->occluded = dict->occluded;
+    target->delegpt = dict->delegpt;
+    target->cut = dict->cut;
     disposesignature(&target->spansignatures);
     if(clear == 0) {
         if(dict->expiry) {
@@ -282,6 +440,7 @@ int
 names_recordhasdata(recordset_type record, ldns_rr_type recordtype, ldns_rr* rr, int exact)
 {
     int i, j;
+    recordfault(record);
     if(!record)
         return 0;
     if(recordtype == 0) { /* note there is no rrtype of 0 in DNS */
@@ -316,7 +475,11 @@ names_recordadddata(recordset_type d, ldns_rr* rr)
 {
     int i, j;
     ldns_rr_type rrtype;
+    recordfault(d);
+    d->generation += 1;
     rrtype = ldns_rr_get_type(rr);
+    disposewire(d, rrtype);
+    d->occluded = d->delegpt = 0;
     for(i=0; i<d->nitemsets; i++)
         if(rrtype == d->itemsets[i].rrtype)
             break;
@@ -342,6 +505,10 @@ void
 names_recorddeldata(recordset_type d, ldns_rr_type rrtype, ldns_rr* rr)
 {
     int i, j;
+    recordfault(d);
+    d->generation += 1;
+    disposewire(d, rrtype);
+    d->occluded = d->delegpt = 0;
     for(i=0; i<d->nitemsets; i++)
         if(rrtype == d->itemsets[i].rrtype)
             break;
@@ -395,6 +562,10 @@ void
 names_recorddelall(recordset_type d, ldns_rr_type rrtype)
 {
     int i, j;
+    recordfault(d);
+    d->generation += 1;
+    disposewire(d, rrtype);
+    d->occluded = d->delegpt = 0;
     for(i=0; i<d->nitemsets; i++) {
         if(rrtype==0 || d->itemsets[i].rrtype == rrtype) {
             disposeitemset(&(d->itemsets[i]));
@@ -433,6 +604,7 @@ names_iterator
 names_recordalltypes(recordset_type d)
 {
     names_iterator iter;
+    recordfault(d);
     iter = names_iterator_createarray(d->nitemsets, d, names_recordalltypes_func);
     return iter;
 }
@@ -451,6 +623,7 @@ names_iterator
 names_recordallvaluestrings(recordset_type d, ldns_rr_type rrtype)
 {
     int i;
+    recordfault(d);
     for(i=0; i<d->nitemsets; i++) {
         if(rrtype == d->itemsets[i].rrtype)
             break;
@@ -483,6 +656,40 @@ names_recordallvaluestrings(recordset_type d, ldns_rr_type rrtype)
     }
 }
 
+names_iterator
+names_recordallvalues(recordset_type d, ldns_rr_type rrtype)
+{
+    int i, j;
+    names_iterator iter;
+    recordfault(d);
+    for(i=0; i<d->nitemsets; i++) {
+        if(rrtype == d->itemsets[i].rrtype)
+            break;
+    }
+    if(i<d->nitemsets) {
+        iter = names_iterator_createrefs(NULL);
+        for(j=0; j<d->itemsets[i].nitems; j++) {
+            names_iterator_addptr(iter, d->itemsets[i].items[j].rr);
+        }
+        if(d->itemsets[i].signatures) {
+            for(j=0; j<d->itemsets[i].signatures->nsigs; j++) {
+                names_iterator_addptr(iter, d->itemsets[i].signatures->sigs[j].rr);
+            }
+        }
+        return iter;
+    } else if((rrtype == LDNS_RR_TYPE_NSEC || rrtype == LDNS_RR_TYPE_NSEC3) && d->spanhashrr) {
+        iter = names_iterator_createrefs(NULL);
+        names_iterator_addptr(iter, d->spanhashrr);
+        if(d->spansignatures) {
+            for(j=0; j<d->spansignatures->nsigs; j++) {
+                names_iterator_addptr(iter, d->spansignatures->sigs[j].rr);
+            }
+        }
+        return iter;
+    }
+    return NULL;
+}
+
 void
 names_recorddispose(recordset_type dict)
 {
@@ -504,6 +711,10 @@ names_recorddispose(recordset_type dict)
     free(dict->validupto);
     free(dict->validfrom);
     free(dict->expiry);
+    names_renderedrelease(dict->rendered);
+    disposewire(dict, 0);
+    if(dict->mapping)
+        names_mappingrelease(dict->mapping);
     free(dict);
 }
 
@@ -550,6 +761,8 @@ names_recordgetsummary(recordset_type dict, char** dest)
 const char*
 names_recordgetdenial(recordset_type record)
 {
+    if(record->pendingdenial)
+        names_recordannotatepending(&record, 1);
     return record->spanhash;
 }
 
@@ -586,22 +799,114 @@ names_recordsetvalidfrom(recordset_type record, int value)
 }
 
 int
-names_recordcmpdenial(recordset_type record, ldns_rr* denial)
+names_recordcmpdenial(recordset_type record, ldns_rr_type rrtype, const uint8_t* rdata, size_t rdatalen)
 {
-    if(record->spanhashrr == NULL || ldns_rr_compare(record->spanhashrr, denial)) {
+    size_t i, size, offset = 0;
+    ldns_rdf* rdf;
+    recordfault(record);
+    if(record->spanhashrr == NULL || ldns_rr_get_type(record->spanhashrr) != rrtype)
         return 1;
-    } else {
-        return 0;
+    for(i=0; i<ldns_rr_rd_count(record->spanhashrr); i++) {
+        rdf = ldns_rr_rdf(record->spanhashrr, i);
+        size = ldns_rdf_size(rdf);
+        if(offset + size > rdatalen || memcmp(&rdata[offset], ldns_rdf_data(rdf), size))
+            return 1;
+        offset += size;
     }
+    return offset != rdatalen;
 }
 
 void
 names_recordsetdenial(recordset_type record, ldns_rr* denial)
 {
+    recordfault(record);
+    record->generation += 1;
     assert(denial != NULL);
+    disposewire(record, LDNS_RR_TYPE_NSEC);
+    disposewire(record, LDNS_RR_TYPE_NSEC3);
     record->spanhashrr = denial;
 }
 
+static struct signatures_struct*
+copysignatures(struct signatures_struct* signatures)
+{
+    int i;
+    struct signatures_struct* copy;
+    if(signatures == NULL)
+        return NULL;
+    CHECKALLOC(copy = malloc(sizeof(struct signatures_struct)));
+    copy->nsigs = signatures->nsigs;
+    CHECKALLOC(copy->sigs = malloc(sizeof(struct signature_struct) * (signatures->nsigs ? signatures->nsigs : 1)));
+    for(i=0; i<signatures->nsigs; i++) {
+        copy->sigs[i].rr = ldns_rr_clone(signatures->sigs[i].rr);
+        copy->sigs[i].keylocator = (signatures->sigs[i].keylocator ? strdup(signatures->sigs[i].keylocator) : NULL);
+        copy->sigs[i].keyflags = signatures->sigs[i].keyflags;
+    }
+    return copy;
+}
+
+static void
+earliestexpiration(struct signatures_struct* signatures, int64_t* expiration)
+{
+    int i;
+    int64_t rrsigexpiration;
+    if(signatures) {
+        for(i=0; i<signatures->nsigs; i++) {
+            rrsigexpiration = ldns_rdf2native_time_t(ldns_rr_rrsig_expiration(signatures->sigs[i].rr));
+            if(rrsigexpiration < *expiration)
+                *expiration = rrsigexpiration;
+        }
+    }
+}
+
+/* Used when the denial chain is replaced as a whole.  The new revision
+ * record takes over the signatures over its data from its previous
+ * revision, and the denial with its signatures from shadow, when given,
+ * after which the expiry again reflects the earliest expiring signature.
+ */
+void
+names_recordrebuilddenial(recordset_type record, recordset_type previous, recordset_type shadow)
+{
+    int i, j;
+    int64_t expiration = INT64_MAX;
+    recordfault(record);
+    recordfault(previous);
+    record->generation += 1;
+    for(i=0; i<record->nitemsets; i++) {
+        if(record->itemsets[i].signatures == NULL) {
+            for(j=0; j<previous->nitemsets; j++)
+                if(previous->itemsets[j].rrtype == record->itemsets[i].rrtype)
+                    break;
+            if(j < previous->nitemsets)
+                record->itemsets[i].signatures = copysignatures(previous->itemsets[j].signatures);
+        }
+        earliestexpiration(record->itemsets[i].signatures, &expiration);
+    }
+    free(record->spanhash);
+    if(record->spanhashrr)
+        ldns_rr_free(record->spanhashrr);
+    disposewire(record, LDNS_RR_TYPE_NSEC);
+    disposewire(record, LDNS_RR_TYPE_NSEC3);
+    disposesignature(&record->spansignatures);
+    record->spanhash = NULL;
+    record->spanhashrr = NULL;
+    record->pendingdenial = NULL;
+    if(shadow) {
+        record->spanhash = shadow->spanhash;
+        record->spanhashrr = shadow->spanhashrr;
+        record->spansignatures = shadow->spansignatures;
+        shadow->spanhash = NULL;
+        shadow->spanhashrr = NULL;
+        shadow->spansignatures = NULL;
+        earliestexpiration(record->spansignatures, &expiration);
+    }
+    if(expiration != INT64_MAX) {
+        if(record->expiry == NULL)
+            CHECKALLOC(record->expiry = malloc(sizeof(int64_t)));
+        *(record->expiry) = expiration;
+    }
+}
+
 int
 names_recordhasexpiry(recordset_type record)
 {
@@ -622,21 +927,202 @@ names_recordsetexpiry(recordset_type record, int64_t value)
     *(record->expiry) = value;
 }
 
+struct names_rendered_struct {
+    int refcount;
+    int revision;
+    unsigned int generation;
+    char* text;
+    size_t size;
+};
+
+/* The presentation text of a record as last written to a zone file is kept
+ * with the record, valid as long as the record was not changed in place.
+ * Records are shared between the views, of which several may be writing
+ * out the zone at once, so the text is handed out as a reference that
+ * stays valid when another writer replaces it.
+ */
+names_rendered_type
+names_recordgetrendered(recordset_type record)
+{
+    names_rendered_type rendered;
+    CHECK(pthread_mutex_lock(&renderlock));
+    rendered = record->rendered;
+    if(rendered && (rendered->revision != record->revision || rendered->generation != record->generation))
+        rendered = NULL;
+    if(rendered)
+        rendered->refcount += 1;
+    CHECK(pthread_mutex_unlock(&renderlock));
+    return rendered;
+}
+
+names_rendered_type
+names_recordsetrendered(recordset_type record, char* text, size_t size)
+{
+    names_rendered_type rendered;
+    names_rendered_type previous;
+    CHECKALLOC(rendered = malloc(sizeof(struct names_rendered_struct)));
+    rendered->refcount = 2;
+    rendered->revision = record->revision;
+    rendered->generation = record->generation;
+    rendered->text = text;
+    rendered->size = size;
+    CHECK(pthread_mutex_lock(&renderlock));
+    previous = record->rendered;
+    record->rendered = rendered;
+    CHECK(pthread_mutex_unlock(&renderlock));
+    names_renderedrelease(previous);
+    return rendered;
+}
+
+const char*
+names_renderedtext(names_rendered_type rendered, size_t* size)
+{
+    *size = rendered->size;
+    return rendered->text;
+}
+
+void
+names_renderedrelease(names_rendered_type rendered)
+{
+    int refcount;
+    if(rendered == NULL)
+        return;
+    CHECK(pthread_mutex_lock(&renderlock));
+    refcount = --rendered->refcount;
+    CHECK(pthread_mutex_unlock(&renderlock));
+    if(refcount == 0) {
+        free(rendered->text);
+        free(rendered);
+    }
+}
+
+struct wireitem {
+    const uint8_t* rdata;
+    size_t rdatasize;
+    size_t offset;
+    size_t size;
+};
+
+static int
+comparewireitem(const void* a, const void* b)
+{
+    const struct wireitem* x = a;
+    const struct wireitem* y = b;
+    int rc;
+    rc = memcmp(x->rdata, y->rdata, (x->rdatasize < y->rdatasize ? x->rdatasize : y->rdatasize));
+    if(rc == 0)
+        rc = (x->rdatasize > y->rdatasize) - (x->rdatasize < y->rdatasize);
+    return rc;
+}
+
+/* Returns the canonical wire encoding of the RRset of the given type, as
+ * signed following the RRSIG rdata, and through rr one of its records.
+ * The encoding is made on first use and kept until the RRset changes.
+ * Returns NULL if the record has no such RRset.
+ */
+const uint8_t*
+names_recordgetwire(recordset_type record, ldns_rr_type rrtype, ldns_rr** rr, size_t* size)
+{
+    int i, n, nrrs;
+    struct item* rrs;
+    struct item span;
+    ldns_buffer* buffer;
+    struct wireitem* items;
+    struct wireset* wireset;
+    size_t offset;
+    recordfault(record);
+    for(i=0; i<record->nitemsets; i++)
+        if(record->itemsets[i].rrtype == rrtype)
+            break;
+    if(i<record->nitemsets && record->itemsets[i].nitems > 0) {
+        nrrs = record->itemsets[i].nitems;
+        rrs = record->itemsets[i].items;
+    } else if((rrtype == LDNS_RR_TYPE_NSEC || rrtype == LDNS_RR_TYPE_NSEC3) && record->spanhashrr) {
+        /* the denial is asked for as NSEC whether it is NSEC or NSEC3 */
+        rrtype = ldns_rr_get_type(record->spanhashrr);
+        nrrs = 1;
+        span.rr = record->spanhashrr;
+        rrs = &span;
+    } else {
+        return NULL;
+    }
+    *rr = rrs[0].rr;
+    for(i=0; i<record->nwiresets; i++) {
+        if(record->wiresets[i].rrtype == rrtype) {
+            *size = record->wiresets[i].size;
+            return record->wiresets[i].data;
+        }
+    }
+    CHECKALLOC(items = malloc(sizeof(struct wireitem) * nrrs));
+    CHECKALLOC(buffer = ldns_buffer_new(LDNS_MIN_BUFLEN));
+    for(i=0; i<nrrs; i++) {
+        items[i].offset = ldns_buffer_position(buffer);
+        if(ldns_rr2buffer_wire_canonical(buffer, rrs[i].rr, LDNS_SECTION_ANSWER) != LDNS_STATUS_OK) {
+            logger_message(&cls, logger_noctx, logger_ERROR, "unable to encode RRset of %s\n", record->name);
+            ldns_buffer_free(buffer);
+            free(items);
+            return NULL;
+        }
+        items[i].size = ldns_buffer_position(buffer) - items[i].offset;
+        items[i].rdatasize = items[i].size - ldns_rdf_size(ldns_rr_owner(rrs[i].rr)) - 10;
+    }
+    for(i=0; i<nrrs; i++)
+        items[i].rdata = ldns_buffer_at(buffer, items[i].offset + items[i].size - items[i].rdatasize);
+    /* RFC 4034 section 6.3, ordered by rdata with duplicates removed */
+    qsort(items, nrrs, sizeof(struct wireitem), comparewireitem);
+    CHECKALLOC(record->wiresets = realloc(record->wiresets, sizeof(struct wireset) * (record->nwiresets + 1)));
+    wireset = &record->wiresets[record->nwiresets++];
+    wireset->rrtype = rrtype;
+    CHECKALLOC(wireset->data = malloc(ldns_buffer_position(buffer)));
+    for(i=0, n=0, offset=0; i<nrrs; i++) {
+        if(n > 0 && !comparewireitem(&items[n-1], &items[i]))
+            continue;
+        memcpy(&wireset->data[offset], ldns_buffer_at(buffer, items[i].offset), items[i].size);
+        offset += items[i].size;
+        items[n++] = items[i];
+    }
+    wireset->size = offset;
+    ldns_buffer_free(buffer);
+    free(items);
+    *size = wireset->size;
+    return wireset->data;
+}
+
 int
-marshall(marshall_handle h, void* ptr)
+names_recordgetstatus(recordset_type record, ldns_rr_type* occluded, ldns_rr_type* delegpt)
+{
+    if(record->occluded == 0 || record->delegpt == 0)
+        return 0;
+    if(occluded)
+        *occluded = record->occluded;
+    if(delegpt)
+        *delegpt = record->delegpt;
+    return 1;
+}
+
+/* The zone cut the name imposed on the names below it when its status was
+ * last resolved.  Unlike the status itself this is kept when the data of
+ * the record changes, so a change in the cut can be told from it.
+ */
+ldns_rr_type
+names_recordgetcut(recordset_type record)
+{
+    return record->cut;
+}
+
+void
+names_recordsetstatus(recordset_type record, ldns_rr_type occluded, ldns_rr_type delegpt, ldns_rr_type cut)
+{
+    record->occluded = occluded;
+    record->delegpt = delegpt;
+    record->cut = cut;
+}
+
+static int
+marshallitemsets(marshall_handle h, recordset_type d)
 {
-    recordset_type d = ptr;
     int size = 0;
     int i, j;
-    size += marshalling(h, "name", &(d->name), NULL, 0, marshallstring);
-    size += marshalling(h, "marker", &(d->marker), NULL, 0, marshallinteger);
-    size += marshalling(h, "revision", &(d->revision), NULL, 0, marshallinteger);
-    size += marshalling(h, "spanhash", &(d->spanhash), NULL, 0, marshallstring);
-    size += marshalling(h, "spansignatures", &(d->spansignatures), marshall_OPTIONAL, sizeof(struct signatures_struct), marshallsigs);
-    size += marshalling(h, "spanhashrr", &(d->spanhashrr), NULL, 0, marshallldnsrr);
-    size += marshalling(h, "validupto", &(d->validupto), marshall_OPTIONAL, sizeof(int), marshallinteger);
-    size += marshalling(h, "validfrom", &(d->validfrom), marshall_OPTIONAL, sizeof(int), marshallinteger);
-    size += marshalling(h, "expiry", &(d->expiry), marshall_OPTIONAL, sizeof(int64_t), marshallint64);
     size += marshalling(h, "itemsets", &(d->itemsets), &(d->nitemsets), sizeof(struct itemset), marshallself);
     for(i=0; i<d->nitemsets; i++) {
         size += marshalling(h, "itemname", &(d->itemsets[i].rrtype), NULL, 0, marshallinteger);
@@ -651,6 +1137,77 @@ marshall(marshall_handle h, void* ptr)
     return size;
 }
 
+int
+marshall(marshall_handle h, void* ptr)
+{
+    recordset_type d = ptr;
+    int size = 0;
+    recordfault(d);
+    size += marshalling(h, "name", &(d->name), NULL, 0, marshallstring);
+    size += marshalling(h, "marker", &(d->marker), NULL, 0, marshallinteger);
+    size += marshalling(h, "revision", &(d->revision), NULL, 0, marshallinteger);
+    size += marshalling(h, "spanhash", &(d->spanhash), NULL, 0, marshallstring);
+    size += marshalling(h, "spansignatures", &(d->spansignatures), marshall_OPTIONAL, sizeof(struct signatures_struct), marshallsigs);
+    size += marshalling(h, "spanhashrr", &(d->spanhashrr), NULL, 0, marshallldnsrr);
+    size += marshalling(h, "validupto", &(d->validupto), marshall_OPTIONAL, sizeof(int), marshallinteger);
+    size += marshalling(h, "validfrom", &(d->validfrom), marshall_OPTIONAL, sizeof(int), marshallinteger);
+    size += marshalling(h, "expiry", &(d->expiry), marshall_OPTIONAL, sizeof(int64_t), marshallint64);
+    size += marshallitemsets(h, d);
+    return size;
+}
+
+/* The snapshot splits a record in the fields needed to place it in the
+ * indices, which are read at restore, and the remainder that is only
+ * decoded on first use.
+ */
+static int
+marshallheader(marshall_handle h, recordset_type d)
+{
+    int size = 0;
+    size += marshalling(h, "name", &(d->name), NULL, 0, marshallstring);
+    size += marshalling(h, "marker", &(d->marker), NULL, 0, marshallinteger);
+    size += marshalling(h, "revision", &(d->revision), NULL, 0, marshallinteger);
+    size += marshalling(h, "spanhash", &(d->spanhash), NULL, 0, marshallstring);
+    size += marshalling(h, "validupto", &(d->validupto), marshall_OPTIONAL, sizeof(int), marshallinteger);
+    size += marshalling(h, "validfrom", &(d->validfrom), marshall_OPTIONAL, sizeof(int), marshallinteger);
+    size += marshalling(h, "expiry", &(d->expiry), marshall_OPTIONAL, sizeof(int64_t), marshallint64);
+    return size;
+}
+
+static int
+marshallbody(marshall_handle h, recordset_type d)
+{
+    int size = 0;
+    size += marshalling(h, "spansignatures", &(d->spansignatures), marshall_OPTIONAL, sizeof(struct signatures_struct), marshallsigs);
+    size += marshalling(h, "spanhashrr", &(d->spanhashrr), NULL, 0, marshallldnsrr);
+    size += marshallitemsets(h, d);
+    return size;
+}
+
+recordset_type
+names_recordcreatemapped(names_mapping_type mapping, const void* header, size_t headersize, const void* body, size_t bodysize, uint32_t checksum)
+{
+    recordset_type d;
+    marshall_handle h;
+    d = recordcreate();
+    h = marshallcreate(marshall_MEMORY, header, headersize);
+    marshallheader(h, d);
+    marshallclose(h);
+    d->mappedbody = body;
+    d->mappedsize = bodysize;
+    d->mappedchecksum = checksum;
+    d->mapping = names_mappingacquire(mapping);
+    return d;
+}
+
+void
+names_recordsnapshot(recordset_type d, marshall_handle header, marshall_handle body)
+{
+    recordfault(d);
+    marshallheader(header, d);
+    marshallbody(body, d);
+}
+
 int
 names_recordmarshall(recordset_type* record, marshall_handle h)
 {
@@ -658,7 +1215,12 @@ names_recordmarshall(recordset_type* record, marshall_handle h)
     recordset_type dummy = NULL;
     if(record == NULL)
         record = &dummy;
+    if(marshalleof(h)) {
+        *record = NULL;
+        return 0;
+    }
     rc = marshalling(h, "domain", record, marshall_OPTIONAL, sizeof(struct recordset_struct), marshall);
+    marshallsync(h, (*record == NULL));
     return rc;
 }
 
@@ -667,6 +1229,7 @@ names_recordextend(recordset_type record)
 {
     int i, j;
     size_t size;
+    recordfault(record);
     size = sizeof(struct recordset_struct);
     size += record->nitemsets * sizeof(struct itemset);
     for(i=0; i<record->nitemsets; i++) {
@@ -699,6 +1262,12 @@ names_recordextend(recordset_type record)
     size += (record->validupto ? sizeof(int) : 0);
     size += (record->validfrom ? sizeof(int) : 0);
     size += (record->expiry ? sizeof(int64_t) : 0);
+    CHECK(pthread_mutex_lock(&renderlock));
+    size += (record->rendered ? record->rendered->size : 0);
+    CHECK(pthread_mutex_unlock(&renderlock));
+    size += record->nwiresets * sizeof(struct wireset);
+    for(i=0; i<record->nwiresets; i++)
+        size += record->wiresets[i].size;
     return size;
 }
 
@@ -708,6 +1277,7 @@ names_recordextend(recordset_type record)
     int rc; N((recordset_type)a, (recordset_type)b, &rc); return rc; }
 
 DEFINECOMPARISON(compareready)
+DEFINECOMPARISON(comparesubtree)
 DEFINECOMPARISON(comparenamerevision)
 DEFINECOMPARISON(comparenamehierarchy)
 DEFINECOMPARISON(compareexpiry)
@@ -861,6 +1431,87 @@ compareready(recordset_type newitem, recordset_type curitem, int* cmp)
     return 1;
 }
 
+/* Split a name in its labels, not counting the root label.  Returns the
+ * number of labels, or -1 if there are more than fit.
+ */
+static int
+namelabels(const char* name, const char** labels, size_t* lengths, int maxlabels)
+{
+    int nlabels = 0;
+    const char* s;
+    for(s=name; *s; ) {
+        if(nlabels == maxlabels)
+            return -1;
+        labels[nlabels] = s;
+        for(; *s && *s != '.'; s++) {
+            if(*s == '\\' && s[1])
+                s++;
+        }
+        lengths[nlabels] = s - labels[nlabels];
+        nlabels++;
+        if(*s)
+            s++;
+    }
+    if(nlabels > 0 && lengths[nlabels-1] == 0)
+        --nlabels;
+    return nlabels;
+}
+
+#define NAMES_MAXLABELS 128
+
+/* Compare names label by label starting from the root, so that all names
+ * below a name follow directly after it.  The labels themselves are
+ * compared bytewise, which is not the canonical DNS order but is enough
+ * to keep each subtree together.  If below is given, it is set when name
+ * is below other.
+ */
+int
+names_namesubtreecmp(const char* name, const char* other, int* below)
+{
+    const char* labels[2][NAMES_MAXLABELS];
+    size_t lengths[2][NAMES_MAXLABELS];
+    int nlabels[2];
+    int i, j, cmp;
+    nlabels[0] = namelabels(name, labels[0], lengths[0], NAMES_MAXLABELS);
+    nlabels[1] = namelabels(other, labels[1], lengths[1], NAMES_MAXLABELS);
+    if(below)
+        *below = 0;
+    if(nlabels[0] < 0 || nlabels[1] < 0)
+        return strcmp(name, other);
+    for(i=nlabels[0]-1, j=nlabels[1]-1; i >= 0 && j >= 0; i--, j--) {
+        cmp = memcmp(labels[0][i], labels[1][j], (lengths[0][i] < lengths[1][j] ? lengths[0][i] : lengths[1][j]));
+        if(cmp == 0)
+            cmp = (lengths[0][i] < lengths[1][j] ? -1 : (lengths[0][i] > lengths[1][j] ? 1 : 0));
+        if(cmp != 0)
+            return cmp;
+    }
+    if(i >= 0) {
+        if(below)
+            *below = 1;
+        return 1;
+    }
+    return (j >= 0 ? -1 : 0);
+}
+
+int
+comparesubtree(recordset_type newitem, recordset_type curitem, int* cmp)
+{
+    int c;
+    if (curitem) {
+        c = names_namesubtreecmp(curitem->name, newitem->name, NULL);
+        if (cmp)
+            *cmp = c;
+        if (c == 0) {
+            if (newitem->revision - curitem->revision <= 0)
+                return 0;
+        }
+    }
+    if (newitem->validupto)
+        return 0;
+    if (!newitem->validfrom)
+        return 0;
+    return 1;
+}
 
 int
 comparecurrentset(recordset_type newitem, recordset_type curitem, int* cmp)
@@ -1048,6 +1699,8 @@ names_recordindexfunction(const char* keyname, int (**acceptfunc)(recordset_type
 #define REFERCOMPARISON(F,N) do { if(comparfunc) *comparfunc = N ## _ldns; if(acceptfunc) *acceptfunc = N; } while(0)
     if(!strcmp(keyname,"nameready")) {
         REFERCOMPARISON("namerevision", compareready);
+    } else if(!strcmp(keyname,"namesubtree")) {
+        REFERCOMPARISON("name", comparesubtree);
     } else if(!strcmp(keyname,"namerevision")) {
         REFERCOMPARISON("namerevision", comparenamerevision);
     } else if(!strcmp(keyname,"nameupcoming")) {
@@ -1083,6 +1736,7 @@ void
 names_recordlookupone(recordset_type record, ldns_rr_type recordtype, ldns_rr* template, ldns_rr** rr)
 {
     int i, j;
+    recordfault(record);
     assert(record);
     assert(recordtype != 0);
     *rr = NULL;
@@ -1110,6 +1764,7 @@ names_recordlookupall(recordset_type record, ldns_rr_type rrtype, ldns_rr* templ
 {
     int i, j;
     int nrrsigs = 0;
+    recordfault(record);
     assert(record);
     if(rrs)
         *rrs = NULL;
@@ -1138,7 +1793,8 @@ names_recordlookupall(recordset_type record, ldns_rr_type rrtype, ldns_rr* templ
         }
     }
     if (i<record->nitemsets) {
-        *rrs = ldns_rr_list_new();
+        if(rrs)
+            *rrs = ldns_rr_list_new();
         if(template == NULL) {
             if(record->itemsets[i].nitems > 0) {
                 if(rrs) {
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <ldns/ldns.h>
+#include "compat.h"
+#include "proto.h"
+
+/* Presentation format of the record types that make up the bulk of a
+ * signed zone, written the way ldns_rr2str() with the default output
+ * format writes them.  Anything ldns would escape or treat specially, and
+ * every other type, is refused so the caller falls back to ldns.
+ */
+
+struct formatbuffer {
+    char* text;
+    size_t size;
+    size_t length;
+};
+
+static void
+formatbytes(struct formatbuffer* b, const char* s, size_t len)
+{
+    if(b->length < b->size)
+        memcpy(&b->text[b->length], s, (b->size - b->length < len ? b->size - b->length : len));
+    b->length += len;
+}
+
+static void
+formatstring(struct formatbuffer* b, const char* s)
+{
+    formatbytes(b, s, strlen(s));
+}
+
+static void
+formatchar(struct formatbuffer* b, char c)
+{
+    if(b->length < b->size)
+        b->text[b->length] = c;
+    b->length += 1;
+}
+
+static void
+formatunsigned(struct formatbuffer* b, unsigned long value, int width)
+{
+    char digits[24];
+    int n = 0;
+    do {
+        digits[sizeof(digits) - ++n] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0 || n < width);
+    formatbytes(b, &digits[sizeof(digits) - n], n);
+}
+
+static int
+formatdname(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    const uint8_t* data = ldns_rdf_data(rdf);
+    size_t size = ldns_rdf_size(rdf);
+    size_t pos = 0;
+    size_t i, len;
+    if(size == 0 || data[size-1] != 0)
+        return -1;
+    if(data[0] == 0) {
+        formatchar(b, '.');
+        return 0;
+    }
+    while(pos < size && (len = data[pos]) != 0) {
+        if(len > 63 || pos + 1 + len >= size)
+            return -1;
+        for(i=pos+1; i<=pos+len; i++) {
+            if(!((data[i] >= 'a' && data[i] <= 'z') || (data[i] >= 'A' && data[i] <= 'Z') ||
+                 (data[i] >= '0' && data[i] <= '9') || data[i] == '-' || data[i] == '_' || data[i] == '*'))
+                return -1;
+        }
+        formatbytes(b, (const char*)&data[pos+1], len);
+        formatchar(b, '.');
+        pos += 1 + len;
+    }
+    return (pos == size - 1 ? 0 : -1);
+}
+
+static int
+formattype(struct formatbuffer* b, ldns_rr_type type)
+{
+    const ldns_rr_descriptor* descriptor = ldns_rr_descript(type);
+    if(descriptor == NULL || descriptor->_name == NULL || descriptor->_type != type)
+        return -1;
+    formatstring(b, descriptor->_name);
+    return 0;
+}
+
+static int
+formatinteger(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    switch(ldns_rdf_size(rdf)) {
+        case 1:
+            formatunsigned(b, ldns_rdf2native_int8(rdf), 0);
+            return 0;
+        case 2:
+            formatunsigned(b, ldns_rdf2native_int16(rdf), 0);
+            return 0;
+        case 4:
+            formatunsigned(b, ldns_rdf2native_int32(rdf), 0);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static int
+formattime(struct formatbuffer* b, const ldns_rdf* rdf, time_t now)
+{
+    struct tm tm;
+    if(ldns_rdf_size(rdf) != 4)
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    if(!ldns_serial_arithmitics_gmtime_r(ldns_rdf2native_int32(rdf), now, &tm) || tm.tm_year + 1900 > 9999 || tm.tm_year + 1900 < 0)
+        return -1;
+    formatunsigned(b, tm.tm_year + 1900, 4);
+    formatunsigned(b, tm.tm_mon + 1, 2);
+    formatunsigned(b, tm.tm_mday, 2);
+    formatunsigned(b, tm.tm_hour, 2);
+    formatunsigned(b, tm.tm_min, 2);
+    formatunsigned(b, tm.tm_sec, 2);
+    return 0;
+}
+
+static int
+formatbase64(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    char chunk[65];
+    size_t i, n;
+    size_t start = b->length;
+    size_t size = ldns_rdf_size(rdf);
+    size_t len = (size + 2) / 3 * 4;
+    if(size == 0)
+        return -1;
+    if(start + len < b->size) {
+        b64_ntop(ldns_rdf_data(rdf), size, &b->text[start], b->size - start);
+    } else {
+        /* only the part that still fits, in whole groups */
+        for(i=0; i<size && b->length < b->size; i+=48) {
+            n = (size - i < 48 ? size - i : 48);
+            formatbytes(b, chunk, b64_ntop(&ldns_rdf_data(rdf)[i], n, chunk, sizeof(chunk)));
+        }
+    }
+    b->length = start + len;
+    return 0;
+}
+
+static int
+formathex(struct formatbuffer* b, const uint8_t* data, size_t size, const char* digits)
+{
+    size_t i;
+    for(i=0; i<size; i++) {
+        formatchar(b, digits[data[i] >> 4]);
+        formatchar(b, digits[data[i] & 0x0f]);
+    }
+    return 0;
+}
+
+static int
+formatbase32(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuv";
+    const uint8_t* data = ldns_rdf_data(rdf);
+    size_t size = ldns_rdf_size(rdf);
+    size_t i;
+    uint64_t group;
+    int j;
+    if(size < 1 || data[0] != size - 1 || (size - 1) % 5 != 0)
+        return -1;
+    for(i=1; i<size; i+=5) {
+        group = ((uint64_t)data[i] << 32) | ((uint64_t)data[i+1] << 24) | ((uint64_t)data[i+2] << 16) | ((uint64_t)data[i+3] << 8) | data[i+4];
+        for(j=35; j>=0; j-=5)
+            formatchar(b, digits[(group >> j) & 0x1f]);
+    }
+    return 0;
+}
+
+static int
+formatsalt(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    const uint8_t* data = ldns_rdf_data(rdf);
+    size_t size = ldns_rdf_size(rdf);
+    if(size < 1 || (size_t)data[0] + 1 > size)
+        return -1;
+    if(data[0] == 0)
+        formatchar(b, '-');
+    else
+        formathex(b, &data[1], data[0], "0123456789abcdef");
+    formatchar(b, ' ');
+    return 0;
+}
+
+static int
+formatbitmap(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    const uint8_t* data = ldns_rdf_data(rdf);
+    size_t size = ldns_rdf_size(rdf);
+    size_t pos = 0;
+    const ldns_rr_descriptor* descriptor;
+    unsigned int window, length, bit, type;
+    while(pos + 2 <= size) {
+        window = data[pos];
+        length = data[pos+1];
+        pos += 2;
+        if(length > 32 || pos + length > size)
+            return -1;
+        for(bit=0; bit<length*8; bit++) {
+            if(data[pos + bit/8] & (0x80 >> (bit%8))) {
+                type = window * 256 + bit;
+                descriptor = ldns_rr_descript(type);
+                if(descriptor && descriptor->_name) {
+                    formatstring(b, descriptor->_name);
+                    formatchar(b, ' ');
+                } else {
+                    formatstring(b, "TYPE");
+                    formatunsigned(b, type, 0);
+                    formatchar(b, ' ');
+                }
+            }
+        }
+        pos += length;
+    }
+    return (pos == size ? 0 : -1);
+}
+
+static int
+formatcharacters(struct formatbuffer* b, const ldns_rdf* rdf)
+{
+    const uint8_t* data = ldns_rdf_data(rdf);
+    size_t size = ldns_rdf_size(rdf);
+    size_t i;
+    if(size < 1 || (size_t)data[0] + 1 != size)
+        return -1;
+    for(i=1; i<size; i++)
+        if(data[i] < 0x20 || data[i] > 0x7e || data[i] == '"' || data[i] == '\\')
+            return -1;
+    formatchar(b, '"');
+    formatbytes(b, (const char*)&data[1], size - 1);
+    formatchar(b, '"');
+    return 0;
+}
+
+static int
+formataddress(struct formatbuffer* b, const ldns_rdf* rdf, int family)
+{
+    char text[INET6_ADDRSTRLEN];
+    if(ldns_rdf_size(rdf) != (family == AF_INET ? 4 : 16))
+        return -1;
+    if(inet_ntop(family, ldns_rdf_data(rdf), text, sizeof(text)) == NULL)
+        return -1;
+    formatstring(b, text);
+    return 0;
+}
+
+static int
+formatkeycomment(struct formatbuffer* b, const ldns_rr* rr)
+{
+    uint8_t rdata[4096];
+    size_t rdatalen = 0;
+    size_t i;
+    uint16_t flags;
+    for(i=0; i<ldns_rr_rd_count(rr); i++) {
+        if(rdatalen + ldns_rdf_size(ldns_rr_rdf(rr, i)) > sizeof(rdata))
+            return -1;
+        memcpy(&rdata[rdatalen], ldns_rdf_data(ldns_rr_rdf(rr, i)), ldns_rdf_size(ldns_rr_rdf(rr, i)));
+        rdatalen += ldns_rdf_size(ldns_rr_rdf(rr, i));
+    }
+    flags = ldns_rdf2native_int16(ldns_rr_rdf(rr, 0));
+    formatstring(b, " ;{id = ");
+    formatunsigned(b, ldns_calc_keytag_raw(rdata, rdatalen), 0);
+    if(flags & LDNS_KEY_ZONE_KEY)
+        formatstring(b, (flags & LDNS_KEY_SEP_KEY ? " (ksk), " : " (zsk), "));
+    else
+        formatstring(b, ", ");
+    formatstring(b, "size = ");
+    formatunsigned(b, ldns_rr_dnskey_key_size(rr), 0);
+    formatstring(b, "b}");
+    return 0;
+}
+
+/* Expected rdata fields per supported type, zero terminated. */
+static const struct {
+    ldns_rr_type type;
+    ldns_rdf_type fields[10];
+} formatlayouts[] = {
+    { LDNS_RR_TYPE_A,      { LDNS_RDF_TYPE_A } },
+    { LDNS_RR_TYPE_AAAA,   { LDNS_RDF_TYPE_AAAA } },
+    { LDNS_RR_TYPE_NS,     { LDNS_RDF_TYPE_DNAME } },
+    { LDNS_RR_TYPE_DS,     { LDNS_RDF_TYPE_INT16, LDNS_RDF_TYPE_ALG, LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_HEX } },
+    { LDNS_RR_TYPE_RRSIG,  { LDNS_RDF_TYPE_TYPE, LDNS_RDF_TYPE_ALG, LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_INT32, LDNS_RDF_TYPE_TIME,
+                             LDNS_RDF_TYPE_TIME, LDNS_RDF_TYPE_INT16, LDNS_RDF_TYPE_DNAME, LDNS_RDF_TYPE_B64 } },
+    { LDNS_RR_TYPE_NSEC3,  { LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_INT16, LDNS_RDF_TYPE_NSEC3_SALT,
+                             LDNS_RDF_TYPE_NSEC3_NEXT_OWNER, LDNS_RDF_TYPE_NSEC } },
+    { LDNS_RR_TYPE_DNSKEY, { LDNS_RDF_TYPE_INT16, LDNS_RDF_TYPE_INT8, LDNS_RDF_TYPE_ALG, LDNS_RDF_TYPE_B64 } },
+    { LDNS_RR_TYPE_TXT,    { LDNS_RDF_TYPE_STR } }
+};
+#define FORMATLAYOUTS (sizeof(formatlayouts)/sizeof(formatlayouts[0]))
+
+/* Layouts whose output turned out to differ from the linked ldns. */
+static int formatdisabled[FORMATLAYOUTS];
+static pthread_once_t formatverified = PTHREAD_ONCE_INIT;
+
+static int
+formatrr(const ldns_rr* rr, char* text, size_t size, time_t now)
+{
+    struct formatbuffer b = { text, size, 0 };
+    const ldns_rdf* rdf;
+    ldns_rr_type type = ldns_rr_get_type(rr);
+    size_t layout, i, count;
+    int status = 0;
+
+    for(layout=0; layout<FORMATLAYOUTS; layout++)
+        if(formatlayouts[layout].type == type)
+            break;
+    if(layout == FORMATLAYOUTS || formatdisabled[layout])
+        return -1;
+    count = ldns_rr_rd_count(rr);
+    if(count == 0 || ldns_rr_owner(rr) == NULL || ldns_rr_get_class(rr) != LDNS_RR_CLASS_IN || ldns_rr_ttl(rr) > 0x7fffffff)
+        return -1;
+    if(type != LDNS_RR_TYPE_TXT && (count >= 10 || formatlayouts[layout].fields[count] != 0))
+        return -1;
+    for(i=0; i<count; i++) {
+        if(ldns_rr_rdf(rr, i) == NULL)
+            return -1;
+        if(ldns_rdf_get_type(ldns_rr_rdf(rr, i)) != (type == LDNS_RR_TYPE_TXT ? LDNS_RDF_TYPE_STR : formatlayouts[layout].fields[i]))
+            return -1;
+    }
+
+    if(formatdname(&b, ldns_rr_owner(rr)))
+        return -1;
+    formatchar(&b, '\t');
+    formatunsigned(&b, ldns_rr_ttl(rr), 0);
+    formatstring(&b, "\tIN\t");
+    if(formattype(&b, type))
+        return -1;
+    formatchar(&b, '\t');
+    for(i=0; i<count && status == 0; i++) {
+        if(i > 0)
+            formatchar(&b, ' ');
+        rdf = ldns_rr_rdf(rr, i);
+        switch(ldns_rdf_get_type(rdf)) {
+            case LDNS_RDF_TYPE_A:
+                status = formataddress(&b, rdf, AF_INET);
+                break;
+            case LDNS_RDF_TYPE_AAAA:
+                status = formataddress(&b, rdf, AF_INET6);
+                break;
+            case LDNS_RDF_TYPE_DNAME:
+                status = formatdname(&b, rdf);
+                break;
+            case LDNS_RDF_TYPE_INT8:
+            case LDNS_RDF_TYPE_INT16:
+            case LDNS_RDF_TYPE_INT32:
+            case LDNS_RDF_TYPE_ALG:
+                status = formatinteger(&b, rdf);
+                break;
+            case LDNS_RDF_TYPE_TYPE:
+                status = (ldns_rdf_size(rdf) == 2 ? formattype(&b, ldns_rdf2native_int16(rdf)) : -1);
+                break;
+            case LDNS_RDF_TYPE_TIME:
+                status = formattime(&b, rdf, now);
+                break;
+            case LDNS_RDF_TYPE_B64:
+                status = formatbase64(&b, rdf);
+                break;
+            case LDNS_RDF_TYPE_HEX:
+                status = formathex(&b, ldns_rdf_data(rdf), ldns_rdf_size(rdf), "0123456789ABCDEF");
+                break;
+            case LDNS_RDF_TYPE_NSEC3_SALT:
+                status = formatsalt(&b, rdf);
+                break;
+            case LDNS_RDF_TYPE_NSEC3_NEXT_OWNER:
+                status = formatbase32(&b, rdf);
+                break;
+            case LDNS_RDF_TYPE_NSEC:
+                status = formatbitmap(&b, rdf);
+                break;
+            case LDNS_RDF_TYPE_STR:
+                status = formatcharacters(&b, rdf);
+                break;
+            default:
+                status = -1;
+        }
+    }
+    if(status == 0 && type == LDNS_RR_TYPE_DNSKEY)
+        status = formatkeycomment(&b, rr);
+    if(status)
+        return -1;
+    formatchar(&b, '\n');
+    if(b.length < b.size)
+        b.text[b.length] = '\0';
+    else if(b.size > 0)
+        b.text[b.size - 1] = '\0';
+    return b.length;
+}
+
+/* Compares one sample of each type against ldns, so an ldns release that
+ * renders a type differently keeps that type on ldns.
+ */
+static void
+formatverify(void)
+{
+    static const char* samples[FORMATLAYOUTS] = {
+        "a.example. 3600 IN A 192.0.2.1",
+        "a.example. 3600 IN AAAA 2001:db8::1",
+        "a.example. 3600 IN NS ns.example.",
+        "a.example. 3600 IN DS 12345 8 2 49FD46E6C4B45C55D4AC69CBD3CD34AC1AFE51DE3B4A2F5F7C3C4B8E2E7B7E31",
+        "a.example. 3600 IN RRSIG A 8 2 3600 20300101000000 20200101000000 12345 example. FV0gZ8FAaqlFnJ6jFuBj4DSImeftLaRdOXhjGxUZuZe29Pkk",
+        "0p9mhaveqvm6t7vbl5lop2u3t2rp3tom.example. 3600 IN NSEC3 1 0 5 aabbccdd 2vptu5timamqttgl4luu9kg21e0aor3s A RRSIG",
+        "example. 3600 IN DNSKEY 257 3 8 AwEAAcFcGsaxxdgiuuGmCkVImy4h99CqT7jwY3pexPGcnUFtR2Fh36BponcwtkZ4cAgtvd4Qs8PkxUdp6p/DlUmObdk=",
+        "a.example. 3600 IN TXT \"hello world\" \"v=spf1 -all\""
+    };
+    char text[1024];
+    char* reference;
+    ldns_rr* rr;
+    size_t layout;
+    time_t now = time(NULL);
+    for(layout=0; layout<FORMATLAYOUTS; layout++) {
+        if(ldns_rr_new_frm_str(&rr, samples[layout], 0, NULL, NULL) != LDNS_STATUS_OK) {
+            formatdisabled[layout] = 1;
+            continue;
+        }
+        reference = ldns_rr2str(rr);
+        if(reference == NULL || formatrr(rr, text, sizeof(text), now) < 0 || strcmp(reference, text))
+            formatdisabled[layout] = 1;
+        free(reference);
+        ldns_rr_free(rr);
+    }
+}
+
+/* Renders a resource record like ldns_rr2str() into text, truncated to
+ * size and NUL terminated when size is not zero.  Returns the length of
+ * the complete presentation, which may exceed size, or -1 when the record
+ * should be rendered by ldns.
+ */
+int
+names_rrformat(const ldns_rr* rr, char* text, size_t size)
+{
+    pthread_once(&formatverified, formatverify);
+    return formatrr(rr, text, size, time(NULL));
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2018 NLNet Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _LARGEFILE_SOURCE
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <ldns/ldns.h>
+#include "logging.h"
+#include "utilities.h"
+#include "proto.h"
+
+static logger_cls_type cls = LOGGER_INITIALIZE("snapshot");
+
+/* A snapshot consists of a fixed header, followed by the bodies of all
+ * records, followed by the per record headers in index order.  The record
+ * headers are read on restore, the bodies stay in the read-only mapping of
+ * the file until a record is used.  A journal of blocks in the regular
+ * marshalling format may follow the snapshot.
+ */
+struct snapshotheader {
+    uint64_t count;
+    uint64_t bodiesoffset;
+    uint64_t bodieslength;
+    uint64_t headersoffset;
+    uint64_t headerslength;
+    uint32_t headerschecksum;
+    uint32_t reserved;
+};
+
+struct snapshotentry {
+    uint32_t headersize;
+    uint32_t bodysize;
+    uint64_t bodyoffset;
+    uint32_t bodychecksum;
+    uint32_t reserved;
+};
+
+/* A pinned snapshot is written from a clone of an index in the background,
+ * while the records in it continue to be amended in place.  A record that
+ * is amended before it is written is serialized first, and that copy is
+ * written instead.  The records are written in index order, current being
+ * the last one written.
+ */
+struct names_snapshotpin_struct {
+    pthread_mutex_t lock;
+    names_index_type index;
+    recordset_type current;
+    names_table_type preserved;
+};
+
+struct snapshotpreserved {
+    size_t headersize;
+    size_t bodysize;
+    char data[];
+};
+
+struct names_mapping_struct {
+    void* base;
+    size_t size;
+    long refcount;
+};
+
+names_mapping_type
+names_mappingcreate(int fd, size_t size)
+{
+    names_mapping_type mapping;
+    void* base;
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(base == MAP_FAILED) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to map state: %s\n", strerror(errno));
+        return NULL;
+    }
+    CHECKALLOC(mapping = malloc(sizeof(struct names_mapping_struct)));
+    mapping->base = base;
+    mapping->size = size;
+    mapping->refcount = 1;
+    return mapping;
+}
+
+names_mapping_type
+names_mappingacquire(names_mapping_type mapping)
+{
+    __atomic_add_fetch(&mapping->refcount, 1, __ATOMIC_RELAXED);
+    return mapping;
+}
+
+void
+names_mappingrelease(names_mapping_type mapping)
+{
+    if(__atomic_sub_fetch(&mapping->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(mapping->base, mapping->size);
+        free(mapping);
+    }
+}
+
+static void
+snapshotappend(char** buffer, size_t* size, size_t* length, const void* data, size_t len)
+{
+    if(*length + len > *size) {
+        while(*length + len > *size)
+            *size *= 2;
+        CHECKALLOC(*buffer = realloc(*buffer, *size));
+    }
+    memcpy(&(*buffer)[*length], data, len);
+    *length += len;
+}
+
+/* Writes the snapshot to the stream, which is positioned at file offset
+ * start.  With a pin, preserved copies take the place of the records.
+ */
+static int
+snapshotemit(FILE* fp, off_t start, names_iterator iter, names_snapshotpin_type pin)
+{
+    struct snapshotheader header;
+    struct snapshotentry entry;
+    struct snapshotpreserved* preserved = NULL;
+    marshall_handle headerh;
+    marshall_handle bodyh;
+    const void* data;
+    const void* body;
+    recordset_type record;
+    char* headers;
+    size_t headerssize = 65536;
+    size_t headerslength = 0;
+
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, fp);
+    header.bodiesoffset = start + sizeof(header);
+
+    CHECKALLOC(headers = malloc(headerssize));
+    headerh = marshallcreate(marshall_BUFFER);
+    bodyh = marshallcreate(marshall_BUFFER);
+    memset(&entry, 0, sizeof(entry));
+    for(; names_iterate(&iter, &record); names_advance(&iter, NULL)) {
+        if(pin) {
+            pthread_mutex_lock(&pin->lock);
+            preserved = names_tableget(pin->preserved, record);
+        }
+        if(preserved) {
+            entry.headersize = preserved->headersize;
+            entry.bodysize = preserved->bodysize;
+            data = preserved->data;
+            body = &preserved->data[preserved->headersize];
+        } else {
+            marshallreset(headerh);
+            marshallreset(bodyh);
+            names_recordsnapshot(record, headerh, bodyh);
+            entry.headersize = marshallbuffer(headerh, &data);
+            entry.bodysize = marshallbuffer(bodyh, &body);
+        }
+        if(pin) {
+            pin->current = record;
+            pthread_mutex_unlock(&pin->lock);
+        }
+        entry.bodyoffset = header.bodiesoffset + header.bodieslength;
+        entry.bodychecksum = marshallchecksum(body, entry.bodysize);
+        fwrite(body, entry.bodysize, 1, fp);
+        header.bodieslength += entry.bodysize;
+        snapshotappend(&headers, &headerssize, &headerslength, &entry, sizeof(entry));
+        snapshotappend(&headers, &headerssize, &headerslength, data, entry.headersize);
+        header.count += 1;
+    }
+    marshallclose(headerh);
+    marshallclose(bodyh);
+
+    header.headersoffset = header.bodiesoffset + header.bodieslength;
+    header.headerslength = headerslength;
+    header.headerschecksum = marshallchecksum(headers, headerslength);
+    fwrite(headers, headerslength, 1, fp);
+    free(headers);
+    fseeko(fp, start, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    fseeko(fp, header.headersoffset + header.headerslength, SEEK_SET);
+    return (ferror(fp) ? -1 : 0);
+}
+
+static int
+snapshotwrite(int fd, names_iterator iter, names_snapshotpin_type pin)
+{
+    FILE* fp;
+    off_t start;
+    int rc;
+
+    start = lseek(fd, 0, SEEK_CUR);
+    if(start < 0 || (fp = fdopen(dup(fd), "w")) == NULL) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write state: %s\n", strerror(errno));
+        names_end(&iter);
+        return -1;
+    }
+    rc = snapshotemit(fp, start, iter, pin);
+    if(fclose(fp))
+        rc = -1;
+    if(rc)
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write state: %s\n", strerror(errno));
+    return rc;
+}
+
+int
+names_snapshotwrite(int fd, names_iterator iter)
+{
+    return snapshotwrite(fd, iter, NULL);
+}
+
+static int
+preservedcompare(const void* a, const void* b)
+{
+    return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+static void
+preserveddispose(void* arg, void* key, void* val)
+{
+    (void)arg;
+    (void)key;
+    free(val);
+}
+
+/* Pins the records currently in the index, which should be written out
+ * using names_snapshotpinwrite.  Until the pin is released, records must
+ * be passed to names_snapshotpreserve before they are modified.
+ */
+names_snapshotpin_type
+names_snapshotpin(names_index_type index)
+{
+    names_snapshotpin_type pin;
+    CHECKALLOC(pin = malloc(sizeof(struct names_snapshotpin_struct)));
+    pthread_mutex_init(&pin->lock, NULL);
+    names_indexclone(&pin->index, index);
+    pin->current = NULL;
+    pin->preserved = names_tablecreate(preservedcompare);
+    return pin;
+}
+
+void
+names_snapshotpreserve(names_snapshotpin_type pin, recordset_type record)
+{
+    struct snapshotpreserved* preserved;
+    marshall_handle headerh;
+    marshall_handle bodyh;
+    const void* header;
+    const void* body;
+    size_t headersize;
+    size_t bodysize;
+    void** slot;
+
+    pthread_mutex_lock(&pin->lock);
+    if(names_indexlookup(pin->index, record) == record &&
+       (pin->current == NULL || names_indexcompare(pin->index, record, pin->current) > 0)) {
+        slot = names_tableput(pin->preserved, record);
+        if(*slot == NULL) {
+            headerh = marshallcreate(marshall_BUFFER);
+            bodyh = marshallcreate(marshall_BUFFER);
+            names_recordsnapshot(record, headerh, bodyh);
+            headersize = marshallbuffer(headerh, &header);
+            bodysize = marshallbuffer(bodyh, &body);
+            CHECKALLOC(preserved = malloc(sizeof(struct snapshotpreserved) + headersize + bodysize));
+            preserved->headersize = headersize;
+            preserved->bodysize = bodysize;
+            memcpy(preserved->data, header, preserved->headersize);
+            memcpy(&preserved->data[preserved->headersize], body, preserved->bodysize);
+            marshallclose(headerh);
+            marshallclose(bodyh);
+            *slot = preserved;
+        }
+    }
+    pthread_mutex_unlock(&pin->lock);
+}
+
+int
+names_snapshotpinwrite(int fd, names_snapshotpin_type pin)
+{
+    return snapshotwrite(fd, names_indexiterator(pin->index), pin);
+}
+
+void
+names_snapshotunpin(names_snapshotpin_type pin)
+{
+    names_tabledispose(pin->preserved, preserveddispose, NULL);
+    names_indexdestroy(pin->index, NULL, NULL);
+    pthread_mutex_destroy(&pin->lock);
+    free(pin);
+}
+
+/* Reads the record headers from a snapshot at the current offset of the
+ * file, leaving the file positioned at the journal following it.  The
+ * returned records are not yet placed in any index.
+ */
+int
+names_snapshotread(int fd, recordset_type** records, size_t* count)
+{
+    struct snapshotheader header;
+    struct snapshotentry entry;
+    struct stat st;
+    names_mapping_type mapping;
+    const unsigned char* base;
+    uint64_t end, offset;
+    off_t start;
+    size_t i;
+
+    *records = NULL;
+    *count = 0;
+    start = lseek(fd, 0, SEEK_CUR);
+    if(start < 0 || pread(fd, &header, sizeof(header), start) != sizeof(header) || fstat(fd, &st)) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to read state header\n");
+        return 1;
+    }
+    end = header.headersoffset + header.headerslength;
+    if(header.bodiesoffset != start + sizeof(header) || header.headersoffset != header.bodiesoffset + header.bodieslength || end > (uint64_t)st.st_size || header.count > header.headerslength / sizeof(entry)) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "state damaged, snapshot incomplete\n");
+        return 1;
+    }
+    if((mapping = names_mappingcreate(fd, end)) == NULL)
+        return 1;
+    base = mapping->base;
+    if(marshallchecksum(&base[header.headersoffset], header.headerslength) != header.headerschecksum) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "state damaged, snapshot index corrupt\n");
+        names_mappingrelease(mapping);
+        return 1;
+    }
+    CHECKALLOC(*records = malloc(sizeof(recordset_type) * (header.count ? header.count : 1)));
+    offset = header.headersoffset;
+    for(i=0; i<header.count; i++) {
+        if(offset + sizeof(entry) > end)
+            break;
+        memcpy(&entry, &base[offset], sizeof(entry));
+        offset += sizeof(entry);
+        if(offset + entry.headersize > end || entry.bodyoffset < header.bodiesoffset || entry.bodyoffset + entry.bodysize > header.headersoffset)
+            break;
+        (*records)[i] = names_recordcreatemapped(mapping, &base[offset], entry.headersize, &base[entry.bodyoffset], entry.bodysize, entry.bodychecksum);
+        offset += entry.headersize;
+    }
+    *count = i;
+    names_mappingrelease(mapping);
+    if(i < header.count) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "state damaged, snapshot index inconsistent\n");
+        while(i > 0)
+            names_recorddispose((*records)[--i]);
+        free(*records);
+        *records = NULL;
+        *count = 0;
+        return 1;
+    }
+    lseek(fd, end, SEEK_SET);
+    return 0;
+}
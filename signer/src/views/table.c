@@ -47,6 +47,7 @@ struct names_table_struct {
     ldns_rbtree_t* tree;
     names_table_type next;
     int (*cmp)(const void *, const void *);
+    long epoch;
 };
 
 struct names_iterator_struct {
@@ -112,6 +113,7 @@ names_tablecreate(int (*cmpf)(const void *, const void *))
     table->tree = ldns_rbtree_create(cmpf);
     table->next = NULL;
     table->cmp = cmpf;
+    table->epoch = 0;
     return table;
 }
 
@@ -33,27 +33,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <ldns/ldns.h>
 #include "uthash.h"
 #include "utilities.h"
 #include "logging.h"
 #include "proto.h"
+#include "signer/shard.h"
 
 const char* names_view_BASE[]    = { "base",    "namerevision", "outdated", NULL };
 const char* names_view_INPUT[]   = { "input",   "nameupcoming", "namehierarchy", NULL };
 const char* names_view_PREPARE[] = { "prepare", "namerevision", "incomingset", "currentset", "relevantset", NULL };
-const char* names_view_NEIGHB[]  = { "neighb",  "namerevision", "nameready", "denialname", NULL };
+const char* names_view_NEIGHB[]  = { "neighb",  "namerevision", "namesubtree", "denialname", NULL };
 const char* names_view_SIGN[]    = { "sign",    "nameready", "expiry", "denialname", NULL };
 const char* names_view_OUTPUT[]  = { "output",  "validnow", NULL };
 const char* names_view_CHANGES[] = { "changes", "validchanges", "validinserts", "validdeletes", NULL };
 const char* names_view_BACKUP[]  = { "backup",  "namerevision", "denialname", NULL };
 
 logger_cls_type names_logcommitlog = LOGGER_INITIALIZE("commitlog");
+static logger_cls_type cls = LOGGER_INITIALIZE("checkpoint");
 
 struct searchfunc {
     names_index_type index;
@@ -70,6 +75,20 @@ struct names_view_struct {
     names_commitlog_type commitlog;
     int nsearchfuncs;
     struct searchfunc* searchfuncs;
+    struct names_compaction* compaction;
+    /* records pinned for a compaction, only set on the base view */
+    pthread_mutex_t pinlock;
+    names_snapshotpin_type pin;
+    off_t persistedsize;
+    long long persistedbytes;
+    /* names other views committed records for, only kept for views that
+     * ask for them; taken are the ones last handed out */
+    int trackarrivals;
+    struct names_arrival* arrivals;
+    size_t narrivals;
+    size_t maxarrivals;
+    struct names_arrival* taken;
+    size_t ntaken;
     int nindices;
     names_index_type indices[];
 };
@@ -81,6 +100,38 @@ struct names_change_struct {
 typedef struct names_change_struct* names_change_type;
 enum changetype { ADD, DEL, MOD, UPD };
 
+/* A compaction writes a new state file from a clone of the base index in a
+ * background thread, while changes continue to be appended to a separate
+ * journal segment.  Once complete, the segment is appended to the new state
+ * file which then replaces the old one.  Records amended in place by any
+ * view before they are written are preserved through the pin.
+ */
+struct names_compaction {
+    names_view_type view;
+    names_snapshotpin_type pin;
+    pthread_t thread;
+    int finished;
+    int failed;
+    int basefd;
+    int fd;
+    char* filename;
+    char* tmpfilename;
+    char* segmentname;
+    off_t snapshotsize;
+    off_t journalsize;
+    long long journalbytes;
+    struct timespec start;
+};
+
+static void
+compactiondispose(struct names_compaction* compaction)
+{
+    free(compaction->filename);
+    free(compaction->tmpfilename);
+    free(compaction->segmentname);
+    free(compaction);
+}
+
 static void
 changed(names_view_type view, recordset_type record, enum changetype type, recordset_type** target)
 {
@@ -188,9 +239,66 @@ names_update(names_view_type view, recordset_type* record)
     *record = *dict;
 }
 
+/* Replace the record by the revision updated in this view, if any */
+void
+names_updated(names_view_type view, recordset_type* record)
+{
+    names_change_type change;
+    change = names_tableget(view->changelog, *record);
+    if(change && change->record)
+        *record = change->record;
+}
+
+static void
+addarrival(names_view_type view, recordset_type record)
+{
+    if(view->narrivals == view->maxarrivals) {
+        view->maxarrivals = (view->maxarrivals ? view->maxarrivals * 2 : 1024);
+        CHECKALLOC(view->arrivals = realloc(view->arrivals, sizeof(struct names_arrival) * view->maxarrivals));
+    }
+    CHECKALLOC(view->arrivals[view->narrivals].name = strdup(names_recordgetname(record)));
+    view->arrivals[view->narrivals].cut = names_recordgetcut(record);
+    view->narrivals++;
+}
+
+static void
+disposearrivals(struct names_arrival* arrivals, size_t narrivals)
+{
+    size_t i;
+    for(i=0; i<narrivals; i++)
+        free((void*)arrivals[i].name);
+    free(arrivals);
+}
+
+/* The names other views have committed records for since the previous
+ * call.  The names remain valid until the next call.
+ */
+names_iterator
+names_viewarrivals(names_view_type view)
+{
+    size_t i;
+    names_iterator iter;
+    disposearrivals(view->taken, view->ntaken);
+    view->taken = view->arrivals;
+    view->ntaken = view->narrivals;
+    view->arrivals = NULL;
+    view->narrivals = view->maxarrivals = 0;
+    iter = names_iterator_createdata(sizeof(struct names_arrival));
+    for(i=0; i<view->ntaken; i++)
+        names_iterator_adddata(iter, &view->taken[i]);
+    return iter;
+}
+
 void
 names_amend(names_view_type view, recordset_type record)
 {
+    names_view_type base = (view->base ? view->base : view);
+    if(__atomic_load_n(&base->pin, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&base->pinlock);
+        if(base->pin)
+            names_snapshotpreserve(base->pin, record);
+        pthread_mutex_unlock(&base->pinlock);
+    }
     changed(view, record, UPD, NULL);
 }
 
@@ -248,26 +356,44 @@ names_viewcreate(names_view_type base, const char* viewname, const char** keynam
     view->zonedata.apex = (base ? base->zonedata.apex : NULL);
     view->zonedata.defaultttl = NULL;
     view->zonedata.signconf = (base ? base->zonedata.signconf : NULL);
+    view->zonedata.nsec3cache = (base ? base->zonedata.nsec3cache : names_nsec3cachecreate());
     int (*comparfunc)(const void *, const void *);
     names_recordindexfunction(keynames[0], NULL, &comparfunc);
     view->changelog = names_tablecreate(comparfunc);
     view->nsearchfuncs = 0;
     view->searchfuncs = NULL;
+    view->compaction = NULL;
+    pthread_mutex_init(&view->pinlock, NULL);
+    view->pin = NULL;
+    view->persistedsize = 0;
+    view->persistedbytes = 0;
+    view->trackarrivals = 0;
+    view->arrivals = NULL;
+    view->narrivals = view->maxarrivals = 0;
+    view->taken = NULL;
+    view->ntaken = 0;
     view->nindices = nindices;
     for(i=0; i<nindices; i++) {
-        names_indexcreate(&view->indices[i], keynames[i]);
+        if(i == 0 && base != NULL && !strcmp(keynames[0], *(char**)base->indices[0])) {
+            names_indexclone(&view->indices[i], base->indices[0]);
+        } else {
+            names_indexcreate(&view->indices[i], keynames[i]);
+        }
         names_indexsearchfunction(view->indices[i], view, keynames[i]);
     }
     if(!strcmp(viewname,names_view_PREPARE[0])) {
         names_viewaddsearchfunction2(view, view->indices[1], view->indices[2], names_iteratorincoming);
     } else if(!strcmp(viewname,names_view_NEIGHB[0])) {
         names_viewaddsearchfunction2(view, view->indices[1], view->indices[2], names_iteratordenialchainupdates);
+        view->trackarrivals = 1;
     } else if(!strcmp(viewname,names_view_SIGN[0])) {
         names_viewaddsearchfunction2(view, view->indices[0], view->indices[2], names_iteratordenialchainupdates);
     }
     if(base != NULL) {
-        for(iter=names_indexiterator(base->indices[0]); names_iterate(&iter, &content); names_advance(&iter, NULL)) {
-            names_indexinsert(view->indices[0], content, NULL);
+        if(strcmp(keynames[0], *(char**)base->indices[0])) {
+            for(iter=names_indexiterator(base->indices[0]); names_iterate(&iter, &content); names_advance(&iter, NULL)) {
+                names_indexinsert(view->indices[0], content, NULL);
+            }
         }
         for(iter=names_indexiterator(view->indices[0]); names_iterate(&iter, &content); names_advance(&iter, NULL)) {
             for(i=1; i<nindices; i++) {
@@ -278,6 +404,13 @@ names_viewcreate(names_view_type base, const char* viewname, const char** keynam
     } else {
         view->commitlog = NULL;
     }
+    if(view->trackarrivals) {
+        /* everything already present is new to whoever follows the arrivals */
+        for(iter=names_indexiterator(view->indices[0]); names_iterate(&iter, &content); names_advance(&iter, NULL)) {
+            if(names_recordvalidfrom(content, NULL) && !names_recordvalidupto(content, NULL))
+                addarrival(view, content);
+        }
+    }
     view->viewid = names_commitlogsubscribe(view, &view->commitlog);
     return view;
 }
@@ -296,6 +429,10 @@ names_viewdestroy(names_view_type view)
 {
     int i;
     marshall_handle store = NULL;
+    if(view->compaction) {
+        pthread_join(view->compaction->thread, NULL);
+        compactiondispose(view->compaction);
+    }
     names_commitlogunsubscribe(view->viewid, view->commitlog);
     names_commitlogdestroy(view->changelog);
     for(i=1; i<view->nindices; i++) {
@@ -304,6 +441,7 @@ names_viewdestroy(names_view_type view)
     if(view->base == NULL || view->base == view) {
         names_commitlogdestroyall(view->commitlog, &store);
         names_indexdestroy(view->indices[0], disposedict, NULL);
+        names_nsec3cachedestroy(view->zonedata.nsec3cache);
     } else {
         names_indexdestroy(view->indices[0], NULL, NULL);
     }
@@ -313,14 +451,17 @@ names_viewdestroy(names_view_type view)
         free((void*)view->zonedata.defaultttl);
     if(view->viewid == 0)
         free((void*)view->zonedata.apex);
+    disposearrivals(view->arrivals, view->narrivals);
+    disposearrivals(view->taken, view->ntaken);
     free(view->searchfuncs);
+    pthread_mutex_destroy(&view->pinlock);
     free(view);
 }
 
 typedef int (*acceptfunction)(recordset_type newitem, recordset_type currentitem, int* cmp);
 struct names_index_struct {
     const char* keyname;
-    ldns_rbtree_t* tree;
+    void* root;
     acceptfunction acceptfunc;
 };
 
@@ -328,7 +469,7 @@ void
 names_viewvalidate(names_view_type view)
 {
     int fail = 0;
-    int count, size, i;
+    int count, shared, size, i;
     char* temp1 = NULL;
     char* temp2 = NULL;
     names_iterator iter;
@@ -343,9 +484,10 @@ names_viewvalidate(names_view_type view)
         }
     }
     if(view->viewid == 0) {
-        fprintf(stderr,"total memory size of records is %d, index nodes are %lu\n",size,sizeof(ldns_rbnode_t));
+        fprintf(stderr,"total memory size of records is %d, index nodes are %lu\n",size,names_indexnodesize());
     }
-    fprintf(stderr,"view %s contains %d records in primary index%s",view->viewname,count,(view->nindices>1?" in other indices:":""));
+    names_indexcount(view->indices[0], &shared);
+    fprintf(stderr,"view %s contains %d records (%d shared) in primary index%s",view->viewname,count,shared,(view->nindices>1?" in other indices:":""));
     for(i=1; i<view->nindices; i++) {
         count = 0;
         for(iter=names_indexiterator(view->indices[i]); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
@@ -460,6 +602,25 @@ names_iteratorexpiring(names_index_type index, va_list ap)
     return result;
 }
 
+/* the signed record of which the signatures expire first, if any */
+names_iterator
+names_iteratorfirstexpiring(names_index_type index, va_list ap)
+{
+    recordset_type record;
+    names_iterator iter;
+    names_iterator result;
+    result = names_iterator_createrefs(NULL);
+    for (iter=names_indexiterator(index); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
+        if(names_recordhasexpiry(record)) {
+            if(names_recordgetexpiry(record) < INT_MAX)
+                names_iterator_addptr(result, record);
+            names_end(&iter);
+            break;
+        }
+    }
+    return result;
+}
+
 names_iterator
 names_iteratordenialchainupdates(names_index_type primary, names_index_type secondary, va_list ap)
 {
@@ -501,10 +662,67 @@ resetchangelog(names_view_type view)
     view->changelog = newchangelog;
 }
 
+/* Below this number of changes, the secondary indices are updated by the
+ * calling thread only.  Above it each secondary index is updated by its own
+ * thread, as the updates to one index do not depend on any other index.
+ */
+#define NAMES_PARALLELUPDATES 1024
+
+struct names_indexupdate {
+    recordset_type record;
+    recordset_type existing;
+};
+
+struct names_indexupdates {
+    names_view_type view;
+    int count;
+    struct names_indexupdate* updates;
+};
+
+static void
+addupdate(struct names_indexupdates* updates, int* capacity, recordset_type record, recordset_type existing)
+{
+    if(updates->count == *capacity) {
+        *capacity = (*capacity ? *capacity * 2 : 64);
+        CHECKALLOC(updates->updates = realloc(updates->updates, sizeof(struct names_indexupdate) * *capacity));
+    }
+    updates->updates[updates->count].record = record;
+    updates->updates[updates->count].existing = existing;
+    updates->count += 1;
+}
+
+/* Applies the updates to the secondary indices begin up to end */
+static void
+applyupdates(void* arg, long begin, long end)
+{
+    int i;
+    long n;
+    recordset_type existing;
+    struct names_indexupdates* updates = arg;
+    for(n=begin; n<end; n++) {
+        for(i=0; i<updates->count; i++) {
+            existing = updates->updates[i].existing;
+            names_indexinsert(updates->view->indices[1+n], updates->updates[i].record, &existing);
+        }
+    }
+}
+
+static void
+applysecondary(names_view_type view, struct names_indexupdates* updates)
+{
+    if(view->nindices <= 1 || updates->count == 0)
+        return;
+    updates->view = view;
+    if(updates->count < NAMES_PARALLELUPDATES)
+        applyupdates(updates, 0, view->nindices - 1);
+    else
+        shard_run(view->nindices - 1, view->nindices - 1, 1, applyupdates, updates, NULL);
+}
+
 static int
 updateview(names_view_type view, names_table_type* mychangelog)
 {
-    int i, conflict = 0;
+    int conflict = 0;
     names_iterator iter;
     names_change_type change;
     names_table_type changelog;
@@ -512,8 +730,13 @@ updateview(names_view_type view, names_table_type* mychangelog)
     char* temp2 = NULL;
     int accepted;
     recordset_type existing;
+    struct names_indexupdates updates;
+    int capacity = 0;
 
     changelog = NULL;
+    updates.view = view;
+    updates.count = 0;
+    updates.updates = NULL;
 
     logger_message(&names_logcommitlog,logger_noctx,logger_DIAG,"update view %s commit %p\n",view->viewname,(mychangelog?(void*)*mychangelog:NULL));
     while((names_commitlogpoppush(view->commitlog, view->viewid, &changelog, mychangelog))) {
@@ -528,24 +751,26 @@ updateview(names_view_type view, names_table_type* mychangelog)
                 conflict = 1;
                 mychangelog = NULL;
             }
+            if(view->trackarrivals && (change->record || change->oldrecord)) {
+                addarrival(view, (change->record ? change->record : change->oldrecord));
+            }
             existing = NULL;
             accepted = names_indexinsert(view->indices[0], change->record, &existing);
             logger_message(&names_logcommitlog,logger_noctx,logger_DIAG,"      update %s %s%s%s\n",names_recordgetsummary(change->record,&temp1),(accepted?"accepted":"dropped"),(existing?" replaces ":""),names_recordgetsummary(existing,&temp2));
-            for(i=1; i<view->nindices; i++) {
-                recordset_type tmp = existing;
-                names_indexinsert(view->indices[i], (accepted ? change->record : NULL), (existing ? &tmp : NULL));
-            }
+            addupdate(&updates, &capacity, (accepted ? change->record : NULL), existing);
         }
     }
+    applysecondary(view, &updates);
+    updates.count = 0;
     if(!conflict && mychangelog) {
         logger_message(&names_logcommitlog,logger_noctx,logger_DIAG,"  process submit commit log %p into %s\n",(void*)changelog,view->viewname);
         for(iter=names_tableitems(changelog); names_iterate(&iter, &change); names_advance(&iter, NULL)) {
             recordset_type existing = change->oldrecord;
             logger_message(&names_logcommitlog,logger_noctx,logger_DIAG,"    update %s %s%s\n",names_recordgetsummary(change->record,&temp1),(existing?" replaces ":""),names_recordgetsummary(existing,&temp2));
-            for(i=1; i<view->nindices; i++) {
-                existing = change->oldrecord;
-                names_indexinsert(view->indices[i], change->record, &existing);
-            }
+            addupdate(&updates, &capacity, change->record, change->oldrecord);
+        }
+        applysecondary(view, &updates);
+        for(iter=names_tableitems(changelog); names_iterate(&iter, &change); names_advance(&iter, NULL)) {
             if(change->record == NULL) {
                 change->record = change->oldrecord;
                 change->oldrecord = NULL;
@@ -553,15 +778,42 @@ updateview(names_view_type view, names_table_type* mychangelog)
             }
         }
     }
+    free(updates.updates);
     names_recordgetsummary(NULL,&temp1);
     names_recordgetsummary(NULL,&temp2);
     return conflict;
 }
 
+/* New names placed in the view are annotated with their NSEC3 hash all at
+ * once, before the secondary indices that order by it are updated.
+ */
+static void
+annotatepending(names_view_type view)
+{
+    names_iterator iter;
+    names_change_type change;
+    recordset_type* records = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    for(iter=names_tableitems(view->changelog); names_iterate(&iter, &change); names_advance(&iter, NULL)) {
+        if(change->record && names_recordhaspendingdenial(change->record)) {
+            if(count == capacity) {
+                capacity = (capacity ? capacity * 2 : 1024);
+                CHECKALLOC(records = realloc(records, sizeof(recordset_type) * capacity));
+            }
+            records[count++] = change->record;
+        }
+    }
+    if(count > 0)
+        names_recordannotatepending(records, count);
+    free(records);
+}
+
 int
 names_viewcommit(names_view_type view)
 {
     int conflict;
+    annotatepending(view);
     conflict = updateview(view, &(view->changelog));
     assert(!conflict);
     return conflict;
@@ -593,37 +845,124 @@ names_viewconfig(names_view_type view, signconf_type** signconf)
     return 0;
 }
 
-static char filemagic[8] = "\0ODS-S1\n";
+static char filemagic[8] = "\0ODS-S3\n";
+static char filemagicv2[8] = "\0ODS-S2\n";
+static char filemagicv1[8] = "\0ODS-S1\n";
+
+/* Do not bother compacting a journal smaller than this */
+#define NAMES_COMPACTMINIMUM (4*1024*1024)
+
+static void
+restorerecord(names_view_type view, recordset_type record)
+{
+    /* after a crash during compaction, changes may be present in both the
+     * state file and the journal segment
+     */
+    if(names_indexlookup(view->indices[0], record)) {
+        names_recorddispose(record);
+    } else {
+        names_indexinsert(view->indices[0], record, NULL);
+    }
+}
+
+static int
+restoresegment(names_view_type view, int basefd, const char* segmentname)
+{
+    int fd;
+    char buffer[8];
+    recordset_type record;
+    marshall_handle input;
+    if((fd = openat(basefd, segmentname, O_RDONLY|O_LARGEFILE)) < 0)
+        return 0;
+    if(read(fd,buffer,sizeof(buffer)) == sizeof(buffer) && memcmp(buffer,filemagicv2,sizeof(filemagicv2)) == 0) {
+        input = marshallcreate(marshall_INPUT, fd);
+        while(!marshalleof(input)) {
+            names_recordmarshall(&record, input);
+            if(record) {
+                restorerecord(view, record);
+            }
+        }
+        marshallclose(input);
+    } else {
+        close(fd);
+    }
+    return 1;
+}
 
 int
 names_viewrestore(names_view_type view, const char* apex, int basefd, const char* filename)
 {
     int fd;
+    int legacy;
+    int rewrite;
     recordset_type record;
+    recordset_type* records;
+    size_t count;
+    off_t snapshotsize;
     marshall_handle input;
     marshall_handle output;
     char buffer[8];
+    char* segmentname;
 
     view->zonedata.apex = strdup(apex);
 
     if(filename != NULL) {
-        if(basefd >= 0)
-            fd = openat(basefd, filename, O_RDWR|O_LARGEFILE);
-        else
-            fd = open(filename, O_RDWR|O_LARGEFILE);
+        if(basefd < 0)
+            basefd = AT_FDCWD;
+        fd = openat(basefd, filename, O_RDWR|O_LARGEFILE);
         if(fd >= 0) {
             read(fd,buffer,sizeof(buffer));
-            assert(memcmp(buffer,filemagic,sizeof(filemagic))==0);
-            input = marshallcreate(marshall_INPUT, fd);
-            do {
-                names_recordmarshall(&record, input);
-                if(record) {
-                    names_indexinsert(view->indices[0], record, NULL);
+            legacy = (memcmp(buffer,filemagicv1,sizeof(filemagicv1))==0);
+            rewrite = legacy || (memcmp(buffer,filemagicv2,sizeof(filemagicv2))==0);
+            snapshotsize = sizeof(buffer);
+            if(memcmp(buffer,filemagic,sizeof(filemagic))==0) {
+                if(names_snapshotread(fd, &records, &count)) {
+                    close(fd);
+                    return 1;
+                }
+                names_indexbuild(view->indices[0], records, count);
+                free(records);
+                snapshotsize = lseek(fd, 0, SEEK_CUR);
+            } else
+                assert(rewrite);
+            /* replay the journal, changes are separated by empty records */
+            input = marshallcreate((legacy ? marshall_LEGACYINPUT : marshall_INPUT), fd);
+            if(legacy) {
+                do {
+                    names_recordmarshall(&record, input);
+                    if(record) {
+                        names_indexinsert(view->indices[0], record, NULL);
+                    }
+                } while(record);
+            } else {
+                while(!marshalleof(input)) {
+                    names_recordmarshall(&record, input);
+                    if(record) {
+                        restorerecord(view, record);
+                    }
+                }
+            }
+            /* a left over journal segment means compaction did not finish */
+            asprintf(&segmentname, "%s.log", filename);
+            if(restoresegment(view, basefd, segmentname))
+                rewrite = 1;
+            if(rewrite) {
+                /* rewrite in the current format, which also sets up appending */
+                marshallclose(input);
+                if(names_viewpersist(view, basefd, filename)) {
+                    free(segmentname);
+                    return 1;
                 }
-            } while(record);
-            output = marshallcreate(marshall_APPEND, input);
-            marshallclose(input);
-            names_commitlogpersistappend(view->commitlog, persistfn, output);
+                unlinkat(basefd, segmentname, 0);
+            } else {
+                /* count the journal already present towards the next compaction */
+                view->persistedsize = snapshotsize;
+                view->persistedbytes = snapshotsize - marshalloffset(input);
+                output = marshallcreate(marshall_APPEND, input);
+                marshallclose(input);
+                names_commitlogpersistappend(view->commitlog, persistfn, output);
+            }
+            free(segmentname);
             return 0;
         } else {
             return 1;
@@ -633,44 +972,302 @@ names_viewrestore(names_view_type view, const char* apex, int basefd, const char
     }
 }
 
+struct names_persist {
+    int basefd;
+    const char* tmpfilename;
+    const char* filename;
+};
+
+static int writeall(int fd, const char* data, size_t length);
+static int syncdirectory(int basefd, const char* filename);
+
+/* Called with the commitlog locked once the state and the pending changes
+ * are written, the file only replaces the last state once it is durable.
+ */
+static int
+persistcommit(void* arg, marshall_handle store)
+{
+    struct names_persist* persist = arg;
+    if(marshallsync(store, 1) || fdatasync(marshallfileno(store)) ||
+       renameat(persist->basefd, persist->tmpfilename, persist->basefd, persist->filename) ||
+       syncdirectory(persist->basefd, persist->filename)) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to replace state %s: %s\n", persist->filename, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
 int
-names_viewpersist(names_view_type view, int basefd, char* filename)
+names_viewpersist(names_view_type view, int basefd, const char* filename)
 {
     char* tmpfilename = NULL;
     size_t tmpfilenamelen;
     int fd;
+    off_t persistedsize;
+    long long persistedbytes;
+    struct names_persist persist;
     marshall_handle marsh;
     marshall_handle oldmarsh;
-    names_iterator iter;
-    recordset_type record;
 
+    if(basefd < 0)
+        basefd = AT_FDCWD;
     tmpfilenamelen = snprintf(tmpfilename,0,"%s.tmp",filename);
     tmpfilename = malloc(tmpfilenamelen+1);
     tmpfilenamelen = snprintf(tmpfilename,tmpfilenamelen+1,"%s.tmp",filename);
 
     updateview(view, NULL);
 
-    if(basefd >= 0)
-        CHECK((fd = openat(basefd, tmpfilename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC,0666)) < 0);
-    else
-        CHECK((fd = open(tmpfilename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC,0666)) < 0);
-    write(fd,filemagic,sizeof(filemagic));
+    if((fd = openat(basefd, tmpfilename, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC,0666)) < 0) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to create state %s: %s\n", tmpfilename, strerror(errno));
+        free(tmpfilename);
+        return 1;
+    }
+    if(writeall(fd, filemagic, sizeof(filemagic)) ||
+       names_snapshotwrite(fd, names_indexiterator(view->indices[0]))) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write state %s: %s\n", tmpfilename, strerror(errno));
+        close(fd);
+        unlinkat(basefd, tmpfilename, 0);
+        free(tmpfilename);
+        return 1;
+    }
+    persistedsize = lseek(fd, 0, SEEK_CUR);
+    names_commitlogpersiststats(view->commitlog, &persistedbytes, NULL);
     marsh = marshallcreate(marshall_OUTPUT, fd);
+    persist.basefd = basefd;
+    persist.tmpfilename = tmpfilename;
+    persist.filename = filename;
+    if(names_commitlogpersistfull(view->commitlog, persistfn, view->viewid, marsh, persistcommit, &persist, &oldmarsh)) {
+        marshallclose(marsh);
+        unlinkat(basefd, tmpfilename, 0);
+        free(tmpfilename);
+        return 1;
+    }
+    view->persistedsize = persistedsize;
+    view->persistedbytes = persistedbytes;
+    /* the state replaced it, what remained unwritten of it is superseded */
+    if(marshallclose(oldmarsh))
+        logger_message(&cls, logger_noctx, logger_WARN, "unable to close previous journal of %s\n", filename);
+
+    free(tmpfilename);
+    return 0;
+}
 
-    iter = names_indexiterator(view->indices[0]);
-    if(names_iterate(&iter, &record)) {
-        do {
-            names_recordmarshall(&record, marsh);
-        } while(names_advance(&iter,&record));        
-        names_recordmarshall(NULL, marsh);
+static int
+writeall(int fd, const char* data, size_t length)
+{
+    ssize_t count;
+    while(length > 0) {
+        if((count = write(fd, data, length)) <= 0) {
+            if(count == 0)
+                errno = ENOSPC;
+            return -1;
+        }
+        data += count;
+        length -= count;
     }
-    names_end(&iter);
-    names_commitlogpersistfull(view->commitlog, persistfn, view->viewid, marsh, &oldmarsh);
+    return 0;
+}
 
-    marshallclose(oldmarsh);
-    CHECK(renameat(basefd, tmpfilename, basefd, filename));
+/* A rename is only durable once the directory holding the file is synced. */
+static int
+syncdirectory(int basefd, const char* filename)
+{
+    char* dirname;
+    const char* s;
+    int fd, rc;
+    if((s = strrchr(filename, '/')) != NULL) {
+        dirname = strndup(filename, (s == filename ? 1 : s - filename));
+        fd = openat(basefd, dirname, O_RDONLY|O_DIRECTORY);
+        free(dirname);
+    } else
+        fd = openat(basefd, ".", O_RDONLY|O_DIRECTORY);
+    if(fd < 0)
+        return -1;
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
 
-    free(tmpfilename);
+/* Called with the commitlog locked, so no changes are written to the
+ * segment while it is copied over.  This is bounded by the amount of
+ * changes made during the compaction.
+ */
+static marshall_handle
+compactswitch(void* arg, marshall_handle segment)
+{
+    struct names_compaction* compaction = arg;
+    marshall_handle store;
+    char buffer[65536];
+    ssize_t count;
+    int fd;
+    if(marshallsync(segment, 1)) {
+        compaction->failed = 1;
+        return segment;
+    }
+    if((fd = openat(compaction->basefd, compaction->segmentname, O_RDONLY|O_LARGEFILE)) < 0) {
+        compaction->failed = 1;
+        return segment;
+    }
+    lseek(fd, sizeof(filemagicv2), SEEK_SET);
+    while((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        if(write(compaction->fd, buffer, count) != count) {
+            count = -1;
+            break;
+        }
+    }
+    close(fd);
+    if(count < 0 || fdatasync(compaction->fd) || renameat(compaction->basefd, compaction->tmpfilename, compaction->basefd, compaction->filename) ||
+       syncdirectory(compaction->basefd, compaction->filename)) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to replace state %s: %s\n", compaction->filename, strerror(errno));
+        compaction->failed = 1;
+        return segment;
+    }
+    compaction->journalsize = lseek(compaction->fd, 0, SEEK_CUR) - compaction->snapshotsize;
+    store = marshallcreate(marshall_OUTPUT, compaction->fd);
+    compaction->fd = -1;
+    marshallclose(segment);
+    unlinkat(compaction->basefd, compaction->segmentname, 0);
+    return store;
+}
+
+static void*
+compactor(void* arg)
+{
+    struct names_compaction* compaction = arg;
+    names_view_type view = compaction->view;
+    struct timespec stop;
+    double elapsed;
+    int rc;
+    compaction->fd = openat(compaction->basefd, compaction->tmpfilename, O_CREAT|O_RDWR|O_LARGEFILE|O_TRUNC, 0666);
+    rc = (compaction->fd < 0 || writeall(compaction->fd, filemagic, sizeof(filemagic)) ||
+          names_snapshotpinwrite(compaction->fd, compaction->pin));
+    /* the records need no longer be preserved once written */
+    pthread_mutex_lock(&view->pinlock);
+    __atomic_store_n(&view->pin, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&view->pinlock);
+    names_snapshotunpin(compaction->pin);
+    compaction->pin = NULL;
+    if(rc == 0 && fdatasync(compaction->fd) == 0) {
+        compaction->snapshotsize = lseek(compaction->fd, 0, SEEK_CUR);
+        names_commitlogpersistswitch(view->commitlog, compactswitch, compaction);
+    } else {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write state %s: %s\n", compaction->tmpfilename, strerror(errno));
+        compaction->failed = 1;
+    }
+    if(compaction->fd >= 0) {
+        close(compaction->fd);
+        unlinkat(compaction->basefd, compaction->tmpfilename, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - compaction->start.tv_sec) + (stop.tv_nsec - compaction->start.tv_nsec) / 1000000000.0;
+    if(!compaction->failed)
+        logger_message(&cls, logger_noctx, logger_INFO, "checkpoint %s in %.3f s, %lld bytes journal compacted into %ld bytes state and %ld bytes carried over\n",
+                       compaction->filename, elapsed, compaction->journalbytes, (long)compaction->snapshotsize, (long)compaction->journalsize);
+    __atomic_store_n(&compaction->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Periodic checkpoint of the state.  The journal is synced, and once it has
+ * grown larger than the last written state a compaction is started in the
+ * background.  Only the first checkpoint writes the state in full.
+ */
+int
+names_viewcheckpoint(names_view_type view, int basefd, const char* filename)
+{
+    struct stat statbuf;
+    struct names_compaction* compaction;
+    marshall_handle segment;
+    marshall_handle oldstore;
+    long long bytes;
+    long syncs;
+    int fd;
+
+    if(basefd < 0)
+        basefd = AT_FDCWD;
+    if(view->compaction) {
+        if(!__atomic_load_n(&view->compaction->finished, __ATOMIC_ACQUIRE)) {
+            names_commitlogpersistsync(view->commitlog);
+            return 0;
+        }
+        pthread_join(view->compaction->thread, NULL);
+        if(view->compaction->failed) {
+            /* fall back to writing the state in full, the journal segment
+             * in use can only be discarded afterwards
+             */
+            if(names_viewpersist(view, basefd, filename)) {
+                /* the segment remains the journal in use */
+                compactiondispose(view->compaction);
+                view->compaction = NULL;
+                return 1;
+            }
+            unlinkat(basefd, view->compaction->segmentname, 0);
+        } else {
+            view->persistedsize = view->compaction->snapshotsize;
+        }
+        compactiondispose(view->compaction);
+        view->compaction = NULL;
+    }
+    if(fstatat(basefd, filename, &statbuf, 0)) {
+        if(errno == ENOENT) {
+            return names_viewpersist(view, basefd, filename);
+        } else {
+            logger_message(&cls, logger_noctx, logger_ERROR, "unable to access state %s: %s\n", filename, strerror(errno));
+            return 1;
+        }
+    }
+    names_commitlogpersistsync(view->commitlog);
+    names_commitlogpersiststats(view->commitlog, &bytes, &syncs);
+    logger_message(&cls, logger_noctx, logger_DIAG, "checkpoint %s journal %lld bytes in %ld syncs\n", filename, bytes - view->persistedbytes, syncs);
+    if(bytes - view->persistedbytes < NAMES_COMPACTMINIMUM || bytes - view->persistedbytes < view->persistedsize)
+        return 0;
+
+    CHECKALLOC(compaction = malloc(sizeof(struct names_compaction)));
+    compaction->view = view;
+    compaction->finished = 0;
+    compaction->failed = 0;
+    compaction->basefd = basefd;
+    compaction->fd = -1;
+    compaction->filename = strdup(filename);
+    asprintf(&compaction->tmpfilename, "%s.tmp", filename);
+    asprintf(&compaction->segmentname, "%s.log", filename);
+    compaction->snapshotsize = 0;
+    compaction->journalsize = 0;
+    compaction->journalbytes = bytes - view->persistedbytes;
+    compaction->pin = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &compaction->start);
+    if((fd = openat(basefd, compaction->segmentname, O_CREAT|O_WRONLY|O_LARGEFILE|O_TRUNC, 0666)) < 0) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to create journal %s: %s\n", compaction->segmentname, strerror(errno));
+        compactiondispose(compaction);
+        return 1;
+    }
+    if(writeall(fd, filemagicv2, sizeof(filemagicv2))) {
+        logger_message(&cls, logger_noctx, logger_ERROR, "unable to write journal %s: %s\n", compaction->segmentname, strerror(errno));
+        close(fd);
+        unlinkat(basefd, compaction->segmentname, 0);
+        compactiondispose(compaction);
+        return 1;
+    }
+
+    /* From here on changes go to the segment, while the state as it is
+     * now is pinned for the compactor to write out.  Later passes amend the
+     * records in place, which preserves those not yet written.
+     */
+    updateview(view, NULL);
+    compaction->pin = names_snapshotpin(view->indices[0]);
+    pthread_mutex_lock(&view->pinlock);
+    __atomic_store_n(&view->pin, compaction->pin, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&view->pinlock);
+    segment = marshallcreate(marshall_OUTPUT, fd);
+    names_commitlogpersistfull(view->commitlog, persistfn, view->viewid, segment, NULL, NULL, &oldstore);
+    if(oldstore) {
+        if(marshallsync(oldstore, 1) == 0 && marshallfileno(oldstore) >= 0)
+            fdatasync(marshallfileno(oldstore));
+        marshallclose(oldstore);
+    }
+    view->persistedbytes = bytes;
+    view->persistedsize = 0;
+    view->compaction = compaction;
+    CHECK(pthread_create(&compaction->thread, NULL, compactor, compaction));
     return 0;
 }
 
@@ -747,7 +1344,7 @@ names__dumpindex(FILE* fp, names_index_type index)
     char* temp = NULL;
     marsh = marshallcreate(marshall_PRINT, fp);
     for(iter = names_indexiterator(index); names_iterate(&iter,&record); names_advance(&iter,NULL)) {
-        printf("  %s\n",names_recordgetsummary(record,&temp));
+        fprintf(fp, "  %s\n",names_recordgetsummary(record,&temp));
         //names_recordmarshalsl(&record, marsh);
     }
     names_recordgetsummary(NULL,&temp);
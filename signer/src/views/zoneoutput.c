@@ -38,44 +38,223 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <ldns/ldns.h>
 #include "uthash.h"
+#include "utilities.h"
 #include "proto.h"
+#include "signer/shard.h"
 
-void
-writerecordcontent(recordset_type domainitem, FILE* fp)
+/* Records are rendered by multiple threads, each taking a consecutive
+ * range of at least this many names.
+ */
+#define OUTPUT_SHARDRECORDS 5000
+#define OUTPUT_MAXTHREADS 8
+#define OUTPUT_IOVCOUNT 1024
+
+struct renderbuffer {
+    char* text;
+    size_t size;
+    size_t length;
+};
+
+static void
+renderreserve(struct renderbuffer* buffer, size_t len)
 {
-    int first;
+    if(buffer->length + len + 1 > buffer->size) {
+        while(buffer->length + len + 1 > buffer->size)
+            buffer->size = (buffer->size ? buffer->size * 2 : 256);
+        CHECKALLOC(buffer->text = realloc(buffer->text, buffer->size));
+    }
+}
+
+static void
+renderappend(struct renderbuffer* buffer, const char* s)
+{
+    size_t len = strlen(s);
+    renderreserve(buffer, len);
+    memcpy(&buffer->text[buffer->length], s, len + 1);
+    buffer->length += len;
+}
+
+/* Formats straight into the buffer, growing it once if the record did not
+ * fit, and leaves the types the formatter does not know to ldns.
+ */
+static void
+renderrr(struct renderbuffer* buffer, ldns_rr* rr)
+{
+    int len;
     char* s;
+    len = names_rrformat(rr, (buffer->text ? &buffer->text[buffer->length] : NULL), buffer->size - buffer->length);
+    if(len >= 0 && buffer->length + len + 1 > buffer->size) {
+        renderreserve(buffer, len);
+        len = names_rrformat(rr, &buffer->text[buffer->length], buffer->size - buffer->length);
+    }
+    if(len >= 0) {
+        buffer->length += len;
+    } else {
+        s = ldns_rr2str(rr);
+        renderappend(buffer, s);
+        free(s);
+    }
+}
+
+/* Appends the presentation text of all resource records of a domain */
+static void
+rendertext(recordset_type domainitem, struct renderbuffer* buffer)
+{
+    int first;
+    ldns_rr* rr;
     ldns_rr_type recordtype;
     names_iterator rrsetiter;
     names_iterator rriter;
     for (rrsetiter = names_recordalltypes(domainitem); names_iterate(&rrsetiter, &recordtype); names_advance(&rrsetiter, NULL)) {
-        s = NULL;
         first = 1;
-        for (rriter = names_recordallvaluestrings(domainitem, recordtype); names_iterate(&rriter, &s); names_advance(&rriter, NULL)) {
+        for (rriter = names_recordallvalues(domainitem, recordtype); names_iterate(&rriter, &rr); names_advance(&rriter, NULL)) {
             if (recordtype == LDNS_RR_TYPE_SOA && first) {
                 first = 0;
                 continue;
             }
-            fprintf(fp, "%s", s);
+            renderrr(buffer, rr);
         }
     }
-    s = NULL;
-    for (rriter = names_recordallvaluestrings(domainitem, LDNS_RR_TYPE_NSEC); names_iterate(&rriter, &s); names_advance(&rriter, NULL)) {
-        fprintf(fp, "%s", s);
-    }    
+    for (rriter = names_recordallvalues(domainitem, LDNS_RR_TYPE_NSEC); names_iterate(&rriter, &rr); names_advance(&rriter, NULL)) {
+        renderrr(buffer, rr);
+    }
+}
+
+/* Returns a reference to the presentation text of a domain, only converting
+ * the resource records when the record changed since the last time.
+ */
+static names_rendered_type
+renderrecord(recordset_type domainitem)
+{
+    names_rendered_type rendered;
+    struct renderbuffer buffer = { NULL, 0, 0 };
+    if((rendered = names_recordgetrendered(domainitem)) != NULL)
+        return rendered;
+    rendertext(domainitem, &buffer);
+    return names_recordsetrendered(domainitem, buffer.text, buffer.length);
 }
 
+/* Writes a single domain, for transfers, in a buffer of its own instead of
+ * the text kept with the record for writing out the zone.
+ */
 void
+writerecordcontent(recordset_type domainitem, FILE* fp)
+{
+    struct renderbuffer buffer = { NULL, 0, 0 };
+    rendertext(domainitem, &buffer);
+    if(buffer.length > 0)
+        fwrite(buffer.text, 1, buffer.length, fp);
+    free(buffer.text);
+}
+
+static void
+renderrange(void* arg, long begin, long end)
+{
+    recordset_type* records = arg;
+    long i;
+    for(i=begin; i<end; i++)
+        names_renderedrelease(renderrecord(records[i]));
+}
+
+static void
+renderrecords(recordset_type* records, size_t count)
+{
+    long nthreads;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > OUTPUT_MAXTHREADS)
+        nthreads = OUTPUT_MAXTHREADS;
+    shard_run(nthreads, count, OUTPUT_SHARDRECORDS, renderrange, records, NULL);
+}
+
+static int
+writebuffers(int fd, struct iovec* iov, int iovcnt)
+{
+    ssize_t count;
+    while(iovcnt > 0) {
+        count = writev(fd, iov, iovcnt);
+        if(count < 0)
+            return -1;
+        while(iovcnt > 0 && (size_t)count >= iov->iov_len) {
+            count -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+    return 0;
+}
+
+ods_status
 writezonecontent(names_view_type view, FILE* fp)
 {
-    char* s;
     names_iterator domainiter;
     recordset_type domainitem;
+    recordset_type* records;
+    size_t i, count, capacity, size;
+    struct iovec iov[OUTPUT_IOVCOUNT];
+    names_rendered_type rendered[OUTPUT_IOVCOUNT];
+    const char* text;
+    int iovcnt, nrendered, j;
+    ods_status status = ODS_STATUS_OK;
+    capacity = 1024;
+    count = 0;
+    CHECKALLOC(records = malloc(sizeof(recordset_type) * capacity));
     for (domainiter = names_viewiterator(view, NULL); names_iterate(&domainiter, &domainitem); names_advance(&domainiter, NULL)) {
-        writerecordcontent(domainitem, fp);
+        if(count == capacity) {
+            capacity *= 2;
+            CHECKALLOC(records = realloc(records, sizeof(recordset_type) * capacity));
+        }
+        records[count++] = domainitem;
+    }
+    renderrecords(records, count);
+    if(fileno(fp) < 0) {
+        for(i=0; i<count; i++) {
+            rendered[0] = renderrecord(records[i]);
+            text = names_renderedtext(rendered[0], &size);
+            if(size > 0)
+                fwrite(text, 1, size, fp);
+            names_renderedrelease(rendered[0]);
+        }
+        free(records);
+        return (ferror(fp) ? ODS_STATUS_FWRITE_ERR : ODS_STATUS_OK);
     }
+    /* the cached texts are written straight from the records, bypassing
+     * the stream, which afterwards needs to pick up the new file offset
+     */
+    fflush(fp);
+    /* the texts are held on to until written, another writer may replace
+     * them in the meantime
+     */
+    iovcnt = 0;
+    nrendered = 0;
+    for(i=0; i<count; i++) {
+        rendered[nrendered] = renderrecord(records[i]);
+        iov[iovcnt].iov_base = (void*) names_renderedtext(rendered[nrendered], &size);
+        iov[iovcnt].iov_len = size;
+        ++nrendered;
+        if(size > 0)
+            ++iovcnt;
+        if(nrendered == OUTPUT_IOVCOUNT || i + 1 == count) {
+            if(writebuffers(fileno(fp), iov, iovcnt))
+                status = ODS_STATUS_FWRITE_ERR;
+            for(j=0; j<nrendered; j++)
+                names_renderedrelease(rendered[j]);
+            if(status != ODS_STATUS_OK)
+                break;
+            iovcnt = 0;
+            nrendered = 0;
+        }
+    }
+    if(status == ODS_STATUS_OK)
+        fseeko(fp, lseek(fileno(fp), 0, SEEK_CUR), SEEK_SET);
+    free(records);
+    return status;
 }
 
 void
@@ -93,18 +272,19 @@ writezoneapex(names_view_type view, FILE* fp)
     }
 }
 
-int
+ods_status
 writezone(names_view_type view, const char* filename)
 {
     FILE* fp;
     int defaultttl = 0;
     ldns_rdf* origin = NULL;
     char* apex = NULL;
+    ods_status status;
 
     fp = fopen(filename,"w");
     if (!fp) {
         fprintf(stderr,"unable to open file \"%s\"\n",filename);
-        /* TODO: abort or otherwise handle this failure. */
+        return ODS_STATUS_FOPEN_ERR;
     }
 
     names_viewgetapex(view, &origin);
@@ -118,11 +298,14 @@ writezone(names_view_type view, const char* filename)
     }
 
     writezoneapex(view, fp);
-    writezonecontent(view, fp);
+    status = writezonecontent(view, fp);
     writezoneapex(view, fp);
 
-    fclose(fp);
+    if (ferror(fp) && status == ODS_STATUS_OK)
+        status = ODS_STATUS_FWRITE_ERR;
+    if (fclose(fp) && status == ODS_STATUS_OK)
+        status = ODS_STATUS_FWRITE_ERR;
     if(apex)
         free(apex);
-    return 0;
+    return status;
 }